@@ -5,52 +5,36 @@
  */
 #include "api_server.h"
 #include "apns.h"
+#include "fcm.h"
+#include "outbox.h"
+#include "push_queue.h"
+#include "results.h"
 #include "token_store.h"
+#include "trace.h"
+#include "json_scan.h"
 #include "esp_log.h"
 #include "esp_http_server.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "freertos/semphr.h"
-#include <cJSON.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <errno.h>
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "lwip/sockets.h"
 #include "mbedtls/base64.h"
 #include "nvs.h"
 #include "sdkconfig.h"
 
 static const char *TAG = "api_server";
 
-#define MAX_CONCURRENT_PUSH  3
-static SemaphoreHandle_t s_push_sem = NULL;
-
-extern apns_config_t g_apns_config;
-
-/* ------------------------------------------------------------------ */
-/*  Request / task parameter structs                                   */
-/* ------------------------------------------------------------------ */
-
-typedef struct {
-    char device_token[128];
-    char title[128];
-    char body[256];
-    int  badge;
-    char sound[32];
-    char custom_payload[256];
-    bool has_sound;
-    bool has_custom;
-    bool use_sandbox;
-} apns_task_params_t;
-
-typedef struct {
-    char title[128];
-    char body[256];
-    int  badge;
-    char sound[32];
-    char custom_payload[256];
-    bool has_sound;
-    bool has_custom;
-    bool use_sandbox;
-} blast_params_t;
+/* Boot milestones for GET /metrics, microseconds since boot (0 = not yet) */
+static int64_t s_ready_us;
+static int64_t s_first_request_us;
 
 /* ------------------------------------------------------------------ */
 /*  Helpers                                                            */
@@ -85,7 +69,10 @@ static bool auth_check(httpd_req_t *req)
     snprintf(expected, sizeof(expected), "%s:%s",
              CONFIG_API_AUTH_USER, CONFIG_API_AUTH_PASS);
 
-    if (strcmp((char *)decoded, expected) == 0) return true;
+    if (strcmp((char *)decoded, expected) == 0) {
+        if (!s_first_request_us) s_first_request_us = esp_timer_get_time();
+        return true;
+    }
 
 fail:
     httpd_resp_set_status(req, "401 Unauthorized");
@@ -95,12 +82,80 @@ fail:
     return false;
 }
 
-/** Read request body into buf (null-terminated). Returns bytes read or ≤0 on error. */
-static int read_body(httpd_req_t *req, char *buf, size_t len)
+/* httpd runs handlers on a single task, so one receive buffer serves them all */
+#define BODY_RX_LEN  512
+static char s_rx[BODY_RX_LEN];
+
+/* Consecutive recv timeouts before a stalled body is given up on; each one
+ * is the server's recv_wait_timeout (5 s by default) of a single httpd task */
+#define BODY_RECV_TIMEOUTS_MAX  3
+
+/**
+ * httpd_req_recv(), retried across up to BODY_RECV_TIMEOUTS_MAX timeouts
+ * in a row.  Returns the bytes read, or <= 0 if the client is gone or has
+ * stalled (HTTPD_SOCK_ERR_TIMEOUT).
+ */
+static int body_recv(httpd_req_t *req, char *buf, size_t len)
 {
-    int received = httpd_req_recv(req, buf, len - 1);
-    if (received > 0) buf[received] = '\0';
-    return received;
+    for (int timeouts = 0;;) {
+        int r = httpd_req_recv(req, buf, len);
+        if (r != HTTPD_SOCK_ERR_TIMEOUT || ++timeouts >= BODY_RECV_TIMEOUTS_MAX) return r;
+    }
+}
+
+/**
+ * Stream the request body through json_scan into @p fields, BODY_RX_LEN
+ * bytes at a time.  The body is never held whole, so its size is not
+ * limited; fields that do not fit their buffers come back truncated.
+ * Returns NULL on success, or the message for a 400 response.
+ */
+static const char *scan_body(httpd_req_t *req, json_field_t *fields, size_t nfields)
+{
+    if (req->content_len == 0) return "No body";
+
+    json_scan_t s;
+    json_scan_init(&s, fields, nfields);
+
+    size_t remaining = req->content_len;
+    while (remaining > 0) {
+        size_t want = remaining < sizeof(s_rx) ? remaining : sizeof(s_rx);
+        int r = body_recv(req, s_rx, want);
+        if (r == HTTPD_SOCK_ERR_TIMEOUT) return "Body timed out";
+        if (r <= 0) return "No body";
+        remaining -= (size_t)r;
+        /* On a syntax error stop reading; httpd discards the rest */
+        if (json_scan_feed(&s, s_rx, (size_t)r) < 0) break;
+    }
+    return json_scan_finish(&s) == ESP_OK ? NULL : "Invalid JSON";
+}
+
+/**
+ * Read the whole request body into a heap buffer (null-terminated), pulling
+ * it across as many recv calls as needed.  The buffer comes from PSRAM when
+ * there is any, so a large body never carves up internal RAM.  Returns NULL
+ * if the body is empty, larger than @p max, stalls, or the connection fails.
+ * Caller frees.
+ */
+static char *read_body_alloc(httpd_req_t *req, size_t max, size_t *out_len)
+{
+    size_t total = req->content_len;
+    if (total == 0 || total > max) return NULL;
+
+    char *buf = heap_caps_malloc_prefer(total + 1, 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_8BIT);
+    if (!buf) return NULL;
+
+    size_t got = 0;
+    while (got < total) {
+        int r = body_recv(req, buf + got, total - got);
+        if (r <= 0) {   /* gone, or stalled past the timeout cap */
+            free(buf);
+            return NULL;
+        }
+        got += (size_t)r;
+    }
+    buf[got] = '\0';
+    if (out_len) *out_len = got;
+    return buf;
 }
 
 /** Send a JSON string with 200 OK. */
@@ -120,193 +175,550 @@ static void send_json_err(httpd_req_t *req, const char *status, const char *msg)
     httpd_resp_sendstr(req, buf);
 }
 
-/** Send a paginated token list as chunked JSON. */
-static void send_token_list(httpd_req_t *req,
-                             token_entry_t *entries, size_t count)
+/** push_queue_submit_wait() plus its trace record. */
+static esp_err_t queue_job(push_job_t *job, uint32_t timeout_ms)
 {
-    httpd_resp_set_type(req, "application/json");
-
-    char tmp[32];
-    httpd_resp_sendstr_chunk(req, "{\"count\":");
-    snprintf(tmp, sizeof(tmp), "%zu", count);
-    httpd_resp_sendstr_chunk(req, tmp);
-    httpd_resp_sendstr_chunk(req, ",\"entries\":[");
-
-    for (size_t i = 0; i < count; i++) {
-        if (i > 0) httpd_resp_sendstr_chunk(req, ",");
-        /* Worst-case entry: ~165 chars */
-        char entry[300];
-        snprintf(entry, sizeof(entry),
-                 "{\"ip\":\"%s\",\"token\":\"%s\",\"server_type\":\"%s\"}",
-                 entries[i].ip, entries[i].token, entries[i].server_type);
-        httpd_resp_sendstr_chunk(req, entry);
+    esp_err_t ret = push_queue_submit_wait(job, timeout_ms);
+    if (ret == ESP_OK) {
+        trace_rec(TRACE_JOB_QUEUED, job->job_id, job->type,
+                  (int32_t)push_queue_pending_lane(push_job_lane(job)));
+    } else {
+        trace_rec(TRACE_JOB_REJECTED, 0, job->type, ret);
     }
+    return ret;
+}
 
-    httpd_resp_sendstr_chunk(req, "]}");
-    httpd_resp_sendstr_chunk(req, NULL); /* end chunked response */
+/** {"status":"queued","job_id":N}, the id its results are published under. */
+static void send_job_queued(httpd_req_t *req, const push_job_t *job)
+{
+    char resp[48];
+    snprintf(resp, sizeof(resp), "{\"status\":\"queued\",\"job_id\":%lu}",
+             (unsigned long)job->job_id);
+    send_json_ok(req, resp);
 }
 
-/** Parse the optional "server_type" field; defaults to sandbox. */
-static bool parse_server_type(cJSON *root)
+/** 503 with Retry-After when the push queue has no free slot. */
+static void send_queue_full(httpd_req_t *req)
 {
-    const char *srv = cJSON_GetStringValue(cJSON_GetObjectItem(root, "server_type"));
-    return !(srv && strcmp(srv, "production") == 0); /* true = sandbox */
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    send_json_err(req, "503 Service Unavailable", "Push queue full");
 }
 
-/* ------------------------------------------------------------------ */
-/*  Background tasks                                                   */
-/* ------------------------------------------------------------------ */
+/* One page of a listing; httpd runs all handlers on a single task */
+#define LIST_PAGE_ENTRIES 16
+static token_entry_t    s_list_page[LIST_PAGE_ENTRIES];
+static token_tag_info_t s_list_tags[TOKEN_TAGS_MAX];   /* tag table snapshot */
+
+/* Query string of the request being handled (httpd runs one at a time) */
+static char s_query[128];
 
-static void apns_send_task(void *arg)
+/**
+ * Read the query string once into s_query.  *@p q is NULL if there is none;
+ * false if it does not fit, which callers treat as a malformed query.
+ */
+static bool query_get(httpd_req_t *req, const char **q)
 {
-    apns_task_params_t *p = (apns_task_params_t *)arg;
+    *q = NULL;
+    size_t len = httpd_req_get_url_query_len(req);
+    if (len == 0) return true;
+    if (len >= sizeof(s_query) ||
+        httpd_req_get_url_query_str(req, s_query, sizeof(s_query)) != ESP_OK) {
+        return false;
+    }
+    *q = s_query;
+    return true;
+}
 
-    apns_config_t cfg = g_apns_config;
-    cfg.use_sandbox = p->use_sandbox;
+/**
+ * Optional unsigned parameter @p key of query @p q (from query_get(), may be
+ * NULL).  Left at its default if absent; false if present but malformed,
+ * too long or out of range.
+ */
+static bool query_size(const char *q, const char *key, size_t *out)
+{
+    char val[12];
+    if (!q) return true;
+    esp_err_t err = httpd_query_key_value(q, key, val, sizeof(val));
+    if (err == ESP_ERR_NOT_FOUND) return true;   /* absent: keep default */
+    if (err != ESP_OK) return false;             /* ESP_ERR_HTTPD_RESULT_TRUNC */
+
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(val, &end, 10);
+    if (end == val || *end != '\0' || errno == ERANGE || val[0] == '-') return false;
+    *out = (size_t)v;
+    return true;
+}
 
-    apns_notification_t notif = {
-        .device_token   = p->device_token,
-        .title          = p->title,
-        .body           = p->body,
-        .badge          = p->badge,
-        .sound          = p->has_sound  ? p->sound          : NULL,
-        .custom_payload = p->has_custom ? p->custom_payload : NULL,
-    };
+/* One listed entry: ~135 chars, plus up to every tag name quoted */
+static char s_list_entry[160 + TOKEN_TAGS_MAX * (TOKEN_TAG_LEN + 3)];
 
-    esp_err_t ret = apns_send_notification(&cfg, &notif);
-    if (ret == APNS_ERR_UNREGISTERED) {
-        ESP_LOGW(TAG, "push [%.16s...]: device unregistered (remove token manually if needed)",
-                 p->device_token);
+/** Append the "tags" member for @p tags (nothing if empty) and close the entry. */
+static void entry_tags(size_t len, token_tags_t tags, size_t ntbl)
+{
+    char       *p    = s_list_entry + len;
+    size_t      room = sizeof(s_list_entry) - len;
+    const char *sep  = ",\"tags\":[";
+    for (size_t i = 0; i < ntbl; i++) {
+        if (!(tags & (1u << s_list_tags[i].id))) continue;
+        int n = snprintf(p, room, "%s\"%s\"", sep, s_list_tags[i].name);
+        p    += n;
+        room -= (size_t)n;
+        sep   = ",";
+    }
+    snprintf(p, room, "%s}", tags ? "]" : "");
+}
+
+/**
+ * Stream a token list straight off a store cursor, honouring the optional
+ * ?offset=&limit=&tag= query.  "count" comes last so it matches what was
+ * sent; "next_offset" is present only when entries remain past the limit.
+ */
+static void send_token_list(httpd_req_t *req, token_list_t list)
+{
+    const char *q;
+    size_t offset = 0, limit = SIZE_MAX;
+    if (!query_get(req, &q) ||
+        !query_size(q, "offset", &offset) || !query_size(q, "limit", &limit)) {
+        send_json_err(req, "400 Bad Request", "Invalid offset or limit");
+        return;
+    }
+
+    /* An unknown tag leaves the cursor closed: an empty list.  One too long
+     * to be a tag (ESP_ERR_HTTPD_RESULT_TRUNC) is invalid, not absent. */
+    char tag[1][TOKEN_TAG_LEN];
+    token_cursor_t cur;
+    esp_err_t tag_err = q ? httpd_query_key_value(q, "tag", tag[0], sizeof(tag[0]))
+                          : ESP_ERR_NOT_FOUND;
+    if (tag_err != ESP_OK && tag_err != ESP_ERR_NOT_FOUND) {
+        send_json_err(req, "400 Bad Request", "Invalid tag");
+        return;
+    }
+    if (tag_err == ESP_OK) {
+        if (!token_tag_valid(tag[0])) {
+            send_json_err(req, "400 Bad Request", "Invalid tag");
+            return;
+        }
+        token_store_cursor_open_tagged(&cur, list, TOKEN_SERVER_ANY, tag, 1);
     } else {
-        ESP_LOGI(TAG, "push [%.16s...] → %s (%s)",
-                 p->device_token,
-                 ret == ESP_OK ? "ok" : "fail",
-                 p->use_sandbox ? "sandbox" : "production");
-    }
-
-    xSemaphoreGive(s_push_sem);
-    free(p);
-    vTaskDelete(NULL);
-}
-
-static void blast_task(void *arg)
-{
-    blast_params_t *p = (blast_params_t *)arg;
-
-    apns_config_t cfg = g_apns_config;
-    cfg.use_sandbox = p->use_sandbox;
-
-    token_entry_t entries[TOKEN_MAX_ENTRIES];
-    size_t count = 0;
-    const char *srv = p->use_sandbox ? "sandbox" : "production";
-    token_store_send_list_type(srv, entries, &count, TOKEN_MAX_ENTRIES);
-
-    int ok = 0, fail = 0;
-    for (size_t i = 0; i < count; i++) {
-        apns_notification_t n = {
-            .device_token   = entries[i].token,
-            .title          = p->title,
-            .body           = p->body,
-            .badge          = p->badge,
-            .sound          = p->has_sound  ? p->sound          : NULL,
-            .custom_payload = p->has_custom ? p->custom_payload : NULL,
-        };
-        esp_err_t r = apns_send_notification(&cfg, &n);
-        if (r == ESP_OK) {
-            ok++;
-            ESP_LOGI(TAG, "blast [%s]: ok", entries[i].ip);
-        } else if (r == APNS_ERR_UNREGISTERED) {
-            fail++;
-            ESP_LOGW(TAG, "blast [%s]: unregistered — removing from store", entries[i].ip);
-            token_store_send_del(entries[i].ip);
-        } else {
-            fail++;
-            ESP_LOGW(TAG, "blast [%s]: fail", entries[i].ip);
+        token_store_cursor_open(&cur, list, TOKEN_SERVER_ANY);
+    }
+    token_store_cursor_skip(&cur, offset);
+    size_t ntbl = token_store_tag_list(s_list_tags, TOKEN_TAGS_MAX);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr_chunk(req, "{\"entries\":[");
+
+    size_t total = 0, n;
+    while (total < limit) {
+        size_t want = limit - total;
+        if (want > LIST_PAGE_ENTRIES) want = LIST_PAGE_ENTRIES;
+        n = token_store_cursor_next(&cur, s_list_page, want);
+        if (n == 0) break;
+
+        for (size_t i = 0; i < n; i++) {
+            const token_entry_t *e = &s_list_page[i];
+            char ip[TOKEN_IP_LEN], hex[TOKEN_HEX_LEN];
+            token_ip_format(e->ip, ip);
+            token_hex_format(e->token, hex);
+
+            if (total++ > 0) httpd_resp_sendstr_chunk(req, ",");
+            int len = snprintf(s_list_entry, sizeof(s_list_entry),
+                               "{\"ip\":\"%s\",\"token\":\"%s\",\"server_type\":\"%s\"",
+                               ip, hex, token_server_name((token_server_t)e->server));
+            entry_tags((size_t)len, e->tags, ntbl);
+            httpd_resp_sendstr_chunk(req, s_list_entry);
         }
     }
+    bool more = (total == limit) && token_store_cursor_skip(&cur, 1) > 0;
+    token_store_cursor_close(&cur);
 
-    ESP_LOGI(TAG, "blast done — %d ok, %d fail (server=%s)",
-             ok, fail, p->use_sandbox ? "sandbox" : "production");
-    free(p);
-    vTaskDelete(NULL);
+    char tmp[96];
+    if (more) {
+        snprintf(tmp, sizeof(tmp), "],\"count\":%zu,\"offset\":%zu,\"next_offset\":%zu}",
+                 total, offset, offset + total);
+    } else {
+        snprintf(tmp, sizeof(tmp), "],\"count\":%zu,\"offset\":%zu}", total, offset);
+    }
+    httpd_resp_sendstr_chunk(req, tmp);
+    httpd_resp_sendstr_chunk(req, NULL); /* end chunked response */
+}
+
+/** String field value, or NULL if it was absent or did not fit its buffer. */
+static const char *field_str(const json_field_t *f)
+{
+    return (f->found && !f->truncated) ? (const char *)f->out : NULL;
+}
+
+/** Optional "server_type" field; defaults to sandbox. */
+static bool field_sandbox(const json_field_t *f)
+{
+    return token_server_parse(field_str(f)) == TOKEN_SERVER_SANDBOX; /* true = sandbox */
+}
+
+/** Strict "server_type" field: false unless "sandbox" or "production". */
+static bool field_server_type(const json_field_t *f, token_server_t *out)
+{
+    const char *srv = field_str(f);
+    if (!srv || (strcmp(srv, "sandbox") != 0 && strcmp(srv, "production") != 0)) return false;
+    *out = token_server_parse(srv);
+    return true;
+}
+
+/** "ip" field as packed IPv4; false if missing or not a dotted quad. */
+static bool field_ip(const json_field_t *f, uint32_t *out)
+{
+    const char *s = field_str(f);
+    return s && token_ip_parse(s, out);
+}
+
+/** "token" field as 32 binary bytes; false if missing or not 64 hex digits. */
+static bool field_token(const json_field_t *f, uint8_t out[TOKEN_BIN_LEN])
+{
+    const char *s = field_str(f);
+    return s && token_hex_parse(s, out);
+}
+
+/** Scan an {"ip": ...} body.  Returns NULL with *ip set, or the 400 message. */
+static const char *scan_ip_body(httpd_req_t *req, uint32_t *ip)
+{
+    char ip_str[TOKEN_IP_LEN];
+    json_field_t f[] = { JSON_SCAN_STR("ip", ip_str) };
+
+    const char *err = scan_body(req, f, 1);
+    if (err) return err;
+    return field_ip(&f[0], ip) ? NULL : "Missing or invalid ip";
+}
+
+/*
+ * A "tags" array of names.  The scanner decodes each element into buf and
+ * tags_item() checks it and keeps it; duplicates collapse.
+ */
+#define TAGS_PER_ENTRY  8
+
+typedef struct {
+    char   buf[TOKEN_TAG_LEN];
+    char   names[TAGS_PER_ENTRY][TOKEN_TAG_LEN];
+    size_t n;
+    size_t max;             /* <= TAGS_PER_ENTRY */
+    bool   bad;             /* an invalid name, or more than max */
+} tags_scan_t;
+
+#define TAGS_ERR  "Invalid tags (up to 8 names of 1-15 chars [A-Za-z0-9._-])"
+
+static void tags_item(json_field_t *f, size_t n, void *arg)
+{
+    tags_scan_t *t = arg;
+    (void)n;
+
+    const char *s = field_str(f);
+    if (!s || !token_tag_valid(s)) {
+        t->bad = true;
+        return;
+    }
+    for (size_t i = 0; i < t->n; i++) {
+        if (strcmp(t->names[i], s) == 0) return;
+    }
+    if (t->n >= t->max) {
+        t->bad = true;
+        return;
+    }
+    memcpy(t->names[t->n++], s, TOKEN_TAG_LEN);
 }
 
 /* ------------------------------------------------------------------ */
 /*  Handler: POST /push                                                */
 /* ------------------------------------------------------------------ */
 
+/*
+ * Field table for a /push or /blast object.  The scanner decodes strings
+ * straight into the job, so nothing is copied after parsing.  PF_TOKEN is
+ * first so /blast can scan the same table without it, and PF_TAGS last so
+ * /push can scan it without that.
+ */
+enum { PF_TOKEN, PF_TITLE, PF_BODY, PF_BADGE, PF_SOUND, PF_CUSTOM, PF_SERVER, PF_TTL, PF_TAGS,
+       PF_COUNT };
+
+typedef struct {
+    json_field_t f[PF_COUNT];
+    char server_type[16];
+    tags_scan_t tags;
+} push_scan_t;
+
+/** Reset @p p to an empty job of @p type and point @p ps at its fields. */
+static void push_scan_init(push_scan_t *ps, push_job_t *p, push_job_type_t type)
+{
+    *p = (push_job_t){ .type = type, .badge = -1, .ttl_s = -1 };
+    ps->tags = (tags_scan_t){ .max = PUSH_BLAST_TAGS_MAX };
+    json_field_t f[PF_COUNT] = {
+        [PF_TOKEN]  = JSON_SCAN_STR("device_token",   p->device_token),
+        [PF_TITLE]  = JSON_SCAN_STR("title",          p->title),
+        [PF_BODY]   = JSON_SCAN_STR("body",           p->body),
+        [PF_BADGE]  = JSON_SCAN_INT("badge",          &p->badge),
+        [PF_SOUND]  = JSON_SCAN_STR("sound",          p->sound),
+        [PF_CUSTOM] = JSON_SCAN_STR("custom_payload", p->custom_payload),
+        [PF_SERVER] = JSON_SCAN_STR("server_type",    ps->server_type),
+        [PF_TTL]    = JSON_SCAN_INT("ttl",            &p->ttl_s),
+        [PF_TAGS]   = JSON_SCAN_STRS("tags",          ps->tags.buf, tags_item, &ps->tags),
+    };
+    memcpy(ps->f, f, sizeof(f));
+}
+
+/**
+ * Finish a job after its object was scanned.  Over-long strings are cut
+ * to the job's buffers as before.  Returns false if a required field is
+ * missing.
+ */
+static bool push_scan_done(push_scan_t *ps, push_job_t *p)
+{
+    if ((p->type == PUSH_JOB_SINGLE && !ps->f[PF_TOKEN].found) ||
+        !ps->f[PF_TITLE].found || !ps->f[PF_BODY].found) return false;
+
+    p->has_sound   = ps->f[PF_SOUND].found;
+    p->has_custom  = ps->f[PF_CUSTOM].found;
+    p->use_sandbox = field_sandbox(&ps->f[PF_SERVER]);
+    p->ntags       = (uint8_t)ps->tags.n;
+    memcpy(p->tags, ps->tags.names, ps->tags.n * TOKEN_TAG_LEN);
+    return true;
+}
+
 static esp_err_t push_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    char buf[600];
-    if (read_body(req, buf, sizeof(buf)) <= 0) {
-        send_json_err(req, "400 Bad Request", "No body");
+    push_job_t  job;
+    push_scan_t ps;
+    push_scan_init(&ps, &job, PUSH_JOB_SINGLE);
+
+    const char *err = scan_body(req, ps.f, PF_TAGS);
+    if (err) {
+        send_json_err(req, "400 Bad Request", err);
+        return ESP_OK;
+    }
+    if (!push_scan_done(&ps, &job)) {
+        send_json_err(req, "400 Bad Request", "Missing required fields");
         return ESP_OK;
     }
 
-    cJSON *root = cJSON_Parse(buf);
-    if (!root) {
-        send_json_err(req, "400 Bad Request", "Invalid JSON");
+    TRACE_LOGI(TAG, "push queued: token=%.16s... server=%s",
+               job.device_token, job.use_sandbox ? "sandbox" : "production");
+
+    if (queue_job(&job, 0) != ESP_OK) {
+        send_queue_full(req);
         return ESP_OK;
     }
 
-    const char *device_token = cJSON_GetStringValue(cJSON_GetObjectItem(root, "device_token"));
-    const char *title        = cJSON_GetStringValue(cJSON_GetObjectItem(root, "title"));
-    const char *body         = cJSON_GetStringValue(cJSON_GetObjectItem(root, "body"));
+    send_job_queued(req, &job);
+    return ESP_OK;
+}
+
+#if CONFIG_FCM_ENABLE
+/* ------------------------------------------------------------------ */
+/*  Handler: POST /fcm                                                 */
+/* ------------------------------------------------------------------ */
+
+/* "data" carries the members of FCM's data object as a string, the way
+ * custom_payload does for /push */
+enum { FF_TOKEN, FF_TITLE, FF_BODY, FF_DATA, FF_TTL, FF_COUNT };
 
-    if (!device_token || !title || !body) {
-        cJSON_Delete(root);
+static esp_err_t fcm_handler(httpd_req_t *req)
+{
+    if (!auth_check(req)) return ESP_OK;
+
+    push_job_t job = { .type = PUSH_JOB_SINGLE, .platform = PUSH_PLATFORM_FCM, .ttl_s = -1 };
+    json_field_t f[FF_COUNT] = {
+        [FF_TOKEN] = JSON_SCAN_STR("device_token", job.device_token),
+        [FF_TITLE] = JSON_SCAN_STR("title",        job.title),
+        [FF_BODY]  = JSON_SCAN_STR("body",         job.body),
+        [FF_DATA]  = JSON_SCAN_STR("data",         job.custom_payload),
+        [FF_TTL]   = JSON_SCAN_INT("ttl",          &job.ttl_s),
+    };
+
+    const char *err = scan_body(req, f, FF_COUNT);
+    if (err) {
+        send_json_err(req, "400 Bad Request", err);
+        return ESP_OK;
+    }
+    if (!f[FF_TOKEN].found || !f[FF_TITLE].found || !f[FF_BODY].found) {
         send_json_err(req, "400 Bad Request", "Missing required fields");
         return ESP_OK;
     }
+    if (f[FF_TOKEN].truncated) {
+        send_json_err(req, "400 Bad Request", "device_token too long");
+        return ESP_OK;
+    }
+    job.has_custom = f[FF_DATA].found;
+
+    TRACE_LOGI(TAG, "FCM push queued: token=%.16s...", job.device_token);
 
-    apns_task_params_t *p = calloc(1, sizeof(apns_task_params_t));
-    if (!p) {
-        cJSON_Delete(root);
-        send_json_err(req, "500 Internal Server Error", "OOM");
+    if (queue_job(&job, 0) != ESP_OK) {
+        send_queue_full(req);
         return ESP_OK;
     }
 
-    strncpy(p->device_token, device_token, sizeof(p->device_token) - 1);
-    strncpy(p->title,        title,        sizeof(p->title)        - 1);
-    strncpy(p->body,         body,         sizeof(p->body)         - 1);
+    send_job_queued(req, &job);
+    return ESP_OK;
+}
+#endif
 
-    cJSON *badge_item = cJSON_GetObjectItem(root, "badge");
-    p->badge = badge_item ? badge_item->valueint : -1;
+/* ------------------------------------------------------------------ */
+/*  Handler: POST /push/batch                                          */
+/* ------------------------------------------------------------------ */
 
-    const char *sound = cJSON_GetStringValue(cJSON_GetObjectItem(root, "sound"));
-    if (sound) {
-        strncpy(p->sound, sound, sizeof(p->sound) - 1);
-        p->has_sound = true;
-    }
+/*
+ * The body is a JSON array of /push objects, or NDJSON with one object per
+ * line, and is never held whole: it is read BODY_RX_LEN bytes at a time
+ * and split into top-level objects by a brace / string scanner.  The bytes
+ * of each object go straight through json_scan into the job, which is
+ * queued as soon as the closing brace arrives, so no item is buffered.
+ * httpd runs handlers on a single task, so the state is static.
+ */
+#define BATCH_ERRORS_MAX  16     /* per-item errors listed in the response */
+#define BATCH_ERROR_LEN   56     /* {"index":NNNNN,"error":"..."} */
 
-    const char *custom = cJSON_GetStringValue(cJSON_GetObjectItem(root, "custom_payload"));
-    if (custom) {
-        strncpy(p->custom_payload, custom, sizeof(p->custom_payload) - 1);
-        p->has_custom = true;
+typedef struct {
+    json_scan_t scan;       /* the item being read */
+    push_scan_t ps;
+    int    depth;           /* brace / bracket nesting, 0 = between items */
+    bool   in_str;
+    bool   esc;
+    size_t index;           /* items seen so far */
+    size_t accepted;
+    size_t rejected;
+    uint32_t first_job;     /* job ids of the first and last accepted item */
+    uint32_t last_job;
+    size_t nerr;
+    size_t errors_len;
+    char   errors[BATCH_ERRORS_MAX * BATCH_ERROR_LEN];
+} batch_t;
+
+static batch_t    s_batch;
+static push_job_t s_batch_job;
+
+static void batch_reject(batch_t *b, const char *why)
+{
+    b->rejected++;
+    if (b->nerr >= BATCH_ERRORS_MAX) return;
+
+    size_t room = sizeof(b->errors) - b->errors_len;
+    int n = snprintf(b->errors + b->errors_len, room, "%s{\"index\":%u,\"error\":\"%s\"}",
+                     b->nerr ? "," : "", (unsigned)b->index, why);
+    if (n > 0 && (size_t)n < room) {
+        b->errors_len += (size_t)n;
+        b->nerr++;
     }
+}
 
-    p->use_sandbox = parse_server_type(root);
-    cJSON_Delete(root);
+/** Queue the object whose closing brace was just scanned. */
+static void batch_item_done(batch_t *b)
+{
+    if (json_scan_finish(&b->scan) != ESP_OK) {
+        batch_reject(b, "Invalid JSON");
+    } else if (!push_scan_done(&b->ps, &s_batch_job)) {
+        batch_reject(b, "Missing required fields");
+    } else if (queue_job(&s_batch_job, CONFIG_PUSH_BATCH_WAIT_MS) != ESP_OK) {
+        batch_reject(b, "Push queue full");
+    } else {
+        if (b->accepted++ == 0) b->first_job = s_batch_job.job_id;
+        b->last_job = s_batch_job.job_id;
+    }
+    b->index++;
+}
 
-    ESP_LOGI(TAG, "push queued: token=%.16s... server=%s",
-             p->device_token, p->use_sandbox ? "sandbox" : "production");
+/** Feed @p n body bytes to the splitter.  Returns false on a framing error. */
+static bool batch_feed(batch_t *b, const char *p, size_t n)
+{
+    size_t start = 0;   /* first byte of the current item within p */
+
+    for (size_t i = 0; i < n; i++) {
+        char c = p[i];
+
+        if (b->depth == 0) {
+            /* Between items: array brackets, commas and whitespace (NDJSON newlines) */
+            if (c == '{') {
+                b->depth  = 1;
+                b->in_str = false;
+                b->esc    = false;
+                start     = i;
+                push_scan_init(&b->ps, &s_batch_job, PUSH_JOB_SINGLE);
+                json_scan_init(&b->scan, b->ps.f, PF_TAGS);
+            } else if (c != '[' && c != ']' && c != ',' &&
+                       c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+                return false;
+            }
+            continue;
+        }
 
-    if (xSemaphoreTake(s_push_sem, 0) != pdTRUE) {
-        free(p);
-        send_json_err(req, "503 Service Unavailable", "Too many concurrent pushes");
-        return ESP_OK;
+        if (b->in_str) {
+            if (b->esc)           b->esc = false;
+            else if (c == '\\')   b->esc = true;
+            else if (c == '"')    b->in_str = false;
+        } else if (c == '"') {
+            b->in_str = true;
+        } else if (c == '{' || c == '[') {
+            b->depth++;
+        } else if ((c == '}' || c == ']') && --b->depth == 0) {
+            json_scan_feed(&b->scan, p + start, i + 1 - start);
+            batch_item_done(b);
+        }
     }
+    /* An item continues into the next chunk: hand over what arrived */
+    if (b->depth > 0) json_scan_feed(&b->scan, p + start, n - start);
+    return true;
+}
+
+static esp_err_t push_batch_handler(httpd_req_t *req)
+{
+    if (!auth_check(req)) return ESP_OK;
 
-    if (xTaskCreate(apns_send_task, "apns_push", 16384, p, 5, NULL) != pdPASS) {
-        xSemaphoreGive(s_push_sem);
-        free(p);
-        send_json_err(req, "500 Internal Server Error", "Task create failed");
+    if (req->content_len == 0) {
+        send_json_err(req, "400 Bad Request", "No body");
         return ESP_OK;
     }
 
-    send_json_ok(req, "{\"status\":\"queued\"}");
+    batch_t *b = &s_batch;
+    memset(b, 0, offsetof(batch_t, errors));
+
+    const char *framing = NULL;
+    size_t remaining = req->content_len;
+    while (remaining > 0) {
+        size_t want = remaining < sizeof(s_rx) ? remaining : sizeof(s_rx);
+        int r = body_recv(req, s_rx, want);
+        if (r == HTTPD_SOCK_ERR_TIMEOUT) {
+            /* Stalled mid-body: free the httpd task, keep what was queued */
+            ESP_LOGW(TAG, "push batch: body stalled after %u item(s), %u queued",
+                     (unsigned)b->index, (unsigned)b->accepted);
+            return ESP_FAIL;
+        }
+        if (r <= 0) {
+            /* Client is gone; whatever was already queued still goes out */
+            ESP_LOGW(TAG, "push batch: connection lost after %u item(s), %u queued",
+                     (unsigned)b->index, (unsigned)b->accepted);
+            return ESP_FAIL;
+        }
+        remaining -= (size_t)r;
+        if (!batch_feed(b, s_rx, (size_t)r)) {
+            framing = "Malformed batch";
+            break;
+        }
+    }
+    if (!framing && b->depth != 0) framing = "Truncated item";
+
+    ESP_LOGI(TAG, "push batch: %u accepted, %u rejected%s%s",
+             (unsigned)b->accepted, (unsigned)b->rejected,
+             framing ? ", stopped: " : "", framing ? framing : "");
+
+    /* A framing error before anything was queued is a bad request; after
+     * that the summary tells the caller where it stopped. */
+    static char resp[sizeof(s_batch.errors) + 160];
+    snprintf(resp, sizeof(resp),
+             "{\"accepted\":%u,\"rejected\":%u,\"job_ids\":[%lu,%lu],\"errors\":[%.*s]%s%s%s}",
+             (unsigned)b->accepted, (unsigned)b->rejected,
+             (unsigned long)b->first_job, (unsigned long)b->last_job,
+             (int)b->errors_len, b->errors,
+             framing ? ",\"error\":\"" : "", framing ? framing : "", framing ? "\"" : "");
+    if (framing && b->accepted == 0) httpd_resp_set_status(req, "400 Bad Request");
+    send_json_ok(req, resp);
     return ESP_OK;
 }
 
@@ -318,60 +730,70 @@ static esp_err_t token_register_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    char buf[350];
-    if (read_body(req, buf, sizeof(buf)) <= 0) {
-        send_json_err(req, "400 Bad Request", "No body");
+    char ip_str[TOKEN_IP_LEN], tok_str[TOKEN_HEX_LEN], srv_str[16];
+    tags_scan_t tags = { .max = TAGS_PER_ENTRY };
+    json_field_t f[] = {
+        JSON_SCAN_STR("ip",          ip_str),
+        JSON_SCAN_STR("token",       tok_str),
+        JSON_SCAN_STR("server_type", srv_str),
+        JSON_SCAN_STRS("tags",       tags.buf, tags_item, &tags),
+    };
+    const char *err = scan_body(req, f, 4);
+    if (err) {
+        send_json_err(req, "400 Bad Request", err);
         return ESP_OK;
     }
 
-    cJSON *root = cJSON_Parse(buf);
-    if (!root) {
-        send_json_err(req, "400 Bad Request", "Invalid JSON");
+    uint32_t ip;
+    uint8_t  token[TOKEN_BIN_LEN];
+    if (!field_ip(&f[0], &ip) || !field_token(&f[1], token)) {
+        send_json_err(req, "400 Bad Request", "Missing or invalid ip or token");
         return ESP_OK;
     }
 
-    const char *ip          = cJSON_GetStringValue(cJSON_GetObjectItem(root, "ip"));
-    const char *token       = cJSON_GetStringValue(cJSON_GetObjectItem(root, "token"));
-    const char *server_type = cJSON_GetStringValue(cJSON_GetObjectItem(root, "server_type"));
-
-    if (!ip || !token) {
-        cJSON_Delete(root);
-        send_json_err(req, "400 Bad Request", "Missing ip or token");
+    token_server_t server;
+    if (!field_server_type(&f[2], &server)) {
+        send_json_err(req, "400 Bad Request", "Missing or invalid server_type (sandbox|production)");
         return ESP_OK;
     }
-
-    if (!server_type ||
-        (strcmp(server_type, "sandbox") != 0 && strcmp(server_type, "production") != 0)) {
-        cJSON_Delete(root);
-        send_json_err(req, "400 Bad Request", "Missing or invalid server_type (sandbox|production)");
+    if (tags.bad) {
+        send_json_err(req, "400 Bad Request", TAGS_ERR);
         return ESP_OK;
     }
 
     /* Guard 1: IP+server_type in block list → ignore */
-    char existing[TOKEN_LEN];
-    if (token_store_block_get(server_type, ip, existing, sizeof(existing)) == ESP_OK) {
-        cJSON_Delete(root);
+    if (token_store_block_get(server, ip, NULL) == ESP_OK) {
         send_json_ok(req, "{\"status\":\"ignored\",\"reason\":\"blocked\"}");
         return ESP_OK;
     }
 
-    /* Guard 2: identical server_type+ip+token already in send list → ignore */
-    if (token_store_send_get(server_type, ip, existing, sizeof(existing)) == ESP_OK
-        && strcmp(existing, token) == 0) {
-        cJSON_Delete(root);
-        send_json_ok(req, "{\"status\":\"ignored\",\"reason\":\"no_change\"}");
-        return ESP_OK;
+    /* Without "tags" the entry keeps the ones it has; with it they are replaced */
+    token_batch_t b;
+    token_store_batch_begin(&b);
+    if (f[3].found) {
+        token_store_batch_send_set_tagged(&b, server, ip, token, tags.names, tags.n);
+    } else {
+        token_store_batch_send_set(&b, server, ip, token);
     }
+    esp_err_t ret = token_store_batch_end(&b);
 
-    esp_err_t ret = token_store_send_set(server_type, ip, token);
-    cJSON_Delete(root);
-
+    if (ret == ESP_ERR_NO_MEM) {
+        send_json_err(req, "500 Internal Server Error", "Store or tag table full");
+        return ESP_OK;
+    }
     if (ret != ESP_OK) {
         send_json_err(req, "500 Internal Server Error", "Store write failed");
         return ESP_OK;
     }
 
-    ESP_LOGI(TAG, "token registered: ip=%s server_type=%s", ip, server_type);
+    /* Guard 2: identical server_type+ip+token(+tags) already in send list → ignore */
+    if (b.unchanged) {
+        send_json_ok(req, "{\"status\":\"ignored\",\"reason\":\"no_change\"}");
+        return ESP_OK;
+    }
+
+    token_ip_format(ip, ip_str);
+    TRACE_LOGI(TAG, "token registered: ip=%s server_type=%s", ip_str, token_server_name(server));
     send_json_ok(req, "{\"status\":\"ok\"}");
     return ESP_OK;
 }
@@ -384,10 +806,7 @@ static esp_err_t tokens_send_get_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    static token_entry_t entries[TOKEN_MAX_ENTRIES];
-    size_t count = TOKEN_MAX_ENTRIES;
-    token_store_send_list(entries, &count, TOKEN_MAX_ENTRIES);
-    send_token_list(req, entries, count);
+    send_token_list(req, TOKEN_LIST_SEND);
     return ESP_OK;
 }
 
@@ -399,27 +818,14 @@ static esp_err_t tokens_send_del_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    char buf[100];
-    if (read_body(req, buf, sizeof(buf)) <= 0) {
-        send_json_err(req, "400 Bad Request", "No body");
-        return ESP_OK;
-    }
-
-    cJSON *root = cJSON_Parse(buf);
-    if (!root) {
-        send_json_err(req, "400 Bad Request", "Invalid JSON");
-        return ESP_OK;
-    }
-
-    const char *ip = cJSON_GetStringValue(cJSON_GetObjectItem(root, "ip"));
-    if (!ip) {
-        cJSON_Delete(root);
-        send_json_err(req, "400 Bad Request", "Missing ip");
+    uint32_t ip;
+    const char *err = scan_ip_body(req, &ip);
+    if (err) {
+        send_json_err(req, "400 Bad Request", err);
         return ESP_OK;
     }
 
     esp_err_t ret = token_store_send_del(ip);
-    cJSON_Delete(root);
 
     if (ret == ESP_ERR_NVS_NOT_FOUND) {
         send_json_err(req, "404 Not Found", "IP not in send list");
@@ -442,10 +848,7 @@ static esp_err_t tokens_block_get_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    static token_entry_t entries[TOKEN_MAX_ENTRIES];
-    size_t count = TOKEN_MAX_ENTRIES;
-    token_store_block_list(entries, &count, TOKEN_MAX_ENTRIES);
-    send_token_list(req, entries, count);
+    send_token_list(req, TOKEN_LIST_BLOCK);
     return ESP_OK;
 }
 
@@ -457,29 +860,25 @@ static esp_err_t tokens_block_post_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    char buf[300];
-    if (read_body(req, buf, sizeof(buf)) <= 0) {
-        send_json_err(req, "400 Bad Request", "No body");
-        return ESP_OK;
-    }
-
-    cJSON *root = cJSON_Parse(buf);
-    if (!root) {
-        send_json_err(req, "400 Bad Request", "Invalid JSON");
+    char ip_str[TOKEN_IP_LEN], tok_str[TOKEN_HEX_LEN];
+    json_field_t f[] = {
+        JSON_SCAN_STR("ip",    ip_str),
+        JSON_SCAN_STR("token", tok_str),
+    };
+    const char *err = scan_body(req, f, 2);
+    if (err) {
+        send_json_err(req, "400 Bad Request", err);
         return ESP_OK;
     }
 
-    const char *ip    = cJSON_GetStringValue(cJSON_GetObjectItem(root, "ip"));
-    const char *token = cJSON_GetStringValue(cJSON_GetObjectItem(root, "token"));
-
-    if (!ip || !token) {
-        cJSON_Delete(root);
-        send_json_err(req, "400 Bad Request", "Missing ip or token");
+    uint32_t ip;
+    uint8_t  token[TOKEN_BIN_LEN];
+    if (!field_ip(&f[0], &ip) || !field_token(&f[1], token)) {
+        send_json_err(req, "400 Bad Request", "Missing or invalid ip or token");
         return ESP_OK;
     }
 
     esp_err_t ret = token_store_block_set(ip, token);
-    cJSON_Delete(root);
 
     if (ret != ESP_OK) {
         send_json_err(req, "500 Internal Server Error", "Store write failed");
@@ -498,27 +897,14 @@ static esp_err_t tokens_block_del_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    char buf[100];
-    if (read_body(req, buf, sizeof(buf)) <= 0) {
-        send_json_err(req, "400 Bad Request", "No body");
-        return ESP_OK;
-    }
-
-    cJSON *root = cJSON_Parse(buf);
-    if (!root) {
-        send_json_err(req, "400 Bad Request", "Invalid JSON");
-        return ESP_OK;
-    }
-
-    const char *ip = cJSON_GetStringValue(cJSON_GetObjectItem(root, "ip"));
-    if (!ip) {
-        cJSON_Delete(root);
-        send_json_err(req, "400 Bad Request", "Missing ip");
+    uint32_t ip;
+    const char *err = scan_ip_body(req, &ip);
+    if (err) {
+        send_json_err(req, "400 Bad Request", err);
         return ESP_OK;
     }
 
     esp_err_t ret = token_store_block_del(ip);
-    cJSON_Delete(root);
 
     if (ret == ESP_ERR_NVS_NOT_FOUND) {
         send_json_err(req, "404 Not Found", "IP not in block list");
@@ -541,27 +927,14 @@ static esp_err_t move_to_block_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    char buf[100];
-    if (read_body(req, buf, sizeof(buf)) <= 0) {
-        send_json_err(req, "400 Bad Request", "No body");
-        return ESP_OK;
-    }
-
-    cJSON *root = cJSON_Parse(buf);
-    if (!root) {
-        send_json_err(req, "400 Bad Request", "Invalid JSON");
-        return ESP_OK;
-    }
-
-    const char *ip = cJSON_GetStringValue(cJSON_GetObjectItem(root, "ip"));
-    if (!ip) {
-        cJSON_Delete(root);
-        send_json_err(req, "400 Bad Request", "Missing ip");
+    uint32_t ip;
+    const char *err = scan_ip_body(req, &ip);
+    if (err) {
+        send_json_err(req, "400 Bad Request", err);
         return ESP_OK;
     }
 
     esp_err_t ret = token_store_move_to_block(ip);
-    cJSON_Delete(root);
 
     if (ret == ESP_ERR_NVS_NOT_FOUND) {
         send_json_err(req, "404 Not Found", "IP not in send list");
@@ -584,27 +957,14 @@ static esp_err_t move_to_send_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    char buf[100];
-    if (read_body(req, buf, sizeof(buf)) <= 0) {
-        send_json_err(req, "400 Bad Request", "No body");
-        return ESP_OK;
-    }
-
-    cJSON *root = cJSON_Parse(buf);
-    if (!root) {
-        send_json_err(req, "400 Bad Request", "Invalid JSON");
-        return ESP_OK;
-    }
-
-    const char *ip = cJSON_GetStringValue(cJSON_GetObjectItem(root, "ip"));
-    if (!ip) {
-        cJSON_Delete(root);
-        send_json_err(req, "400 Bad Request", "Missing ip");
+    uint32_t ip;
+    const char *err = scan_ip_body(req, &ip);
+    if (err) {
+        send_json_err(req, "400 Bad Request", err);
         return ESP_OK;
     }
 
     esp_err_t ret = token_store_move_to_send(ip);
-    cJSON_Delete(root);
 
     if (ret == ESP_ERR_NVS_NOT_FOUND) {
         send_json_err(req, "404 Not Found", "IP not in block list");
@@ -620,75 +980,756 @@ static esp_err_t move_to_send_handler(httpd_req_t *req)
 }
 
 /* ------------------------------------------------------------------ */
-/*  Handler: POST /blast                                               */
+/*  Handler: GET /tokens/tags                                          */
 /* ------------------------------------------------------------------ */
 
-static esp_err_t blast_handler(httpd_req_t *req)
+static esp_err_t tokens_tags_get_handler(httpd_req_t *req)
 {
     if (!auth_check(req)) return ESP_OK;
 
-    char buf[600];
-    if (read_body(req, buf, sizeof(buf)) <= 0) {
-        send_json_err(req, "400 Bad Request", "No body");
+    size_t n = token_store_tag_list(s_list_tags, TOKEN_TAGS_MAX);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr_chunk(req, "{\"tags\":[");
+    for (size_t i = 0; i < n; i++) {
+        char entry[64];
+        snprintf(entry, sizeof(entry), "%s{\"name\":\"%s\",\"entries\":%lu}",
+                 i ? "," : "", s_list_tags[i].name, (unsigned long)s_list_tags[i].entries);
+        httpd_resp_sendstr_chunk(req, entry);
+    }
+    char tmp[48];
+    snprintf(tmp, sizeof(tmp), "],\"count\":%u,\"capacity\":%d}",
+             (unsigned)n, CONFIG_TOKEN_STORE_MAX_TAGS);
+    httpd_resp_sendstr_chunk(req, tmp);
+    httpd_resp_sendstr_chunk(req, NULL); /* end chunked response */
+    return ESP_OK;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Handler: POST /tokens/bulk                                         */
+/* ------------------------------------------------------------------ */
+
+#define BULK_BODY_MAX  (32 * 1024)
+
+/*
+ * The body is held whole (one allocation, bounded by one NVS batch) and
+ * scanned in place twice, since "list" may come after the entries it
+ * applies to.  No per-entry parse tree is built.
+ */
+typedef struct {
+    token_batch_t *b;
+    bool to_block;
+    int  skipped;
+    int  failed;
+    char ip[TOKEN_IP_LEN];
+    char token[TOKEN_HEX_LEN];
+    char server_type[16];
+    tags_scan_t tags;       /* this entry's, reset after each one */
+} bulk_ctx_t;
+
+enum { BF_IP, BF_TOKEN, BF_SERVER, BF_TAGS, BF_COUNT };
+
+static void bulk_apply(bulk_ctx_t *c, json_field_t *f)
+{
+    uint32_t ip;
+    uint8_t  token[TOKEN_BIN_LEN];
+    if (!field_ip(&f[BF_IP], &ip) || !field_token(&f[BF_TOKEN], token)) {
+        c->failed++;
+        return;
+    }
+
+    esp_err_t r;
+    if (c->to_block) {
+        r = token_store_batch_block_set(c->b, ip, token);
+    } else {
+        token_server_t srv;
+        if (!field_server_type(&f[BF_SERVER], &srv)) {
+            c->failed++;
+            return;
+        }
+        /* Same guard as POST /token: blocked IPs are never (re)added */
+        if (token_store_block_get(srv, ip, NULL) == ESP_OK) {
+            c->skipped++;
+            return;
+        }
+        if (c->tags.bad) {
+            c->failed++;
+            return;
+        }
+        r = f[BF_TAGS].found
+            ? token_store_batch_send_set_tagged(c->b, srv, ip, token, c->tags.names, c->tags.n)
+            : token_store_batch_send_set(c->b, srv, ip, token);
+    }
+    if (r != ESP_OK) c->failed++;
+}
+
+static void bulk_entry(json_field_t *f, size_t n, void *arg)
+{
+    bulk_ctx_t *c = arg;
+    (void)n;
+
+    bulk_apply(c, f);
+    c->tags.n   = 0;
+    c->tags.bad = false;
+}
+
+static esp_err_t tokens_bulk_handler(httpd_req_t *req)
+{
+    if (!auth_check(req)) return ESP_OK;
+
+    size_t len;
+    char *body = read_body_alloc(req, BULK_BODY_MAX, &len);
+    if (!body) {
+        send_json_err(req, "400 Bad Request", "Missing or oversized body");
         return ESP_OK;
     }
 
-    cJSON *root = cJSON_Parse(buf);
-    if (!root) {
+    /* First pass: validate, pick up "list" and check "entries" is an array */
+    char list[8];
+    json_field_t top[] = {
+        JSON_SCAN_STR("list", list),
+        { .name = "entries", .type = JSON_FIELD_OBJECTS },
+    };
+    if (json_scan_buf(body, len, top, 2) != ESP_OK) {
+        free(body);
         send_json_err(req, "400 Bad Request", "Invalid JSON");
         return ESP_OK;
     }
+    if (!top[1].found) {
+        free(body);
+        send_json_err(req, "400 Bad Request", "Missing entries array");
+        return ESP_OK;
+    }
+
+    bool to_block = top[0].found && strcmp(list, "block") == 0;
+    if (top[0].found && !to_block && strcmp(list, "send") != 0) {
+        free(body);
+        send_json_err(req, "400 Bad Request", "Invalid list (send|block)");
+        return ESP_OK;
+    }
+
+    /* Second pass writes each entry as it is walked.
+     * One batch: a single NVS handle + commit per touched namespace. */
+    token_batch_t b;
+    bulk_ctx_t ctx = { .b = &b, .to_block = to_block, .tags = { .max = TAGS_PER_ENTRY } };
+    json_field_t sub[BF_COUNT] = {
+        [BF_IP]     = JSON_SCAN_STR("ip",          ctx.ip),
+        [BF_TOKEN]  = JSON_SCAN_STR("token",       ctx.token),
+        [BF_SERVER] = JSON_SCAN_STR("server_type", ctx.server_type),
+        [BF_TAGS]   = JSON_SCAN_STRS("tags",       ctx.tags.buf, tags_item, &ctx.tags),
+    };
+    json_field_t entries[] = {
+        { .name = "entries", .type = JSON_FIELD_OBJECTS,
+          .sub = sub, .nsub = BF_COUNT, .on_item = bulk_entry, .ctx = &ctx },
+    };
+
+    token_store_batch_begin(&b);
+    json_scan_buf(body, len, entries, 1);
+    esp_err_t ret = token_store_batch_end(&b);
+    free(body);
+    int skipped = ctx.skipped, failed = ctx.failed;
+
+    ESP_LOGI(TAG, "bulk import (%s): %u written, %u unchanged, %d skipped, %d failed",
+             to_block ? "block" : "send", b.written, b.unchanged, skipped, failed);
+
+    char resp[160];
+    snprintf(resp, sizeof(resp),
+             "{\"status\":\"%s\",\"written\":%u,\"unchanged\":%u,"
+             "\"skipped\":%d,\"failed\":%d}",
+             (ret == ESP_OK && failed == 0) ? "ok" : "partial",
+             b.written, b.unchanged, skipped, failed);
+    send_json_ok(req, resp);
+    return ESP_OK;
+}
 
-    const char *title = cJSON_GetStringValue(cJSON_GetObjectItem(root, "title"));
-    const char *body  = cJSON_GetStringValue(cJSON_GetObjectItem(root, "body"));
+/* ------------------------------------------------------------------ */
+/*  Handler: POST /blast                                               */
+/* ------------------------------------------------------------------ */
 
-    if (!title || !body) {
-        cJSON_Delete(root);
+static esp_err_t blast_handler(httpd_req_t *req)
+{
+    if (!auth_check(req)) return ESP_OK;
+
+    push_job_t  job;
+    push_job_t *p = &job;
+    push_scan_t ps;
+    push_scan_init(&ps, p, PUSH_JOB_BLAST);
+
+    /* Same table as /push, minus device_token, plus the "tags" selector */
+    const char *err = scan_body(req, ps.f + 1, PF_COUNT - 1);
+    if (err) {
+        send_json_err(req, "400 Bad Request", err);
+        return ESP_OK;
+    }
+    if (!push_scan_done(&ps, p)) {
         send_json_err(req, "400 Bad Request", "Missing title or body");
         return ESP_OK;
     }
+    if (ps.tags.bad || (ps.f[PF_TAGS].found && p->ntags == 0)) {
+        send_json_err(req, "400 Bad Request",
+                      "Invalid tags (up to 4 names of 1-15 chars [A-Za-z0-9._-])");
+        return ESP_OK;
+    }
+    if (ps.f[PF_TAGS].found) {
+        /* Refuse a selector that can match nobody rather than run an empty blast */
+        token_cursor_t cur;
+        esp_err_t ret = token_store_cursor_open_tagged(&cur, TOKEN_LIST_SEND, TOKEN_SERVER_ANY,
+                                                       p->tags, p->ntags);
+        token_store_cursor_close(&cur);
+        if (ret != ESP_OK) {
+            send_json_err(req, "404 Not Found", "Unknown tags");
+            return ESP_OK;
+        }
+    }
 
-    blast_params_t *p = calloc(1, sizeof(blast_params_t));
-    if (!p) {
-        cJSON_Delete(root);
-        send_json_err(req, "500 Internal Server Error", "OOM");
+    if (queue_job(&job, 0) != ESP_OK) {
+        send_queue_full(req);
         return ESP_OK;
     }
+    ESP_LOGI(TAG, "blast #%lu queued (server=%s, tags=%u)", (unsigned long)job.blast_id,
+             p->use_sandbox ? "sandbox" : "production", (unsigned)p->ntags);
 
-    strncpy(p->title, title, sizeof(p->title) - 1);
-    strncpy(p->body,  body,  sizeof(p->body)  - 1);
+    char resp[64];
+    snprintf(resp, sizeof(resp), "{\"status\":\"queued\",\"id\":%lu,\"job_id\":%lu}",
+             (unsigned long)job.blast_id, (unsigned long)job.job_id);
+    send_json_ok(req, resp);
+    return ESP_OK;
+}
 
-    cJSON *badge_item = cJSON_GetObjectItem(root, "badge");
-    p->badge = badge_item ? badge_item->valueint : -1;
+/* ------------------------------------------------------------------ */
+/*  Handlers: GET / DELETE /blast/{id}                                 */
+/* ------------------------------------------------------------------ */
+
+/** Parse the id out of /blast/{id}[?...]; 0 if malformed. */
+static uint32_t blast_uri_id(httpd_req_t *req)
+{
+    const char *s = req->uri + strlen("/blast/");
+    char *end;
+    unsigned long id = strtoul(s, &end, 10);
+    if (end == s || (*end != '\0' && *end != '?')) return 0;
+    return (uint32_t)id;
+}
+
+static esp_err_t blast_get_handler(httpd_req_t *req)
+{
+    if (!auth_check(req)) return ESP_OK;
 
-    const char *sound = cJSON_GetStringValue(cJSON_GetObjectItem(root, "sound"));
-    if (sound) {
-        strncpy(p->sound, sound, sizeof(p->sound) - 1);
-        p->has_sound = true;
+    push_blast_status_t st;
+    uint32_t id = blast_uri_id(req);
+    if (id == 0 || push_blast_get(id, &st) != ESP_OK) {
+        send_json_err(req, "404 Not Found", "Unknown blast id");
+        return ESP_OK;
     }
 
-    const char *custom = cJSON_GetStringValue(cJSON_GetObjectItem(root, "custom_payload"));
-    if (custom) {
-        strncpy(p->custom_payload, custom, sizeof(p->custom_payload) - 1);
-        p->has_custom = true;
+    int64_t now     = esp_timer_get_time();
+    int64_t end     = st.finished_us ? st.finished_us : now;
+    int64_t elapsed = st.started_us ? end - st.started_us : 0;
+    int64_t waited  = (st.started_us ? st.started_us : end) - st.queued_us;
+    unsigned long rate = elapsed > 0 ? (unsigned long)(st.sent * 1000000LL / elapsed) : 0;
+
+    char resp[384];
+    snprintf(resp, sizeof(resp),
+             "{\"id\":%lu,\"state\":\"%s\",\"server_type\":\"%s\",\"total\":%lu,"
+             "\"sent\":%lu,\"ok\":%lu,\"failed\":%lu,\"unregistered\":%lu,\"pruned\":%lu,"
+             "\"queued_ms\":%lld,\"elapsed_ms\":%lld,\"rate_per_s\":%lu}",
+             (unsigned long)st.id, push_blast_state_name(st.state),
+             st.use_sandbox ? "sandbox" : "production", (unsigned long)st.total,
+             (unsigned long)st.sent, (unsigned long)st.ok, (unsigned long)st.failed,
+             (unsigned long)st.unregistered, (unsigned long)st.pruned,
+             (long long)(waited / 1000), (long long)(elapsed / 1000), rate);
+    send_json_ok(req, resp);
+    return ESP_OK;
+}
+
+static esp_err_t blast_delete_handler(httpd_req_t *req)
+{
+    if (!auth_check(req)) return ESP_OK;
+
+    uint32_t id = blast_uri_id(req);
+    esp_err_t ret = id ? push_blast_cancel(id) : ESP_ERR_NOT_FOUND;
+    if (ret == ESP_ERR_NOT_FOUND) {
+        send_json_err(req, "404 Not Found", "Unknown blast id");
+        return ESP_OK;
+    }
+    if (ret == ESP_ERR_INVALID_STATE) {
+        send_json_err(req, "409 Conflict", "Blast already finished");
+        return ESP_OK;
     }
 
-    p->use_sandbox = parse_server_type(root);
-    cJSON_Delete(root);
+    push_blast_status_t st;
+    bool queued_cancel = push_blast_get(id, &st) == ESP_OK && st.state == PUSH_BLAST_CANCELLED;
+    ESP_LOGI(TAG, "blast #%lu cancel requested", (unsigned long)id);
 
-    ESP_LOGI(TAG, "blast queued (server=%s)",
-             p->use_sandbox ? "sandbox" : "production");
+    char resp[64];
+    snprintf(resp, sizeof(resp), "{\"status\":\"%s\",\"id\":%lu}",
+             queued_cancel ? "cancelled" : "cancelling", (unsigned long)id);
+    send_json_ok(req, resp);
+    return ESP_OK;
+}
 
-    /* 20 KB stack — reads send list + multiple TLS/HTTP2 connections */
-    if (xTaskCreate(blast_task, "apns_blast", 20480, p, 5, NULL) != pdPASS) {
-        free(p);
-        send_json_err(req, "500 Internal Server Error", "Task create failed");
+/* ------------------------------------------------------------------ */
+/*  Handler: GET /metrics                                              */
+/* ------------------------------------------------------------------ */
+
+/** printf into one response chunk. */
+/*
+ * One formatted chunk.  Callers keep each format short enough for the
+ * largest values (a %lu runs to 10 digits); a cut chunk would break the
+ * JSON for every client, so a format that outgrew the buffer is logged.
+ */
+static void sendf(httpd_req_t *req, const char *fmt, ...)
+{
+    char buf[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int)sizeof(buf)) {
+        ESP_LOGE(TAG, "sendf: chunk needs %d of %u bytes: %.32s", n, (unsigned)sizeof(buf), fmt);
+    }
+    httpd_resp_sendstr_chunk(req, buf);
+}
+
+static void send_hist(httpd_req_t *req, const char *name, const h2_hist_t *h, bool last)
+{
+    sendf(req, "\"%s\":{\"count\":%lu,\"sum_us\":%llu,\"max_us\":%lu,\"buckets\":[",
+          name, (unsigned long)h->count, (unsigned long long)h->sum_us,
+          (unsigned long)h->max_us);
+    for (int i = 0; i < H2_HIST_BUCKETS; i++) {
+        sendf(req, i ? ",%lu" : "%lu", (unsigned long)h->buckets[i]);
+    }
+    httpd_resp_sendstr_chunk(req, last ? "]}" : "]},");
+}
+
+/* Tasks whose stack high-water mark is reported, when they exist */
+static const char *const s_watched_tasks[] = {
+    "apns_jwt", "fcm_auth", "h2_warm", "tok_flush", "push_w0", "push_w1", "push_w2", "push_w3",
+    "push_b0", "httpd", "tiT", "wifi", "sys_evt",
+};
+
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+    if (!auth_check(req)) return ESP_OK;
+
+    static h2_metrics_t   m;   /* httpd runs handlers on a single task */
+    static apns_metrics_t a;
+    h2_engine_metrics_get(&m);
+    apns_metrics_get(&a);
+
+    httpd_resp_set_type(req, "application/json");
+    sendf(req, "{\"uptime_s\":%lld,", (long long)(esp_timer_get_time() / 1000000));
+
+    sendf(req, "\"heap\":{\"free\":%lu,\"min_free\":%lu,\"internal_free\":%lu,",
+          (unsigned long)esp_get_free_heap_size(),
+          (unsigned long)esp_get_minimum_free_heap_size(),
+          (unsigned long)heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    sendf(req, "\"internal_min_free\":%lu,\"internal_largest\":%lu,\"psram_free\":%lu},",
+          (unsigned long)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+          (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL),
+          (unsigned long)heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+
+    /* nghttp2 slab pool: free blocks per class now and at the low point */
+    httpd_resp_sendstr_chunk(req, "\"pools\":{\"h2\":{\"sizes\":[");
+    for (int i = 0; i < H2_POOL_CLASSES; i++) {
+        sendf(req, i ? ",%u" : "%u", (unsigned)h2_pool_sizes[i]);
+    }
+    httpd_resp_sendstr_chunk(req, "],\"free\":[");
+    for (int i = 0; i < H2_POOL_CLASSES; i++) {
+        sendf(req, i ? ",%u" : "%u", (unsigned)m.pool_free[i]);
+    }
+    httpd_resp_sendstr_chunk(req, "],\"min_free\":[");
+    for (int i = 0; i < H2_POOL_CLASSES; i++) {
+        sendf(req, i ? ",%u" : "%u", (unsigned)m.pool_min_free[i]);
+    }
+    sendf(req, "],\"blocks\":%d,\"fallbacks\":%lu}},",
+          CONFIG_APNS_H2_POOL_BLOCKS, (unsigned long)m.pool_fallbacks);
+
+    httpd_resp_sendstr_chunk(req, "\"stack_free_min\":{");
+    bool first = true;
+    for (size_t i = 0; i < sizeof(s_watched_tasks) / sizeof(s_watched_tasks[0]); i++) {
+        TaskHandle_t t = xTaskGetHandle(s_watched_tasks[i]);
+        if (!t) continue;
+        sendf(req, "%s\"%s\":%lu", first ? "" : ",", s_watched_tasks[i],
+              (unsigned long)uxTaskGetStackHighWaterMark(t));
+        first = false;
+    }
+    httpd_resp_sendstr_chunk(req, "},");
+
+    sendf(req, "\"queue\":{\"pending\":%u,\"interactive\":%u,\"bulk\":%u,"
+               "\"interactive_joins\":%lu},",
+          (unsigned)push_queue_pending(),
+          (unsigned)push_queue_pending_lane(PUSH_LANE_INTERACTIVE),
+          (unsigned)push_queue_pending_lane(PUSH_LANE_BULK),
+          (unsigned long)m.interactive_joins);
+
+    outbox_stats_t ob;
+    outbox_get_stats(&ob);
+    sendf(req, "\"outbox\":{\"pending\":%lu,\"capacity\":%lu,\"appended\":%lu,\"drained\":%lu,",
+          (unsigned long)ob.pending, (unsigned long)ob.capacity, (unsigned long)ob.appended,
+          (unsigned long)ob.consumed);
+    sendf(req, "\"expired\":%lu,\"dropped\":%lu,\"erases\":%lu},",
+          (unsigned long)ob.expired, (unsigned long)ob.dropped, (unsigned long)ob.erases);
+
+    token_wb_stats_t wb;
+    token_store_wb_stats(&wb);
+    sendf(req, "\"tokens\":{\"dirty\":%lu,\"flushes\":%lu,\"flush_failures\":%lu},",
+          (unsigned long)wb.dirty, (unsigned long)wb.flushes, (unsigned long)wb.failures);
+
+    /* Milestones since boot; null until reached */
+    const int64_t boot[] = { s_ready_us, push_queue_opened_us(), s_first_request_us,
+                             m.first_ok_us };
+    static const char *const boot_names[] = { "api_ready_ms", "clock_valid_ms",
+                                              "first_request_ms", "first_push_ms" };
+    httpd_resp_sendstr_chunk(req, "\"boot\":{");
+    for (size_t i = 0; i < sizeof(boot) / sizeof(boot[0]); i++) {
+        if (boot[i]) sendf(req, "%s\"%s\":%lld", i ? "," : "", boot_names[i],
+                           (long long)(boot[i] / 1000));
+        else         sendf(req, "%s\"%s\":null", i ? "," : "", boot_names[i]);
+    }
+    httpd_resp_sendstr_chunk(req, "},");
+
+    sendf(req, "\"push\":{\"sent\":%lu,\"ok\":%lu,\"unregistered\":%lu,",
+          (unsigned long)m.sent, (unsigned long)m.ok, (unsigned long)m.unregistered);
+    sendf(req, "\"timeouts\":%lu,\"failed\":%lu,\"stream_resets\":%lu,",
+          (unsigned long)m.timeouts, (unsigned long)m.failed,
+          (unsigned long)m.stream_resets);
+    sendf(req, "\"retries\":%lu,\"retries_exhausted\":%lu,\"auth_retries\":%lu},",
+          (unsigned long)m.retries, (unsigned long)m.retries_exhausted,
+          (unsigned long)m.auth_retries);
+
+    httpd_resp_sendstr_chunk(req, "\"status\":{");
+    for (int i = 0; i < H2_STATUS_SLOTS - 1; i++) {
+        sendf(req, "\"%u\":%lu,", (unsigned)h2_status_codes[i], (unsigned long)m.status[i]);
+    }
+    sendf(req, "\"other\":%lu},", (unsigned long)m.status[H2_STATUS_SLOTS - 1]);
+
+    /* Only reasons seen so far; the full list is long and mostly zero */
+    httpd_resp_sendstr_chunk(req, "\"reasons\":{");
+    first = true;
+    for (int r = APNS_REASON_NONE + 1; r < APNS_REASON_COUNT; r++) {
+        if (!a.reasons[r]) continue;
+        sendf(req, "%s\"%s\":%lu", first ? "" : ",",
+              apns_reason_name((apns_reason_t)r), (unsigned long)a.reasons[r]);
+        first = false;
+    }
+    httpd_resp_sendstr_chunk(req, "},");
+
+    sendf(req, "\"conn\":{\"connects\":%lu,\"reconnects\":%lu,\"failures\":%lu,",
+          (unsigned long)m.connects, (unsigned long)m.reconnects,
+          (unsigned long)m.connect_failures);
+    sendf(req, "\"goaways\":%lu,\"session_offers\":%lu,\"prewarms\":%lu},",
+          (unsigned long)m.goaways, (unsigned long)m.session_offers, (unsigned long)m.prewarms);
+    /* One window per registered host, keyed by its label */
+    httpd_resp_sendstr_chunk(req, "\"pacing\":{\"window\":{");
+    first = true;
+    for (int i = 0; i < H2_HOSTS_MAX; i++) {
+        if (!m.hosts[i].label) continue;
+        sendf(req, "%s\"%s\":%lu", first ? "" : ",", m.hosts[i].label,
+              (unsigned long)m.hosts[i].window);
+        first = false;
+    }
+    sendf(req, "},\"window_shrinks\":%lu,\"rate_waits\":%lu},",
+          (unsigned long)m.window_shrinks, (unsigned long)m.rate_waits);
+    sendf(req, "\"jwt\":{\"refreshes\":%lu,\"failures\":%lu,\"inline\":%lu},",
+          (unsigned long)a.jwt_refreshes, (unsigned long)a.jwt_failures,
+          (unsigned long)a.jwt_inline);
+#if CONFIG_FCM_ENABLE
+    static fcm_metrics_t f;
+    fcm_metrics_get(&f);
+    sendf(req, "\"fcm\":{\"token_refreshes\":%lu,\"token_failures\":%lu,\"token_waits\":%lu,",
+          (unsigned long)f.token_refreshes, (unsigned long)f.token_failures,
+          (unsigned long)f.token_waits);
+    httpd_resp_sendstr_chunk(req, "\"reasons\":{");
+    first = true;
+    for (int r = FCM_REASON_NONE + 1; r < FCM_REASON_COUNT; r++) {
+        if (!f.reasons[r]) continue;
+        sendf(req, "%s\"%s\":%lu", first ? "" : ",",
+              fcm_reason_name((fcm_reason_t)r), (unsigned long)f.reasons[r]);
+        first = false;
+    }
+    httpd_resp_sendstr_chunk(req, "}},");
+#endif
+
+    httpd_resp_sendstr_chunk(req, "\"histograms\":{\"bounds_us\":[");
+    for (int i = 0; i < H2_HIST_BUCKETS - 1; i++) {
+        sendf(req, i ? ",%lu" : "%lu", (unsigned long)h2_hist_bounds_us[i]);
+    }
+    httpd_resp_sendstr_chunk(req, "],");
+    send_hist(req, "jwt_sign",   &a.jwt_sign,   false);
+#if CONFIG_FCM_ENABLE
+    send_hist(req, "fcm_token",  &f.token_fetch, false);
+#endif
+    send_hist(req, "connect",    &m.connect,    false);
+    send_hist(req, "rtt",        &m.rtt,        false);
+    send_hist(req, "queue_wait", &m.queue_wait, true);
+    httpd_resp_sendstr_chunk(req, "}}");
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+#if CONFIG_TRACE_ENABLE
+/* ------------------------------------------------------------------ */
+/*  Handler: GET /trace                                                */
+/* ------------------------------------------------------------------ */
+
+/*
+ * The ring from ?since=<seq> (default: all of it) up to the last record
+ * written when the request arrived, as [ts_us,"event",job,a,b] rows.
+ * Records are copied out TRACE_PAGE at a time, so the ring's lock is only
+ * held for a page; records overwritten before they were read are counted
+ * in "lost".  "next" is the since= of a follow-up request.
+ */
+#define TRACE_PAGE     32
+#define TRACE_ROW_LEN  72     /* [4294967295,"stream_timeout",4294967295,-32768,-2147483648], */
+
+static trace_rec_t s_trace_page[TRACE_PAGE];
+static char        s_trace_rows[TRACE_PAGE * TRACE_ROW_LEN];
+
+static esp_err_t trace_handler(httpd_req_t *req)
+{
+    if (!auth_check(req)) return ESP_OK;
+
+    const char *q;
+    size_t since = 0;
+    if (!query_get(req, &q) || !query_size(q, "since", &since)) {
+        send_json_err(req, "400 Bad Request", "Invalid since");
         return ESP_OK;
     }
 
-    send_json_ok(req, "{\"status\":\"queued\"}");
+    uint32_t seq  = (uint32_t)since;
+    uint32_t end  = trace_head();
+    uint32_t lost = 0;
+    if ((int32_t)(end - seq) < 0) seq = 0;   /* cursor from before a reboot */
+
+    httpd_resp_set_type(req, "application/json");
+    sendf(req, "{\"now_us\":%lu,\"events\":[", (unsigned long)(uint32_t)esp_timer_get_time());
+
+    bool first = true;
+    while ((int32_t)(end - seq) > 0) {
+        size_t want = end - seq < TRACE_PAGE ? end - seq : TRACE_PAGE;
+        uint32_t skipped;
+        size_t n = trace_read(&seq, s_trace_page, want, &skipped);
+        lost += skipped;
+        if (n == 0) break;
+
+        size_t len = 0;
+        for (size_t i = 0; i < n; i++) {
+            const trace_rec_t *r = &s_trace_page[i];
+            len += (size_t)snprintf(s_trace_rows + len, sizeof(s_trace_rows) - len,
+                                    "%s[%lu,\"%s\",%lu,%d,%ld]", first ? "" : ",",
+                                    (unsigned long)r->ts_us, trace_event_name(r->event),
+                                    (unsigned long)r->job, (int)r->a, (long)r->b);
+            first = false;
+        }
+        httpd_resp_send_chunk(req, s_trace_rows, (ssize_t)len);
+    }
+    sendf(req, "],\"next\":%lu,\"lost\":%lu}", (unsigned long)seq, (unsigned long)lost);
+    httpd_resp_sendstr_chunk(req, NULL);
     return ESP_OK;
 }
+#endif
+
+#if CONFIG_RESULTS_ENABLE
+/* ------------------------------------------------------------------ */
+/*  Handler: GET /results (Server-Sent Events)                         */
+/* ------------------------------------------------------------------ */
+
+/*
+ * The handler writes the response head itself, with neither a length nor
+ * chunking, and returns: the socket stays open as an idle httpd session,
+ * and everything written to it from then on is event stream.  All writes
+ * happen in sse_work(), which each publish (and a once-a-second tick)
+ * queues to the httpd task, so a session cannot be closed under a write.
+ *
+ * Writes never block.  A subscriber whose socket buffer is full keeps its
+ * unsent bytes and its ring cursor and is tried again on the next tick;
+ * if it falls a whole ring behind, the oldest results are dropped for it
+ * and it gets a "lost" event.  A run formats at most SSE_BATCH records per
+ * subscriber, so a blast cannot monopolise the httpd task.
+ */
+#define SSE_BATCH         8
+#define SSE_EVENT_LEN     256    /* id:, event: and a ~200-byte data: line */
+#define SSE_KEEPALIVE_US  (15LL * 1000 * 1000)
+
+typedef struct {
+    bool     used;
+    bool     closing;         /* write failed, close requested */
+    int      fd;
+    uint32_t seq;             /* next result record to send */
+    size_t   len;             /* bytes in tx */
+    size_t   off;             /* of which already sent */
+    int64_t  last_tx_us;
+    char     tx[SSE_BATCH * SSE_EVENT_LEN + 64];
+} sse_client_t;
+
+static httpd_handle_t       s_server;
+static sse_client_t         s_sse[CONFIG_RESULTS_MAX_CLIENTS];
+static volatile int         s_sse_count;    /* written on the httpd task only */
+static bool                 s_sse_queued;   /* sse_work() already queued */
+static portMUX_TYPE         s_sse_lock = portMUX_INITIALIZER_UNLOCKED;
+static result_rec_t         s_sse_page[SSE_BATCH];
+
+static void sse_work(void *arg);
+
+/** Queue sse_work() unless it already is.  Any task; the results notify hook. */
+static void sse_kick(void)
+{
+    if (s_sse_count == 0) return;
+    portENTER_CRITICAL(&s_sse_lock);
+    bool queue = !s_sse_queued;
+    s_sse_queued = true;
+    portEXIT_CRITICAL(&s_sse_lock);
+    if (queue && httpd_queue_work(s_server, sse_work, NULL) != ESP_OK) {
+        portENTER_CRITICAL(&s_sse_lock);
+        s_sse_queued = false;
+        portEXIT_CRITICAL(&s_sse_lock);
+    }
+}
+
+static void sse_tick(TimerHandle_t t)
+{
+    sse_kick();
+}
+
+static const char *const s_job_type_names[] = {
+    [PUSH_JOB_SINGLE] = "single",
+    [PUSH_JOB_BLAST]  = "blast",
+    [PUSH_JOB_DRAIN]  = "drain",
+};
+
+/** Append one result event for record @p seq to @p buf; returns its length. */
+static size_t sse_format(const result_rec_t *r, uint32_t seq, char *buf, size_t room)
+{
+    char ip[TOKEN_IP_LEN] = "";
+    if (r->ip) token_ip_format(r->ip, ip);
+    int n = snprintf(buf, room,
+                     "id: %lu\nevent: result\ndata: {\"job\":%lu,\"type\":\"%s\","
+                     "\"platform\":\"%s\"%s%s%s,\"ok\":%s,\"status\":%d,"
+                     "\"reason\":\"%.40s\",\"latency_us\":%lu}\n\n",
+                     (unsigned long)seq, (unsigned long)r->job,
+                     r->type <= PUSH_JOB_DRAIN ? s_job_type_names[r->type] : "?",
+                     r->platform == PUSH_PLATFORM_FCM ? "fcm" : "apns",
+                     r->ip ? ",\"ip\":\"" : "", ip, r->ip ? "\"" : "",
+                     r->err == ESP_OK ? "true" : "false", (int)r->status,
+                     results_reason_name(r), (unsigned long)r->latency_us);
+    return (n > 0 && (size_t)n < room) ? (size_t)n : 0;
+}
+
+/** Refill @p c->tx from the ring, or with a keep-alive comment when idle. */
+static void sse_fill(sse_client_t *c, int64_t now_us)
+{
+    uint32_t lost;
+    size_t n = results_read(&c->seq, s_sse_page, SSE_BATCH, &lost);
+    size_t len = 0;
+    if (lost) {
+        len = (size_t)snprintf(c->tx, sizeof(c->tx), "event: lost\ndata: {\"lost\":%lu}\n\n",
+                               (unsigned long)lost);
+    }
+    for (size_t i = 0; i < n; i++) {
+        len += sse_format(&s_sse_page[i], c->seq - (uint32_t)(n - i),
+                          c->tx + len, sizeof(c->tx) - len);
+    }
+    if (len == 0 && now_us - c->last_tx_us > SSE_KEEPALIVE_US) {
+        len = (size_t)snprintf(c->tx, sizeof(c->tx), ": keepalive\n\n");
+    }
+    c->len = len;
+    c->off = 0;
+}
+
+/** Runs on the httpd task: move each subscriber along as far as its socket takes. */
+static void sse_work(void *arg)
+{
+    portENTER_CRITICAL(&s_sse_lock);
+    s_sse_queued = false;
+    portEXIT_CRITICAL(&s_sse_lock);
+
+    int64_t  now_us = esp_timer_get_time();
+    uint32_t head   = results_head();
+    bool     more   = false;
+    for (int i = 0; i < CONFIG_RESULTS_MAX_CLIENTS; i++) {
+        sse_client_t *c = &s_sse[i];
+        if (!c->used || c->closing) continue;
+        if (c->off == c->len) sse_fill(c, now_us);
+        if (c->off == c->len) continue;
+
+        int r = httpd_socket_send(s_server, c->fd, c->tx + c->off, c->len - c->off, MSG_DONTWAIT);
+        if (r == HTTPD_SOCK_ERR_TIMEOUT) continue;   /* socket full: next tick */
+        if (r < 0) {
+            ESP_LOGW(TAG, "results: subscriber %d gone, closing", c->fd);
+            c->closing = true;
+            httpd_sess_trigger_close(s_server, c->fd);
+            continue;
+        }
+        c->off += (size_t)r;
+        c->last_tx_us = now_us;
+        /* Keep going while the socket keeps up; a full one waits for the tick */
+        if (c->off == c->len && c->seq != head) more = true;
+    }
+    if (more) sse_kick();
+}
+
+/** Session close: free the subscriber slot (httpd task). */
+static void sse_client_free(void *ctx)
+{
+    sse_client_t *c = (sse_client_t *)ctx;
+    ESP_LOGI(TAG, "results: subscriber %d closed", c->fd);
+    c->used = false;
+    s_sse_count--;
+}
+
+/*
+ * Start at the record after Last-Event-ID (an EventSource reconnecting),
+ * else at ?since=<seq>, else with the next result published.
+ */
+static esp_err_t results_handler(httpd_req_t *req)
+{
+    if (!auth_check(req)) return ESP_OK;
+
+    uint32_t seq = results_head();
+    char last_id[12];
+    const char *q;
+    size_t since;
+    if (httpd_req_get_hdr_value_str(req, "Last-Event-ID", last_id, sizeof(last_id)) == ESP_OK) {
+        seq = (uint32_t)strtoul(last_id, NULL, 10) + 1;
+    } else {
+        since = seq;
+        if (!query_get(req, &q) || !query_size(q, "since", &since)) {
+            send_json_err(req, "400 Bad Request", "Invalid since");
+            return ESP_OK;
+        }
+        seq = (uint32_t)since;
+    }
+
+    sse_client_t *c = NULL;
+    for (int i = 0; i < CONFIG_RESULTS_MAX_CLIENTS && !c; i++) {
+        if (!s_sse[i].used) c = &s_sse[i];
+    }
+    if (!c) {
+        send_json_err(req, "503 Service Unavailable", "Too many subscribers");
+        return ESP_OK;
+    }
+
+    static const char head[] = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: text/event-stream\r\n"
+                               "Cache-Control: no-cache\r\n"
+                               "\r\n"
+                               "retry: 2000\n\n";
+    if (httpd_send(req, head, sizeof(head) - 1) < 0) return ESP_FAIL;
+
+    *c = (sse_client_t){
+        .used       = true,
+        .fd         = httpd_req_to_sockfd(req),
+        .seq        = seq,
+        .last_tx_us = esp_timer_get_time(),
+    };
+    s_sse_count++;
+    req->sess_ctx = c;
+    req->free_ctx = sse_client_free;
+    ESP_LOGI(TAG, "results: subscriber %d from #%lu", c->fd, (unsigned long)seq);
+    sse_kick();
+    return ESP_OK;
+}
+#endif
 
 /* ------------------------------------------------------------------ */
 /*  Server start                                                       */
@@ -696,10 +1737,13 @@ static esp_err_t blast_handler(httpd_req_t *req)
 
 esp_err_t api_server_start(void)
 {
-    s_push_sem = xSemaphoreCreateCounting(MAX_CONCURRENT_PUSH, MAX_CONCURRENT_PUSH);
-
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = 16;
+    config.max_uri_handlers = 20;
+    config.uri_match_fn     = httpd_uri_match_wildcard;   /* for /blast/{id} */
+    /* Keep httpd off the core the push workers are pinned to */
+#if !CONFIG_FREERTOS_UNICORE
+    config.core_id = CONFIG_PUSH_WORKER_CORE ? 0 : 1;
+#endif
 
     httpd_handle_t server = NULL;
     esp_err_t ret = httpd_start(&server, &config);
@@ -715,6 +1759,7 @@ esp_err_t api_server_start(void)
 } while (0)
 
     REG("/push",               HTTP_POST,   push_handler);
+    REG("/push/batch",         HTTP_POST,   push_batch_handler);
     REG("/token",              HTTP_POST,   token_register_handler);
     REG("/tokens/send",        HTTP_GET,    tokens_send_get_handler);
     REG("/tokens/send",        HTTP_DELETE, tokens_send_del_handler);
@@ -723,10 +1768,36 @@ esp_err_t api_server_start(void)
     REG("/tokens/block",       HTTP_DELETE, tokens_block_del_handler);
     REG("/tokens/move-to-block", HTTP_POST, move_to_block_handler);
     REG("/tokens/move-to-send",  HTTP_POST, move_to_send_handler);
+    REG("/tokens/tags",        HTTP_GET,    tokens_tags_get_handler);
+    REG("/tokens/bulk",        HTTP_POST,   tokens_bulk_handler);
     REG("/blast",              HTTP_POST,   blast_handler);
+    REG("/blast/*",            HTTP_GET,    blast_get_handler);
+    REG("/blast/*",            HTTP_DELETE, blast_delete_handler);
+    REG("/metrics",            HTTP_GET,    metrics_handler);
+#if CONFIG_TRACE_ENABLE
+    REG("/trace",              HTTP_GET,    trace_handler);
+#endif
+#if CONFIG_RESULTS_ENABLE
+    REG("/results",            HTTP_GET,    results_handler);
+#endif
+#if CONFIG_FCM_ENABLE
+    REG("/fcm",                HTTP_POST,   fcm_handler);
+#endif
 
 #undef REG
 
-    ESP_LOGI(TAG, "API server started on port %d", config.server_port);
+#if CONFIG_RESULTS_ENABLE
+    /* Retries subscribers whose socket was full, and sends keep-alives */
+    s_server = server;
+    TimerHandle_t tick = xTimerCreate("sse", pdMS_TO_TICKS(1000), pdTRUE, NULL, sse_tick);
+    if (!tick || xTimerStart(tick, 0) != pdPASS) {
+        ESP_LOGW(TAG, "results: no tick timer, stalled subscribers resume on the next result");
+    }
+    results_set_notify(sse_kick);
+#endif
+
+    s_ready_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "API server started on port %d (%lld ms after boot)",
+             config.server_port, (long long)(s_ready_us / 1000));
     return ESP_OK;
 }
@@ -19,9 +19,10 @@
  *
  * ── Send list CRUD ────────────────────────────────────────────────────
  *
- * GET /tokens/send
- *   List all entries in the send list.
- *   Response: { "count": N, "entries": [{"ip":"...","token":"..."},...] }
+ * GET /tokens/send[?offset=N&limit=M]
+ *   List entries in the send list (all of them without a limit).
+ *   Response: { "entries": [{"ip":"...","token":"..."},...], "count": N,
+ *               "offset": N, "next_offset": N (only if more remain) }
  *
  * DELETE /tokens/send
  *   Remove an entry from the send list.
@@ -30,9 +31,10 @@
  *
  * ── Block list CRUD ───────────────────────────────────────────────────
  *
- * GET /tokens/block
- *   List all entries in the block list.
- *   Response: { "count": N, "entries": [{"ip":"...","token":"..."},...] }
+ * GET /tokens/block[?offset=N&limit=M]
+ *   List entries in the block list (all of them without a limit).
+ *   Response: { "entries": [{"ip":"...","token":"..."},...], "count": N,
+ *               "offset": N, "next_offset": N (only if more remain) }
  *
  * POST /tokens/block
  *   Add or overwrite an entry in the block list directly.
@@ -56,10 +58,24 @@
  *   JSON body: { "ip": "..." }
  *   Response: { "status": "ok" }
  *
+ * ── Bulk import ───────────────────────────────────────────────────────
+ *
+ * POST /tokens/bulk
+ *   Write many entries in one request, grouped into a single NVS commit
+ *   per namespace.  "list" defaults to "send"; send-list entries need a
+ *   server_type and are skipped if the IP is blocked (same as POST /token).
+ *   Block-list entries apply to both server types (same as POST /tokens/block).
+ *   JSON body (up to 32 KB):
+ *     { "list": "send" | "block",
+ *       "entries": [{"ip":"...","token":"...","server_type":"sandbox"}, ...] }
+ *   Response:
+ *     { "status": "ok" | "partial", "written": N, "unchanged": N,
+ *       "skipped": N, "failed": N }
+ *
  * ── Push notifications ────────────────────────────────────────────────
  *
  * POST /push
- *   Send a push notification to a single explicit device token (fire and forget).
+ *   Send a push notification to a single explicit device token (background job).
  *   JSON body:
  *     {
  *       "device_token":  "...",
@@ -70,9 +86,20 @@
  *       "custom_payload":"...",         // optional, raw JSON fields
  *       "server_type":   "sandbox"      // optional: "sandbox" (default) | "production"
  *     }
+ *   Response: { "status": "queued", "job_id": 57 }
+ *             503 + Retry-After when the push job queue is full
+ *
+ * POST /push/batch
+ *   Many /push objects in one request: a JSON array, or NDJSON (one object
+ *   per line).  The body is streamed; each item is queued as soon as it is
+ *   parsed, waiting up to CONFIG_PUSH_BATCH_WAIT_MS for queue room.
+ *   Response: { "accepted": 198, "rejected": 2, "job_ids": [612, 811],
+ *               "errors": [{"index": 5, "error": "Missing required fields"}, ...] }
+ *             errors lists at most 16 items.  A framing error stops the scan
+ *             and adds "error"; it is a 400 only if nothing was accepted.
  *
  * POST /blast
- *   Send the same push notification to every token in the send list (fire and forget).
+ *   Send the same push notification to every token in the send list (background job).
  *   JSON body:
  *     {
  *       "title":         "...",
@@ -82,8 +109,40 @@
  *       "custom_payload":"...",         // optional, raw JSON fields
  *       "server_type":   "sandbox"      // optional: "sandbox" (default) | "production"
  *     }
- *   Response: { "status": "queued" }
- *   Per-token results are logged to the console.
+ *   Response: { "status": "queued", "id": 7, "job_id": 58 }
+ *             503 + Retry-After when the push job queue (or blast ring) is full
+ *   Per-token results are streamed by GET /results.
+ *
+ * GET /blast/{id}
+ *   Progress of a blast job.
+ *   Response: { "id": 7, "state": "running", "server_type": "sandbox",
+ *               "total": 120, "sent": 64, "ok": 62, "failed": 1, "unregistered": 1,
+ *               "pruned": 1,
+ *               "queued_ms": 3, "elapsed_ms": 410, "rate_per_s": 156 }
+ *   state: queued | running | done | cancelled | failed.  404 once evicted
+ *   from the CONFIG_PUSH_BLAST_HISTORY ring.
+ *
+ * DELETE /blast/{id}
+ *   Cancel a blast.  A queued one is dropped at once ("cancelled"); a running
+ *   one stops after its in-flight chunk ("cancelling").  409 if it already
+ *   finished.
+ *
+ * ── Observability ─────────────────────────────────────────────────────
+ *
+ * GET /metrics
+ *   Counters and fixed-bucket latency histograms from the APNs client
+ *   (JWT signing, connect, request RTT, queue wait), APNs status / reason
+ *   counts, connection and JWT events, heap and task stack headroom.
+ *
+ * GET /results[?since=N]
+ *   Server-Sent Events, one "result" event per finished push:
+ *     id: 4183
+ *     event: result
+ *     data: {"job":58,"type":"blast","platform":"apns","ip":"192.168.1.42",
+ *            "ok":false,"status":410,"reason":"Unregistered","latency_us":38900}
+ *   Starts after Last-Event-ID if sent, else at since=, else with the next
+ *   result.  A subscriber that falls a ring behind gets "event: lost".
+ *   503 beyond CONFIG_RESULTS_MAX_CLIENTS subscribers.
  */
 #pragma once
 
@@ -1,8 +1,9 @@
 /*
  * APNs (Apple Push Notification service) client implementation
  *
- * - JWT ES256 token generation using mbedtls
- * - HTTP/2 POST to APNs using sh2lib (nghttp2 wrapper)
+ * - JWT ES256 signing with a resident key (encoding lives in apns_codec.c)
+ * - APNs provider for the shared HTTP/2 engine (h2_engine.c): hosts,
+ *   request headers, error reasons and retry classification
  * - Certificate bundle verification for Apple's TLS certificates
  */
 
@@ -15,107 +16,156 @@
 #include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_err.h"
-#include "esp_crt_bundle.h"
-#include "sh2lib.h"
+#include "esp_timer.h"
 
 #include "mbedtls/pk.h"
-#include "mbedtls/ecdsa.h"
-#include "mbedtls/sha256.h"
-#include "mbedtls/base64.h"
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 
-#include "cJSON.h"
 #include "apns.h"
+#include "apns_codec.h"
+#include "trace.h"
 
 static const char *TAG = "apns";
 
-static SemaphoreHandle_t s_apns_mutex = NULL;
-
-/* JWT cache — reuse for up to 55 min to avoid Apple's TooManyProviderTokenUpdates (1 h limit) */
-#define JWT_VALID_SECONDS  3300
-static char   s_jwt_cache[1024] = {0};
-static time_t s_jwt_generated_at = 0;
-
-esp_err_t apns_init(void)
-{
-    s_apns_mutex = xSemaphoreCreateMutex();
-    return s_apns_mutex ? ESP_OK : ESP_FAIL;
-}
-
+/* JWT cache — reuse for up to 55 min to avoid Apple's TooManyProviderTokenUpdates (1 h limit).
+ * A background task re-signs 5 min before expiry so no push pays for it. */
+#define JWT_VALID_SECONDS    3300
+#define JWT_REFRESH_SECONDS  3000
+#define JWT_MIN_VALID_EPOCH  1700000000   /* clock not yet synced below this */
+
+/* Double buffer: the refresher writes the inactive slot, then flips s_jwt_active */
+static char            s_jwt_buf[2][512];
+static volatile int    s_jwt_active       = -1;   /* -1 = no token yet */
+static volatile time_t s_jwt_generated_at = 0;
+
+/* Signing state — .p8 key parsed and DRBG seeded once in apns_init() */
+static const apns_config_t     *s_jwt_config = NULL;
+static SemaphoreHandle_t        s_sign_mutex = NULL;
+static mbedtls_pk_context       s_pk;
+static mbedtls_entropy_context  s_entropy;
+static mbedtls_ctr_drbg_context s_ctr_drbg;
+
+#if CONFIG_APNS_MOCK_SERVER
+/* Benchmark build: both hosts point at tools/mock_apns.py (see Kconfig) */
+#define APNS_HOST_PRODUCTION CONFIG_APNS_MOCK_HOST
+#define APNS_HOST_SANDBOX    CONFIG_APNS_MOCK_HOST
+#else
 #define APNS_HOST_PRODUCTION "api.push.apple.com"
 #define APNS_HOST_SANDBOX    "api.sandbox.push.apple.com"
+#endif
+
+/* Engine connections, registered in apns_init() */
+static h2_host_t *s_host_sandbox;
+static h2_host_t *s_host_production;
 
 /* ------------------------------------------------------------------ */
-/*  Base64URL helpers                                                  */
+/*  Metrics                                                            */
 /* ------------------------------------------------------------------ */
 
-/**
- * Standard base64 encode, then convert to URL-safe variant:
- *   '+' -> '-',  '/' -> '_',  trailing '=' removed
- */
-static size_t base64url_encode(const unsigned char *src, size_t slen,
-                               char *dst, size_t dlen)
+static const char *const s_reason_names[APNS_REASON_COUNT] = {
+    [APNS_REASON_NONE]                            = "",
+    [APNS_REASON_BAD_COLLAPSE_ID]                 = "BadCollapseId",
+    [APNS_REASON_BAD_DEVICE_TOKEN]                = "BadDeviceToken",
+    [APNS_REASON_BAD_EXPIRATION_DATE]             = "BadExpirationDate",
+    [APNS_REASON_BAD_MESSAGE_ID]                  = "BadMessageId",
+    [APNS_REASON_BAD_PRIORITY]                    = "BadPriority",
+    [APNS_REASON_BAD_TOPIC]                       = "BadTopic",
+    [APNS_REASON_DEVICE_TOKEN_NOT_FOR_TOPIC]      = "DeviceTokenNotForTopic",
+    [APNS_REASON_DUPLICATE_HEADERS]               = "DuplicateHeaders",
+    [APNS_REASON_IDLE_TIMEOUT]                    = "IdleTimeout",
+    [APNS_REASON_INVALID_PUSH_TYPE]               = "InvalidPushType",
+    [APNS_REASON_MISSING_DEVICE_TOKEN]            = "MissingDeviceToken",
+    [APNS_REASON_MISSING_TOPIC]                   = "MissingTopic",
+    [APNS_REASON_PAYLOAD_EMPTY]                   = "PayloadEmpty",
+    [APNS_REASON_TOPIC_DISALLOWED]                = "TopicDisallowed",
+    [APNS_REASON_BAD_CERTIFICATE]                 = "BadCertificate",
+    [APNS_REASON_BAD_CERTIFICATE_ENVIRONMENT]     = "BadCertificateEnvironment",
+    [APNS_REASON_EXPIRED_PROVIDER_TOKEN]          = "ExpiredProviderToken",
+    [APNS_REASON_FORBIDDEN]                       = "Forbidden",
+    [APNS_REASON_INVALID_PROVIDER_TOKEN]          = "InvalidProviderToken",
+    [APNS_REASON_MISSING_PROVIDER_TOKEN]          = "MissingProviderToken",
+    [APNS_REASON_UNRELATED_KEY_ID_IN_TOKEN]       = "UnrelatedKeyIdInToken",
+    [APNS_REASON_BAD_ENVIRONMENT_KEY_IN_TOKEN]    = "BadEnvironmentKeyInToken",
+    [APNS_REASON_BAD_PATH]                        = "BadPath",
+    [APNS_REASON_METHOD_NOT_ALLOWED]              = "MethodNotAllowed",
+    [APNS_REASON_EXPIRED_TOKEN]                   = "ExpiredToken",
+    [APNS_REASON_UNREGISTERED]                    = "Unregistered",
+    [APNS_REASON_PAYLOAD_TOO_LARGE]               = "PayloadTooLarge",
+    [APNS_REASON_TOO_MANY_PROVIDER_TOKEN_UPDATES] = "TooManyProviderTokenUpdates",
+    [APNS_REASON_TOO_MANY_REQUESTS]               = "TooManyRequests",
+    [APNS_REASON_INTERNAL_SERVER_ERROR]           = "InternalServerError",
+    [APNS_REASON_SERVICE_UNAVAILABLE]             = "ServiceUnavailable",
+    [APNS_REASON_SHUTDOWN]                        = "Shutdown",
+    [APNS_REASON_OTHER]                           = "Other",
+};
+
+static apns_metrics_t s_metrics;
+static portMUX_TYPE   s_metrics_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#define METRIC_INC(field) do {                  \
+        portENTER_CRITICAL(&s_metrics_lock);    \
+        s_metrics.field++;                      \
+        portEXIT_CRITICAL(&s_metrics_lock);     \
+    } while (0)
+
+static void hist_record(h2_hist_t *h, int64_t us)
 {
-    size_t olen = 0;
-    int rc = mbedtls_base64_encode((unsigned char *)dst, dlen, &olen, src, slen);
-    if (rc != 0) {
-        return 0;
-    }
-    /* URL-safe replacements */
-    for (size_t i = 0; i < olen; i++) {
-        if (dst[i] == '+')      dst[i] = '-';
-        else if (dst[i] == '/') dst[i] = '_';
-    }
-    /* Strip trailing '=' padding */
-    while (olen > 0 && dst[olen - 1] == '=') {
-        olen--;
-    }
-    dst[olen] = '\0';
-    return olen;
+    portENTER_CRITICAL(&s_metrics_lock);
+    h2_hist_add(h, us);
+    portEXIT_CRITICAL(&s_metrics_lock);
 }
 
-/* ------------------------------------------------------------------ */
-/*  DER -> raw (r || s) ECDSA signature conversion                     */
-/* ------------------------------------------------------------------ */
-
-/**
- * mbedtls produces ECDSA signatures in ASN.1/DER format:
- *   30 <len> 02 <rlen> <r> 02 <slen> <s>
- *
- * JWT ES256 expects the raw 64-byte format: r (32 bytes) || s (32 bytes)
- */
-static int der_sig_to_raw(const unsigned char *der, size_t der_len,
-                          unsigned char raw[64])
+/** Pull the "reason" string out of an APNs error body. */
+static apns_reason_t reason_parse(const char *body)
 {
-    if (der_len < 8 || der[0] != 0x30) {
-        return -1;
+    const char *p = strstr(body, "\"reason\"");
+    if (!p) return APNS_REASON_OTHER;
+    p = strchr(p + 8, '"');
+    if (!p) return APNS_REASON_OTHER;
+    const char *end = strchr(++p, '"');
+    if (!end) return APNS_REASON_OTHER;
+
+    size_t len = (size_t)(end - p);
+    for (int r = APNS_REASON_NONE + 1; r < APNS_REASON_OTHER; r++) {
+        if (strlen(s_reason_names[r]) == len && memcmp(s_reason_names[r], p, len) == 0) {
+            return (apns_reason_t)r;
+        }
     }
+    return APNS_REASON_OTHER;
+}
 
-    size_t pos = 2; /* skip SEQUENCE tag + length */
-
-    /* --- R --- */
-    if (der[pos] != 0x02) return -1;
-    pos++;
-    size_t r_len = der[pos++];
-    const unsigned char *r = &der[pos];
-    pos += r_len;
-
-    /* --- S --- */
-    if (pos >= der_len || der[pos] != 0x02) return -1;
-    pos++;
-    size_t s_len = der[pos++];
-    const unsigned char *s = &der[pos];
+const char *apns_reason_name(apns_reason_t reason)
+{
+    return ((unsigned)reason < APNS_REASON_COUNT) ? s_reason_names[reason] : "";
+}
 
-    /* Copy right-aligned into 32-byte slots */
-    memset(raw, 0, 64);
-    if (r_len > 32) { r += (r_len - 32); r_len = 32; }
-    memcpy(raw + (32 - r_len), r, r_len);
+apns_reason_t apns_err_reason(esp_err_t err)
+{
+    if (err <= APNS_ERR_BASE || err >= APNS_ERR_REASON(APNS_REASON_COUNT)) {
+        return APNS_REASON_NONE;
+    }
+    return (apns_reason_t)(err - APNS_ERR_BASE);
+}
 
-    if (s_len > 32) { s += (s_len - 32); s_len = 32; }
-    memcpy(raw + 32 + (32 - s_len), s, s_len);
+bool apns_reason_is_permanent(apns_reason_t reason)
+{
+    switch (reason) {
+    case APNS_REASON_BAD_DEVICE_TOKEN:
+    case APNS_REASON_DEVICE_TOKEN_NOT_FOR_TOPIC:
+    case APNS_REASON_EXPIRED_TOKEN:
+    case APNS_REASON_UNREGISTERED:
+        return true;
+    default:
+        return false;
+    }
+}
 
-    return 0;
+void apns_metrics_get(apns_metrics_t *out)
+{
+    portENTER_CRITICAL(&s_metrics_lock);
+    *out = s_metrics;
+    portEXIT_CRITICAL(&s_metrics_lock);
 }
 
 /* ------------------------------------------------------------------ */
@@ -123,320 +173,292 @@ static int der_sig_to_raw(const unsigned char *der, size_t der_len,
 /* ------------------------------------------------------------------ */
 
 /**
- * Generate a JWT signed with ES256 for APNs token-based authentication.
- *
- * Header : {"alg":"ES256","kid":"<key_id>"}
- * Payload: {"iss":"<team_id>","iat":<unix_timestamp>}
+ * Sign a JWT for "now" with the resident key and DRBG (see apns_codec.c).
+ * Caller must hold s_sign_mutex.
  */
 static esp_err_t generate_jwt(const apns_config_t *config,
                               char *jwt_buf, size_t jwt_buf_len)
 {
-    esp_err_t ret = ESP_FAIL;
-    mbedtls_pk_context pk;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
-
-    mbedtls_pk_init(&pk);
-    mbedtls_entropy_init(&entropy);
-    mbedtls_ctr_drbg_init(&ctr_drbg);
+    time_t now;
+    time(&now);
+    return apns_jwt_sign(&s_pk, &s_ctr_drbg, config->key_id, config->team_id,
+                         (long)now, jwt_buf, jwt_buf_len);
+}
 
-    /* Seed the DRBG */
-    int rc = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
-                                   (const unsigned char *)"apns_jwt", 8);
-    if (rc != 0) {
-        ESP_LOGE(TAG, "DRBG seed failed: -0x%04x", (unsigned)-rc);
-        goto cleanup;
-    }
+/**
+ * Sign a fresh JWT into the inactive buffer and publish it.
+ * Senders never see a partially written token.
+ */
+static esp_err_t jwt_refresh(void)
+{
+    xSemaphoreTake(s_sign_mutex, portMAX_DELAY);
 
-    /* Parse the .p8 private key (PEM PKCS#8 EC P-256) */
-    rc = mbedtls_pk_parse_key(&pk,
-                              (const unsigned char *)config->apns_key_pem,
-                              strlen(config->apns_key_pem) + 1,   /* PEM needs null */
-                              NULL, 0,
-                              mbedtls_ctr_drbg_random, &ctr_drbg);
-    if (rc != 0) {
-        ESP_LOGE(TAG, "Failed to parse .p8 key: -0x%04x", (unsigned)-rc);
-        goto cleanup;
+    time_t now;
+    time(&now);
+    int slot = (s_jwt_active == 0) ? 1 : 0;
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t ret = generate_jwt(s_jwt_config, s_jwt_buf[slot], sizeof(s_jwt_buf[slot]));
+    if (ret == ESP_OK) {
+        int64_t sign_us = esp_timer_get_time() - t0;
+        hist_record(&s_metrics.jwt_sign, sign_us);
+        trace_rec(TRACE_AUTH_REFRESH, trace_job(), 0, (int32_t)sign_us);
+        METRIC_INC(jwt_refreshes);
+        s_jwt_generated_at = now;
+        s_jwt_active       = slot;
+        ESP_LOGI(TAG, "JWT refreshed");
+    } else {
+        METRIC_INC(jwt_failures);
+        trace_rec(TRACE_AUTH_FAIL, trace_job(), 0, ret);
     }
 
-    /* --- Build JWT header & payload --- */
-    char header[80];
-    snprintf(header, sizeof(header),
-             "{\"alg\":\"ES256\",\"kid\":\"%s\"}", config->key_id);
+    xSemaphoreGive(s_sign_mutex);
+    return ret;
+}
 
-    char payload[128];
+/**
+ * Write "bearer <jwt>" into @p out.  Normally served from the buffer kept
+ * fresh by jwt_refresh_task(); signs inline only if that task fell behind.
+ */
+static esp_err_t jwt_bearer(char *out, size_t len)
+{
     time_t now;
     time(&now);
-    snprintf(payload, sizeof(payload),
-             "{\"iss\":\"%s\",\"iat\":%ld}", config->team_id, (long)now);
-
-    /* --- Base64URL encode --- */
-    char hdr_b64[128], pay_b64[256];
-    size_t h_len = base64url_encode((const unsigned char *)header,
-                                    strlen(header), hdr_b64, sizeof(hdr_b64));
-    size_t p_len = base64url_encode((const unsigned char *)payload,
-                                    strlen(payload), pay_b64, sizeof(pay_b64));
-    if (h_len == 0 || p_len == 0) {
-        ESP_LOGE(TAG, "Base64URL encode failed");
-        goto cleanup;
+    if (s_jwt_active < 0 || (now - s_jwt_generated_at) >= JWT_VALID_SECONDS) {
+        ESP_LOGW(TAG, "JWT not refreshed in time, signing inline");
+        METRIC_INC(jwt_inline);
+        esp_err_t ret = jwt_refresh();
+        if (ret != ESP_OK) return ret;
+    } else {
+        ESP_LOGD(TAG, "JWT cache hit (age=%lds)", (long)(now - s_jwt_generated_at));
     }
+    snprintf(out, len, "bearer %s", s_jwt_buf[s_jwt_active]);
+    return ESP_OK;
+}
 
-    /* --- Signing input: header.payload --- */
-    char signing_input[512];
-    snprintf(signing_input, sizeof(signing_input), "%s.%s", hdr_b64, pay_b64);
-
-    /* SHA-256 of signing input */
-    unsigned char hash[32];
-    rc = mbedtls_sha256((const unsigned char *)signing_input,
-                        strlen(signing_input), hash, 0);
-    if (rc != 0) {
-        ESP_LOGE(TAG, "SHA-256 failed");
-        goto cleanup;
-    }
+/** Low-priority task that re-signs the JWT shortly before it expires. */
+static void jwt_refresh_task(void *arg)
+{
+    for (;;) {
+        uint32_t wait_s;
+        time_t now;
+        time(&now);
 
-    /* --- ECDSA sign --- */
-    unsigned char sig_der[MBEDTLS_ECDSA_MAX_LEN];
-    size_t sig_der_len = 0;
-    rc = mbedtls_pk_sign(&pk, MBEDTLS_MD_SHA256,
-                         hash, sizeof(hash),
-                         sig_der, sizeof(sig_der), &sig_der_len,
-                         mbedtls_ctr_drbg_random, &ctr_drbg);
-    if (rc != 0) {
-        ESP_LOGE(TAG, "ECDSA sign failed: -0x%04x", (unsigned)-rc);
-        goto cleanup;
+        if (now < JWT_MIN_VALID_EPOCH) {
+            wait_s = 10;                       /* wait for SNTP */
+        } else {
+            time_t age = now - s_jwt_generated_at;
+            if (s_jwt_active < 0 || age >= JWT_REFRESH_SECONDS) {
+                wait_s = (jwt_refresh() == ESP_OK) ? JWT_REFRESH_SECONDS : 30;
+            } else {
+                wait_s = (uint32_t)(JWT_REFRESH_SECONDS - age);
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(wait_s * 1000));
     }
+}
 
-    /* Convert DER -> raw r||s (64 bytes) */
-    unsigned char sig_raw[64];
-    if (der_sig_to_raw(sig_der, sig_der_len, sig_raw) != 0) {
-        ESP_LOGE(TAG, "DER->raw signature conversion failed");
-        goto cleanup;
-    }
 
-    /* Base64URL encode signature */
-    char sig_b64[128];
-    size_t s_len = base64url_encode(sig_raw, 64, sig_b64, sizeof(sig_b64));
-    if (s_len == 0) {
-        ESP_LOGE(TAG, "Signature base64url failed");
-        goto cleanup;
-    }
+/* ------------------------------------------------------------------ */
+/*  HTTP/2 engine provider                                             */
+/* ------------------------------------------------------------------ */
 
-    /* --- Assemble JWT --- */
-    int total = snprintf(jwt_buf, jwt_buf_len, "%s.%s.%s",
-                         hdr_b64, pay_b64, sig_b64);
-    if (total < 0 || (size_t)total >= jwt_buf_len) {
-        ESP_LOGE(TAG, "JWT buffer too small");
-        goto cleanup;
-    }
+static h2_host_t *apns_host(const void *cfg)
+{
+    return ((const apns_config_t *)cfg)->use_sandbox ? s_host_sandbox : s_host_production;
+}
 
-    ESP_LOGI(TAG, "JWT generated (len=%d)", total);
-    ret = ESP_OK;
+/* The host already tells sandbox from production: the topic is the key */
+static const char *apns_batch_key(const void *cfg)
+{
+    return ((const apns_config_t *)cfg)->bundle_id;
+}
 
-cleanup:
-    mbedtls_pk_free(&pk);
-    mbedtls_entropy_free(&entropy);
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    return ret;
+static esp_err_t apns_auth(bool refresh, char *out, size_t len)
+{
+    if (refresh) {
+        /* ExpiredProviderToken: re-sign now rather than wait for the task */
+        esp_err_t ret = jwt_refresh();
+        if (ret != ESP_OK) return ret;
+    }
+    return jwt_bearer(out, len);
 }
 
-/* ------------------------------------------------------------------ */
-/*  HTTP/2 sh2lib callbacks (static context – single-threaded use)     */
-/* ------------------------------------------------------------------ */
+static esp_err_t apns_request(const void *cfg, const void *item, char *buf,
+                              const char **body, size_t *body_len, char *path, size_t path_len)
+{
+    const apns_notification_t *n = item;
+    if (n->payload) {
+        *body     = n->payload;
+        *body_len = strlen(n->payload);
+    } else {
+        esp_err_t er = apns_payload_encode(n, buf, H2_BODY_MAX, body_len);
+        if (er != ESP_OK) return er;
+        *body = buf;
+    }
+    snprintf(path, path_len, "/3/device/%s", n->device_token);
+    return ESP_OK;
+}
 
-static const char *s_post_body    = NULL;
-static size_t      s_post_len     = 0;
-static size_t      s_post_offset  = 0;
-static bool        s_resp_done    = false;
-static char        s_resp_body[512];
-static size_t      s_resp_len     = 0;
+static size_t apns_headers(const void *cfg, h2_header_t *out, size_t max)
+{
+    const apns_config_t *config = cfg;
+    out[0] = (h2_header_t){ "apns-topic",     config->bundle_id };
+    out[1] = (h2_header_t){ "apns-push-type", "alert" };
+    return 2;
+}
 
-/**
- * Callback: nghttp2 wants POST body data from us.
- */
-static int apns_send_cb(struct sh2lib_handle *handle, char *data,
-                        size_t len, uint32_t *data_flags)
+static void apns_header(h2_response_t *r, const uint8_t *name, size_t namelen,
+                        const uint8_t *value, size_t valuelen)
 {
-    size_t remaining = s_post_len - s_post_offset;
-    size_t to_copy   = (remaining < len) ? remaining : len;
+    char *dst;
+    if (namelen == 7 && memcmp(name, "apns-id", 7) == 0) {
+        dst = r->id;
+    } else if (namelen == 14 && memcmp(name, "apns-unique-id", 14) == 0) {
+        dst = r->unique_id;
+    } else {
+        return;
+    }
+    size_t n = valuelen < H2_ID_LEN - 1 ? valuelen : H2_ID_LEN - 1;
+    memcpy(dst, value, n);
+    dst[n] = '\0';
+}
 
-    if (to_copy > 0) {
-        memcpy(data, s_post_body + s_post_offset, to_copy);
-        s_post_offset += to_copy;
+static esp_err_t apns_result(h2_response_t *r, const char *body, size_t len,
+                             bool *retry, bool *auth_expired)
+{
+    if (r->status == 200) {
+        TRACE_LOGI(TAG, "APNs: 200 OK (apns-id %s)", r->id);
+        return ESP_OK;
     }
-    if (s_post_offset >= s_post_len) {
-        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+
+    r->reason = len > 0 ? reason_parse(body) : APNS_REASON_OTHER;
+    METRIC_INC(reasons[r->reason]);
+    ESP_LOGW(TAG, "APNs: %d %s (apns-id %s)", r->status,
+             apns_reason_name(r->reason), r->id);
+
+    switch (r->reason) {
+    case APNS_REASON_EXPIRED_PROVIDER_TOKEN:
+        *auth_expired = true;
+        *retry        = true;
+        break;
+    case APNS_REASON_IDLE_TIMEOUT:
+    case APNS_REASON_TOO_MANY_REQUESTS:
+    case APNS_REASON_INTERNAL_SERVER_ERROR:
+    case APNS_REASON_SERVICE_UNAVAILABLE:
+    case APNS_REASON_SHUTDOWN:
+        *retry = true;
+        break;
+    default:
+        *retry = r->status == 429 || r->status == 500 || r->status == 503;
+        break;
     }
-    return (int)to_copy;
+    return APNS_ERR_REASON(r->reason);
 }
 
-/**
- * Callback: received response data from APNs.
- */
-static int apns_recv_cb(struct sh2lib_handle *handle, const char *data,
-                        size_t len, int flags)
+static void apns_warm(void)
 {
-    if (data && len > 0) {
-        size_t space   = sizeof(s_resp_body) - s_resp_len - 1;
-        size_t to_copy = (len < space) ? len : space;
-        memcpy(s_resp_body + s_resp_len, data, to_copy);
-        s_resp_len += to_copy;
-        s_resp_body[s_resp_len] = '\0';
-    }
-    if (flags == DATA_RECV_FRAME_COMPLETE || flags == DATA_RECV_RST_STREAM) {
-        s_resp_done = true;
+    if (s_jwt_active < 0 && apns_clock_valid()) {
+        jwt_refresh();
     }
-    return 0;
 }
 
+static const h2_provider_t s_provider = {
+    .name             = "APNs",
+    .item_size        = sizeof(apns_notification_t),
+    .err_unregistered = APNS_ERR_UNREGISTERED,
+    .host             = apns_host,
+    .batch_key        = apns_batch_key,
+    .auth             = apns_auth,
+    .request          = apns_request,
+    .headers          = apns_headers,
+    .header           = apns_header,
+    .result           = apns_result,
+    .warm             = apns_warm,
+};
+
 /* ------------------------------------------------------------------ */
 /*  Public API                                                         */
 /* ------------------------------------------------------------------ */
 
-esp_err_t apns_send_notification(const apns_config_t *config,
-                                 const apns_notification_t *notification)
+esp_err_t apns_init(const apns_config_t *config)
 {
-    if (!config || !notification) {
+    if (!config || !config->apns_key_pem) {
         return ESP_ERR_INVALID_ARG;
     }
 
-    xSemaphoreTake(s_apns_mutex, portMAX_DELAY);
-
-    char *json_str = NULL;
-    bool hd_open   = false;
-    esp_err_t ret  = ESP_FAIL;
+    s_sign_mutex = xSemaphoreCreateMutex();
+    if (!s_sign_mutex) return ESP_ERR_NO_MEM;
+
+    esp_err_t ret = h2_engine_init();
+    if (ret != ESP_OK) return ret;
+#if CONFIG_APNS_MOCK_SERVER
+    bool verify = false;   /* the mock's certificate is self-signed */
+#else
+    bool verify = true;
+#endif
+    s_host_sandbox    = h2_engine_host(&s_provider, APNS_HOST_SANDBOX, "sandbox", verify);
+    s_host_production = h2_engine_host(&s_provider, APNS_HOST_PRODUCTION, "production", verify);
+    if (!s_host_sandbox || !s_host_production) return ESP_ERR_NO_MEM;
+
+#if CONFIG_APNS_MOCK_SERVER
+    ESP_LOGW(TAG, "Mock APNs server build: all pushes go to %s, unverified", APNS_HOST_SANDBOX);
+#endif
+
+    s_jwt_config = config;
+    mbedtls_pk_init(&s_pk);
+    mbedtls_entropy_init(&s_entropy);
+    mbedtls_ctr_drbg_init(&s_ctr_drbg);
 
-    /* ---- 1. JWT (cached; regenerate only when expired) ---- */
-    time_t now;
-    time(&now);
-    if (s_jwt_generated_at == 0 || (now - s_jwt_generated_at) >= JWT_VALID_SECONDS) {
-        ret = generate_jwt(config, s_jwt_cache, sizeof(s_jwt_cache));
-        if (ret != ESP_OK) goto done;
-        s_jwt_generated_at = now;
-        ESP_LOGI(TAG, "JWT refreshed");
-    } else {
-        ESP_LOGD(TAG, "JWT cache hit (age=%lds)", (long)(now - s_jwt_generated_at));
+    /* Seed the DRBG */
+    int rc = mbedtls_ctr_drbg_seed(&s_ctr_drbg, mbedtls_entropy_func, &s_entropy,
+                                   (const unsigned char *)"apns_jwt", 8);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "DRBG seed failed: -0x%04x", (unsigned)-rc);
+        return ESP_FAIL;
     }
 
-    /* ---- 2. Build JSON payload ---- */
-    cJSON *root_j  = cJSON_CreateObject();
-    cJSON *aps_j   = cJSON_AddObjectToObject(root_j, "aps");
-    cJSON *alert_j = cJSON_AddObjectToObject(aps_j, "alert");
-    cJSON_AddStringToObject(alert_j, "title", notification->title);
-    cJSON_AddStringToObject(alert_j, "body",  notification->body);
-    if (notification->badge >= 0) {
-        cJSON_AddNumberToObject(aps_j, "badge", notification->badge);
-    }
-    if (notification->sound) {
-        cJSON_AddStringToObject(aps_j, "sound", notification->sound);
-    }
-    json_str = cJSON_PrintUnformatted(root_j);
-    cJSON_Delete(root_j);
-    if (!json_str) {
-        ESP_LOGE(TAG, "cJSON failed to build payload");
-        ret = ESP_FAIL;
-        goto done;
-    }
-    int jlen = (int)strlen(json_str);
-
-    ESP_LOGI(TAG, "Payload (%d bytes): %s", jlen, json_str);
-
-    /* ---- 3. Prepare static callback context ---- */
-    s_post_body   = json_str;
-    s_post_len    = (size_t)jlen;
-    s_post_offset = 0;
-    s_resp_done   = false;
-    s_resp_len    = 0;
-    memset(s_resp_body, 0, sizeof(s_resp_body));
-
-    /* ---- 4. Build path & auth header ---- */
-    char path[150];
-    snprintf(path, sizeof(path), "/3/device/%s", notification->device_token);
-
-    char auth_hdr[1100];
-    snprintf(auth_hdr, sizeof(auth_hdr), "bearer %s", s_jwt_cache);
-
-    const char *host = config->use_sandbox ? APNS_HOST_SANDBOX
-                                           : APNS_HOST_PRODUCTION;
-
-    /* ---- 5. Connect HTTP/2 ---- */
-    char uri[128];
-    snprintf(uri, sizeof(uri), "https://%s", host);
-
-    struct sh2lib_handle hd;
-    tls_keep_alive_cfg_t ka = {
-        .keep_alive_enable   = true,
-        .keep_alive_idle     = 5,
-        .keep_alive_interval = 5,
-        .keep_alive_count    = 3,
-    };
-    struct sh2lib_config_t sh2cfg = {
-        .uri               = uri,
-        .crt_bundle_attach = esp_crt_bundle_attach,
-        .keep_alive_cfg    = &ka,
-    };
-
-    ESP_LOGI(TAG, "Connecting to %s ...", host);
-    if (sh2lib_connect(&sh2cfg, &hd) != 0) {
-        ESP_LOGE(TAG, "HTTP/2 connection failed");
-        goto done;
-    }
-    hd_open = true;
-    ESP_LOGI(TAG, "HTTP/2 connected");
-
-    /* ---- 6. Submit POST with custom headers ---- */
-    const nghttp2_nv nva[] = {
-        SH2LIB_MAKE_NV(":method",       "POST"),
-        SH2LIB_MAKE_NV(":scheme",       "https"),
-        SH2LIB_MAKE_NV(":path",         path),
-        SH2LIB_MAKE_NV("host",          host),
-        SH2LIB_MAKE_NV("authorization", auth_hdr),
-        SH2LIB_MAKE_NV("apns-topic",    config->bundle_id),
-        SH2LIB_MAKE_NV("apns-push-type","alert"),
-        SH2LIB_MAKE_NV("content-type",  "application/json"),
-    };
-
-    int sid = sh2lib_do_putpost_with_nv(&hd, nva,
-                                        sizeof(nva) / sizeof(nva[0]),
-                                        apns_send_cb, apns_recv_cb);
-    if (sid < 0) {
-        ESP_LOGE(TAG, "Failed to submit POST request");
-        goto done;
-    }
-    ESP_LOGI(TAG, "POST submitted (stream %d)", sid);
-
-    /* ---- 7. Execute send/receive loop ---- */
-    ret = ESP_FAIL;
-    int rounds = 0;
-    while (!s_resp_done && rounds < 150) {
-        if (sh2lib_execute(&hd) != 0) {
-            ESP_LOGE(TAG, "sh2lib_execute error");
-            break;
-        }
-        vTaskDelay(pdMS_TO_TICKS(100));
-        rounds++;
+    /* Parse the .p8 private key (PEM PKCS#8 EC P-256) */
+    rc = mbedtls_pk_parse_key(&s_pk,
+                              (const unsigned char *)config->apns_key_pem,
+                              strlen(config->apns_key_pem) + 1,   /* PEM needs null */
+                              NULL, 0,
+                              mbedtls_ctr_drbg_random, &s_ctr_drbg);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "Failed to parse .p8 key: -0x%04x", (unsigned)-rc);
+        return ESP_FAIL;
     }
 
-    /* ---- 8. Evaluate response ---- */
-    if (s_resp_done && s_resp_len > 0) {
-        /* APNs returns an empty body on 200 OK; a JSON body means error */
-        ESP_LOGW(TAG, "APNs error response: %s", s_resp_body);
-        if (strstr(s_resp_body, "Unregistered") != NULL) {
-            ESP_LOGW(TAG, "APNs: device token is unregistered");
-            ret = APNS_ERR_UNREGISTERED;
-        } else {
-            ret = ESP_FAIL;
-        }
-    } else if (s_resp_done && s_resp_len == 0) {
-        ESP_LOGI(TAG, "APNs: 200 OK");
-        ret = ESP_OK;
-    } else {
-        ESP_LOGE(TAG, "APNs: timed out waiting for response");
-        ret = ESP_FAIL;
+    /* Priority 1: signing must never compete with the send path */
+    if (xTaskCreate(jwt_refresh_task, "apns_jwt", 6144, NULL, 1, NULL) != pdPASS) {
+        return ESP_ERR_NO_MEM;
     }
+    return ESP_OK;
+}
 
-done:
-    cJSON_free(json_str);
-    if (hd_open) sh2lib_free(&hd);
-    xSemaphoreGive(s_apns_mutex);
-    return ret;
+bool apns_clock_valid(void)
+{
+    time_t now;
+    time(&now);
+    return now >= JWT_MIN_VALID_EPOCH;
+}
+
+esp_err_t apns_prewarm(bool use_sandbox)
+{
+    if (!s_host_sandbox) return ESP_ERR_INVALID_STATE;
+    return h2_engine_prewarm(use_sandbox ? s_host_sandbox : s_host_production);
+}
+
+esp_err_t apns_send_batch(const apns_config_t *config,
+                          const apns_notification_t *notifications, size_t count,
+                          h2_priority_t priority,
+                          h2_result_cb_t on_result, void *ctx)
+{
+    return h2_engine_send(&s_provider, config, notifications, count, priority, on_result, ctx);
+}
+
+esp_err_t apns_send_notification(const apns_config_t *config,
+                                 const apns_notification_t *notification,
+                                 h2_response_t *resp)
+{
+    return h2_engine_send_one(&s_provider, config, notification, resp);
 }
@@ -9,15 +9,86 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include "esp_err.h"
+#include "h2_engine.h"
 
-/** Returned when APNs reports the device token is no longer registered. */
-#define APNS_ERR_UNREGISTERED  ((esp_err_t)0x8001)
+/** Largest JSON body apns_payload_encode() / the send path will produce. */
+#define APNS_PAYLOAD_MAX  H2_BODY_MAX
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* ------------------------------------------------------------------ */
+/*  Results                                                            */
+/* ------------------------------------------------------------------ */
+
+/** APNs error reasons (the "reason" field of an error response body). */
+typedef enum {
+    APNS_REASON_NONE = 0,                   /*!< no error body */
+    APNS_REASON_BAD_COLLAPSE_ID,
+    APNS_REASON_BAD_DEVICE_TOKEN,
+    APNS_REASON_BAD_EXPIRATION_DATE,
+    APNS_REASON_BAD_MESSAGE_ID,
+    APNS_REASON_BAD_PRIORITY,
+    APNS_REASON_BAD_TOPIC,
+    APNS_REASON_DEVICE_TOKEN_NOT_FOR_TOPIC,
+    APNS_REASON_DUPLICATE_HEADERS,
+    APNS_REASON_IDLE_TIMEOUT,
+    APNS_REASON_INVALID_PUSH_TYPE,
+    APNS_REASON_MISSING_DEVICE_TOKEN,
+    APNS_REASON_MISSING_TOPIC,
+    APNS_REASON_PAYLOAD_EMPTY,
+    APNS_REASON_TOPIC_DISALLOWED,
+    APNS_REASON_BAD_CERTIFICATE,
+    APNS_REASON_BAD_CERTIFICATE_ENVIRONMENT,
+    APNS_REASON_EXPIRED_PROVIDER_TOKEN,
+    APNS_REASON_FORBIDDEN,
+    APNS_REASON_INVALID_PROVIDER_TOKEN,
+    APNS_REASON_MISSING_PROVIDER_TOKEN,
+    APNS_REASON_UNRELATED_KEY_ID_IN_TOKEN,
+    APNS_REASON_BAD_ENVIRONMENT_KEY_IN_TOKEN,
+    APNS_REASON_BAD_PATH,
+    APNS_REASON_METHOD_NOT_ALLOWED,
+    APNS_REASON_EXPIRED_TOKEN,
+    APNS_REASON_UNREGISTERED,
+    APNS_REASON_PAYLOAD_TOO_LARGE,
+    APNS_REASON_TOO_MANY_PROVIDER_TOKEN_UPDATES,
+    APNS_REASON_TOO_MANY_REQUESTS,
+    APNS_REASON_INTERNAL_SERVER_ERROR,
+    APNS_REASON_SERVICE_UNAVAILABLE,
+    APNS_REASON_SHUTDOWN,
+    APNS_REASON_OTHER,                      /*!< error status, reason missing or not recognised */
+    APNS_REASON_COUNT
+} apns_reason_t;
+
+/** Apple's spelling of @p reason ("BadDeviceToken", ...); "" for NONE. */
+const char *apns_reason_name(apns_reason_t reason);
+
+/**
+ * An APNs error response is returned as APNS_ERR_REASON(reason), one
+ * esp_err_t per reason, so callers can tell BadDeviceToken from
+ * TooManyRequests without a separate out-parameter.  ESP_FAIL and
+ * ESP_ERR_TIMEOUT remain for failures where no response arrived.
+ */
+#define APNS_ERR_BASE          0x8000
+#define APNS_ERR_REASON(r)     ((esp_err_t)(APNS_ERR_BASE + (r)))
+
+/** Returned when APNs reports the device token is no longer registered. */
+#define APNS_ERR_UNREGISTERED  APNS_ERR_REASON(APNS_REASON_UNREGISTERED)
+
+/** Reason carried by an APNS_ERR_REASON() code; APNS_REASON_NONE for any other code. */
+apns_reason_t apns_err_reason(esp_err_t err);
+
+/**
+ * True if @p reason means the token itself will never accept a push for
+ * this topic and environment (BadDeviceToken, Unregistered,
+ * DeviceTokenNotForTopic, ExpiredToken), so it should be pruned from the
+ * store rather than retried or sent again.
+ */
+bool apns_reason_is_permanent(apns_reason_t reason);
+
 /**
  * @brief APNs client configuration (static, set once at boot)
  */
@@ -40,20 +111,71 @@ typedef struct {
     const char *sound;           /*!< Sound name (NULL to omit, "default" for default) */
     const char *custom_payload;  /*!< Extra JSON fields merged at root level (NULL to omit).
                                       Example: "\"type\":\"alert\",\"id\":42" */
+    const char *payload;         /*!< Pre-encoded JSON body from apns_payload_encode()
+                                      (NULL = encode from the fields above). Lets a
+                                      batch share one body across every stream. */
 } apns_notification_t;
 
 /**
- * @brief Initialise the APNs module (creates the internal send mutex).
- *        Must be called once from app_main before api_server_start().
+ * @brief Initialise the APNs module.
+ *
+ * Starts the shared HTTP/2 engine (h2_engine_init()) and registers the
+ * sandbox and production hosts with it, parses the .p8 key and seeds the
+ * DRBG once, and starts a low-priority task that keeps the JWT refreshed
+ * ahead of expiry.  @p config must stay valid for the lifetime of the program.
+ * Must be called once from app_main before api_server_start().
  */
-esp_err_t apns_init(void);
+esp_err_t apns_init(const apns_config_t *config);
+
+/** True once the system clock is late enough to sign a JWT APNs will accept. */
+bool apns_clock_valid(void);
+
+/**
+ * @brief Sign the JWT and connect to one APNs host in the background
+ *
+ * Wakes the engine's "h2_warm" task (see h2_engine_prewarm()), which makes
+ * sure a JWT is ready and opens a fresh persistent connection to the
+ * sandbox or production host, so the next send finds both warm.  Any open
+ * APNs connection is closed first, since after a WiFi drop it only looks
+ * alive; its TLS session is kept for resumption.  Returns at once; calls made while a
+ * warm-up runs coalesce into one more run.  Safe to call from an event
+ * handler.  Does nothing with CONFIG_APNS_PREWARM disabled.
+ *
+ * @return ESP_OK, or ESP_ERR_INVALID_STATE before apns_init()
+ */
+esp_err_t apns_prewarm(bool use_sandbox);
+
+/**
+ * @brief Encode the APNs JSON body for @p notification into @p buf
+ *
+ * Produces {"aps":{"alert":{"title":..,"body":..},"badge":..,"sound":..},<custom>}
+ * with proper JSON string escaping and custom_payload merged at the root
+ * (optional surrounding braces are accepted).  No heap allocation.
+ * The device_token and payload fields are ignored.
+ *
+ * @param notification  Notification fields
+ * @param buf           Output buffer (NUL-terminated on success)
+ * @param buf_len       Size of @p buf; APNS_PAYLOAD_MAX is always enough for a send
+ * @param out_len       Optional: encoded length, excluding the NUL
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if @p buf is too small,
+ *         ESP_ERR_INVALID_ARG on NULL arguments
+ */
+esp_err_t apns_payload_encode(const apns_notification_t *notification,
+                              char *buf, size_t buf_len, size_t *out_len);
 
 /**
  * @brief Send an Apple Push Notification via APNs HTTP/2 API
  *
- * This function generates a JWT (ES256) from the provided .p8 key,
- * opens an HTTP/2 connection to Apple's APNs server, and sends
- * the notification payload.
+ * This function takes the current JWT (ES256, refreshed in the background
+ * from the key parsed in apns_init()) and sends the notification payload over a
+ * persistent HTTP/2 connection to Apple's APNs server.  The connection
+ * is opened on first use and re-established transparently if the peer
+ * sent GOAWAY, the socket dropped, or it sat idle for too long.
+ *
+ * Interactive: if a bulk apns_send_batch() holds the connection to the same
+ * host, the notification is handed to it and sent in a reserved stream
+ * slot instead of waiting for the batch to finish.
  *
  * Prerequisites:
  *   - WiFi must be connected and have internet access
@@ -61,14 +183,82 @@ esp_err_t apns_init(void);
  *
  * @param config       Pointer to APNs configuration (static credentials)
  * @param notification Pointer to notification content (per-push fields)
+ * @param resp         Receives :status, apns-id and RTT of the answer; may be
+ *                     NULL.  Zero-initialise it: status stays 0 without one
  *
  * @return
  *   - ESP_OK on success
+ *   - APNS_ERR_REASON(reason) if APNs answered with an error, e.g.
+ *     APNS_ERR_UNREGISTERED; see apns_err_reason()
+ *   - ESP_ERR_TIMEOUT if APNs did not answer in time
  *   - ESP_FAIL on connection/send failure
  *   - ESP_ERR_INVALID_ARG if config or notification is NULL
  */
 esp_err_t apns_send_notification(const apns_config_t *config,
-                                 const apns_notification_t *notification);
+                                 const apns_notification_t *notification,
+                                 h2_response_t *resp);
+
+/**
+ * @brief Send many notifications multiplexed over one HTTP/2 connection
+ *
+ * Keeps up to min(peer SETTINGS_MAX_CONCURRENT_STREAMS, the host's AIMD
+ * window, CONFIG_APNS_WINDOW_MAX) POSTs in flight at once, paced by the
+ * optional CONFIG_APNS_RATE_LIMIT token bucket, and reports each item through @p on_result as
+ * its stream completes — so callbacks arrive in completion order, not
+ * array order.  Every item gets exactly one callback.  Runs on the calling
+ * task and blocks until all items are done.
+ *
+ * Transient failures (429, 500, 503, reset or refused streams, timeouts, a
+ * dropped connection) are resent with jittered exponential backoff before
+ * the callback fires, up to CONFIG_APNS_RETRY_MAX_ATTEMPTS per item and
+ * CONFIG_APNS_RETRY_BUDGET per call.  An ExpiredProviderToken response
+ * re-signs the JWT and retries.  Other errors are reported immediately.
+ *
+ * With H2_PRIORITY_BULK the call also serves apns_send_notification()
+ * calls made meanwhile for the same host and topic: they get free slots
+ * ahead of the batch's own items, and the call returns once they are done
+ * too.  A bulk call also waits for interactive callers queued on the
+ * connection to go first.
+ *
+ * @param config         APNs configuration (host chosen by use_sandbox)
+ * @param notifications  Array of @p count notifications
+ * @param count          Number of notifications
+ * @param priority       H2_PRIORITY_BULK for blasts, else interactive
+ * @param on_result      Completion callback (required); resp->reason is an
+ *                       apns_reason_t, resp->id the apns-id
+ * @param ctx            Passed through to @p on_result
+ *
+ * @return
+ *   - ESP_OK when every item was attempted (see per-item results)
+ *   - ESP_FAIL / JWT error if no connection could be established;
+ *     remaining items are reported with that error
+ *   - ESP_ERR_INVALID_ARG on NULL arguments
+ */
+esp_err_t apns_send_batch(const apns_config_t *config,
+                          const apns_notification_t *notifications, size_t count,
+                          h2_priority_t priority,
+                          h2_result_cb_t on_result, void *ctx);
+
+/* ------------------------------------------------------------------ */
+/*  Metrics                                                            */
+/* ------------------------------------------------------------------ */
+
+/* Connection, stream and per-item counters live in h2_metrics_t. */
+typedef struct {
+    h2_hist_t jwt_sign;            /*!< ES256 signing */
+    uint32_t  jwt_refreshes;
+    uint32_t  jwt_failures;
+    uint32_t  jwt_inline;          /*!< refreshes the send path had to do itself */
+    uint32_t  reasons[APNS_REASON_COUNT];
+} apns_metrics_t;
+
+/**
+ * @brief Copy a consistent snapshot of the APNs metrics.
+ *
+ * Counters are updated under a spinlock held for a handful of
+ * instructions, so they are always on; reading them is a memcpy.
+ */
+void apns_metrics_get(apns_metrics_t *out);
 
 #ifdef __cplusplus
 }
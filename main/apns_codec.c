@@ -0,0 +1,276 @@
+/*
+ * apns_codec.c — APNs JWT and payload encoding
+ *
+ * No esp-tls / nghttp2 / FreeRTOS here, so this file builds for the linux
+ * target unchanged.  All output goes into caller buffers; nothing is
+ * allocated.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/base64.h"
+
+#include "apns.h"
+#include "apns_codec.h"
+
+static const char *TAG = "apns";
+
+/* ------------------------------------------------------------------ */
+/*  Base64URL helpers                                                  */
+/* ------------------------------------------------------------------ */
+
+/**
+ * Standard base64 encode, then convert to URL-safe variant:
+ *   '+' -> '-',  '/' -> '_',  trailing '=' removed
+ */
+size_t apns_base64url_encode(const unsigned char *src, size_t slen,
+                             char *dst, size_t dlen)
+{
+    size_t olen = 0;
+    int rc = mbedtls_base64_encode((unsigned char *)dst, dlen, &olen, src, slen);
+    if (rc != 0) {
+        return 0;
+    }
+    /* URL-safe replacements */
+    for (size_t i = 0; i < olen; i++) {
+        if (dst[i] == '+')      dst[i] = '-';
+        else if (dst[i] == '/') dst[i] = '_';
+    }
+    /* Strip trailing '=' padding */
+    while (olen > 0 && dst[olen - 1] == '=') {
+        olen--;
+    }
+    dst[olen] = '\0';
+    return olen;
+}
+
+/* ------------------------------------------------------------------ */
+/*  DER -> raw (r || s) ECDSA signature conversion                     */
+/* ------------------------------------------------------------------ */
+
+/**
+ * mbedtls produces ECDSA signatures in ASN.1/DER format:
+ *   30 <len> 02 <rlen> <r> 02 <slen> <s>
+ *
+ * JWT ES256 expects the raw 64-byte format: r (32 bytes) || s (32 bytes)
+ */
+int apns_der_sig_to_raw(const unsigned char *der, size_t der_len,
+                        unsigned char raw[64])
+{
+    if (der_len < 8 || der[0] != 0x30) {
+        return -1;
+    }
+
+    size_t pos = 2; /* skip SEQUENCE tag + length */
+
+    /* --- R --- */
+    if (der[pos] != 0x02) return -1;
+    pos++;
+    size_t r_len = der[pos++];
+    const unsigned char *r = &der[pos];
+    pos += r_len;
+
+    /* --- S --- */
+    if (pos >= der_len || der[pos] != 0x02) return -1;
+    pos++;
+    size_t s_len = der[pos++];
+    const unsigned char *s = &der[pos];
+
+    /* Copy right-aligned into 32-byte slots */
+    memset(raw, 0, 64);
+    if (r_len > 32) { r += (r_len - 32); r_len = 32; }
+    memcpy(raw + (32 - r_len), r, r_len);
+
+    if (s_len > 32) { s += (s_len - 32); s_len = 32; }
+    memcpy(raw + 32 + (32 - s_len), s, s_len);
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  JWT ES256 token generation                                         */
+/* ------------------------------------------------------------------ */
+
+/**
+ * Header : {"alg":"ES256","kid":"<key_id>"}
+ * Payload: {"iss":"<team_id>","iat":<unix_timestamp>}
+ */
+esp_err_t apns_jwt_sign(mbedtls_pk_context *pk, mbedtls_ctr_drbg_context *drbg,
+                        const char *key_id, const char *team_id, long iat,
+                        char *jwt_buf, size_t jwt_buf_len)
+{
+    int rc;
+
+    /* --- Build JWT header & payload --- */
+    char header[80];
+    snprintf(header, sizeof(header),
+             "{\"alg\":\"ES256\",\"kid\":\"%s\"}", key_id);
+
+    char payload[128];
+    snprintf(payload, sizeof(payload),
+             "{\"iss\":\"%s\",\"iat\":%ld}", team_id, iat);
+
+    /* --- Base64URL encode --- */
+    char hdr_b64[128], pay_b64[256];
+    size_t h_len = apns_base64url_encode((const unsigned char *)header,
+                                         strlen(header), hdr_b64, sizeof(hdr_b64));
+    size_t p_len = apns_base64url_encode((const unsigned char *)payload,
+                                         strlen(payload), pay_b64, sizeof(pay_b64));
+    if (h_len == 0 || p_len == 0) {
+        ESP_LOGE(TAG, "Base64URL encode failed");
+        return ESP_FAIL;
+    }
+
+    /* --- Signing input: header.payload --- */
+    char signing_input[512];
+    snprintf(signing_input, sizeof(signing_input), "%s.%s", hdr_b64, pay_b64);
+
+    /* SHA-256 of signing input */
+    unsigned char hash[32];
+    rc = mbedtls_sha256((const unsigned char *)signing_input,
+                        strlen(signing_input), hash, 0);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "SHA-256 failed");
+        return ESP_FAIL;
+    }
+
+    /* --- ECDSA sign --- */
+    unsigned char sig_der[MBEDTLS_ECDSA_MAX_LEN];
+    size_t sig_der_len = 0;
+    rc = mbedtls_pk_sign(pk, MBEDTLS_MD_SHA256,
+                         hash, sizeof(hash),
+                         sig_der, sizeof(sig_der), &sig_der_len,
+                         mbedtls_ctr_drbg_random, drbg);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "ECDSA sign failed: -0x%04x", (unsigned)-rc);
+        return ESP_FAIL;
+    }
+
+    /* Convert DER -> raw r||s (64 bytes) */
+    unsigned char sig_raw[64];
+    if (apns_der_sig_to_raw(sig_der, sig_der_len, sig_raw) != 0) {
+        ESP_LOGE(TAG, "DER->raw signature conversion failed");
+        return ESP_FAIL;
+    }
+
+    /* Base64URL encode signature */
+    char sig_b64[128];
+    size_t s_len = apns_base64url_encode(sig_raw, 64, sig_b64, sizeof(sig_b64));
+    if (s_len == 0) {
+        ESP_LOGE(TAG, "Signature base64url failed");
+        return ESP_FAIL;
+    }
+
+    /* --- Assemble JWT --- */
+    int total = snprintf(jwt_buf, jwt_buf_len, "%s.%s.%s",
+                         hdr_b64, pay_b64, sig_b64);
+    if (total < 0 || (size_t)total >= jwt_buf_len) {
+        ESP_LOGE(TAG, "JWT buffer too small");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "JWT generated (len=%d)", total);
+    return ESP_OK;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Payload encoder (no heap — writes straight into the caller buffer)  */
+/* ------------------------------------------------------------------ */
+
+void json_writer_raw(json_writer_t *w, const char *s, size_t n)
+{
+    if (w->overflow || w->pos + n >= w->cap) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->pos, s, n);
+    w->pos += n;
+}
+
+void json_writer_lit(json_writer_t *w, const char *s)
+{
+    json_writer_raw(w, s, strlen(s));
+}
+
+void json_writer_str(json_writer_t *w, const char *s)
+{
+    json_writer_raw(w, "\"", 1);
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch != '"' && ch != '\\' && ch >= 0x20) continue;
+
+        json_writer_raw(w, run, (size_t)(s - run));
+        char esc[8];
+        switch (ch) {
+        case '"':  json_writer_raw(w, "\\\"", 2); break;
+        case '\\': json_writer_raw(w, "\\\\", 2); break;
+        case '\n': json_writer_raw(w, "\\n", 2);  break;
+        case '\r': json_writer_raw(w, "\\r", 2);  break;
+        case '\t': json_writer_raw(w, "\\t", 2);  break;
+        default:
+            snprintf(esc, sizeof(esc), "\\u%04x", ch);
+            json_writer_raw(w, esc, 6);
+            break;
+        }
+        run = s + 1;
+    }
+    json_writer_raw(w, run, (size_t)(s - run));
+    json_writer_raw(w, "\"", 1);
+}
+
+size_t json_members(const char *src, const char **start)
+{
+    const char *c = src;
+    const char *e = c + strlen(c);
+    while (c < e && (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r')) c++;
+    while (e > c && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\n' || e[-1] == '\r')) e--;
+    if (e - c >= 2 && *c == '{' && e[-1] == '}') { c++; e--; }
+    *start = c;
+    return (size_t)(e - c);
+}
+
+esp_err_t apns_payload_encode(const apns_notification_t *n,
+                              char *buf, size_t buf_len, size_t *out_len)
+{
+    if (!n || !buf || buf_len == 0) return ESP_ERR_INVALID_ARG;
+
+    json_writer_t w = { .buf = buf, .cap = buf_len };
+
+    json_writer_lit(&w, "{\"aps\":{\"alert\":{\"title\":");
+    json_writer_str(&w, n->title ? n->title : "");
+    json_writer_lit(&w, ",\"body\":");
+    json_writer_str(&w, n->body ? n->body : "");
+    json_writer_lit(&w, "}");
+    if (n->badge >= 0) {
+        char num[24];
+        int k = snprintf(num, sizeof(num), ",\"badge\":%d", n->badge);
+        json_writer_raw(&w, num, (size_t)k);
+    }
+    if (n->sound) {
+        json_writer_lit(&w, ",\"sound\":");
+        json_writer_str(&w, n->sound);
+    }
+    json_writer_lit(&w, "}");
+
+    /* custom_payload: raw root-level fields; tolerate surrounding braces/whitespace */
+    if (n->custom_payload) {
+        const char *c;
+        size_t len = json_members(n->custom_payload, &c);
+        if (len) {
+            json_writer_lit(&w, ",");
+            json_writer_raw(&w, c, len);
+        }
+    }
+    json_writer_lit(&w, "}");
+
+    if (w.overflow) return ESP_ERR_INVALID_SIZE;
+    buf[w.pos] = '\0';
+    if (out_len) *out_len = w.pos;
+    return ESP_OK;
+}
@@ -0,0 +1,84 @@
+/*
+ * apns_codec.h — APNs JWT and payload encoding
+ *
+ * Pure encoding helpers split out of apns.c: they depend only on mbedtls
+ * and libc, so they build for the linux target as well (see host_bench.c)
+ * and can be exercised without a device.  apns_payload_encode() is
+ * implemented here too; it is declared in apns.h with the send API.  The
+ * JSON writer behind it is shared with fcm_codec.c.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ctr_drbg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Base64URL-encode @p src (RFC 4648 §5, no padding)
+ *
+ * @return Encoded length (excluding the null written after it),
+ *         or 0 if @p dst is too small.
+ */
+size_t apns_base64url_encode(const unsigned char *src, size_t slen,
+                             char *dst, size_t dlen);
+
+/**
+ * @brief Convert an ASN.1/DER ECDSA signature to the raw r || s form JWS uses
+ *
+ * @return 0 on success, -1 if @p der is not a well-formed SEQUENCE of two INTEGERs
+ */
+int apns_der_sig_to_raw(const unsigned char *der, size_t der_len,
+                        unsigned char raw[64]);
+
+/**
+ * @brief Build and sign an APNs provider token (JWT, ES256)
+ *
+ * Header  {"alg":"ES256","kid":"<key_id>"}, claims {"iss":"<team_id>","iat":<iat>}.
+ *
+ * @param pk    Parsed EC P-256 private key
+ * @param drbg  Seeded DRBG used for the ECDSA nonce
+ * @return ESP_OK, or ESP_FAIL if signing failed or @p jwt_buf is too small
+ */
+esp_err_t apns_jwt_sign(mbedtls_pk_context *pk, mbedtls_ctr_drbg_context *drbg,
+                        const char *key_id, const char *team_id, long iat,
+                        char *jwt_buf, size_t jwt_buf_len);
+
+/* ------------------------------------------------------------------ */
+/*  JSON writer                                                        */
+/* ------------------------------------------------------------------ */
+
+/**
+ * Appends into a caller buffer.  Writes that do not fit set @c overflow and
+ * are dropped, so a whole body is built first and checked once; @c pos is
+ * always short of @c cap, leaving room for the NUL.
+ */
+typedef struct {
+    char  *buf;
+    size_t cap;
+    size_t pos;
+    bool   overflow;
+} json_writer_t;
+
+void json_writer_raw(json_writer_t *w, const char *s, size_t n);
+void json_writer_lit(json_writer_t *w, const char *s);
+
+/** Append @p s as a quoted JSON string, escaping quotes, backslashes and control chars. */
+void json_writer_str(json_writer_t *w, const char *s);
+
+/**
+ * Members of a caller-supplied object for splicing into another one: @p src
+ * with surrounding whitespace and optional braces trimmed.
+ *
+ * @return Length of the members at *@p start, 0 if there are none
+ */
+size_t json_members(const char *src, const char **start);
+
+#ifdef __cplusplus
+}
+#endif
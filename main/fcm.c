@@ -0,0 +1,500 @@
+/*
+ * FCM (Firebase Cloud Messaging) client implementation
+ *
+ * - Service-account JWT (RS256, see fcm_codec.c) exchanged for an OAuth2
+ *   access token by a background task, over esp_http_client
+ * - FCM provider for the shared HTTP/2 engine (h2_engine.c): host, path,
+ *   error codes and retry classification
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+
+#include "fcm.h"
+#include "sdkconfig.h"
+
+#if CONFIG_FCM_ENABLE
+#include "esp_crt_bundle.h"
+#include "esp_http_client.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+
+#include "apns.h"
+#include "fcm_codec.h"
+#include "json_scan.h"
+#include "trace.h"
+#endif
+
+static const char *TAG = "fcm";
+
+/* ------------------------------------------------------------------ */
+/*  Results                                                            */
+/* ------------------------------------------------------------------ */
+
+static const char *const s_reason_names[FCM_REASON_COUNT] = {
+    [FCM_REASON_NONE]                   = "",
+    [FCM_REASON_UNSPECIFIED_ERROR]      = "UNSPECIFIED_ERROR",
+    [FCM_REASON_INVALID_ARGUMENT]       = "INVALID_ARGUMENT",
+    [FCM_REASON_UNREGISTERED]           = "UNREGISTERED",
+    [FCM_REASON_SENDER_ID_MISMATCH]     = "SENDER_ID_MISMATCH",
+    [FCM_REASON_QUOTA_EXCEEDED]         = "QUOTA_EXCEEDED",
+    [FCM_REASON_UNAVAILABLE]            = "UNAVAILABLE",
+    [FCM_REASON_INTERNAL]               = "INTERNAL",
+    [FCM_REASON_THIRD_PARTY_AUTH_ERROR] = "THIRD_PARTY_AUTH_ERROR",
+    [FCM_REASON_UNAUTHENTICATED]        = "UNAUTHENTICATED",
+    [FCM_REASON_PERMISSION_DENIED]      = "PERMISSION_DENIED",
+    [FCM_REASON_NOT_FOUND]              = "NOT_FOUND",
+    [FCM_REASON_OTHER]                  = "OTHER",
+};
+
+const char *fcm_reason_name(fcm_reason_t reason)
+{
+    return ((unsigned)reason < FCM_REASON_COUNT) ? s_reason_names[reason] : "";
+}
+
+fcm_reason_t fcm_err_reason(esp_err_t err)
+{
+    if (err <= FCM_ERR_BASE || err >= FCM_ERR_REASON(FCM_REASON_COUNT)) {
+        return FCM_REASON_NONE;
+    }
+    return (fcm_reason_t)(err - FCM_ERR_BASE);
+}
+
+bool fcm_reason_is_permanent(fcm_reason_t reason)
+{
+    return reason == FCM_REASON_UNREGISTERED || reason == FCM_REASON_SENDER_ID_MISMATCH;
+}
+
+static fcm_metrics_t s_metrics;
+static portMUX_TYPE  s_metrics_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void fcm_metrics_get(fcm_metrics_t *out)
+{
+    portENTER_CRITICAL(&s_metrics_lock);
+    *out = s_metrics;
+    portEXIT_CRITICAL(&s_metrics_lock);
+}
+
+#if CONFIG_FCM_ENABLE
+
+#define METRIC_INC(field) do {                  \
+        portENTER_CRITICAL(&s_metrics_lock);    \
+        s_metrics.field++;                      \
+        portEXIT_CRITICAL(&s_metrics_lock);     \
+    } while (0)
+
+#define FCM_HOST       "fcm.googleapis.com"
+#define FCM_TOKEN_URL  "https://oauth2.googleapis.com/token"
+
+/* Renew this long before the token expires, and stop using it this long before */
+#define FCM_TOKEN_MARGIN_S  300
+#define FCM_TOKEN_GRACE_S   60
+
+/* Longest a send waits for the auth task to fetch a token */
+#define FCM_AUTH_WAIT_MS    12000
+
+static h2_host_t *s_host;
+
+/* ------------------------------------------------------------------ */
+/*  OAuth2 access token                                                */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Double buffer as for the APNs JWT: the auth task fills the inactive slot,
+ * then flips s_token_active.  Google's access tokens run to a few hundred
+ * bytes; H2_AUTH_MAX leaves room for "Bearer ".
+ */
+static EXT_RAM_BSS_ATTR char s_token_buf[2][H2_AUTH_MAX - 8];
+static volatile int    s_token_active  = -1;   /* -1 = no token yet */
+static volatile time_t s_token_expires = 0;
+static volatile bool   s_token_stale;          /* FCM rejected the current one */
+
+/* Signing state — service account key parsed and DRBG seeded once in fcm_init() */
+static const fcm_config_t      *s_config;
+static mbedtls_pk_context       s_pk;
+static mbedtls_entropy_context  s_entropy;
+static mbedtls_ctr_drbg_context s_ctr_drbg;
+
+static TaskHandle_t       s_auth_task;
+static EventGroupHandle_t s_auth_events;
+#define AUTH_DONE_BIT  BIT0   /* set after every fetch attempt */
+
+#define FCM_GRANT_PREFIX \
+    "grant_type=urn%3Aietf%3Aparams%3Aoauth%3Agrant-type%3Ajwt-bearer&assertion="
+
+/* Only the auth task uses these */
+static char s_form[sizeof(FCM_GRANT_PREFIX) + 1024];
+static char s_access_token[sizeof(s_token_buf[0])];
+
+static bool token_valid(time_t now)
+{
+    return s_token_active >= 0 && !s_token_stale && now + FCM_TOKEN_GRACE_S < s_token_expires;
+}
+
+/**
+ * Sign an assertion and trade it for an access token at Google's OAuth2
+ * endpoint.  The response is scanned as it is read; nothing is allocated
+ * beyond what esp_http_client itself needs.
+ */
+static esp_err_t token_fetch(void)
+{
+    time_t now;
+    time(&now);
+    int64_t t0 = esp_timer_get_time();
+
+    size_t prefix = sizeof(FCM_GRANT_PREFIX) - 1;
+    memcpy(s_form, FCM_GRANT_PREFIX, prefix);
+    esp_err_t ret = fcm_jwt_sign(&s_pk, &s_ctr_drbg, s_config->sa_email, (long)now,
+                                 s_form + prefix, sizeof(s_form) - prefix);
+    if (ret != ESP_OK) return ret;
+    size_t form_len = strlen(s_form);
+
+    esp_http_client_config_t http_cfg = {
+        .url               = FCM_TOKEN_URL,
+        .method            = HTTP_METHOD_POST,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .timeout_ms        = 10000,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&http_cfg);
+    if (!client) return ESP_ERR_NO_MEM;
+    esp_http_client_set_header(client, "Content-Type", "application/x-www-form-urlencoded");
+
+    int expires_in = 0;
+    json_field_t fields[] = {
+        JSON_SCAN_STR("access_token", s_access_token),
+        JSON_SCAN_INT("expires_in", &expires_in),
+    };
+    json_scan_t scan;
+    json_scan_init(&scan, fields, 2);
+
+    ret = esp_http_client_open(client, (int)form_len);
+    if (ret == ESP_OK && esp_http_client_write(client, s_form, (int)form_len) != (int)form_len) {
+        ret = ESP_FAIL;
+    }
+    int status = 0;
+    if (ret == ESP_OK) {
+        esp_http_client_fetch_headers(client);
+        status = esp_http_client_get_status_code(client);
+        char chunk[128];
+        int n;
+        while ((n = esp_http_client_read(client, chunk, sizeof(chunk))) > 0) {
+            if (status == 200) json_scan_feed(&scan, chunk, (size_t)n);
+        }
+    }
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "OAuth2 token request failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    if (status != 200) {
+        ESP_LOGE(TAG, "OAuth2 token request: HTTP %d", status);
+        return ESP_FAIL;
+    }
+    if (json_scan_finish(&scan) != ESP_OK || !fields[0].found || fields[0].truncated ||
+        expires_in <= FCM_TOKEN_MARGIN_S) {
+        ESP_LOGE(TAG, "OAuth2 token response not understood");
+        return ESP_FAIL;
+    }
+
+    int slot = (s_token_active == 0) ? 1 : 0;
+    memcpy(s_token_buf[slot], s_access_token, strlen(s_access_token) + 1);
+    s_token_expires = now + expires_in;
+    s_token_active  = slot;
+    s_token_stale   = false;
+
+    portENTER_CRITICAL(&s_metrics_lock);
+    h2_hist_add(&s_metrics.token_fetch, esp_timer_get_time() - t0);
+    s_metrics.token_refreshes++;
+    portEXIT_CRITICAL(&s_metrics_lock);
+    ESP_LOGI(TAG, "Access token refreshed (valid %ds)", expires_in);
+    return ESP_OK;
+}
+
+/**
+ * Low-priority task that keeps the access token fresh.  TLS to Google and
+ * the RSA signature both happen here, never on the send path; senders and
+ * fcm_prewarm() wake it when they find no usable token.
+ */
+static void auth_task(void *arg)
+{
+    for (;;) {
+        uint32_t wait_s;
+        time_t now;
+        time(&now);
+
+        if (!apns_clock_valid()) {
+            wait_s = 10;                       /* wait for SNTP */
+        } else if (!token_valid(now) || now + FCM_TOKEN_MARGIN_S >= s_token_expires) {
+            int64_t t0 = esp_timer_get_time();
+            esp_err_t ret = token_fetch();
+            if (ret == ESP_OK) {
+                trace_rec(TRACE_AUTH_REFRESH, 0, 1, (int32_t)(esp_timer_get_time() - t0));
+                wait_s = (uint32_t)(s_token_expires - now - FCM_TOKEN_MARGIN_S);
+            } else {
+                METRIC_INC(token_failures);
+                trace_rec(TRACE_AUTH_FAIL, 0, 1, ret);
+                wait_s = 30;
+            }
+            xEventGroupSetBits(s_auth_events, AUTH_DONE_BIT);
+        } else {
+            wait_s = (uint32_t)(s_token_expires - now - FCM_TOKEN_MARGIN_S);
+        }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_s * 1000));
+    }
+}
+
+/** Wake the auth task and wait for one fetch attempt to finish. */
+static void token_wait(void)
+{
+    xEventGroupClearBits(s_auth_events, AUTH_DONE_BIT);
+    xTaskNotifyGive(s_auth_task);
+    xEventGroupWaitBits(s_auth_events, AUTH_DONE_BIT, pdFALSE, pdTRUE,
+                        pdMS_TO_TICKS(FCM_AUTH_WAIT_MS));
+}
+
+/**
+ * Before a send takes the engine: wait here, not in the provider hook, for
+ * a token to exist.  Normally only on the first send after boot or a long
+ * outage; the engine is free for APNs traffic meanwhile.
+ */
+static void token_ensure(void)
+{
+    time_t now;
+    time(&now);
+    if (token_valid(now)) return;
+    ESP_LOGW(TAG, "No valid access token, waiting for the auth task");
+    METRIC_INC(token_waits);
+    token_wait();
+}
+
+/* ------------------------------------------------------------------ */
+/*  HTTP/2 engine provider                                             */
+/* ------------------------------------------------------------------ */
+
+/** Pull the error code out of an FCM error body: details[].errorCode, else status. */
+static fcm_reason_t reason_parse(const char *body)
+{
+    static const char *const keys[] = { "\"errorCode\"", "\"status\"" };
+
+    for (size_t k = 0; k < 2; k++) {
+        const char *p = strstr(body, keys[k]);
+        if (!p) continue;
+        p = strchr(p + strlen(keys[k]), '"');
+        if (!p) continue;
+        const char *end = strchr(++p, '"');
+        if (!end) continue;
+
+        size_t len = (size_t)(end - p);
+        for (int r = FCM_REASON_NONE + 1; r < FCM_REASON_OTHER; r++) {
+            if (strlen(s_reason_names[r]) == len && memcmp(s_reason_names[r], p, len) == 0) {
+                return (fcm_reason_t)r;
+            }
+        }
+    }
+    return FCM_REASON_OTHER;
+}
+
+static h2_host_t *fcm_host(const void *cfg)
+{
+    return s_host;
+}
+
+static const char *fcm_batch_key(const void *cfg)
+{
+    return ((const fcm_config_t *)cfg)->project_id;
+}
+
+/* Runs with the engine held: never waits for the auth task's fetch */
+static esp_err_t fcm_auth(bool refresh, char *out, size_t len)
+{
+    if (refresh) {
+        s_token_stale = true;
+        xTaskNotifyGive(s_auth_task);
+    }
+    time_t now;
+    time(&now);
+    if (!token_valid(now)) return ESP_ERR_INVALID_STATE;
+    snprintf(out, len, "Bearer %s", s_token_buf[s_token_active]);
+    return ESP_OK;
+}
+
+static esp_err_t fcm_request(const void *cfg, const void *item, char *buf,
+                             const char **body, size_t *body_len, char *path, size_t path_len)
+{
+    const fcm_config_t *config = cfg;
+    esp_err_t er = fcm_payload_encode(item, buf, H2_BODY_MAX, body_len);
+    if (er != ESP_OK) return er;
+    *body = buf;
+    snprintf(path, path_len, "/v1/projects/%s/messages:send", config->project_id);
+    return ESP_OK;
+}
+
+static esp_err_t fcm_result(h2_response_t *r, const char *body, size_t len,
+                            bool *retry, bool *auth_expired)
+{
+    if (r->status == 200) {
+        /* {"name":"projects/<id>/messages/<message id>"} */
+        char name[128];
+        json_field_t f[] = { JSON_SCAN_STR("name", name) };
+        if (json_scan_buf(body, len, f, 1) == ESP_OK && f[0].found) {
+            const char *id = strrchr(name, '/');
+            id = id ? id + 1 : name;
+            size_t n = strlen(id) < H2_ID_LEN - 1 ? strlen(id) : H2_ID_LEN - 1;
+            memcpy(r->id, id, n);
+            r->id[n] = '\0';
+        }
+        TRACE_LOGI(TAG, "FCM: 200 OK (message %s)", r->id);
+        return ESP_OK;
+    }
+
+    r->reason = len > 0 ? reason_parse(body) : FCM_REASON_OTHER;
+    METRIC_INC(reasons[r->reason]);
+    ESP_LOGW(TAG, "FCM: %d %s", r->status, fcm_reason_name(r->reason));
+
+    if (r->status == 401 || r->reason == FCM_REASON_UNAUTHENTICATED) {
+        *auth_expired = true;
+        *retry        = true;
+    } else {
+        *retry = r->reason == FCM_REASON_QUOTA_EXCEEDED || r->reason == FCM_REASON_UNAVAILABLE ||
+                 r->reason == FCM_REASON_INTERNAL ||
+                 r->status == 429 || r->status == 500 || r->status == 503;
+    }
+    return FCM_ERR_REASON(r->reason);
+}
+
+static void fcm_warm(void)
+{
+    time_t now;
+    time(&now);
+    if (!token_valid(now) && apns_clock_valid()) token_wait();
+}
+
+static const h2_provider_t s_provider = {
+    .name             = "FCM",
+    .item_size        = sizeof(fcm_notification_t),
+    .err_unregistered = FCM_ERR_UNREGISTERED,
+    .host             = fcm_host,
+    .batch_key        = fcm_batch_key,
+    .auth             = fcm_auth,
+    .request          = fcm_request,
+    .headers          = NULL,
+    .header           = NULL,
+    .result           = fcm_result,
+    .warm             = fcm_warm,
+};
+
+/* ------------------------------------------------------------------ */
+/*  Public API                                                         */
+/* ------------------------------------------------------------------ */
+
+esp_err_t fcm_init(const fcm_config_t *config)
+{
+    if (!config || !config->sa_key_pem || !config->project_id || !config->project_id[0] ||
+        !config->sa_email || !config->sa_email[0]) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t ret = h2_engine_init();
+    if (ret != ESP_OK) return ret;
+    s_host = h2_engine_host(&s_provider, FCM_HOST, "fcm", true);
+    if (!s_host) return ESP_ERR_NO_MEM;
+
+    s_auth_events = xEventGroupCreate();
+    if (!s_auth_events) return ESP_ERR_NO_MEM;
+
+    s_config = config;
+    mbedtls_pk_init(&s_pk);
+    mbedtls_entropy_init(&s_entropy);
+    mbedtls_ctr_drbg_init(&s_ctr_drbg);
+
+    int rc = mbedtls_ctr_drbg_seed(&s_ctr_drbg, mbedtls_entropy_func, &s_entropy,
+                                   (const unsigned char *)"fcm_jwt", 7);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "DRBG seed failed: -0x%04x", (unsigned)-rc);
+        return ESP_FAIL;
+    }
+
+    /* Service account private_key: PEM PKCS#8 RSA */
+    rc = mbedtls_pk_parse_key(&s_pk,
+                              (const unsigned char *)config->sa_key_pem,
+                              strlen(config->sa_key_pem) + 1,   /* PEM needs null */
+                              NULL, 0,
+                              mbedtls_ctr_drbg_random, &s_ctr_drbg);
+    if (rc != 0 || !mbedtls_pk_can_do(&s_pk, MBEDTLS_PK_RSA)) {
+        ESP_LOGE(TAG, "Failed to parse service account key: -0x%04x", (unsigned)-rc);
+        return ESP_FAIL;
+    }
+
+    /* Priority 1, like the APNs JWT task: signing and the token exchange
+     * never compete with the send path */
+    if (xTaskCreate(auth_task, "fcm_auth", 8192, NULL, 1, &s_auth_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "FCM ready for project %s", config->project_id);
+    return ESP_OK;
+}
+
+esp_err_t fcm_prewarm(void)
+{
+    if (!s_host) return ESP_ERR_INVALID_STATE;
+    return h2_engine_prewarm(s_host);
+}
+
+esp_err_t fcm_send_batch(const fcm_config_t *config,
+                         const fcm_notification_t *notifications, size_t count,
+                         h2_priority_t priority,
+                         h2_result_cb_t on_result, void *ctx)
+{
+    if (!s_host) return ESP_ERR_INVALID_STATE;
+    token_ensure();
+    return h2_engine_send(&s_provider, config, notifications, count, priority, on_result, ctx);
+}
+
+esp_err_t fcm_send_notification(const fcm_config_t *config,
+                                const fcm_notification_t *notification,
+                                h2_response_t *resp)
+{
+    if (!s_host) return ESP_ERR_INVALID_STATE;
+    token_ensure();
+    return h2_engine_send_one(&s_provider, config, notification, resp);
+}
+
+#else   /* !CONFIG_FCM_ENABLE */
+
+esp_err_t fcm_init(const fcm_config_t *config)
+{
+    ESP_LOGD(TAG, "FCM disabled (CONFIG_FCM_ENABLE)");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t fcm_prewarm(void)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t fcm_send_batch(const fcm_config_t *config,
+                         const fcm_notification_t *notifications, size_t count,
+                         h2_priority_t priority,
+                         h2_result_cb_t on_result, void *ctx)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t fcm_send_notification(const fcm_config_t *config,
+                                const fcm_notification_t *notification,
+                                h2_response_t *resp)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif  /* CONFIG_FCM_ENABLE */
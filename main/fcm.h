@@ -0,0 +1,182 @@
+/*
+ * FCM (Firebase Cloud Messaging) client for ESP-IDF
+ *
+ * Sends push notifications to Android devices via the FCM HTTP v1 API.
+ * Authenticates with a Google service account: an RS256-signed JWT is
+ * exchanged for an OAuth2 access token in the background, and the token is
+ * sent as the bearer credential.
+ *
+ * Sends go through the same HTTP/2 engine as APNs (h2_engine.h), so FCM
+ * gets the persistent connection, multiplexed batches, pacing, retries and
+ * interactive inbox without a second copy of them.
+ *
+ * Tunables (menuconfig → "APNs Configuration" → "Firebase Cloud Messaging"):
+ *   CONFIG_FCM_ENABLE      build the FCM client and POST /fcm
+ *   CONFIG_FCM_PROJECT_ID  Firebase project the messages are sent for
+ *   CONFIG_FCM_SA_EMAIL    service account client_email
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "h2_engine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------ */
+/*  Results                                                            */
+/* ------------------------------------------------------------------ */
+
+/** FCM error codes (details[].errorCode, else the error status). */
+typedef enum {
+    FCM_REASON_NONE = 0,                 /*!< no error body */
+    FCM_REASON_UNSPECIFIED_ERROR,
+    FCM_REASON_INVALID_ARGUMENT,
+    FCM_REASON_UNREGISTERED,
+    FCM_REASON_SENDER_ID_MISMATCH,
+    FCM_REASON_QUOTA_EXCEEDED,
+    FCM_REASON_UNAVAILABLE,
+    FCM_REASON_INTERNAL,
+    FCM_REASON_THIRD_PARTY_AUTH_ERROR,
+    FCM_REASON_UNAUTHENTICATED,          /*!< access token rejected */
+    FCM_REASON_PERMISSION_DENIED,
+    FCM_REASON_NOT_FOUND,
+    FCM_REASON_OTHER,                    /*!< error status, code missing or not recognised */
+    FCM_REASON_COUNT
+} fcm_reason_t;
+
+/** Google's spelling of @p reason ("UNREGISTERED", ...); "" for NONE. */
+const char *fcm_reason_name(fcm_reason_t reason);
+
+/**
+ * As with APNS_ERR_REASON(), an FCM error response is returned as
+ * FCM_ERR_REASON(reason), in a range of its own.  ESP_FAIL and
+ * ESP_ERR_TIMEOUT remain for failures where no response arrived.
+ */
+#define FCM_ERR_BASE          0x8100
+#define FCM_ERR_REASON(r)     ((esp_err_t)(FCM_ERR_BASE + (r)))
+
+/** Returned when FCM reports the registration token is no longer valid. */
+#define FCM_ERR_UNREGISTERED  FCM_ERR_REASON(FCM_REASON_UNREGISTERED)
+
+/** Reason carried by an FCM_ERR_REASON() code; FCM_REASON_NONE for any other code. */
+fcm_reason_t fcm_err_reason(esp_err_t err);
+
+/**
+ * True if @p reason means the token will never accept a push for this
+ * project (UNREGISTERED, SENDER_ID_MISMATCH).
+ */
+bool fcm_reason_is_permanent(fcm_reason_t reason);
+
+/* ------------------------------------------------------------------ */
+/*  Client                                                             */
+/* ------------------------------------------------------------------ */
+
+/**
+ * @brief FCM client configuration (static, set once at boot)
+ */
+typedef struct {
+    const char *project_id;      /*!< Firebase project id (the :send path) */
+    const char *sa_email;        /*!< Service account client_email (JWT iss) */
+    const char *sa_key_pem;      /*!< PEM-encoded RSA private key (null-terminated) */
+} fcm_config_t;
+
+/**
+ * @brief FCM notification — all fields are dynamically supplied per push
+ */
+typedef struct {
+    const char *device_token;    /*!< FCM registration token */
+    const char *title;           /*!< Notification title */
+    const char *body;            /*!< Notification body text */
+    const char *data;            /*!< Members of the "data" object (NULL to omit).
+                                      FCM only accepts string values.
+                                      Example: "\"type\":\"alert\",\"id\":\"42\"" */
+} fcm_notification_t;
+
+/**
+ * @brief Initialise the FCM module.
+ *
+ * Starts the shared HTTP/2 engine if APNs has not, registers the FCM host,
+ * parses the service account key, and starts the "fcm_auth" task that
+ * fetches the OAuth2 access token and renews it ahead of expiry.  @p config
+ * must stay valid for the lifetime of the program.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_SUPPORTED with CONFIG_FCM_ENABLE off,
+ *         ESP_ERR_INVALID_ARG / ESP_FAIL for a missing or unparsable key
+ */
+esp_err_t fcm_init(const fcm_config_t *config);
+
+/**
+ * @brief Fetch an access token and connect to FCM in the background
+ *
+ * Same as apns_prewarm() for the FCM host.
+ *
+ * @return ESP_OK, or ESP_ERR_INVALID_STATE before fcm_init()
+ */
+esp_err_t fcm_prewarm(void);
+
+/**
+ * @brief Encode the FCM v1 request body for @p notification into @p buf
+ *
+ * Produces {"message":{"token":..,"notification":{"title":..,"body":..},"data":{..}}}
+ * with JSON string escaping; data is spliced in as given (optional
+ * surrounding braces are accepted).  No heap allocation.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if @p buf is too small,
+ *         ESP_ERR_INVALID_ARG on NULL arguments
+ */
+esp_err_t fcm_payload_encode(const fcm_notification_t *notification,
+                             char *buf, size_t buf_len, size_t *out_len);
+
+/**
+ * @brief Send one notification via the FCM HTTP v1 API
+ *
+ * Interactive, like apns_send_notification(): rides along in a running FCM
+ * batch if there is one.  @p resp, if not NULL, receives the answer.
+ *
+ * @return
+ *   - ESP_OK on success
+ *   - FCM_ERR_REASON(reason) if FCM answered with an error
+ *   - ESP_ERR_TIMEOUT if FCM did not answer in time
+ *   - ESP_FAIL on connection/send failure, or no access token yet
+ *   - ESP_ERR_NOT_SUPPORTED with CONFIG_FCM_ENABLE off
+ */
+esp_err_t fcm_send_notification(const fcm_config_t *config,
+                                const fcm_notification_t *notification,
+                                h2_response_t *resp);
+
+/**
+ * @brief Send many notifications multiplexed over the FCM connection
+ *
+ * As apns_send_batch().  resp->reason is an fcm_reason_t and resp->id the
+ * message id (the last segment of the returned message name).  429, 500
+ * and 503 are retried; a 401 renews the access token once and retries.
+ */
+esp_err_t fcm_send_batch(const fcm_config_t *config,
+                         const fcm_notification_t *notifications, size_t count,
+                         h2_priority_t priority,
+                         h2_result_cb_t on_result, void *ctx);
+
+/* ------------------------------------------------------------------ */
+/*  Metrics                                                            */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    h2_hist_t token_fetch;         /*!< JWT signing + OAuth2 token exchange */
+    uint32_t  token_refreshes;
+    uint32_t  token_failures;
+    uint32_t  token_waits;         /*!< sends that found no valid token and waited for one */
+    uint32_t  reasons[FCM_REASON_COUNT];
+} fcm_metrics_t;
+
+/** Copy a consistent snapshot of the FCM metrics (all zero when disabled). */
+void fcm_metrics_get(fcm_metrics_t *out);
+
+#ifdef __cplusplus
+}
+#endif
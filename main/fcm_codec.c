@@ -0,0 +1,128 @@
+/*
+ * fcm_codec.c — FCM service-account JWT and payload encoding
+ *
+ * Like apns_codec.c: no esp-tls / nghttp2 / FreeRTOS, no allocation.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+
+#include "fcm.h"
+#include "fcm_codec.h"
+#include "apns_codec.h"
+
+static const char *TAG = "fcm";
+
+#define FCM_OAUTH_SCOPE     "https://www.googleapis.com/auth/firebase.messaging"
+#define FCM_OAUTH_AUDIENCE  "https://oauth2.googleapis.com/token"
+
+/* ------------------------------------------------------------------ */
+/*  JWT RS256 assertion                                                */
+/* ------------------------------------------------------------------ */
+
+esp_err_t fcm_jwt_sign(mbedtls_pk_context *pk, mbedtls_ctr_drbg_context *drbg,
+                       const char *sa_email, long iat,
+                       char *jwt_buf, size_t jwt_buf_len)
+{
+    static const char header[] = "{\"alg\":\"RS256\",\"typ\":\"JWT\"}";
+
+    char claims[320];
+    int n = snprintf(claims, sizeof(claims),
+                     "{\"iss\":\"%s\",\"scope\":\"" FCM_OAUTH_SCOPE "\","
+                     "\"aud\":\"" FCM_OAUTH_AUDIENCE "\",\"iat\":%ld,\"exp\":%ld}",
+                     sa_email, iat, iat + FCM_JWT_LIFETIME_S);
+    if (n < 0 || (size_t)n >= sizeof(claims)) {
+        ESP_LOGE(TAG, "Service account email too long");
+        return ESP_FAIL;
+    }
+
+    /* The signing input is assembled in place: header.claims */
+    size_t h_len = apns_base64url_encode((const unsigned char *)header, sizeof(header) - 1,
+                                         jwt_buf, jwt_buf_len);
+    if (h_len == 0 || h_len + 1 >= jwt_buf_len) {
+        ESP_LOGE(TAG, "JWT buffer too small");
+        return ESP_FAIL;
+    }
+    jwt_buf[h_len] = '.';
+    size_t c_len = apns_base64url_encode((const unsigned char *)claims, (size_t)n,
+                                         jwt_buf + h_len + 1, jwt_buf_len - h_len - 1);
+    if (c_len == 0) {
+        ESP_LOGE(TAG, "JWT buffer too small");
+        return ESP_FAIL;
+    }
+    size_t input_len = h_len + 1 + c_len;
+
+    unsigned char hash[32];
+    int rc = mbedtls_sha256((const unsigned char *)jwt_buf, input_len, hash, 0);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "SHA-256 failed");
+        return ESP_FAIL;
+    }
+
+    /* --- RSASSA-PKCS1-v1_5 sign (2048-bit key = 256-byte signature) --- */
+    unsigned char sig[MBEDTLS_PK_SIGNATURE_MAX_SIZE];
+    size_t sig_len = 0;
+    rc = mbedtls_pk_sign(pk, MBEDTLS_MD_SHA256, hash, sizeof(hash),
+                         sig, sizeof(sig), &sig_len,
+                         mbedtls_ctr_drbg_random, drbg);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "RSA sign failed: -0x%04x", (unsigned)-rc);
+        return ESP_FAIL;
+    }
+
+    if (input_len + 1 >= jwt_buf_len) {
+        ESP_LOGE(TAG, "JWT buffer too small");
+        return ESP_FAIL;
+    }
+    jwt_buf[input_len] = '.';
+    size_t s_len = apns_base64url_encode(sig, sig_len, jwt_buf + input_len + 1,
+                                         jwt_buf_len - input_len - 1);
+    if (s_len == 0) {
+        ESP_LOGE(TAG, "JWT buffer too small");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "JWT generated (len=%d)", (int)(input_len + 1 + s_len));
+    return ESP_OK;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Payload encoder                                                    */
+/* ------------------------------------------------------------------ */
+
+esp_err_t fcm_payload_encode(const fcm_notification_t *n,
+                             char *buf, size_t buf_len, size_t *out_len)
+{
+    if (!n || !n->device_token || !buf || buf_len == 0) return ESP_ERR_INVALID_ARG;
+
+    json_writer_t w = { .buf = buf, .cap = buf_len };
+
+    json_writer_lit(&w, "{\"message\":{\"token\":");
+    json_writer_str(&w, n->device_token);
+    json_writer_lit(&w, ",\"notification\":{\"title\":");
+    json_writer_str(&w, n->title ? n->title : "");
+    json_writer_lit(&w, ",\"body\":");
+    json_writer_str(&w, n->body ? n->body : "");
+    json_writer_lit(&w, "}");
+
+    /* data: raw members of the data object; tolerate surrounding braces/whitespace */
+    if (n->data) {
+        const char *c;
+        size_t len = json_members(n->data, &c);
+        if (len) {
+            json_writer_lit(&w, ",\"data\":{");
+            json_writer_raw(&w, c, len);
+            json_writer_lit(&w, "}");
+        }
+    }
+    json_writer_lit(&w, "}}");
+
+    if (w.overflow) return ESP_ERR_INVALID_SIZE;
+    buf[w.pos] = '\0';
+    if (out_len) *out_len = w.pos;
+    return ESP_OK;
+}
@@ -0,0 +1,39 @@
+/*
+ * fcm_codec.h — FCM service-account JWT and payload encoding
+ *
+ * The FCM counterpart of apns_codec.h: libc and mbedtls only, so it builds
+ * for the linux target too.  fcm_payload_encode() is implemented here and
+ * declared in fcm.h with the send API.
+ */
+#pragma once
+
+#include <stddef.h>
+#include "esp_err.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ctr_drbg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Lifetime Google allows a service-account assertion, and what we ask for. */
+#define FCM_JWT_LIFETIME_S  3600
+
+/**
+ * @brief Build and sign a service-account assertion (JWT, RS256)
+ *
+ * Header {"alg":"RS256","typ":"JWT"}, claims {"iss":"<sa_email>",
+ * "scope":"https://www.googleapis.com/auth/firebase.messaging",
+ * "aud":"https://oauth2.googleapis.com/token","iat":<iat>,"exp":<iat+3600>}.
+ *
+ * @param pk    Parsed RSA private key
+ * @param drbg  Seeded DRBG (used for RSA blinding)
+ * @return ESP_OK, or ESP_FAIL if signing failed or @p jwt_buf is too small
+ */
+esp_err_t fcm_jwt_sign(mbedtls_pk_context *pk, mbedtls_ctr_drbg_context *drbg,
+                       const char *sa_email, long iat,
+                       char *jwt_buf, size_t jwt_buf_len);
+
+#ifdef __cplusplus
+}
+#endif
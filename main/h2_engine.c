@@ -0,0 +1,1553 @@
+/*
+ * h2_engine.c — provider-agnostic HTTP/2 push engine (see h2_engine.h)
+ *
+ * - HTTP/2 POSTs using nghttp2 directly on top of esp-tls
+ * - Persistent connection per registered host, reused across sends
+ * - Batches multiplexed as concurrent streams on that connection
+ * - Shared stream slots, retry queue, inbox and slab pool for all providers
+ */
+
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_crt_bundle.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include <nghttp2/nghttp2.h>
+
+#include "h2_engine.h"
+#include "mem_pool.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "h2_engine";
+
+static SemaphoreHandle_t s_engine_mutex = NULL;
+
+/* Provider of the batch holding s_engine_mutex */
+static const h2_provider_t *s_provider;
+
+/* ------------------------------------------------------------------ */
+/*  nghttp2 allocator                                                  */
+/* ------------------------------------------------------------------ */
+
+/*
+ * nghttp2 allocates its stream, outbound item and header copies per
+ * request and frees them when the stream closes.  Served from slabs in
+ * internal RAM that are carved once at init, that churn never reaches
+ * the heap.  Per-connection buffers (frame buffers, HPACK tables) are
+ * larger than any class and come from the heap once per connect.
+ */
+const uint16_t h2_pool_sizes[H2_POOL_CLASSES] = { 64, 128, 256, 512, 1024 };
+
+static mem_pool_t s_h2_pool;
+
+static void *h2_malloc(size_t size, void *ud)
+{
+    return mem_pool_alloc(ud, size);
+}
+
+static void h2_free(void *ptr, void *ud)
+{
+    mem_pool_free(ud, ptr);
+}
+
+static void *h2_calloc(size_t n, size_t size, void *ud)
+{
+    return mem_pool_calloc(ud, n, size);
+}
+
+static void *h2_realloc(void *ptr, size_t size, void *ud)
+{
+    return mem_pool_realloc(ud, ptr, size);
+}
+
+static nghttp2_mem s_h2_mem = {
+    .mem_user_data = &s_h2_pool,
+    .malloc        = h2_malloc,
+    .free          = h2_free,
+    .calloc        = h2_calloc,
+    .realloc       = h2_realloc,
+};
+
+static esp_err_t h2_pool_init(void)
+{
+    size_t sizes[H2_POOL_CLASSES];
+    for (int i = 0; i < H2_POOL_CLASSES; i++) sizes[i] = h2_pool_sizes[i];
+    return mem_pool_init(&s_h2_pool, sizes, H2_POOL_CLASSES, CONFIG_APNS_H2_POOL_BLOCKS,
+                         MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Metrics                                                            */
+/* ------------------------------------------------------------------ */
+
+const uint32_t h2_hist_bounds_us[H2_HIST_BUCKETS - 1] = {
+    500, 1000, 2000, 5000, 10000, 20000, 50000,
+    100000, 200000, 500000, 1000000, 2000000, 5000000,
+};
+
+const uint16_t h2_status_codes[H2_STATUS_SLOTS - 1] = {
+    200, 400, 401, 403, 404, 405, 410, 413, 429, 500, 503,
+};
+
+static h2_metrics_t s_metrics;
+static portMUX_TYPE s_metrics_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#define METRIC_INC(field) do {                  \
+        portENTER_CRITICAL(&s_metrics_lock);    \
+        s_metrics.field++;                      \
+        portEXIT_CRITICAL(&s_metrics_lock);     \
+    } while (0)
+
+void h2_hist_add(h2_hist_t *h, int64_t us)
+{
+    uint32_t v = (us < 0) ? 0 : (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+    size_t b = 0;
+    while (b < H2_HIST_BUCKETS - 1 && v > h2_hist_bounds_us[b]) b++;
+
+    h->count++;
+    h->sum_us += v;
+    if (v > h->max_us) h->max_us = v;
+    h->buckets[b]++;
+}
+
+static void hist_record(h2_hist_t *h, int64_t us)
+{
+    portENTER_CRITICAL(&s_metrics_lock);
+    h2_hist_add(h, us);
+    portEXIT_CRITICAL(&s_metrics_lock);
+}
+
+static void metrics_status(int status)
+{
+    size_t slot = 0;
+    while (slot < H2_STATUS_SLOTS - 1 && h2_status_codes[slot] != status) slot++;
+    METRIC_INC(status[slot]);
+}
+
+void h2_engine_metrics_get(h2_metrics_t *out)
+{
+    portENTER_CRITICAL(&s_metrics_lock);
+    *out = s_metrics;
+    portEXIT_CRITICAL(&s_metrics_lock);
+
+    for (int i = 0; i < H2_POOL_CLASSES; i++) {
+        out->pool_free[i]     = s_h2_pool.cls[i].free;
+        out->pool_min_free[i] = s_h2_pool.cls[i].min_free;
+    }
+    out->pool_fallbacks = s_h2_pool.fallbacks;
+}
+
+void h2_engine_record_queue_wait(int64_t wait_us)
+{
+    hist_record(&s_metrics.queue_wait, wait_us);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Connection manager — one persistent HTTP/2 connection per host     */
+/* ------------------------------------------------------------------ */
+
+/*
+ * A TLS handshake costs far more than the POST itself, so the connection
+ * is kept open between sends and only re-established when the peer goes
+ * away (GOAWAY, socket error) or it has sat idle long enough that a
+ * middlebox has probably dropped it.  Access is serialised by
+ * s_engine_mutex.
+ */
+#define H2_CONN_IDLE_MAX_US  (10LL * 60 * 1000 * 1000)   /* 10 min */
+
+/*
+ * Outbound pacing, kept per host across reconnects.  A token bucket caps
+ * the submit rate (CONFIG_APNS_RATE_LIMIT); an AIMD window caps streams in
+ * flight below the peer's limit, opening by one stream per window of 200s
+ * and halving on 429, a timeout or an RTT spike.
+ */
+typedef struct {
+    uint32_t window;          /* AIMD streams-in-flight limit */
+    uint32_t acked;           /* 200s since the window last changed */
+    int64_t  srtt_us;         /* smoothed RTT of 200s, 0 until the first one */
+    int64_t  hold_until_us;   /* one shrink per RTT: a burst of 429s counts once */
+    int64_t  credit;          /* token bucket, in millionths of a push */
+    int64_t  refill_us;       /* last bucket top-up, 0 = never */
+} h2_pace_t;
+
+struct h2_host {
+    const h2_provider_t *provider;
+    const char      *host;
+    uint8_t          index;          /* slot in s_hosts and s_metrics.hosts */
+    bool             verify;         /* check the peer certificate against the bundle */
+    esp_tls_t       *tls;
+    nghttp2_session *sess;
+    bool             open;
+    bool             goaway;
+    uint32_t         max_streams;    /* peer SETTINGS_MAX_CONCURRENT_STREAMS */
+    uint32_t         opens;          /* successful connects, for the reconnect count */
+    int64_t          last_used_us;
+    h2_pace_t        pace;
+#if CONFIG_APNS_TLS_SESSION_RESUME
+    esp_tls_client_session_t *session;   /* last ticket, offered on the next connect */
+#endif
+};
+
+static h2_host_t s_hosts[H2_HOSTS_MAX];
+static size_t    s_host_count;
+
+/* ------------------------------------------------------------------ */
+/*  Per-stream context                                                 */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Upper bound on streams in flight per batch, regardless of what the peer
+ * advertises or the AIMD window allows.  Each slot is attached to its
+ * nghttp2 stream as stream user data and owns one h2_stream_buf_t.
+ */
+#define H2_MAX_STREAMS       CONFIG_APNS_WINDOW_MAX
+#define H2_STREAM_TIMEOUT_US (15LL * 1000 * 1000)
+
+/* After the peer rejects the credential, submits hold until the provider
+ * has a new one, looking every H2_AUTH_POLL_US for at most H2_AUTH_WAIT_US */
+#define H2_AUTH_POLL_US      (50LL * 1000)
+#define H2_AUTH_WAIT_US      (15LL * 1000 * 1000)
+
+typedef struct {
+    bool       in_use;
+    bool       submitted;     /* false = waiting for (re)submission */
+    uint8_t    attempts;      /* retries already spent on this item */
+    bool       done;
+    size_t     index;         /* position in the caller's item array */
+    int32_t    stream_id;
+    uint32_t   error_code;    /* RST_STREAM / close error, 0 = clean close */
+    h2_response_t response;   /* :status, ids, reason */
+    uint32_t   retry_after_s; /* Retry-After header, 0 if absent */
+    int64_t    submitted_us;
+    int64_t    deadline_us;
+    const char *body;         /* buf->payload, or a caller's pre-encoded body */
+    size_t     body_len;
+    size_t     body_off;
+    char       path[150];
+    struct h2_stream_buf *buf;
+    size_t     resp_len;
+    struct h2_urgent *urgent; /* inbox entry carried for another task, else NULL */
+} h2_stream_t;
+
+/*
+ * Payload and response bytes, written once and read once per stream.  They
+ * are kept apart from the slot state above so that, with PSRAM and
+ * CONFIG_SPIRAM_ALLOW_BSS_SEG_EXTERNAL_MEMORY, they land in external RAM
+ * while the slots stay in internal SRAM.
+ */
+typedef struct h2_stream_buf {
+    char payload[H2_BODY_MAX];
+    char resp[512];
+} h2_stream_buf_t;
+
+static h2_stream_t                      s_streams[H2_MAX_STREAMS];
+static EXT_RAM_BSS_ATTR h2_stream_buf_t s_stream_bufs[H2_MAX_STREAMS];
+
+/* Authorization header of the running batch; only the mutex holder uses it */
+static char s_auth_hdr[H2_AUTH_MAX];
+
+/*
+ * Delayed-retry queue.  A transient failure frees its stream slot and parks
+ * the item index here until its backoff expires; the send loop resubmits
+ * due entries ahead of new ones.  Sized so one full blast chunk can be
+ * waiting at once.
+ */
+#define H2_RETRY_SLOTS 32
+
+typedef struct {
+    size_t  index;
+    uint8_t attempts;
+    int64_t due_us;
+    struct h2_urgent *urgent;
+} h2_retry_t;
+
+static h2_retry_t s_retry[H2_RETRY_SLOTS];
+static size_t     s_retry_count;
+
+/*
+ * Interactive inbox.  While a bulk batch holds the engine, a single
+ * interactive send for the same host and batch key does not wait for the
+ * whole batch: it posts itself here, and the running loop submits it ahead
+ * of its own items into the slots bulk leaves free
+ * (CONFIG_APNS_INTERACTIVE_RESERVE).  The poster sleeps until the loop
+ * reports its result.  s_urgent_held counts entries the loop has taken but
+ * not reported yet, in a slot or the retry queue; only the mutex holder
+ * touches it.
+ */
+#define H2_INBOX_SLOTS    8
+#define H2_BATCH_KEY_LEN  160    /* longest batch key an inbox matches (bundle ids run to 155) */
+#define H2_INBOX_POLL_US  5000   /* longest a new entry waits for the loop to look */
+
+typedef struct h2_urgent {
+    const h2_provider_t *provider;
+    const void   *cfg;
+    const void   *item;
+    TaskHandle_t  waiter;
+    esp_err_t     result;
+    h2_response_t *resp;         /* caller's copy of the answer, may be NULL */
+    uint32_t      job;           /* poster's trace job, for the records the loop writes */
+} h2_urgent_t;
+
+static h2_urgent_t       *s_inbox[H2_INBOX_SLOTS];
+static size_t             s_inbox_count;
+static bool               s_bulk_active;           /* a bulk batch takes inbox entries */
+static const h2_provider_t *s_bulk_provider;
+static const h2_host_t   *s_bulk_host;
+static bool               s_bulk_keyed;            /* s_bulk_key held the whole key */
+static char               s_bulk_key[H2_BATCH_KEY_LEN];   /* written only while !s_bulk_active */
+static volatile uint32_t  s_interactive_waiting;   /* interactive senders blocked on the mutex */
+static size_t             s_urgent_held;
+static portMUX_TYPE       s_inbox_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * Interactive senders waiting for the engine block on a wake semaphore of
+ * their own (on their stack), given whenever the engine is released or a
+ * bulk batch opens its inbox; they re-check then, rather than poll.  A bulk
+ * caller waits on s_bulk_gate, given when the last interactive waiter
+ * leaves, but for at most H2_BULK_YIELD_MAX_MS: under steady interactive
+ * load it then takes its turn, and the waiters join its inbox.
+ */
+#define H2_BULK_YIELD_MAX_MS  200
+
+typedef struct h2_waiter {
+    SemaphoreHandle_t wake;
+    StaticSemaphore_t wake_buf;
+    struct h2_waiter *next;
+} h2_waiter_t;
+
+static h2_waiter_t      *s_waiters;          /* under s_waiters_lock */
+static SemaphoreHandle_t s_waiters_lock;     /* mutex: waiters are woken with it held */
+static SemaphoreHandle_t s_bulk_gate;        /* binary */
+
+static void waiters_wake(void)
+{
+    xSemaphoreTake(s_waiters_lock, portMAX_DELAY);
+    for (h2_waiter_t *w = s_waiters; w; w = w->next) xSemaphoreGive(w->wake);
+    xSemaphoreGive(s_waiters_lock);
+}
+
+static void waiter_add(h2_waiter_t *w)
+{
+    w->wake = xSemaphoreCreateBinaryStatic(&w->wake_buf);
+    xSemaphoreTake(s_waiters_lock, portMAX_DELAY);
+    w->next   = s_waiters;
+    s_waiters = w;
+    xSemaphoreGive(s_waiters_lock);
+}
+
+static void waiter_remove(h2_waiter_t *w)
+{
+    xSemaphoreTake(s_waiters_lock, portMAX_DELAY);
+    for (h2_waiter_t **p = &s_waiters; *p; p = &(*p)->next) {
+        if (*p == w) {
+            *p = w->next;
+            break;
+        }
+    }
+    xSemaphoreGive(s_waiters_lock);
+    vSemaphoreDelete(w->wake);
+}
+
+/** Release the engine and let waiting interactive senders look again. */
+static void engine_give(void)
+{
+    xSemaphoreGive(s_engine_mutex);
+    waiters_wake();
+}
+
+#define H2_NV(NAME, VALUE) \
+    { (uint8_t *)(NAME), (uint8_t *)(VALUE), strlen(NAME), strlen(VALUE), NGHTTP2_NV_FLAG_NONE }
+
+/* ------------------------------------------------------------------ */
+/*  nghttp2 session callbacks                                          */
+/* ------------------------------------------------------------------ */
+
+static ssize_t h2_send_cb(nghttp2_session *session, const uint8_t *data,
+                          size_t length, int flags, void *user_data)
+{
+    h2_host_t *c = (h2_host_t *)user_data;
+    ssize_t rc = esp_tls_conn_write(c->tls, data, length);
+    if (rc == ESP_TLS_ERR_SSL_WANT_READ || rc == ESP_TLS_ERR_SSL_WANT_WRITE) {
+        return NGHTTP2_ERR_WOULDBLOCK;
+    }
+    return (rc <= 0) ? NGHTTP2_ERR_CALLBACK_FAILURE : rc;
+}
+
+static ssize_t h2_recv_cb(nghttp2_session *session, uint8_t *buf,
+                          size_t length, int flags, void *user_data)
+{
+    h2_host_t *c = (h2_host_t *)user_data;
+    ssize_t rc = esp_tls_conn_read(c->tls, buf, length);
+    if (rc == ESP_TLS_ERR_SSL_WANT_READ || rc == ESP_TLS_ERR_SSL_WANT_WRITE) {
+        return NGHTTP2_ERR_WOULDBLOCK;
+    }
+    if (rc == 0) return NGHTTP2_ERR_EOF;
+    return (rc < 0) ? NGHTTP2_ERR_CALLBACK_FAILURE : rc;
+}
+
+static int h2_on_frame_recv_cb(nghttp2_session *session,
+                               const nghttp2_frame *frame, void *user_data)
+{
+    h2_host_t *c = (h2_host_t *)user_data;
+
+    if (frame->hd.type == NGHTTP2_SETTINGS && !(frame->hd.flags & NGHTTP2_FLAG_ACK)) {
+        c->max_streams = nghttp2_session_get_remote_settings(
+                             session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+        ESP_LOGD(TAG, "%s: peer max concurrent streams = %u",
+                 c->host, (unsigned)c->max_streams);
+    } else if (frame->hd.type == NGHTTP2_GOAWAY) {
+        ESP_LOGW(TAG, "%s: GOAWAY (error=%u, last_stream=%d)", c->host,
+                 (unsigned)frame->goaway.error_code, (int)frame->goaway.last_stream_id);
+        c->goaway = true;
+        METRIC_INC(goaways);
+        trace_rec(TRACE_GOAWAY, trace_job(), c->index, (int32_t)frame->goaway.error_code);
+    }
+    return 0;
+}
+
+static int h2_on_header_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                           const uint8_t *name, size_t namelen,
+                           const uint8_t *value, size_t valuelen,
+                           uint8_t flags, void *user_data)
+{
+    if (frame->hd.type != NGHTTP2_HEADERS) return 0;
+    h2_stream_t *st = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (!st) return 0;
+    h2_host_t *c = (h2_host_t *)user_data;
+
+    if (namelen == 7 && memcmp(name, ":status", 7) == 0) {
+        int status = 0;
+        for (size_t i = 0; i < valuelen && value[i] >= '0' && value[i] <= '9'; i++) {
+            status = status * 10 + (value[i] - '0');
+        }
+        st->response.status = status;
+    } else if (namelen == 11 && memcmp(name, "retry-after", 11) == 0) {
+        uint32_t secs = 0;
+        for (size_t i = 0; i < valuelen && value[i] >= '0' && value[i] <= '9'; i++) {
+            secs = secs * 10 + (value[i] - '0');
+        }
+        st->retry_after_s = secs;
+    } else if (c->provider->header) {
+        c->provider->header(&st->response, name, namelen, value, valuelen);
+    }
+    return 0;
+}
+
+static int h2_on_data_chunk_cb(nghttp2_session *session, uint8_t flags,
+                               int32_t stream_id, const uint8_t *data,
+                               size_t len, void *user_data)
+{
+    h2_stream_t *st = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (!st) return 0;
+
+    size_t space   = sizeof(st->buf->resp) - st->resp_len - 1;
+    size_t to_copy = (len < space) ? len : space;
+    memcpy(st->buf->resp + st->resp_len, data, to_copy);
+    st->resp_len += to_copy;
+    st->buf->resp[st->resp_len] = '\0';
+    return 0;
+}
+
+static int h2_on_stream_close_cb(nghttp2_session *session, int32_t stream_id,
+                                 uint32_t error_code, void *user_data)
+{
+    h2_stream_t *st = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (!st) return 0;
+
+    st->error_code = error_code;
+    st->done       = true;
+    return 0;
+}
+
+/**
+ * nghttp2 data provider: copy the next chunk of this stream's POST body.
+ */
+static ssize_t h2_body_read_cb(nghttp2_session *session, int32_t stream_id,
+                               uint8_t *buf, size_t length, uint32_t *data_flags,
+                               nghttp2_data_source *source, void *user_data)
+{
+    h2_stream_t *st  = (h2_stream_t *)source->ptr;
+    size_t remaining = st->body_len - st->body_off;
+    size_t to_copy   = (remaining < length) ? remaining : length;
+
+    if (to_copy > 0) {
+        memcpy(buf, st->body + st->body_off, to_copy);
+        st->body_off += to_copy;
+    }
+    if (st->body_off >= st->body_len) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return (ssize_t)to_copy;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Connection lifecycle                                               */
+/* ------------------------------------------------------------------ */
+
+#if CONFIG_APNS_TLS_SESSION_RESUME
+/*
+ * Replace the cached session with the one @p c->tls holds now.  Called
+ * after the handshake and again before teardown, because a TLS 1.3
+ * server only sends its ticket once the handshake has completed.
+ */
+static void conn_save_session(h2_host_t *c)
+{
+    esp_tls_client_session_t *s = esp_tls_get_client_session(c->tls);
+    if (!s) return;
+    if (c->session) esp_tls_free_client_session(c->session);
+    c->session = s;
+}
+
+static void conn_drop_session(h2_host_t *c)
+{
+    if (!c->session) return;
+    esp_tls_free_client_session(c->session);
+    c->session = NULL;
+}
+#endif
+
+static void conn_close(h2_host_t *c)
+{
+    if (!c->open) return;
+
+#if CONFIG_APNS_TLS_SESSION_RESUME
+    conn_save_session(c);
+#endif
+
+    /* Detach in-flight slots so teardown callbacks cannot touch them */
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (s_streams[i].in_use && s_streams[i].submitted) {
+            nghttp2_session_set_stream_user_data(c->sess, s_streams[i].stream_id, NULL);
+        }
+    }
+    nghttp2_session_del(c->sess);
+    esp_tls_conn_destroy(c->tls);
+    c->sess = NULL;
+    c->tls  = NULL;
+    c->open = false;
+    trace_rec(TRACE_DISCONNECT, trace_job(), c->index, 0);
+    ESP_LOGI(TAG, "HTTP/2 connection to %s closed", c->host);
+}
+
+/** One round of non-blocking I/O: flush pending frames, then read what is available. */
+static int conn_io(h2_host_t *c)
+{
+    int rc = nghttp2_session_send(c->sess);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "%s: HTTP/2 send error: %s", c->host, nghttp2_strerror(rc));
+        return rc;
+    }
+    rc = nghttp2_session_recv(c->sess);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "%s: HTTP/2 recv error: %s", c->host, nghttp2_strerror(rc));
+        return rc;
+    }
+    return 0;
+}
+
+/**
+ * Block until the socket becomes readable (or writable while nghttp2 still
+ * has output queued) or @p deadline_us passes, whichever comes first.
+ * Returns at once if mbedTLS already holds decrypted bytes, which select()
+ * cannot see.
+ */
+static void conn_wait(h2_host_t *c, int64_t deadline_us)
+{
+    if (esp_tls_get_bytes_avail(c->tls) > 0) return;
+
+    int fd = -1;
+    if (esp_tls_get_conn_sockfd(c->tls, &fd) != ESP_OK || fd < 0) return;
+
+    int64_t wait_us = deadline_us - esp_timer_get_time();
+    if (wait_us <= 0) return;
+
+    fd_set rfds, wfds;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_SET(fd, &rfds);
+    bool want_write = nghttp2_session_want_write(c->sess);
+    if (want_write) FD_SET(fd, &wfds);
+
+    struct timeval tv = {
+        .tv_sec  = (time_t)(wait_us / 1000000),
+        .tv_usec = (suseconds_t)(wait_us % 1000000),
+    };
+    select(fd + 1, &rfds, want_write ? &wfds : NULL, NULL, &tv);
+}
+
+/**
+ * Returns true if the nghttp2 session can still carry new streams.
+ * Pending frames (e.g. a GOAWAY received while idle) are processed first.
+ */
+static bool conn_alive(h2_host_t *c)
+{
+    if (!c->open) return false;
+    if (esp_timer_get_time() - c->last_used_us > H2_CONN_IDLE_MAX_US) {
+        ESP_LOGI(TAG, "%s: connection idle too long, reconnecting", c->host);
+        return false;
+    }
+    if (conn_io(c) != 0) {
+        ESP_LOGW(TAG, "%s: connection lost while idle", c->host);
+        return false;
+    }
+    if (c->goaway ||
+        (!nghttp2_session_want_read(c->sess) && !nghttp2_session_want_write(c->sess))) {
+        ESP_LOGI(TAG, "%s: peer closed session (GOAWAY)", c->host);
+        return false;
+    }
+    return true;
+}
+
+static esp_err_t conn_open(h2_host_t *c)
+{
+    char uri[64];
+    snprintf(uri, sizeof(uri), "https://%s", c->host);
+
+    static const char *alpn[] = { "h2", NULL };
+    tls_keep_alive_cfg_t ka = {
+        .keep_alive_enable   = true,
+        .keep_alive_idle     = 5,
+        .keep_alive_interval = 5,
+        .keep_alive_count    = 3,
+    };
+    esp_tls_cfg_t tls_cfg = {
+        .alpn_protos       = alpn,
+        .crt_bundle_attach = c->verify ? esp_crt_bundle_attach : NULL,
+        .keep_alive_cfg    = &ka,
+        .non_block         = true,
+        .timeout_ms        = 10000,
+#if CONFIG_APNS_TLS_SESSION_RESUME
+        .client_session    = c->session,
+#endif
+    };
+
+    TRACE_LOGI(TAG, "Connecting to %s ...", c->host);
+    trace_rec(TRACE_CONNECT, trace_job(), c->index, 0);
+    c->tls = esp_tls_init();
+    if (!c->tls) {
+        ESP_LOGE(TAG, "esp_tls_init failed");
+        return ESP_ERR_NO_MEM;
+    }
+    int64_t t0 = esp_timer_get_time();
+    if (esp_tls_conn_http_new_sync(uri, &tls_cfg, c->tls) != 1) {
+        ESP_LOGE(TAG, "TLS connection to %s failed", c->host);
+        METRIC_INC(connect_failures);
+        trace_rec(TRACE_CONNECT_FAIL, trace_job(), c->index, 0);
+        esp_tls_conn_destroy(c->tls);
+        c->tls = NULL;
+#if CONFIG_APNS_TLS_SESSION_RESUME
+        conn_drop_session(c);   /* next attempt does a full handshake */
+#endif
+        return ESP_FAIL;
+    }
+    int64_t connect_us = esp_timer_get_time() - t0;
+    hist_record(&s_metrics.connect, connect_us);
+    trace_rec(TRACE_CONNECTED, trace_job(), c->index, (int32_t)connect_us);
+#if CONFIG_APNS_TLS_SESSION_RESUME
+    if (c->session) METRIC_INC(session_offers);
+    conn_save_session(c);
+#endif
+
+    nghttp2_session_callbacks *cbs;
+    if (nghttp2_session_callbacks_new(&cbs) != 0) {
+        esp_tls_conn_destroy(c->tls);
+        c->tls = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    nghttp2_session_callbacks_set_send_callback(cbs, h2_send_cb);
+    nghttp2_session_callbacks_set_recv_callback(cbs, h2_recv_cb);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(cbs, h2_on_frame_recv_cb);
+    nghttp2_session_callbacks_set_on_header_callback(cbs, h2_on_header_cb);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(cbs, h2_on_data_chunk_cb);
+    nghttp2_session_callbacks_set_on_stream_close_callback(cbs, h2_on_stream_close_cb);
+    int rc = nghttp2_session_client_new3(&c->sess, cbs, c, NULL, &s_h2_mem);
+    nghttp2_session_callbacks_del(cbs);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "nghttp2 session init failed: %s", nghttp2_strerror(rc));
+        esp_tls_conn_destroy(c->tls);
+        c->tls = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    const nghttp2_settings_entry iv[] = {
+        { NGHTTP2_SETTINGS_ENABLE_PUSH, 0 },
+    };
+    nghttp2_submit_settings(c->sess, NGHTTP2_FLAG_NONE, iv, sizeof(iv) / sizeof(iv[0]));
+
+    c->open         = true;
+    c->goaway       = false;
+    c->max_streams  = 1;   /* until the peer's SETTINGS arrive */
+    c->last_used_us = esp_timer_get_time();
+    METRIC_INC(connects);
+    if (c->opens++ > 0) METRIC_INC(reconnects);
+    ESP_LOGI(TAG, "HTTP/2 connected to %s", c->host);
+    return ESP_OK;
+}
+
+/** Streams this batch may keep in flight on @p c right now. */
+static size_t conn_window(const h2_host_t *c)
+{
+    size_t window = c->max_streams;
+    if (window > c->pace.window) window = c->pace.window;
+    if (window > H2_MAX_STREAMS) window = H2_MAX_STREAMS;
+    return window ? window : 1;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Pacing — token bucket + AIMD window                                */
+/* ------------------------------------------------------------------ */
+
+#define H2_PACE_UNIT         1000000LL   /* bucket credit for one push */
+#define H2_PACE_RTT_FLOOR_US 20000       /* RTTs below this never count as spikes */
+#define H2_PACE_HOLD_MIN_US  100000      /* shrink hold-off before an RTT is known */
+
+static void pace_publish(const h2_host_t *c)
+{
+    portENTER_CRITICAL(&s_metrics_lock);
+    s_metrics.hosts[c->index].window = c->pace.window;
+    portEXIT_CRITICAL(&s_metrics_lock);
+    trace_rec(TRACE_WINDOW, trace_job(), c->index, (int32_t)c->pace.window);
+}
+
+/**
+ * Top up the bucket and return how long until one push may be sent:
+ * 0 = now.  Always 0 with CONFIG_APNS_RATE_LIMIT unset.
+ */
+static int64_t pace_delay(h2_host_t *c, int64_t now_us)
+{
+#if CONFIG_APNS_RATE_LIMIT == 0
+    return 0;
+#else
+    h2_pace_t *p = &c->pace;
+    const int64_t burst = (int64_t)CONFIG_APNS_RATE_BURST * H2_PACE_UNIT;
+    if (p->refill_us == 0) {
+        p->credit = burst;
+    } else {
+        p->credit += (now_us - p->refill_us) * CONFIG_APNS_RATE_LIMIT;
+        if (p->credit > burst) p->credit = burst;
+    }
+    p->refill_us = now_us;
+
+    if (p->credit >= H2_PACE_UNIT) return 0;
+    return (H2_PACE_UNIT - p->credit + CONFIG_APNS_RATE_LIMIT - 1) / CONFIG_APNS_RATE_LIMIT;
+#endif
+}
+
+/** Charge one submitted push to the bucket (after pace_delay() returned 0). */
+static void pace_consume(h2_host_t *c)
+{
+    if (CONFIG_APNS_RATE_LIMIT != 0) c->pace.credit -= H2_PACE_UNIT;
+}
+
+/** Multiplicative decrease, at most once per smoothed RTT. */
+static void pace_shrink(h2_host_t *c, int64_t now_us, const char *why)
+{
+    h2_pace_t *p = &c->pace;
+    if (now_us < p->hold_until_us) return;
+
+    uint32_t w = p->window / 2;
+    if (w < CONFIG_APNS_WINDOW_MIN) w = CONFIG_APNS_WINDOW_MIN;
+    p->acked         = 0;
+    p->hold_until_us = now_us + (p->srtt_us > H2_PACE_HOLD_MIN_US ? p->srtt_us
+                                                                 : H2_PACE_HOLD_MIN_US);
+    if (w == p->window) return;
+
+    ESP_LOGW(TAG, "%s: %s, window %u -> %u", c->host, why,
+             (unsigned)p->window, (unsigned)w);
+    p->window = w;
+    METRIC_INC(window_shrinks);
+    pace_publish(c);
+}
+
+/** Feed one completed stream into the window; a 429 also empties the bucket. */
+static void pace_on_response(h2_host_t *c, const h2_stream_t *st, int64_t now_us)
+{
+    h2_pace_t *p = &c->pace;
+
+    if (st->error_code != NGHTTP2_NO_ERROR) return;   /* resets say nothing about load */
+    if (st->response.status == 429) {
+        p->credit = 0;
+        pace_shrink(c, now_us, "429 Too Many Requests");
+        return;
+    }
+    if (st->response.status != 200) return;
+
+    int64_t rtt_us = now_us - st->submitted_us;
+    bool spike = p->srtt_us > 0 && rtt_us > H2_PACE_RTT_FLOOR_US &&
+                 rtt_us * 100 > p->srtt_us * CONFIG_APNS_RTT_SPIKE_PCT;
+    p->srtt_us = p->srtt_us ? p->srtt_us + (rtt_us - p->srtt_us) / 8 : rtt_us;
+    if (spike) {
+        pace_shrink(c, now_us, "RTT spike");
+        return;
+    }
+
+    /* Additive increase: one stream per full window of 200s */
+    uint32_t cap = c->max_streams < H2_MAX_STREAMS ? c->max_streams : H2_MAX_STREAMS;
+    if (++p->acked >= p->window && p->window < cap) {
+        p->window++;
+        p->acked = 0;
+        ESP_LOGD(TAG, "%s: window -> %u", c->host, (unsigned)p->window);
+        pace_publish(c);
+    }
+}
+
+/** Return an open connection to @p c, connecting if needed. */
+static h2_host_t *conn_acquire(h2_host_t *c)
+{
+    if (conn_alive(c)) {
+        ESP_LOGD(TAG, "Reusing HTTP/2 connection to %s", c->host);
+        return c;
+    }
+    conn_close(c);
+    return (conn_open(c) == ESP_OK) ? c : NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Stream helpers                                                     */
+/* ------------------------------------------------------------------ */
+
+static void stream_release(h2_stream_t *st)
+{
+    st->in_use    = false;
+    st->submitted = false;
+    st->attempts  = 0;
+    st->done      = false;
+    st->body      = NULL;
+    st->urgent    = NULL;
+}
+
+/** Trace job of the item in @p st: the poster's for an inbox entry, else ours. */
+static uint32_t stream_job(const h2_stream_t *st)
+{
+    return st->urgent ? st->urgent->job : trace_job();
+}
+
+/** Submit (or resubmit) the POST for a prepared slot on @p c. */
+static esp_err_t stream_submit(h2_host_t *c, h2_stream_t *st, const void *cfg)
+{
+    nghttp2_nv nva[6 + H2_EXTRA_HEADERS_MAX] = {
+        H2_NV(":method",       "POST"),
+        H2_NV(":scheme",       "https"),
+        H2_NV(":path",         st->path),
+        H2_NV("host",          c->host),
+        H2_NV("authorization", s_auth_hdr),
+        H2_NV("content-type",  "application/json"),
+    };
+    size_t nnv = 6;
+    h2_header_t extra[H2_EXTRA_HEADERS_MAX];
+    size_t nextra = s_provider->headers ? s_provider->headers(cfg, extra, H2_EXTRA_HEADERS_MAX) : 0;
+    for (size_t i = 0; i < nextra; i++) {
+        nva[nnv++] = (nghttp2_nv)H2_NV(extra[i].name, extra[i].value);
+    }
+    nghttp2_data_provider prd = {
+        .source.ptr    = st,
+        .read_callback = h2_body_read_cb,
+    };
+
+    st->body_off   = 0;
+    st->resp_len   = 0;
+    st->buf->resp[0] = '\0';
+    st->done       = false;
+    st->error_code    = 0;
+    st->retry_after_s = 0;
+    memset(&st->response, 0, sizeof(st->response));
+
+    int32_t sid = nghttp2_submit_request(c->sess, NULL, nva, nnv, &prd, st);
+    if (sid < 0) {
+        ESP_LOGW(TAG, "Failed to submit POST request: %s", nghttp2_strerror(sid));
+        return ESP_FAIL;
+    }
+    st->stream_id    = sid;
+    st->submitted    = true;
+    st->submitted_us = esp_timer_get_time();
+    st->deadline_us  = st->submitted_us + H2_STREAM_TIMEOUT_US;
+    trace_rec(TRACE_STREAM_SUBMIT, stream_job(st), c->index, sid);
+    TRACE_LOGI(TAG, "%s: POST submitted (stream %d)", s_provider->name, (int)sid);
+    return ESP_OK;
+}
+
+/**
+ * Map a completed stream to the send result; the provider reads the
+ * response.  *@p retry is set when the failure is transient and worth
+ * another attempt; *@p auth_expired when the peer rejected the credential.
+ */
+static esp_err_t stream_result(h2_stream_t *st, bool *retry, bool *auth_expired)
+{
+    h2_response_t *r = &st->response;
+    int64_t rtt_us = esp_timer_get_time() - st->submitted_us;
+    hist_record(&s_metrics.rtt, rtt_us);
+    r->rtt_us = rtt_us > UINT32_MAX ? UINT32_MAX : (uint32_t)rtt_us;
+    *retry        = false;
+    *auth_expired = false;
+    trace_rec(TRACE_STREAM_DONE, stream_job(st), st->error_code ? 0 : r->status, st->stream_id);
+
+    if (st->error_code != NGHTTP2_NO_ERROR || r->status == 0) {
+        /* Includes REFUSED_STREAM for streams above a GOAWAY's last id */
+        METRIC_INC(stream_resets);
+        ESP_LOGE(TAG, "%s: stream %d reset (error=%u)", s_provider->name,
+                 (int)st->stream_id, (unsigned)st->error_code);
+        *retry = true;
+        return ESP_FAIL;
+    }
+    metrics_status(r->status);
+    return s_provider->result(r, st->buf->resp, st->resp_len, retry, auth_expired);
+}
+
+/**
+ * Park the item in @p st for a delayed resend, if its attempts, the batch
+ * @p budget and the retry queue allow.  False = report failure now.
+ * Inbox entries are not charged to the budget of the batch they rode in.
+ */
+static bool retry_schedule(const h2_stream_t *st, size_t *budget)
+{
+    if (st->attempts >= CONFIG_APNS_RETRY_MAX_ATTEMPTS || (*budget == 0 && !st->urgent) ||
+        s_retry_count >= H2_RETRY_SLOTS) {
+        METRIC_INC(retries_exhausted);
+        return false;
+    }
+
+    /* Exponential backoff, jittered over the upper half of each step */
+    int64_t max_us  = (int64_t)CONFIG_APNS_RETRY_MAX_DELAY_MS * 1000;
+    int64_t step_us = (int64_t)CONFIG_APNS_RETRY_BASE_MS * 1000 << st->attempts;
+    if (step_us > max_us) step_us = max_us;
+    int64_t delay_us = step_us / 2 + (int64_t)(esp_random() % (uint32_t)(step_us / 2 + 1));
+
+    if (st->retry_after_s) {
+        int64_t ra_us = (int64_t)st->retry_after_s * 1000000;
+        if (ra_us > max_us) {
+            ESP_LOGW(TAG, "%s: Retry-After %lus exceeds the retry cap, giving up",
+                     s_provider->name, (unsigned long)st->retry_after_s);
+            METRIC_INC(retries_exhausted);
+            return false;
+        }
+        if (ra_us > delay_us) delay_us = ra_us;
+    }
+
+    s_retry[s_retry_count++] = (h2_retry_t){
+        .index    = st->index,
+        .attempts = (uint8_t)(st->attempts + 1),
+        .due_us   = esp_timer_get_time() + delay_us,
+        .urgent   = st->urgent,
+    };
+    if (!st->urgent) (*budget)--;
+    METRIC_INC(retries);
+    trace_rec(TRACE_RETRY, stream_job(st), st->attempts + 1, (int32_t)(delay_us / 1000));
+    ESP_LOGW(TAG, "%s: retry %u/%d for item %u in %lld ms", s_provider->name,
+             st->attempts + 1, CONFIG_APNS_RETRY_MAX_ATTEMPTS, (unsigned)st->index,
+             (long long)(delay_us / 1000));
+    return true;
+}
+
+/**
+ * Remove and return the earliest due retry, or false if none is due by
+ * @p now_us.  Without @p bulk_ok only inbox entries qualify.
+ */
+static bool retry_take_due(int64_t now_us, bool bulk_ok, h2_retry_t *out)
+{
+    size_t best = SIZE_MAX;
+    for (size_t i = 0; i < s_retry_count; i++) {
+        if (s_retry[i].due_us <= now_us && (bulk_ok || s_retry[i].urgent) &&
+            (best == SIZE_MAX || s_retry[i].due_us < s_retry[best].due_us)) {
+            best = i;
+        }
+    }
+    if (best == SIZE_MAX) return false;
+    *out = s_retry[best];
+    s_retry[best] = s_retry[--s_retry_count];
+    return true;
+}
+
+/** Passed to the callback for items that never got an answer. */
+static const h2_response_t s_no_response;
+
+/** Count the outcome, then hand it to the caller. */
+static void report(h2_result_cb_t on_result, void *ctx, size_t index,
+                   esp_err_t result, const h2_response_t *resp)
+{
+    portENTER_CRITICAL(&s_metrics_lock);
+    s_metrics.sent++;
+    if (result == ESP_OK && s_metrics.first_ok_us == 0) {
+        s_metrics.first_ok_us = esp_timer_get_time();
+    }
+    if (result == ESP_OK)                                  s_metrics.ok++;
+    else if (result == s_provider->err_unregistered)       s_metrics.unregistered++;
+    else if (result == ESP_ERR_TIMEOUT)                    s_metrics.timeouts++;
+    else                                                   s_metrics.failed++;
+    portEXIT_CRITICAL(&s_metrics_lock);
+
+    on_result(index, result, resp, ctx);
+}
+
+static void urgent_done_cb(size_t index, esp_err_t result,
+                           const h2_response_t *resp, void *ctx)
+{
+    h2_urgent_t *u = (h2_urgent_t *)ctx;
+    u->result = result;
+    if (u->resp) *u->resp = *resp;
+    xTaskNotifyGive(u->waiter);   /* u lives on the waiter's stack: last touch */
+}
+
+/**
+ * Report one item, either the batch's own (@p urgent NULL) or an inbox
+ * entry.  Returns true for the former, so callers can count them.
+ */
+static bool report_item(h2_result_cb_t on_result, void *ctx, h2_urgent_t *urgent,
+                        size_t index, esp_err_t result, const h2_response_t *resp)
+{
+    if (!urgent) {
+        report(on_result, ctx, index, result, resp);
+        return true;
+    }
+    s_urgent_held--;
+    report(urgent_done_cb, urgent, 0, result, resp);
+    return false;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Interactive inbox                                                  */
+/* ------------------------------------------------------------------ */
+
+/**
+ * Post @p u to a running bulk batch for the same host and batch key.  The
+ * provider hooks run before the spinlock; inside it only stored values
+ * are compared.
+ */
+static bool inbox_post(h2_urgent_t *u)
+{
+    const h2_host_t *host = u->provider->host(u->cfg);
+    const char      *key  = u->provider->batch_key(u->cfg);
+    bool posted = false;
+    portENTER_CRITICAL(&s_inbox_lock);
+    if (s_bulk_active && s_inbox_count < H2_INBOX_SLOTS && s_bulk_provider == u->provider &&
+        s_bulk_host == host && s_bulk_keyed && strcmp(s_bulk_key, key) == 0) {
+        s_inbox[s_inbox_count++] = u;
+        posted = true;
+    }
+    portEXIT_CRITICAL(&s_inbox_lock);
+    return posted;
+}
+
+static h2_urgent_t *inbox_take(void)
+{
+    h2_urgent_t *u = NULL;
+    portENTER_CRITICAL(&s_inbox_lock);
+    if (s_inbox_count) {
+        u = s_inbox[0];
+        memmove(&s_inbox[0], &s_inbox[1], --s_inbox_count * sizeof(s_inbox[0]));
+    }
+    portEXIT_CRITICAL(&s_inbox_lock);
+    if (u) {
+        s_urgent_held++;
+        METRIC_INC(interactive_joins);
+    }
+    return u;
+}
+
+static bool inbox_pending(void)
+{
+    portENTER_CRITICAL(&s_inbox_lock);
+    bool pending = s_inbox_count > 0;
+    portEXIT_CRITICAL(&s_inbox_lock);
+    return pending;
+}
+
+/** Start taking entries for the bulk batch now holding the engine. */
+static void inbox_open(const void *cfg)
+{
+    /* Posters read the key only while the inbox is open, so it is written
+     * outside the lock; a key too long to hold takes no entries */
+    const h2_host_t *host = s_provider->host(cfg);
+    const char      *key  = s_provider->batch_key(cfg);
+    size_t len = strlen(key);
+    bool keyed = len < sizeof(s_bulk_key);
+    if (keyed) memcpy(s_bulk_key, key, len + 1);
+
+    portENTER_CRITICAL(&s_inbox_lock);
+    s_bulk_active   = true;
+    s_bulk_provider = s_provider;
+    s_bulk_host     = host;
+    s_bulk_keyed    = keyed;
+    portEXIT_CRITICAL(&s_inbox_lock);
+    waiters_wake();   /* interactive senders for this host can post now */
+}
+
+/** Close the inbox unless an entry is still waiting; true once closed. */
+static bool inbox_close(void)
+{
+    portENTER_CRITICAL(&s_inbox_lock);
+    bool empty = s_inbox_count == 0;
+    if (empty) s_bulk_active = false;
+    portEXIT_CRITICAL(&s_inbox_lock);
+    return empty;
+}
+
+/** Stream slots a bulk batch may fill, keeping the interactive reserve free. */
+static size_t bulk_cap(size_t window)
+{
+    return window > CONFIG_APNS_INTERACTIVE_RESERVE ? window - CONFIG_APNS_INTERACTIVE_RESERVE : 1;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Public API                                                         */
+/* ------------------------------------------------------------------ */
+
+#if CONFIG_APNS_PREWARM
+static TaskHandle_t      s_warm_task = NULL;
+static volatile uint32_t s_warm_hosts;   /* bit i: s_hosts[i] asked for a warm-up */
+static void prewarm_task(void *arg);
+#endif
+
+esp_err_t h2_engine_init(void)
+{
+    if (s_engine_mutex) return ESP_OK;
+
+    s_waiters_lock = xSemaphoreCreateMutex();
+    s_bulk_gate    = xSemaphoreCreateBinary();
+    if (!s_waiters_lock || !s_bulk_gate) return ESP_ERR_NO_MEM;
+    s_engine_mutex = xSemaphoreCreateMutex();
+    if (!s_engine_mutex) return ESP_ERR_NO_MEM;
+
+    if (h2_pool_init() != ESP_OK) {
+        ESP_LOGE(TAG, "nghttp2 slab pool allocation failed");
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < H2_MAX_STREAMS; i++) s_streams[i].buf = &s_stream_bufs[i];
+
+#if CONFIG_APNS_PREWARM
+    /* Created once while the heap is still whole, then woken by
+     * h2_engine_prewarm(), rather than a fresh 10 KB stack per WiFi
+     * reconnect.  Same priority as the push workers: a send arriving
+     * meanwhile just waits on s_engine_mutex and then reuses the
+     * connection. */
+    if (xTaskCreate(prewarm_task, "h2_warm", 10240, NULL, 5, &s_warm_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    return ESP_OK;
+}
+
+h2_host_t *h2_engine_host(const h2_provider_t *provider, const char *host,
+                          const char *label, bool verify)
+{
+    if (s_host_count >= H2_HOSTS_MAX) return NULL;
+
+    h2_host_t *c = &s_hosts[s_host_count];
+    *c = (h2_host_t){
+        .provider = provider,
+        .host     = host,
+        .index    = (uint8_t)s_host_count,
+        .verify   = verify,
+        .pace     = { .window = CONFIG_APNS_WINDOW_INITIAL },
+    };
+    portENTER_CRITICAL(&s_metrics_lock);
+    s_metrics.hosts[s_host_count].label = label;
+    portEXIT_CRITICAL(&s_metrics_lock);
+    pace_publish(c);
+    s_host_count++;
+    return c;
+}
+
+#if CONFIG_APNS_PREWARM
+static void prewarm_once(uint32_t hosts)
+{
+    int64_t t0 = esp_timer_get_time();
+
+    for (size_t i = 0; i < s_host_count; i++) {
+        if ((hosts & (1u << i)) && s_hosts[i].provider->warm) s_hosts[i].provider->warm();
+    }
+
+    /* After a WiFi drop the old sockets look idle but are dead (and may be
+     * bound to a stale address): start the asking providers' hosts over,
+     * then open the ones asked for. */
+    xSemaphoreTake(s_engine_mutex, portMAX_DELAY);
+    for (size_t i = 0; i < s_host_count; i++) {
+        for (size_t k = 0; k < s_host_count; k++) {
+            if ((hosts & (1u << k)) && s_hosts[k].provider == s_hosts[i].provider) {
+                conn_close(&s_hosts[i]);
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < s_host_count; i++) {
+        if (!(hosts & (1u << i))) continue;
+        h2_host_t *c = conn_acquire(&s_hosts[i]);
+        if (c) {
+            METRIC_INC(prewarms);
+            ESP_LOGI(TAG, "%s warm in %lld ms", c->host,
+                     (long long)((esp_timer_get_time() - t0) / 1000));
+        } else {
+            ESP_LOGW(TAG, "Pre-warm connect to %s failed; the first send will retry",
+                     s_hosts[i].host);
+        }
+    }
+    engine_give();
+}
+
+static void prewarm_task(void *arg)
+{
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        portENTER_CRITICAL(&s_inbox_lock);
+        uint32_t hosts = s_warm_hosts;
+        s_warm_hosts = 0;
+        portEXIT_CRITICAL(&s_inbox_lock);
+        if (hosts) prewarm_once(hosts);
+    }
+}
+#endif
+
+esp_err_t h2_engine_prewarm(h2_host_t *host)
+{
+#if CONFIG_APNS_PREWARM
+    if (!s_warm_task || !host) return ESP_ERR_INVALID_STATE;
+    /* Requests made while a warm-up runs coalesce into one more run */
+    portENTER_CRITICAL(&s_inbox_lock);
+    s_warm_hosts |= 1u << host->index;
+    portEXIT_CRITICAL(&s_inbox_lock);
+    xTaskNotifyGive(s_warm_task);
+#endif
+    return ESP_OK;
+}
+
+static const void *item_at(const void *items, size_t index)
+{
+    return (const char *)items + index * s_provider->item_size;
+}
+
+/** The send loop proper; the caller holds s_engine_mutex and set s_provider. */
+static esp_err_t send_locked(const void *cfg, const void *items, size_t count,
+                             h2_priority_t priority,
+                             h2_result_cb_t on_result, void *ctx)
+{
+    const h2_provider_t *p = s_provider;
+    esp_err_t ret = ESP_OK;
+    size_t next = 0, finished = 0;
+    size_t budget = CONFIG_APNS_RETRY_BUDGET;
+    bool bulk = priority == H2_PRIORITY_BULK;
+    bool auth_renewed = false;
+    int64_t auth_since_us = 0;    /* nonzero: waiting for a renewed credential */
+    h2_host_t *host = p->host(cfg);
+    h2_host_t *conn = NULL;
+    s_retry_count = 0;
+    s_urgent_held = 0;
+    if (bulk) inbox_open(cfg);
+
+    /* ---- 1. Credential (kept fresh in the background) ---- */
+    ret = p->auth(false, s_auth_hdr, sizeof(s_auth_hdr));
+    if (ret != ESP_OK) goto fail_rest;
+
+    /* ---- 2. Multiplexed send loop ---- */
+    while (finished < count || s_urgent_held > 0 || (bulk && !inbox_close())) {
+        if (auth_since_us) {
+            if (p->auth(false, s_auth_hdr, sizeof(s_auth_hdr)) == ESP_OK) {
+                auth_since_us = 0;
+            } else if (esp_timer_get_time() - auth_since_us > H2_AUTH_WAIT_US) {
+                /* Give up once the streams still out have been answered or timed out */
+                bool busy = false;
+                for (int i = 0; i < H2_MAX_STREAMS; i++) busy |= s_streams[i].in_use;
+                if (!busy) {
+                    ESP_LOGE(TAG, "%s: no new credential after it was rejected", p->name);
+                    ret = ESP_ERR_TIMEOUT;
+                    goto fail_rest;
+                }
+            }
+        }
+        if (!conn || !conn->open) {
+            conn = conn_acquire(host);
+            if (!conn) {
+                ret = ESP_FAIL;
+                goto fail_rest;
+            }
+        }
+
+        /* Refill free slots up to the peer's concurrency limit.  Inbox
+         * entries go first, then due retries, then new items; a bulk
+         * batch's own items stay within bulk_cap(). */
+        size_t window = conn_window(conn);
+        size_t cap    = bulk ? bulk_cap(window) : window;
+
+        size_t inflight = 0, own_inflight = 0;
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            if (!s_streams[i].in_use) continue;
+            inflight++;
+            if (!s_streams[i].urgent) own_inflight++;
+        }
+        int64_t now_us = esp_timer_get_time();
+        for (int i = 0; i < H2_MAX_STREAMS && inflight < window && !auth_since_us; i++) {
+            h2_stream_t *st = &s_streams[i];
+            if (st->in_use) continue;
+            if (pace_delay(conn, now_us) > 0) break;
+
+            bool own_ok = own_inflight < cap;
+            h2_urgent_t *u = bulk ? inbox_take() : NULL;
+            h2_retry_t r = { 0 };
+            if (u) {
+                st->urgent   = u;
+                st->index    = 0;
+                st->attempts = 0;
+            } else if (retry_take_due(now_us, own_ok, &r)) {
+                st->urgent   = r.urgent;
+                st->index    = r.index;
+                st->attempts = r.attempts;
+            } else if (next < count && own_ok) {
+                st->index    = next++;
+                st->attempts = 0;
+            } else {
+                break;
+            }
+            st->in_use = true;
+            if (!st->urgent) own_inflight++;
+
+            const void *item = st->urgent ? st->urgent->item : item_at(items, st->index);
+            esp_err_t er = p->request(cfg, item, st->buf->payload, &st->body, &st->body_len,
+                                      st->path, sizeof(st->path));
+            if (er != ESP_OK) {
+                ESP_LOGE(TAG, "%s: request body exceeds %d bytes", p->name, H2_BODY_MAX);
+                finished += report_item(on_result, ctx, st->urgent, st->index, er, &s_no_response);
+                if (!st->urgent) own_inflight--;
+                stream_release(st);
+                continue;
+            }
+            TRACE_LOGI(TAG, "Payload (%d bytes): %.*s", (int)st->body_len, (int)st->body_len,
+                       st->body);
+
+            if (stream_submit(conn, st, cfg) != ESP_OK) {
+                finished += report_item(on_result, ctx, st->urgent, st->index, ESP_FAIL, &s_no_response);
+                if (!st->urgent) own_inflight--;
+                stream_release(st);
+                continue;
+            }
+            pace_consume(conn);
+            inflight++;
+        }
+
+        /* ---- 3. Drive I/O ---- */
+        if (conn_io(conn) != 0) {
+            /* Dead connection: streams that got no answer yet go back through
+             * the retry queue, everything else fails. */
+            conn_close(conn);
+            for (int i = 0; i < H2_MAX_STREAMS; i++) {
+                h2_stream_t *st = &s_streams[i];
+                if (!st->in_use || !st->submitted || st->done) continue;
+                if (st->response.status != 0 || !retry_schedule(st, &budget)) {
+                    finished += report_item(on_result, ctx, st->urgent, st->index,
+                                            ESP_FAIL, &st->response);
+                }
+                stream_release(st);
+            }
+        } else {
+            conn->last_used_us = esp_timer_get_time();
+        }
+
+        /* ---- 4. Collect completed and timed-out streams ---- */
+        now_us = esp_timer_get_time();
+        int64_t wake_us = now_us + H2_STREAM_TIMEOUT_US;
+        inflight = own_inflight = 0;
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            h2_stream_t *st = &s_streams[i];
+            if (!st->in_use || !st->submitted) continue;
+            esp_err_t result;
+            bool retry = false;
+            if (st->done) {
+                bool auth_expired;
+                result = stream_result(st, &retry, &auth_expired);
+                pace_on_response(conn, st, now_us);
+                if (auth_expired && !auth_renewed) {
+                    /* Renew once per batch; later submits use the new credential,
+                     * and hold until there is one if it is not ready yet */
+                    auth_renewed = true;
+                    METRIC_INC(auth_retries);
+                    if (p->auth(true, s_auth_hdr, sizeof(s_auth_hdr)) != ESP_OK) {
+                        auth_since_us = now_us;
+                    }
+                }
+            } else if (now_us > st->deadline_us) {
+                ESP_LOGE(TAG, "%s: timed out waiting for response (stream %d)",
+                         p->name, (int)st->stream_id);
+                trace_rec(TRACE_STREAM_TIMEOUT, stream_job(st), conn->index, st->stream_id);
+                if (conn->open) {
+                    nghttp2_session_set_stream_user_data(conn->sess, st->stream_id, NULL);
+                    nghttp2_submit_rst_stream(conn->sess, NGHTTP2_FLAG_NONE,
+                                              st->stream_id, NGHTTP2_CANCEL);
+                }
+                result = ESP_ERR_TIMEOUT;
+                retry  = true;
+                pace_shrink(conn, now_us, "response timeout");
+            } else {
+                if (st->deadline_us < wake_us) wake_us = st->deadline_us;
+                inflight++;
+                if (!st->urgent) own_inflight++;
+                continue;
+            }
+            if (!retry || !retry_schedule(st, &budget)) {
+                finished += report_item(on_result, ctx, st->urgent, st->index,
+                                        result, &st->response);
+            }
+            stream_release(st);
+        }
+
+        /* ---- 5. Sleep until the socket has data, the nearest stream deadline,
+         *         the next retry or the next bucket token is due, unless there
+         *         is room to submit more right away.  A bulk batch also
+         *         looks at the inbox every H2_INBOX_POLL_US ---- */
+        window = conn_window(conn);
+        bool own_ok = own_inflight < (bulk ? bulk_cap(window) : window);
+        bool retry_due = false;
+        for (size_t i = 0; i < s_retry_count; i++) {
+            if (s_retry[i].due_us <= now_us) retry_due |= own_ok || s_retry[i].urgent;
+            else if (s_retry[i].due_us < wake_us) wake_us = s_retry[i].due_us;
+        }
+        bool can_submit = ((next < count && own_ok) || retry_due || (bulk && inbox_pending())) &&
+                          inflight < window && !auth_since_us;
+        int64_t pace_us = can_submit ? pace_delay(conn, now_us) : 0;
+        if (pace_us > 0) {
+            METRIC_INC(rate_waits);
+            if (now_us + pace_us < wake_us) wake_us = now_us + pace_us;
+            can_submit = false;
+        }
+        if (bulk && wake_us > now_us + H2_INBOX_POLL_US) wake_us = now_us + H2_INBOX_POLL_US;
+        if (auth_since_us && wake_us > now_us + H2_AUTH_POLL_US) wake_us = now_us + H2_AUTH_POLL_US;
+        if ((finished < count || s_urgent_held > 0 || auth_since_us) && !can_submit) {
+            if (conn->open) {
+                conn_wait(conn, wake_us);
+            } else if (wake_us > now_us) {
+                /* Nothing in flight: only backoff timers remain */
+                vTaskDelay(pdMS_TO_TICKS((wake_us - now_us + 999) / 1000));
+            }
+        }
+    }
+
+    return ESP_OK;
+
+fail_rest:
+    /* No credential or no connection: every unfinished item fails with the
+     * same error, and so does everything still waiting in the inbox */
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (s_streams[i].in_use) {
+            report_item(on_result, ctx, s_streams[i].urgent, s_streams[i].index,
+                        ret, &s_no_response);
+            stream_release(&s_streams[i]);
+        }
+    }
+    for (size_t i = 0; i < s_retry_count; i++) {
+        report_item(on_result, ctx, s_retry[i].urgent, s_retry[i].index, ret, &s_no_response);
+    }
+    s_retry_count = 0;
+    while (next < count) {
+        report(on_result, ctx, next++, ret, &s_no_response);
+    }
+    while (bulk && !inbox_close()) {
+        report_item(on_result, ctx, inbox_take(), 0, ret, &s_no_response);
+    }
+    return ret;
+}
+
+static void interactive_waiting(int delta)
+{
+    portENTER_CRITICAL(&s_inbox_lock);
+    s_interactive_waiting += delta;
+    bool last = s_interactive_waiting == 0;
+    portEXIT_CRITICAL(&s_inbox_lock);
+    if (last) xSemaphoreGive(s_bulk_gate);
+}
+
+/**
+ * Take the engine.  Bulk callers let waiting interactive ones go first, for
+ * up to H2_BULK_YIELD_MAX_MS; a stale gate only costs one more look.
+ */
+static void engine_take(h2_priority_t priority)
+{
+    if (priority == H2_PRIORITY_BULK) {
+        const TickType_t max   = pdMS_TO_TICKS(H2_BULK_YIELD_MAX_MS);
+        const TickType_t start = xTaskGetTickCount();
+        while (s_interactive_waiting) {
+            TickType_t waited = xTaskGetTickCount() - start;
+            if (waited >= max) break;
+            xSemaphoreTake(s_bulk_gate, max - waited);
+        }
+        xSemaphoreTake(s_engine_mutex, portMAX_DELAY);
+        return;
+    }
+    interactive_waiting(1);
+    xSemaphoreTake(s_engine_mutex, portMAX_DELAY);
+    interactive_waiting(-1);
+}
+
+esp_err_t h2_engine_send(const h2_provider_t *provider, const void *cfg,
+                         const void *items, size_t count, h2_priority_t priority,
+                         h2_result_cb_t on_result, void *ctx)
+{
+    if (!provider || !cfg || !items || !on_result) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!s_engine_mutex) return ESP_ERR_INVALID_STATE;
+    if (count == 0) return ESP_OK;
+
+    engine_take(priority);
+    s_provider = provider;
+    esp_err_t ret = send_locked(cfg, items, count, priority, on_result, ctx);
+    engine_give();
+    return ret;
+}
+
+static void single_result_cb(size_t index, esp_err_t result,
+                             const h2_response_t *resp, void *ctx)
+{
+    h2_urgent_t *u = (h2_urgent_t *)ctx;
+    u->result = result;
+    if (u->resp) *u->resp = *resp;
+}
+
+esp_err_t h2_engine_send_one(const h2_provider_t *provider, const void *cfg,
+                             const void *item, h2_response_t *resp)
+{
+    if (!provider || !cfg || !item) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!s_engine_mutex) return ESP_ERR_INVALID_STATE;
+
+    /* Ride along in a running bulk batch if there is one for this host;
+     * otherwise wait for the engine, looking again whenever it is released
+     * or a bulk batch opens its inbox */
+    h2_urgent_t u = {
+        .provider = provider,
+        .cfg      = cfg,
+        .item     = item,
+        .waiter   = xTaskGetCurrentTaskHandle(),
+        .result   = ESP_FAIL,
+        .resp     = resp,
+        .job      = trace_job(),
+    };
+    h2_waiter_t w;
+    waiter_add(&w);
+    interactive_waiting(1);
+    bool joined;
+    for (;;) {
+        if ((joined = inbox_post(&u))) break;
+        if (xSemaphoreTake(s_engine_mutex, 0) == pdTRUE) break;
+        xSemaphoreTake(w.wake, portMAX_DELAY);
+    }
+    waiter_remove(&w);
+    interactive_waiting(-1);
+
+    if (joined) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        return u.result;
+    }
+    s_provider = provider;
+    send_locked(cfg, item, 1, H2_PRIORITY_INTERACTIVE, single_result_cb, &u);
+    engine_give();
+    return u.result;
+}
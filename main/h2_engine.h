@@ -0,0 +1,313 @@
+/*
+ * h2_engine.h — provider-agnostic HTTP/2 push engine
+ *
+ * Everything about delivering pushes that does not depend on who is on the
+ * other end: one persistent nghttp2 connection per registered host on top
+ * of esp-tls (idle / GOAWAY handling, TLS session resumption, background
+ * pre-warm), a batch multiplexed as concurrent streams over it, per-host
+ * AIMD window and token-bucket pacing, the delayed-retry queue, the
+ * interactive inbox, and the send metrics.
+ *
+ * A provider (apns.c, fcm.c) only describes what differs per service: the
+ * host for a config, the path, headers and body of one request, the bearer
+ * credential and how to refresh it, and how to read a response.  All
+ * providers send through one engine mutex, so they share one set of stream
+ * slots and buffers, one nghttp2 slab pool and one pre-warm task rather
+ * than each paying for its own.
+ *
+ * Tunables keep their APNS_ names from when APNs was the only provider
+ * (menuconfig → "APNs Configuration" → "Rate Limiting", "Send Retries",
+ * "Memory"); they apply to every host.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Largest request body a stream slot holds. */
+#define H2_BODY_MAX   1024
+
+/** Length of a canonical UUID string plus NUL; message ids are cut to it. */
+#define H2_ID_LEN     37
+
+/** Longest authorization header value, "bearer " included. */
+#define H2_AUTH_MAX   1040
+
+/** Hosts the engine keeps a connection to: APNs sandbox + production, FCM. */
+#define H2_HOSTS_MAX  4
+
+/* ------------------------------------------------------------------ */
+/*  Results                                                            */
+/* ------------------------------------------------------------------ */
+
+/** What the peer answered for one item, passed to h2_result_cb_t. */
+typedef struct {
+    int  status;                  /*!< HTTP :status, 0 if no response arrived */
+    int  reason;                  /*!< provider's error reason, 0 on 200 or no response */
+    char id[H2_ID_LEN];           /*!< message id (apns-id, FCM message name), "" if absent */
+    char unique_id[H2_ID_LEN];    /*!< apns-unique-id (APNs sandbox only), "" if absent */
+    uint32_t rtt_us;              /*!< last attempt's request submitted → stream closed, 0 if none */
+} h2_response_t;
+
+/**
+ * Traffic class of a batch.  Bulk batches (blasts) leave
+ * CONFIG_APNS_INTERACTIVE_RESERVE stream slots free and carry interactive
+ * sends for the same host in them while they run, so a single push waits
+ * about one response time, however large the blast.
+ */
+typedef enum {
+    H2_PRIORITY_INTERACTIVE,
+    H2_PRIORITY_BULK,
+} h2_priority_t;
+
+/**
+ * @brief Per-item completion callback for h2_engine_send()
+ *
+ * @param index   Index of the item in the array passed to h2_engine_send()
+ * @param result  ESP_OK, the provider's error for the response,
+ *                ESP_ERR_TIMEOUT, or ESP_FAIL if no response arrived
+ * @param resp    Status, reason and ids of the final attempt (never NULL).
+ *                Valid only during the call.
+ * @param ctx     Caller context passed to h2_engine_send()
+ */
+typedef void (*h2_result_cb_t)(size_t index, esp_err_t result,
+                               const h2_response_t *resp, void *ctx);
+
+/* ------------------------------------------------------------------ */
+/*  Providers                                                          */
+/* ------------------------------------------------------------------ */
+
+typedef struct h2_host h2_host_t;
+
+typedef struct {
+    const char *name;
+    const char *value;
+} h2_header_t;
+
+/** Extra request headers a provider may add. */
+#define H2_EXTRA_HEADERS_MAX  4
+
+/**
+ * A push service.  The engine calls these with the engine mutex held, on
+ * the sending task; @p cfg is the provider's own config type and an item
+ * is one element of its notification array.
+ */
+typedef struct {
+    const char *name;                /*!< log prefix: "APNs", "FCM" */
+    size_t      item_size;           /*!< stride of the items array */
+    esp_err_t   err_unregistered;    /*!< result counted as "unregistered" */
+
+    /** Connection @p cfg sends on. */
+    h2_host_t *(*host)(const void *cfg);
+
+    /**
+     * Batch key of @p cfg (APNs topic, FCM project).  An interactive send
+     * may ride a bulk batch for the same host with an equal key.
+     */
+    const char *(*batch_key)(const void *cfg);
+
+    /**
+     * Write the authorization header value into @p out.  With @p refresh,
+     * the peer rejected the last one: start getting a new credential.
+     * Called with the engine held, so it must not block on the network;
+     * an error while the new one is not ready makes the batch hold its
+     * submits and ask again (without @p refresh).
+     */
+    esp_err_t (*auth)(bool refresh, char *out, size_t len);
+
+    /**
+     * Set the request body of @p item: point *@p body at bytes the caller
+     * owns, or encode into @p buf (H2_BODY_MAX).  Also writes :path.
+     */
+    esp_err_t (*request)(const void *cfg, const void *item, char *buf,
+                         const char **body, size_t *body_len, char *path, size_t path_len);
+
+    /** Headers after :method, :scheme, :path, host, authorization, content-type. */
+    size_t (*headers)(const void *cfg, h2_header_t *out, size_t max);
+
+    /** A response header other than :status and retry-after; may be NULL. */
+    void (*header)(h2_response_t *r, const uint8_t *name, size_t namelen,
+                   const uint8_t *value, size_t valuelen);
+
+    /**
+     * Map an answered stream (@p r->status set, @p body its first bytes,
+     * NUL-terminated) to the send result and fill in @p r->reason and id.
+     * *@p retry = transient, worth another attempt; *@p auth_expired = the
+     * credential itself was rejected.
+     */
+    esp_err_t (*result)(h2_response_t *r, const char *body, size_t len,
+                        bool *retry, bool *auth_expired);
+
+    /** Pre-warm hook, run before connecting: get a credential ready.  May be NULL. */
+    void (*warm)(void);
+} h2_provider_t;
+
+/**
+ * @brief Create the engine mutex, stream slots, slab pool and pre-warm task.
+ *        Called by each provider's init; later calls do nothing.
+ */
+esp_err_t h2_engine_init(void);
+
+/**
+ * @brief Register a connection to @p host for @p provider.
+ *
+ * @p label names it in the metrics ("production", "sandbox", "fcm").
+ * With @p verify false the peer certificate is not checked (mock server).
+ *
+ * @return The host, or NULL once H2_HOSTS_MAX are registered
+ */
+h2_host_t *h2_engine_host(const h2_provider_t *provider, const char *host,
+                          const char *label, bool verify);
+
+/**
+ * @brief Send @p count items multiplexed over one HTTP/2 connection
+ *
+ * Keeps up to min(peer SETTINGS_MAX_CONCURRENT_STREAMS, the host's AIMD
+ * window, CONFIG_APNS_WINDOW_MAX) requests in flight at once, paced by the
+ * optional CONFIG_APNS_RATE_LIMIT token bucket, and reports each item
+ * through @p on_result as its stream completes — so callbacks arrive in
+ * completion order, not array order.  Every item gets exactly one
+ * callback.  Runs on the calling task and blocks until all items are done.
+ *
+ * Transient failures (as the provider classifies them, plus reset or
+ * refused streams, timeouts and a dropped connection) are resent with
+ * jittered exponential backoff before the callback fires, up to
+ * CONFIG_APNS_RETRY_MAX_ATTEMPTS per item and CONFIG_APNS_RETRY_BUDGET per
+ * call.  A rejected credential is refreshed once per call and retried.
+ *
+ * With H2_PRIORITY_BULK the call also serves h2_engine_send_one() calls
+ * made meanwhile for the same host (and provider batch key): they get free
+ * slots ahead of the batch's own items, and the call returns once they are
+ * done too.  A bulk call waits for interactive callers queued on the
+ * engine to go first.
+ *
+ * @return
+ *   - ESP_OK when every item was attempted (see per-item results)
+ *   - ESP_FAIL / credential error if no connection or credential could be
+ *     had; remaining items are reported with that error
+ *   - ESP_ERR_INVALID_ARG on NULL arguments
+ */
+esp_err_t h2_engine_send(const h2_provider_t *provider, const void *cfg,
+                         const void *items, size_t count, h2_priority_t priority,
+                         h2_result_cb_t on_result, void *ctx);
+
+/**
+ * @brief Send one item interactively
+ *
+ * Rides along in a running bulk batch for the same host if there is one;
+ * otherwise waits for the engine, woken to look again whenever it is
+ * released or a bulk batch opens its inbox.  Bulk callers defer to waiting
+ * interactive ones for up to 200 ms.
+ *
+ * @return As the per-item result of h2_engine_send()
+ */
+esp_err_t h2_engine_send_one(const h2_provider_t *provider, const void *cfg,
+                             const void *item, h2_response_t *resp);
+
+/**
+ * @brief Reconnect @p host in the background
+ *
+ * Wakes the "h2_warm" task, which runs the provider's warm hook, closes the
+ * provider's open connections (after a WiFi drop they only look alive;
+ * TLS sessions are kept for resumption) and opens @p host.  Requests made
+ * while a warm-up runs coalesce into one more run.  Safe to call from an
+ * event handler.  Does nothing with CONFIG_APNS_PREWARM disabled.
+ *
+ * @return ESP_OK, or ESP_ERR_INVALID_STATE before h2_engine_init()
+ */
+esp_err_t h2_engine_prewarm(h2_host_t *host);
+
+/* ------------------------------------------------------------------ */
+/*  Metrics                                                            */
+/* ------------------------------------------------------------------ */
+
+/**
+ * Fixed-bucket latency histogram.  buckets[i] counts samples
+ * <= h2_hist_bounds_us[i] (and above the previous bound); the last
+ * bucket counts everything above the largest bound.
+ */
+#define H2_HIST_BUCKETS  14
+extern const uint32_t h2_hist_bounds_us[H2_HIST_BUCKETS - 1];
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t buckets[H2_HIST_BUCKETS];
+} h2_hist_t;
+
+/** Add one sample to @p h.  The caller serialises access to it. */
+void h2_hist_add(h2_hist_t *h, int64_t us);
+
+/** HTTP :status values counted individually; anything else lands in "other". */
+#define H2_STATUS_SLOTS  12
+extern const uint16_t h2_status_codes[H2_STATUS_SLOTS - 1];
+
+/** Block sizes of the nghttp2 slab pool (CONFIG_APNS_H2_POOL_BLOCKS each). */
+#define H2_POOL_CLASSES  5
+extern const uint16_t h2_pool_sizes[H2_POOL_CLASSES];
+
+typedef struct {
+    /* Latency */
+    h2_hist_t connect;             /*!< DNS + TCP + TLS + ALPN (one esp-tls call) */
+    h2_hist_t rtt;                 /*!< request submitted → stream closed */
+    h2_hist_t queue_wait;          /*!< push_queue_submit() → worker pick-up */
+
+    /* Per-item outcomes, all providers */
+    uint32_t sent;                 /*!< items handed to the send path */
+    uint32_t ok;
+    uint32_t unregistered;
+    uint32_t timeouts;
+    uint32_t failed;               /*!< any other failure */
+    uint32_t stream_resets;        /*!< closed with a non-zero HTTP/2 error code */
+    uint32_t retries;              /*!< resends scheduled after a transient failure */
+    uint32_t retries_exhausted;    /*!< transient failures reported because no retry was left */
+    uint32_t auth_retries;         /*!< credentials refreshed after the peer rejected them */
+    uint32_t status[H2_STATUS_SLOTS];   /*!< index matches h2_status_codes, last = other */
+
+    /* Connections */
+    uint32_t connects;
+    uint32_t reconnects;           /*!< connects to a host that had been connected before */
+    uint32_t connect_failures;
+    uint32_t goaways;
+    uint32_t session_offers;       /*!< connects that offered a cached TLS session */
+    uint32_t prewarms;             /*!< background warm-ups that left a connection open */
+
+    /* Boot */
+    int64_t  first_ok_us;          /*!< boot → first 200 from any provider, 0 until then */
+
+    /* Pacing, per registered host */
+    struct {
+        const char *label;         /*!< NULL = unused */
+        uint32_t    window;        /*!< current AIMD concurrency window */
+    } hosts[H2_HOSTS_MAX];
+    uint32_t window_shrinks;       /*!< halvings on 429, timeout or RTT spike */
+    uint32_t rate_waits;           /*!< sends held back by the token bucket */
+    uint32_t interactive_joins;    /*!< single sends carried by a running bulk batch */
+
+    /* nghttp2 slab pool, index matches h2_pool_sizes */
+    uint16_t pool_free[H2_POOL_CLASSES];
+    uint16_t pool_min_free[H2_POOL_CLASSES];
+    uint32_t pool_fallbacks;       /*!< nghttp2 allocations the heap had to serve */
+} h2_metrics_t;
+
+/**
+ * @brief Copy a consistent snapshot of the engine metrics.
+ *
+ * Counters are updated under a spinlock held for a handful of
+ * instructions, so they are always on; reading them is a memcpy.
+ */
+void h2_engine_metrics_get(h2_metrics_t *out);
+
+/** Record how long a job waited in the push queue (called by push_queue.c). */
+void h2_engine_record_queue_wait(int64_t wait_us);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,333 @@
+/*
+ * host_bench.c — token store / payload microbenchmarks for the linux target
+ *
+ * Built instead of the firmware when IDF_TARGET is linux (see
+ * CMakeLists.txt), so regressions in the hot paths show up in a host run:
+ *
+ *   idf.py --preview set-target linux
+ *   idf.py build
+ *   ./build/scan.elf
+ *
+ * NVS runs on ESP-IDF's file-backed flash emulation with the real
+ * partitions.csv, so set / commit numbers include the NVS page logic but
+ * not real flash latency.  The token store is erased on every run.
+ *
+ * Each token store case grows the registry to 64, 1k and then 10k send-list
+ * entries.  At each size it times:
+ *   - batched set + commit
+ *   - single-shot set, changed and unchanged
+ *   - hit / miss lookup
+ *   - a full cursor walk
+ * The codec cases time payload encoding, base64url, DER → raw and a full
+ * ES256 JWT sign with a throwaway P-256 key, then scanning a /push request
+ * body, whole and one byte per feed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ecp.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "sdkconfig.h"
+
+#include "apns.h"
+#include "apns_codec.h"
+#include "json_scan.h"
+#include "token_store.h"
+
+static const char *TAG = "host_bench";
+
+#define LOOKUP_ROUNDS   200000
+#define SINGLE_SETS     64
+#define WALK_PAGE       32
+#define ENCODE_ROUNDS   200000
+#define SIGN_ROUNDS     50
+#define SCAN_ROUNDS     200000
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void report(const char *name, size_t tokens, size_t ops, int64_t us)
+{
+    char n[12] = "-";
+    if (tokens) snprintf(n, sizeof(n), "%zu", tokens);
+    double per = ops ? (double)us * 1000.0 / (double)ops : 0.0;
+    printf("%-22s %6s %9zu %12.1f %12.0f\n",
+           name, n, ops, per, us > 0 ? (double)ops * 1e6 / (double)us : 0.0);
+}
+
+/* Deterministic test data: entry i → 10.x.y.z, token bytes derived from i and a generation */
+static uint32_t bench_ip(size_t i)
+{
+    return 0x0A000000u | (uint32_t)(i & 0xFFFFFF);
+}
+
+static void bench_token(size_t i, uint8_t gen, uint8_t tok[TOKEN_BIN_LEN])
+{
+    uint32_t x = (uint32_t)i * 2654435761u ^ gen;
+    for (size_t k = 0; k < TOKEN_BIN_LEN; k++) {
+        x = x * 1103515245u + 12345u;
+        tok[k] = (uint8_t)(x >> 16);
+    }
+}
+
+/* xorshift — cheap enough not to show up in the lookup numbers */
+static uint32_t s_rng = 0x9E3779B9u;
+static uint32_t rnd(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Token store                                                        */
+/* ------------------------------------------------------------------ */
+
+static esp_err_t grow_to(size_t *have, size_t want)
+{
+    uint8_t tok[TOKEN_BIN_LEN];
+    token_batch_t b;
+
+    int64_t t0 = now_us();
+    token_store_batch_begin(&b);
+    for (size_t i = *have; i < want; i++) {
+        bench_token(i, 0, tok);
+        token_store_batch_send_set(&b, TOKEN_SERVER_SANDBOX, bench_ip(i), tok);
+    }
+    esp_err_t err = token_store_batch_end(&b);
+    if (err == ESP_OK) err = token_store_flush();   /* write-behind: count the flash writes too */
+    int64_t dt = now_us() - t0;
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "batch set to %zu entries failed: %s", want, esp_err_to_name(err));
+        return err;
+    }
+    report("batch set+commit", want, want - *have, dt);
+    *have = want;
+    return ESP_OK;
+}
+
+static void bench_store_at(size_t n)
+{
+    uint8_t tok[TOKEN_BIN_LEN];
+    static uint8_t gen = 1;
+
+    /* Single-shot set: one NVS commit per call, or with write-behind an
+     * index update plus an inline flush whenever the dirty table fills */
+    int64_t t0 = now_us();
+    for (size_t k = 0; k < SINGLE_SETS; k++) {
+        size_t i = rnd() % n;
+        bench_token(i, gen, tok);
+        token_store_send_set(TOKEN_SERVER_SANDBOX, bench_ip(i), tok);
+    }
+    report("set (changed)", n, SINGLE_SETS, now_us() - t0);
+    gen++;
+
+    token_wb_stats_t wb;
+    token_store_wb_stats(&wb);
+    t0 = now_us();
+    token_store_flush();
+    report("flush (dirty keys)", n, wb.dirty, now_us() - t0);
+
+    /* Unchanged set: index compare only, no flash write */
+    t0 = now_us();
+    for (size_t k = 0; k < LOOKUP_ROUNDS; k++) {
+        size_t i = rnd() % n;
+        if (token_store_send_get(TOKEN_SERVER_SANDBOX, bench_ip(i), tok) == ESP_OK) {
+            token_store_send_set(TOKEN_SERVER_SANDBOX, bench_ip(i), tok);
+        }
+    }
+    report("get+set (unchanged)", n, LOOKUP_ROUNDS, now_us() - t0);
+
+    t0 = now_us();
+    size_t found = 0;
+    for (size_t k = 0; k < LOOKUP_ROUNDS; k++) {
+        found += token_store_send_get(TOKEN_SERVER_SANDBOX, bench_ip(rnd() % n), tok) == ESP_OK;
+    }
+    report("lookup (hit)", n, LOOKUP_ROUNDS, now_us() - t0);
+    if (found != LOOKUP_ROUNDS) ESP_LOGW(TAG, "%zu lookups missed", LOOKUP_ROUNDS - found);
+
+    t0 = now_us();
+    for (size_t k = 0; k < LOOKUP_ROUNDS; k++) {
+        token_store_send_get(TOKEN_SERVER_SANDBOX, 0xC0A80000u | (rnd() & 0xFFFF), NULL);
+    }
+    report("lookup (miss)", n, LOOKUP_ROUNDS, now_us() - t0);
+
+    static token_entry_t page[WALK_PAGE];
+    size_t walked = 0;
+    int rounds = n >= 1000 ? 10 : 100;
+    t0 = now_us();
+    for (int r = 0; r < rounds; r++) {
+        token_cursor_t c;
+        size_t got;
+        token_store_cursor_open(&c, TOKEN_LIST_SEND, TOKEN_SERVER_ANY);
+        while ((got = token_store_cursor_next(&c, page, WALK_PAGE)) > 0) walked += got;
+        token_store_cursor_close(&c);
+    }
+    report("cursor walk / entry", n, walked, now_us() - t0);
+}
+
+static void bench_store(void)
+{
+    static const size_t sizes[] = { 64, 1024, 10000 };
+    size_t have = 0;
+
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        if (sizes[k] > CONFIG_TOKEN_STORE_CAPACITY) {
+            printf("(%zu tokens skipped: CONFIG_TOKEN_STORE_CAPACITY is %d)\n",
+                   sizes[k], CONFIG_TOKEN_STORE_CAPACITY);
+            continue;
+        }
+        if (grow_to(&have, sizes[k]) != ESP_OK) return;
+        bench_store_at(have);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Payload / JWT codecs                                               */
+/* ------------------------------------------------------------------ */
+
+static void bench_codec(void)
+{
+    static char buf[APNS_PAYLOAD_MAX];
+    apns_notification_t n = {
+        .device_token   = "",
+        .title          = "Front door",
+        .body           = "Motion detected at \"Front door\"\n2 people",
+        .badge          = 3,
+        .sound          = "default",
+        .custom_payload = "\"type\":\"alert\",\"id\":42",
+    };
+
+    size_t len = 0;
+    int64_t t0 = now_us();
+    for (int k = 0; k < ENCODE_ROUNDS; k++) {
+        apns_payload_encode(&n, buf, sizeof(buf), &len);
+    }
+    report("payload encode", 0, ENCODE_ROUNDS, now_us() - t0);
+
+    unsigned char raw[64];
+    char b64[128];
+    memset(raw, 0xA5, sizeof(raw));
+    t0 = now_us();
+    for (int k = 0; k < ENCODE_ROUNDS; k++) {
+        apns_base64url_encode(raw, sizeof(raw), b64, sizeof(b64));
+    }
+    report("base64url (64 B)", 0, ENCODE_ROUNDS, now_us() - t0);
+
+    /* DER with a leading-zero r, as mbedtls emits when r's top bit is set */
+    unsigned char der[72] = { 0x30, 0x45, 0x02, 0x21, 0x00 };
+    memset(der + 5, 0x81, 32);
+    der[37] = 0x02;
+    der[38] = 0x20;
+    memset(der + 39, 0x42, 32);
+    t0 = now_us();
+    for (int k = 0; k < ENCODE_ROUNDS; k++) {
+        apns_der_sig_to_raw(der, 71, raw);
+    }
+    report("DER -> raw sig", 0, ENCODE_ROUNDS, now_us() - t0);
+
+    mbedtls_pk_context       pk;
+    mbedtls_entropy_context  entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_pk_init(&pk);
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+
+    if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                              (const unsigned char *)"host_bench", 10) != 0 ||
+        mbedtls_pk_setup(&pk, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY)) != 0 ||
+        mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(pk),
+                            mbedtls_ctr_drbg_random, &drbg) != 0) {
+        ESP_LOGE(TAG, "P-256 key setup failed, skipping JWT sign");
+    } else {
+        static char jwt[512];
+        /* Quiet the per-sign "JWT generated" line while timing */
+        esp_log_level_set("apns", ESP_LOG_WARN);
+        t0 = now_us();
+        for (int k = 0; k < SIGN_ROUNDS; k++) {
+            apns_jwt_sign(&pk, &drbg, "ABCDE12345", "TEAM123456", 1700000000L + k,
+                          jwt, sizeof(jwt));
+        }
+        report("JWT sign (ES256)", 0, SIGN_ROUNDS, now_us() - t0);
+        esp_log_level_set("apns", ESP_LOG_INFO);
+    }
+
+    mbedtls_pk_free(&pk);
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Request parsing                                                    */
+/* ------------------------------------------------------------------ */
+
+static void bench_scan(void)
+{
+    static const char body[] =
+        "{\"device_token\":\"3b3c5f1e0a9d4c7b8e2f6a1d0c9b8a7f6e5d4c3b2a1908f7e6d5c4b3a2918070\","
+        "\"title\":\"Front door\",\"body\":\"Motion detected at \\\"Front door\\\"\\n2 people\","
+        "\"badge\":3,\"sound\":\"default\",\"server_type\":\"sandbox\","
+        "\"custom_payload\":\"\\\"type\\\":\\\"alert\\\",\\\"id\\\":42\"}";
+    static char token[128], title[128], text[256], sound[32], custom[256], server[16];
+    int badge = -1;
+    json_field_t f[] = {
+        JSON_SCAN_STR("device_token",   token),
+        JSON_SCAN_STR("title",          title),
+        JSON_SCAN_STR("body",           text),
+        JSON_SCAN_INT("badge",          &badge),
+        JSON_SCAN_STR("sound",          sound),
+        JSON_SCAN_STR("custom_payload", custom),
+        JSON_SCAN_STR("server_type",    server),
+    };
+    const size_t nf = sizeof(f) / sizeof(f[0]);
+
+    int64_t t0 = now_us();
+    for (int k = 0; k < SCAN_ROUNDS; k++) {
+        json_scan_buf(body, sizeof(body) - 1, f, nf);
+    }
+    report("scan /push body", 0, SCAN_ROUNDS, now_us() - t0);
+
+    /* Worst case for a chunked body: every byte arrives in its own feed */
+    t0 = now_us();
+    for (int k = 0; k < SCAN_ROUNDS / 10; k++) {
+        json_scan_t s;
+        json_scan_init(&s, f, nf);
+        for (size_t i = 0; i < sizeof(body) - 1; i++) json_scan_feed(&s, body + i, 1);
+        json_scan_finish(&s);
+    }
+    report("scan /push, 1 B feeds", 0, SCAN_ROUNDS / 10, now_us() - t0);
+    if (!f[0].found || badge != 3) ESP_LOGW(TAG, "scan produced wrong fields");
+}
+
+void app_main(void)
+{
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+
+    /* Start from an empty registry every run (NOT_FOUND: no tokens partition) */
+    ret = nvs_flash_erase_partition(TOKEN_PARTITION_LABEL);
+    if (ret != ESP_OK && ret != ESP_ERR_NOT_FOUND) ESP_ERROR_CHECK(ret);
+    ESP_ERROR_CHECK(token_store_init());
+
+    printf("\n%-22s %6s %9s %12s %12s\n", "case", "tokens", "ops", "ns/op", "ops/s");
+    bench_store();
+    bench_codec();
+    bench_scan();
+    printf("\n");
+}
@@ -0,0 +1,405 @@
+/*
+ * json_scan.c — zero-allocation JSON field extractor (see json_scan.h)
+ */
+#include "json_scan.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    S_VALUE,          /* a value is expected */
+    S_VALUE_OR_END,   /* just after '[': a value or ']' */
+    S_KEY_OR_END,     /* just after '{': a key or '}' */
+    S_KEY,            /* after ',' in an object: a key */
+    S_IN_KEY,
+    S_COLON,
+    S_IN_STR,
+    S_TOKEN,          /* number or true / false / null */
+    S_AFTER,          /* after a value: ',' or the closing bracket */
+    S_DONE,
+    S_ERROR,
+};
+
+static bool is_ws(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_token_char(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           c == '-' || c == '+' || c == '.';
+}
+
+static int hex_val(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void clear_fields(json_field_t *f, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        f[i].found     = false;
+        f[i].truncated = false;
+        if ((f[i].type == JSON_FIELD_STR || f[i].type == JSON_FIELD_STRS) && f[i].len) {
+            ((char *)f[i].out)[0] = '\0';
+        }
+    }
+}
+
+static bool top_is_array(const json_scan_t *s)
+{
+    return s->depth > 0 && (s->is_array & (1u << (s->depth - 1)));
+}
+
+/* ------------------------------------------------------------------ */
+/*  Strings                                                            */
+/* ------------------------------------------------------------------ */
+
+/** Append one decoded byte to the key, the current field, or nowhere. */
+static void emit(json_scan_t *s, uint8_t b)
+{
+    if (s->state == S_IN_KEY) {
+        if (s->pos < sizeof(s->key) - 1) s->key[s->pos++] = (char)b;
+        else                             s->key_long = true;
+        return;
+    }
+    json_field_t *f = s->cur;
+    if (!f) return;
+    if (s->pos + 1 < f->len) ((char *)f->out)[s->pos++] = (char)b;
+    else                     f->truncated = true;
+}
+
+static void emit_utf8(json_scan_t *s, uint32_t cp)
+{
+    if (cp < 0x80) {
+        emit(s, (uint8_t)cp);
+    } else if (cp < 0x800) {
+        emit(s, (uint8_t)(0xC0 | (cp >> 6)));
+        emit(s, (uint8_t)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        emit(s, (uint8_t)(0xE0 | (cp >> 12)));
+        emit(s, (uint8_t)(0x80 | ((cp >> 6) & 0x3F)));
+        emit(s, (uint8_t)(0x80 | (cp & 0x3F)));
+    } else {
+        emit(s, (uint8_t)(0xF0 | (cp >> 18)));
+        emit(s, (uint8_t)(0x80 | ((cp >> 12) & 0x3F)));
+        emit(s, (uint8_t)(0x80 | ((cp >> 6) & 0x3F)));
+        emit(s, (uint8_t)(0x80 | (cp & 0x3F)));
+    }
+}
+
+/** A \uXXXX escape completed; surrogate pairs combine into one code point. */
+static bool emit_escape_u(json_scan_t *s)
+{
+    uint32_t v = s->u_val;
+    if (s->u_high) {
+        if (v < 0xDC00 || v > 0xDFFF) return false;
+        emit_utf8(s, 0x10000 + ((s->u_high - 0xD800) << 10) + (v - 0xDC00));
+        s->u_high = 0;
+    } else if (v >= 0xD800 && v <= 0xDBFF) {
+        s->u_high = v;
+    } else if (v >= 0xDC00 && v <= 0xDFFF) {
+        return false;
+    } else {
+        emit_utf8(s, v);
+    }
+    return true;
+}
+
+/**
+ * One byte inside a key or string value.
+ * Returns false on a malformed escape; sets *closed at the closing quote.
+ */
+static bool string_char(json_scan_t *s, char c, bool *closed)
+{
+    *closed = false;
+    if (s->u_digits) {
+        int h = hex_val(c);
+        if (h < 0) return false;
+        s->u_val = (s->u_val << 4) | (uint32_t)h;
+        return --s->u_digits ? true : emit_escape_u(s);
+    }
+    if (s->esc) {
+        s->esc = false;
+        if (s->u_high && c != 'u') return false;
+        switch (c) {
+        case '"': case '\\': case '/': emit(s, (uint8_t)c); break;
+        case 'b': emit(s, '\b'); break;
+        case 'f': emit(s, '\f'); break;
+        case 'n': emit(s, '\n'); break;
+        case 'r': emit(s, '\r'); break;
+        case 't': emit(s, '\t'); break;
+        case 'u': s->u_digits = 4; s->u_val = 0; break;
+        default:  return false;
+        }
+        return true;
+    }
+    if (c == '\\') {
+        s->esc = true;
+        return true;
+    }
+    if (s->u_high) return false;    /* high surrogate not followed by \u low */
+    if (c == '"') {
+        *closed = true;
+        return true;
+    }
+    emit(s, (uint8_t)c);
+    return true;
+}
+
+static void string_begin(json_scan_t *s, int state)
+{
+    s->state    = state;
+    s->pos      = 0;
+    s->esc      = false;
+    s->u_digits = 0;
+    s->u_high   = 0;
+    s->key_long = false;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Structure                                                          */
+/* ------------------------------------------------------------------ */
+
+/** A value just ended at the current depth. */
+static void value_done(json_scan_t *s)
+{
+    json_field_t *f = s->cur;
+    s->cur = NULL;
+    if (s->strs && s->depth == s->strs_depth) {
+        if (f == s->strs && f->on_item) f->on_item(f, 1, f->ctx);
+    } else if (s->strs && s->depth < s->strs_depth) {
+        s->strs = NULL;
+    }
+    if (s->arr && s->depth == s->arr_depth) {
+        if (s->arr->on_item) s->arr->on_item(s->arr->sub, s->arr->nsub, s->arr->ctx);
+    } else if (s->arr && s->depth < s->arr_depth) {
+        s->arr = NULL;
+    }
+    s->state = s->depth == 0 ? S_DONE : S_AFTER;
+}
+
+static bool push(json_scan_t *s, bool array)
+{
+    if (s->depth >= JSON_SCAN_DEPTH_MAX) return false;
+    if (array) s->is_array |=  (1u << s->depth);
+    else       s->is_array &= ~(1u << s->depth);
+    s->depth++;
+    return true;
+}
+
+static bool close_container(json_scan_t *s, char c)
+{
+    if (s->depth == 0 || top_is_array(s) != (c == ']')) return false;
+    s->depth--;
+    if (s->tbl != s->root && s->depth < s->tbl_depth) {
+        s->tbl       = s->root;
+        s->ntbl      = s->nroot;
+        s->tbl_depth = 1;
+    }
+    value_done(s);
+    return true;
+}
+
+static void key_done(json_scan_t *s)
+{
+    s->key[s->pos] = '\0';
+    s->cur = NULL;
+    if (s->depth == s->tbl_depth && !s->key_long) {
+        for (size_t i = 0; i < s->ntbl; i++) {
+            if (strcmp(s->tbl[i].name, s->key) == 0) {
+                if (!s->tbl[i].found) s->cur = &s->tbl[i];
+                break;
+            }
+        }
+    }
+    s->state = S_COLON;
+}
+
+static bool value_begin(json_scan_t *s, char c)
+{
+    json_field_t *f = s->cur;
+    s->cur = NULL;
+
+    /* Each element of a walked array starts with a clean sub-table */
+    if (s->arr && s->depth == s->arr_depth) clear_fields(s->arr->sub, s->arr->nsub);
+    /* ... and each element of a string array with an empty buffer */
+    if (s->strs && s->depth == s->strs_depth) {
+        f = s->strs;
+        f->truncated = false;
+        ((char *)f->out)[0] = '\0';
+    }
+
+    if (c == '"') {
+        string_begin(s, S_IN_STR);
+        if (f && (f->type == JSON_FIELD_STR || f == s->strs)) {
+            f->found = true;
+            s->cur = f;
+        }
+    } else if (c == '{') {
+        if (!push(s, false)) return false;
+        if (s->arr && s->depth == s->arr_depth + 1) {
+            s->tbl       = s->arr->sub;
+            s->ntbl      = s->arr->nsub;
+            s->tbl_depth = s->depth;
+        }
+        s->state = S_KEY_OR_END;
+    } else if (c == '[') {
+        if (!push(s, true)) return false;
+        if (f && f->type == JSON_FIELD_OBJECTS && !s->arr) {
+            f->found     = true;
+            s->arr       = f;
+            s->arr_depth = s->depth;
+        } else if (f && f->type == JSON_FIELD_STRS && !s->strs) {
+            f->found      = true;
+            s->strs       = f;
+            s->strs_depth = s->depth;
+        }
+        s->state = S_VALUE_OR_END;
+    } else if (c == '-' || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')) {
+        s->tok[0] = c;
+        s->pos    = 1;
+        if (f && f->type == JSON_FIELD_INT) s->cur = f;
+        s->state  = S_TOKEN;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/** A number or literal ended; store it if it belongs to an INT field. */
+static bool token_done(json_scan_t *s)
+{
+    s->tok[s->pos] = '\0';
+    if (strcmp(s->tok, "true") != 0 && strcmp(s->tok, "false") != 0 &&
+        strcmp(s->tok, "null") != 0) {
+        const char *d = s->tok[0] == '-' ? s->tok + 1 : s->tok;
+        if (*d < '0' || *d > '9') return false;
+        char *end;
+        double v = strtod(s->tok, &end);
+        if (*end != '\0') return false;
+        if (s->cur) {
+            /* Same clamping as cJSON's valueint */
+            *(int *)s->cur->out = v >= (double)INT_MAX ? INT_MAX :
+                                  v <= (double)INT_MIN ? INT_MIN : (int)v;
+            s->cur->found = true;
+        }
+    }
+    value_done(s);
+    return true;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Public API                                                         */
+/* ------------------------------------------------------------------ */
+
+void json_scan_init(json_scan_t *s, json_field_t *fields, size_t nfields)
+{
+    memset(s, 0, sizeof(*s));
+    s->root      = s->tbl  = fields;
+    s->nroot     = s->ntbl = nfields;
+    s->tbl_depth = 1;
+    s->state     = S_VALUE;
+    clear_fields(fields, nfields);
+}
+
+int json_scan_feed(json_scan_t *s, const char *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        char c = p[i];
+
+        if (s->state == S_TOKEN) {
+            if (is_token_char(c)) {
+                if (s->pos >= sizeof(s->tok) - 1) goto fail;
+                s->tok[s->pos++] = c;
+                continue;
+            }
+            if (!token_done(s)) goto fail;
+            /* c is the first byte after the token: handle it below */
+        }
+        if (s->state == S_DONE) return (int)i;
+
+        bool closed;
+        switch (s->state) {
+        case S_IN_KEY:
+        case S_IN_STR:
+            if (!string_char(s, c, &closed)) goto fail;
+            if (closed && s->state == S_IN_KEY) {
+                key_done(s);
+            } else if (closed) {
+                if (s->cur) ((char *)s->cur->out)[s->pos] = '\0';
+                value_done(s);
+            }
+            break;
+
+        case S_VALUE_OR_END:
+            if (c == ']') {
+                if (!close_container(s, c)) goto fail;
+                break;
+            }
+            /* fall through */
+        case S_VALUE:
+            if (is_ws(c)) break;
+            if (!value_begin(s, c)) goto fail;
+            break;
+
+        case S_KEY_OR_END:
+            if (c == '}') {
+                if (!close_container(s, c)) goto fail;
+                break;
+            }
+            /* fall through */
+        case S_KEY:
+            if (is_ws(c)) break;
+            if (c != '"') goto fail;
+            string_begin(s, S_IN_KEY);
+            break;
+
+        case S_COLON:
+            if (is_ws(c)) break;
+            if (c != ':') goto fail;
+            s->state = S_VALUE;
+            break;
+
+        case S_AFTER:
+            if (is_ws(c)) break;
+            if (c == ',') {
+                s->state = top_is_array(s) ? S_VALUE : S_KEY;
+            } else if (c == '}' || c == ']') {
+                if (!close_container(s, c)) goto fail;
+            } else {
+                goto fail;
+            }
+            break;
+
+        default:
+            goto fail;
+        }
+    }
+    return (int)n;
+
+fail:
+    s->state = S_ERROR;
+    return -1;
+}
+
+esp_err_t json_scan_finish(json_scan_t *s)
+{
+    if (s->state == S_TOKEN && s->depth == 0 && !token_done(s)) s->state = S_ERROR;
+    if (s->state == S_DONE)  return ESP_OK;
+    if (s->state == S_ERROR) return ESP_ERR_INVALID_ARG;
+    return ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t json_scan_buf(const char *buf, size_t len, json_field_t *fields, size_t nfields)
+{
+    json_scan_t s;
+    json_scan_init(&s, fields, nfields);
+    json_scan_feed(&s, buf, len);
+    return json_scan_finish(&s);
+}
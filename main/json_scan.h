@@ -0,0 +1,131 @@
+/*
+ * json_scan.h — zero-allocation JSON field extractor for request bodies
+ *
+ * A byte-at-a-time JSON tokenizer that copies a fixed table of known fields
+ * into caller buffers as it reads.  No tree is built and nothing is
+ * allocated.  The body can arrive in any number of pieces: all state lives
+ * in json_scan_t, so a handler can feed each httpd_req_recv() chunk straight
+ * through without ever holding the whole body.
+ *
+ * Fields are looked up in the top-level object only.  Unknown keys, nested
+ * values and values of the wrong type are skipped, which matches how the
+ * handlers used cJSON_GetObjectItem() / cJSON_GetStringValue() before.  The
+ * first occurrence of a duplicate key wins.  A JSON_FIELD_OBJECTS field
+ * walks an array of objects against its own sub-table and calls back once
+ * per element; a JSON_FIELD_STRS field decodes an array of strings one
+ * element at a time into its buffer and calls back once per string.  A
+ * STRS field may sit inside an OBJECTS sub-table.
+ *
+ * Pure libc, so it builds for the linux target as well.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JSON_SCAN_KEY_MAX     24   /* longest key that can match a field */
+#define JSON_SCAN_NUM_MAX     32   /* longest number / literal token */
+#define JSON_SCAN_DEPTH_MAX   32   /* nesting limit */
+
+typedef enum {
+    JSON_FIELD_STR,       /*!< string, decoded into out[len] and null-terminated */
+    JSON_FIELD_INT,       /*!< number, integer part into *(int *)out (clamped) */
+    JSON_FIELD_OBJECTS,   /*!< array; each element scanned against sub[] */
+    JSON_FIELD_STRS,      /*!< array of strings; each one decoded into out[len] in turn */
+} json_field_type_t;
+
+typedef struct json_field json_field_t;
+
+struct json_field {
+    const char        *name;
+    json_field_type_t  type;
+    void              *out;        /*!< STR: char buffer, INT: int */
+    size_t             len;        /*!< STR: size of out, including the null */
+    bool               found;      /*!< set when a value of the right type was seen */
+    bool               truncated;  /*!< STR: value did not fit and was cut at len - 1 */
+
+    /* JSON_FIELD_OBJECTS: on_item(sub, nsub) per element, may be NULL to just
+     * check the array.  JSON_FIELD_STRS: on_item(this field, 1) per string,
+     * with out / truncated describing that string; other elements are skipped. */
+    json_field_t      *sub;
+    size_t             nsub;
+    void             (*on_item)(json_field_t *sub, size_t nsub, void *ctx);
+    void              *ctx;
+};
+
+/* Table entry initialisers */
+#define JSON_SCAN_STR(key, buf)  { .name = (key), .type = JSON_FIELD_STR, .out = (buf), .len = sizeof(buf) }
+#define JSON_SCAN_INT(key, ptr)  { .name = (key), .type = JSON_FIELD_INT, .out = (ptr) }
+#define JSON_SCAN_STRS(key, buf, fn, arg) \
+    { .name = (key), .type = JSON_FIELD_STRS, .out = (buf), .len = sizeof(buf), \
+      .on_item = (fn), .ctx = (arg) }
+
+/** Scanner state; treat as opaque. */
+typedef struct {
+    json_field_t *root;
+    size_t        nroot;
+    json_field_t *tbl;             /* table keys are matched against */
+    size_t        ntbl;
+    int           tbl_depth;       /* depth at which tbl applies */
+    json_field_t *arr;             /* JSON_FIELD_OBJECTS array being walked */
+    int           arr_depth;
+    json_field_t *strs;            /* JSON_FIELD_STRS array being walked */
+    int           strs_depth;
+    json_field_t *cur;             /* field receiving the current value */
+
+    int           state;
+    int           depth;
+    uint32_t      is_array;        /* bit d set: container at depth d + 1 is an array */
+
+    size_t        pos;             /* bytes written to the current key / string / token */
+    bool          esc;
+    uint8_t       u_digits;        /* \uXXXX digits still expected */
+    uint32_t      u_val;
+    uint32_t      u_high;          /* pending high surrogate */
+    char          key[JSON_SCAN_KEY_MAX];
+    bool          key_long;
+    char          tok[JSON_SCAN_NUM_MAX];
+} json_scan_t;
+
+/**
+ * @brief Start scanning one JSON document into @p fields
+ *
+ * Clears found / truncated and, for JSON_FIELD_STR, empties the buffers.
+ */
+void json_scan_init(json_scan_t *s, json_field_t *fields, size_t nfields);
+
+/**
+ * @brief Feed the next @p n bytes of the document
+ *
+ * Stops at the end of the top-level value; anything after it is left
+ * unconsumed, like cJSON_Parse() ignores trailing bytes.
+ *
+ * @return Bytes consumed, or -1 if the input is not valid JSON (the
+ *         scanner then stays failed)
+ */
+int json_scan_feed(json_scan_t *s, const char *p, size_t n);
+
+/**
+ * @brief Finish the document once the input is exhausted
+ *
+ * @return ESP_OK if one complete value was read, ESP_ERR_INVALID_SIZE if it
+ *         is truncated, ESP_ERR_INVALID_ARG if it was malformed
+ */
+esp_err_t json_scan_finish(json_scan_t *s);
+
+/**
+ * @brief Scan a complete document held in memory
+ *
+ * @return As json_scan_finish()
+ */
+esp_err_t json_scan_buf(const char *buf, size_t len, json_field_t *fields, size_t nfields);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,118 @@
+/*
+ * mem_pool.c — fixed-size slab pools (see mem_pool.h)
+ */
+#include "mem_pool.h"
+
+#include <string.h>
+#include "esp_heap_caps.h"
+
+esp_err_t mem_pool_init(mem_pool_t *p, const size_t *sizes, size_t nsizes,
+                        uint16_t blocks, uint32_t caps)
+{
+    if (!p || !sizes || nsizes == 0 || nsizes > MEM_POOL_CLASSES_MAX) return ESP_ERR_INVALID_ARG;
+
+    memset(p, 0, sizeof(*p));
+    portMUX_INITIALIZE(&p->lock);
+    p->caps     = caps;
+    p->nclasses = nsizes;
+
+    size_t total = 0;
+    for (size_t i = 0; i < nsizes; i++) {
+        if (sizes[i] % 8 || (i && sizes[i] <= sizes[i - 1])) return ESP_ERR_INVALID_ARG;
+        p->cls[i].size = sizes[i];
+        total += sizes[i] * blocks;
+    }
+    if (blocks == 0) return ESP_OK;
+
+    uint8_t *arena = heap_caps_malloc(total, caps);
+    if (!arena) return ESP_ERR_NO_MEM;
+
+    for (size_t i = 0; i < nsizes; i++) {
+        mem_pool_class_t *c = &p->cls[i];
+        c->base     = arena;
+        c->count    = blocks;
+        c->free     = blocks;
+        c->min_free = blocks;
+        /* Thread the free list through the blocks, lowest address first */
+        for (int k = blocks - 1; k >= 0; k--) {
+            void **b = (void **)(arena + (size_t)k * c->size);
+            *b = c->free_list;
+            c->free_list = b;
+        }
+        arena += c->size * blocks;
+    }
+    return ESP_OK;
+}
+
+/** Class owning @p ptr, or NULL if it came from the heap. */
+static mem_pool_class_t *owner(mem_pool_t *p, const void *ptr)
+{
+    const uint8_t *a = ptr;
+    for (size_t i = 0; i < p->nclasses; i++) {
+        mem_pool_class_t *c = &p->cls[i];
+        if (c->count && a >= c->base && a < c->base + c->size * c->count) return c;
+    }
+    return NULL;
+}
+
+void *mem_pool_alloc(mem_pool_t *p, size_t size)
+{
+    void *b = NULL;
+
+    portENTER_CRITICAL(&p->lock);
+    for (size_t i = 0; i < p->nclasses; i++) {
+        mem_pool_class_t *c = &p->cls[i];
+        if (size > c->size || !c->free_list) continue;   /* an empty class spills upward */
+        b = c->free_list;
+        c->free_list = *(void **)b;
+        if (--c->free < c->min_free) c->min_free = c->free;
+        break;
+    }
+    if (!b) p->fallbacks++;
+    portEXIT_CRITICAL(&p->lock);
+
+    return b ? b : heap_caps_malloc(size, p->caps);
+}
+
+void *mem_pool_calloc(mem_pool_t *p, size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size) return NULL;
+    void *b = mem_pool_alloc(p, n * size);
+    if (b) memset(b, 0, n * size);
+    return b;
+}
+
+void mem_pool_free(mem_pool_t *p, void *ptr)
+{
+    if (!ptr) return;
+
+    mem_pool_class_t *c = owner(p, ptr);
+    if (!c) {
+        heap_caps_free(ptr);
+        return;
+    }
+    portENTER_CRITICAL(&p->lock);
+    *(void **)ptr = c->free_list;
+    c->free_list  = ptr;
+    c->free++;
+    portEXIT_CRITICAL(&p->lock);
+}
+
+void *mem_pool_realloc(mem_pool_t *p, void *ptr, size_t size)
+{
+    if (!ptr) return mem_pool_alloc(p, size);
+    if (size == 0) {
+        mem_pool_free(p, ptr);
+        return NULL;
+    }
+
+    mem_pool_class_t *c = owner(p, ptr);
+    if (!c) return heap_caps_realloc(ptr, size, p->caps);
+    if (size <= c->size) return ptr;
+
+    void *b = mem_pool_alloc(p, size);
+    if (!b) return NULL;
+    memcpy(b, ptr, c->size);
+    mem_pool_free(p, ptr);
+    return b;
+}
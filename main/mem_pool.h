@@ -0,0 +1,63 @@
+/*
+ * mem_pool.h — fixed-size slab pools, preallocated at start-up
+ *
+ * A pool is a few size classes, each one arena of equal blocks carved out
+ * of a single allocation made at init.  Requests go to the smallest class
+ * that fits and has a free block; anything larger than the biggest class,
+ * or arriving when every class that fits is empty, falls back to the heap
+ * and is counted.  Steady-state churn therefore never touches the heap,
+ * so it cannot fragment it.
+ *
+ * Blocks are recognised on free by address, so no header is stored in
+ * front of them.  All calls are thread-safe.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MEM_POOL_CLASSES_MAX  6
+
+typedef struct {
+    size_t    size;          /* block size, a multiple of 8 */
+    uint16_t  count;
+    uint16_t  free;
+    uint16_t  min_free;      /* low-water mark since init */
+    uint8_t  *base;          /* count * size bytes */
+    void     *free_list;     /* next pointer lives in the free block */
+} mem_pool_class_t;
+
+typedef struct {
+    mem_pool_class_t cls[MEM_POOL_CLASSES_MAX];
+    size_t           nclasses;
+    uint32_t         fallbacks;   /* requests the heap had to serve */
+    uint32_t         caps;        /* heap_caps for the fallback */
+    portMUX_TYPE     lock;
+} mem_pool_t;
+
+/**
+ * @brief Carve @p blocks blocks of each of @p sizes (ascending) from one
+ *        allocation with @p caps
+ *
+ * With @p blocks = 0 the pool holds nothing and every call goes to the heap.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG, or ESP_ERR_NO_MEM
+ */
+esp_err_t mem_pool_init(mem_pool_t *p, const size_t *sizes, size_t nsizes,
+                        uint16_t blocks, uint32_t caps);
+
+void *mem_pool_alloc(mem_pool_t *p, size_t size);
+void *mem_pool_calloc(mem_pool_t *p, size_t n, size_t size);
+void *mem_pool_realloc(mem_pool_t *p, void *ptr, size_t size);
+void  mem_pool_free(mem_pool_t *p, void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
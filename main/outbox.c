@@ -0,0 +1,291 @@
+/*
+ * outbox.c — durable outbound queue in a flash ring (see outbox.h)
+ *
+ * Record sequence numbers map straight onto slots: seq lives in slot
+ * seq % s_nslots, so the ring needs no index on flash.  In RAM there is a
+ * live bitmap and three cursors:
+ *
+ *   s_tail     oldest seq that may still be live
+ *   s_flushed  seqs below this are programmed; [s_flushed, s_head) are
+ *              staged in s_stage, always within one sector
+ *   s_head     next seq to write
+ *
+ * The sector under s_head is erased when the head enters it, dropping any
+ * records still live there (they are the oldest in the ring).
+ */
+#include "outbox.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <string.h>
+#include "sdkconfig.h"
+
+static const char *TAG = "outbox";
+
+#define OUTBOX_SECTOR        4096
+#define OUTBOX_SPS           (OUTBOX_SECTOR / OUTBOX_SLOT_SIZE)   /* slots per sector */
+#define OUTBOX_STATE_ERASED  0xFFFFFFFFu
+#define OUTBOX_STATE_LIVE    0x0B0C5A5Au   /* programmed on append */
+#define OUTBOX_STATE_DONE    0x00000000u   /* programmed over LIVE on consume */
+
+typedef struct {
+    uint32_t state;
+    uint32_t seq;
+    uint32_t expires;
+    uint32_t len;
+    uint32_t crc;        /* CRC-32 of seq, expires, len and the data */
+} outbox_hdr_t;
+
+_Static_assert(sizeof(outbox_hdr_t) + OUTBOX_DATA_MAX == OUTBOX_SLOT_SIZE, "slot layout");
+_Static_assert(OUTBOX_SECTOR % OUTBOX_SLOT_SIZE == 0, "slots must tile a sector");
+
+static const esp_partition_t *s_part;
+static SemaphoreHandle_t      s_lock;
+static uint8_t               *s_live;      /* s_nslots bits */
+static uint32_t               s_nslots;
+static uint32_t               s_cap;
+static uint32_t               s_tail, s_flushed, s_head;
+static outbox_stats_t         s_stats;
+
+/* The sector being filled; written once and read back only on peek */
+static EXT_RAM_BSS_ATTR uint8_t s_stage[OUTBOX_SECTOR];
+
+static uint32_t slot_of(uint32_t seq)     { return seq % s_nslots; }
+static size_t   offset_of(uint32_t seq)   { return (size_t)slot_of(seq) * OUTBOX_SLOT_SIZE; }
+static uint8_t *staged(uint32_t seq)      { return s_stage + (seq % OUTBOX_SPS) * OUTBOX_SLOT_SIZE; }
+
+static bool live_get(uint32_t seq) { uint32_t s = slot_of(seq); return s_live[s / 8] & (1u << (s % 8)); }
+static void live_set(uint32_t seq) { uint32_t s = slot_of(seq); s_live[s / 8] |= (uint8_t)(1u << (s % 8)); }
+static void live_clr(uint32_t seq) { uint32_t s = slot_of(seq); s_live[s / 8] &= (uint8_t)~(1u << (s % 8)); }
+
+static uint32_t hdr_crc(const outbox_hdr_t *h, const void *data)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&h->seq, 3 * sizeof(uint32_t));
+    return esp_rom_crc32_le(crc, data, h->len);
+}
+
+/** Mark @p seq consumed, in the stage or on flash.  Caller holds s_lock. */
+static void retire(uint32_t seq, uint32_t *counter)
+{
+    if (!live_get(seq)) return;
+    live_clr(seq);
+    s_stats.pending--;
+    (*counter)++;
+
+    if (seq >= s_flushed) {
+        ((outbox_hdr_t *)staged(seq))->state = OUTBOX_STATE_DONE;
+    } else {
+        const uint32_t done = OUTBOX_STATE_DONE;
+        esp_err_t ret = esp_partition_write(s_part, offset_of(seq), &done, sizeof(done));
+        if (ret != ESP_OK) {
+            /* Comes back after a reboot: at worst the push is sent twice */
+            ESP_LOGW(TAG, "Failed to mark #%lu consumed: %s", (unsigned long)seq, esp_err_to_name(ret));
+        }
+    }
+    while (s_tail < s_head && !live_get(s_tail)) s_tail++;
+}
+
+static esp_err_t flush_locked(void)
+{
+    if (s_flushed == s_head) return ESP_OK;
+    esp_err_t ret = esp_partition_write(s_part, offset_of(s_flushed), staged(s_flushed),
+                                        (size_t)(s_head - s_flushed) * OUTBOX_SLOT_SIZE);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Flush failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    s_flushed = s_head;
+    return ESP_OK;
+}
+
+/** Erase the sector s_head is entering.  Caller holds s_lock. */
+static esp_err_t open_sector(void)
+{
+    for (uint32_t k = 0; k < OUTBOX_SPS; k++) {
+        if (s_head + k >= s_nslots) retire(s_head + k - s_nslots, &s_stats.dropped);
+    }
+    esp_err_t ret = esp_partition_erase_range(s_part, offset_of(s_head), OUTBOX_SECTOR);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Sector erase failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    s_stats.erases++;
+    memset(s_stage, 0xFF, sizeof(s_stage));
+    return ESP_OK;
+}
+
+static bool slot_blank(uint32_t slot, uint8_t *buf)
+{
+    if (esp_partition_read(s_part, (size_t)slot * OUTBOX_SLOT_SIZE, buf, OUTBOX_SLOT_SIZE) != ESP_OK) {
+        return false;
+    }
+    for (size_t i = 0; i < OUTBOX_SLOT_SIZE; i++) {
+        if (buf[i] != 0xFF) return false;
+    }
+    return true;
+}
+
+esp_err_t outbox_init(void)
+{
+    s_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                      OUTBOX_PARTITION_LABEL);
+    if (!s_part) {
+        ESP_LOGW(TAG, "No \"%s\" partition — undeliverable pushes will not be kept",
+                 OUTBOX_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+    s_nslots = (s_part->size / OUTBOX_SECTOR) * OUTBOX_SPS;
+    s_lock   = xSemaphoreCreateMutex();
+    s_live   = heap_caps_calloc((s_nslots + 7) / 8, 1, MALLOC_CAP_8BIT);
+    uint8_t *buf = heap_caps_malloc(OUTBOX_SLOT_SIZE, MALLOC_CAP_8BIT);
+    if (s_nslots < 2 * OUTBOX_SPS || !s_lock || !s_live || !buf) {
+        ESP_LOGE(TAG, "Cannot use the %lu-byte partition", (unsigned long)s_part->size);
+        heap_caps_free(buf);
+        s_part = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    /* One sector is always being recycled under the head */
+    s_cap = s_nslots - OUTBOX_SPS;
+    if (s_cap > CONFIG_OUTBOX_MAX_ENTRIES) s_cap = CONFIG_OUTBOX_MAX_ENTRIES;
+
+    /* Rebuild the cursors: the highest intact record fixes the head */
+    bool any = false;
+    uint32_t max_seq = 0, min_live = UINT32_MAX;
+    outbox_hdr_t *h = (outbox_hdr_t *)buf;
+    for (uint32_t slot = 0; slot < s_nslots; slot++) {
+        if (esp_partition_read(s_part, (size_t)slot * OUTBOX_SLOT_SIZE, buf, OUTBOX_SLOT_SIZE) != ESP_OK ||
+            h->state == OUTBOX_STATE_ERASED || h->len > OUTBOX_DATA_MAX ||
+            h->seq % s_nslots != slot || hdr_crc(h, h + 1) != h->crc) {
+            continue;
+        }
+        if (!any || h->seq > max_seq) max_seq = h->seq;
+        any = true;
+        if (h->state == OUTBOX_STATE_LIVE) {
+            live_set(h->seq);
+            s_stats.pending++;
+            if (h->seq < min_live) min_live = h->seq;
+        }
+    }
+    s_head = any ? max_seq + 1 : 0;
+
+    /* A write torn by a reset leaves the rest of its sector unusable */
+    for (uint32_t seq = s_head; seq % OUTBOX_SPS; seq++) {
+        if (!slot_blank(slot_of(seq), buf)) {
+            s_head += OUTBOX_SPS - s_head % OUTBOX_SPS;
+            break;
+        }
+    }
+    heap_caps_free(buf);
+
+    /* A sector is erased before the head reuses it, so every live record is
+     * within one lap of the head */
+    s_tail    = s_stats.pending ? min_live : s_head;
+    s_flushed = s_head;
+    memset(s_stage, 0xFF, sizeof(s_stage));
+    s_stats.capacity = s_cap;
+
+    ESP_LOGI(TAG, "%lu pending of %lu (%lu slots, head #%lu)",
+             (unsigned long)s_stats.pending, (unsigned long)s_cap,
+             (unsigned long)s_nslots, (unsigned long)s_head);
+    return ESP_OK;
+}
+
+esp_err_t outbox_append(const void *data, size_t len, uint32_t expires)
+{
+    if (!s_part) return ESP_ERR_INVALID_STATE;
+    if (len > OUTBOX_DATA_MAX) return ESP_ERR_INVALID_SIZE;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    while (s_stats.pending >= s_cap) retire(s_tail, &s_stats.dropped);
+
+    if (s_head % OUTBOX_SPS == 0) {
+        /* The previous sector is fully programmed before the stage is reused */
+        ret = flush_locked();
+        if (ret == ESP_OK) ret = open_sector();
+    }
+    if (ret == ESP_OK) {
+        uint8_t *slot = staged(s_head);
+        outbox_hdr_t *h = (outbox_hdr_t *)slot;
+        memset(slot, 0xFF, OUTBOX_SLOT_SIZE);
+        memcpy(h + 1, data, len);
+        h->state   = OUTBOX_STATE_LIVE;
+        h->seq     = s_head;
+        h->expires = expires;
+        h->len     = (uint32_t)len;
+        h->crc     = hdr_crc(h, data);
+
+        live_set(s_head);
+        if (s_stats.pending == 0) s_tail = s_head;
+        s_head++;
+        s_stats.pending++;
+        s_stats.appended++;
+
+        /* A full sector goes out in one write */
+        if (s_head % OUTBOX_SPS == 0) ret = flush_locked();
+    }
+    xSemaphoreGive(s_lock);
+    return ret;
+}
+
+esp_err_t outbox_flush(void)
+{
+    if (!s_part) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    esp_err_t ret = flush_locked();
+    xSemaphoreGive(s_lock);
+    return ret;
+}
+
+size_t outbox_peek(void *data, size_t stride, outbox_meta_t *meta, size_t max)
+{
+    if (!s_part) return 0;
+
+    size_t n = 0;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (uint32_t seq = s_tail; seq < s_head && n < max; seq++) {
+        if (!live_get(seq)) continue;
+
+        outbox_hdr_t h;
+        uint8_t *out = (uint8_t *)data + n * stride;
+        if (seq >= s_flushed) {
+            memcpy(&h, staged(seq), sizeof(h));
+            memcpy(out, staged(seq) + sizeof(h), h.len < stride ? h.len : stride);
+        } else if (esp_partition_read(s_part, offset_of(seq), &h, sizeof(h)) != ESP_OK ||
+                   esp_partition_read(s_part, offset_of(seq) + sizeof(h), out,
+                                      h.len < stride ? h.len : stride) != ESP_OK) {
+            continue;
+        }
+        meta[n++] = (outbox_meta_t){ .seq = seq, .expires = h.expires, .len = (uint16_t)h.len };
+    }
+    xSemaphoreGive(s_lock);
+    return n;
+}
+
+void outbox_consume(uint32_t seq, bool expired)
+{
+    if (!s_part) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    retire(seq, expired ? &s_stats.expired : &s_stats.consumed);
+    xSemaphoreGive(s_lock);
+}
+
+size_t outbox_pending(void)
+{
+    return s_part ? s_stats.pending : 0;
+}
+
+void outbox_get_stats(outbox_stats_t *out)
+{
+    if (!s_part) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *out = s_stats;
+    xSemaphoreGive(s_lock);
+}
@@ -0,0 +1,104 @@
+/*
+ * outbox.h — durable outbound queue in a flash ring
+ *
+ * Pushes that cannot be sent because the link is down (or APNs never
+ * answered) are appended here instead of being dropped, and drained once
+ * the connection is back.  The queue lives in its own data partition
+ * ("outbox", see partitions.csv) laid out as a ring of fixed-size slots:
+ *
+ *   - Records are only ever appended.  Consuming one clears its state word
+ *     in place (1 → 0 bits, no erase), and a sector is erased only when the
+ *     write head comes round to it again, so erases are spread evenly over
+ *     the whole partition.
+ *   - Appends are staged in RAM and programmed a sector's worth (or
+ *     whatever has accumulated) at a time by outbox_flush(); callers flush
+ *     once a burst is over rather than after every record.
+ *   - Each record carries a sequence number, an expiry and a CRC, so the
+ *     queue is rebuilt by one scan at init and a torn write is skipped.
+ *
+ * At most CONFIG_OUTBOX_MAX_ENTRIES records are kept; appending beyond
+ * that, or beyond what the partition holds, drops the oldest.  All calls
+ * are thread-safe.
+ *
+ * Tunables (menuconfig → "APNs Configuration" → "Outbox"):
+ *   CONFIG_OUTBOX_ENABLE       spool undeliverable pushes to flash
+ *   CONFIG_OUTBOX_MAX_ENTRIES  cap on queued records
+ *   CONFIG_OUTBOX_TTL_S        default lifetime of a record
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OUTBOX_PARTITION_LABEL  "outbox"
+#define OUTBOX_SLOT_SIZE        1024
+#define OUTBOX_DATA_MAX         (OUTBOX_SLOT_SIZE - 20)   /* slot minus record header */
+
+/** One queued record as handed out by outbox_peek(). */
+typedef struct {
+    uint32_t seq;                /*!< pass back to outbox_consume() */
+    uint32_t expires;            /*!< epoch seconds; 0 = never */
+    uint16_t len;
+} outbox_meta_t;
+
+typedef struct {
+    uint32_t pending;            /*!< records waiting to be sent */
+    uint32_t capacity;           /*!< effective cap: config and partition size */
+    uint32_t appended;           /*!< since boot */
+    uint32_t consumed;
+    uint32_t expired;            /*!< consumed unsent because their TTL ran out */
+    uint32_t dropped;            /*!< oldest records discarded to make room */
+    uint32_t erases;             /*!< sector erases since boot */
+} outbox_stats_t;
+
+/**
+ * @brief Find the partition and rebuild the queue from flash.
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if there is no "outbox" partition
+ *         (the outbox then stays disabled and every append fails)
+ */
+esp_err_t outbox_init(void);
+
+/**
+ * @brief Stage @p len bytes of @p data as the newest record.
+ *
+ * The record is in RAM until the next outbox_flush() (or until its sector
+ * fills up), but outbox_peek() already sees it.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if @p len > OUTBOX_DATA_MAX,
+ *         ESP_ERR_INVALID_STATE if outbox_init() failed, or a flash error
+ */
+esp_err_t outbox_append(const void *data, size_t len, uint32_t expires);
+
+/** Program every staged record.  Cheap when nothing is staged. */
+esp_err_t outbox_flush(void);
+
+/**
+ * @brief Copy up to @p max of the oldest records, oldest first.
+ *
+ * Record i goes to @p data + i × @p stride, cut to @p stride bytes, and its
+ * header to @p meta[i].  Records stay queued until outbox_consume()d.
+ *
+ * @return Records copied
+ */
+size_t outbox_peek(void *data, size_t stride, outbox_meta_t *meta, size_t max);
+
+/**
+ * @brief Remove record @p seq.  @p expired only selects the counter.
+ */
+void outbox_consume(uint32_t seq, bool expired);
+
+/** Records waiting to be sent. */
+size_t outbox_pending(void);
+
+void outbox_get_stats(outbox_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
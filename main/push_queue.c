@@ -0,0 +1,715 @@
+/*
+ * push_queue.c — bounded send-job lanes + fixed worker pool
+ */
+#include "push_queue.h"
+#include "apns.h"
+#include "fcm.h"
+#include "outbox.h"
+#include "results.h"
+#include "token_store.h"
+#include "trace.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include <string.h>
+#include <time.h>
+#include "sdkconfig.h"
+
+static const char *TAG = "push_queue";
+
+/* One queue per lane: singles go to the interactive workers, blasts to
+ * the bulk worker, so a blast never holds up a /push at the worker level */
+static QueueHandle_t s_lanes[PUSH_LANE_COUNT];
+
+/* Jobs are copied in and out once each, so their storage can sit in PSRAM */
+static EXT_RAM_BSS_ATTR uint8_t s_job_storage[CONFIG_PUSH_QUEUE_DEPTH * sizeof(push_job_t)];
+static EXT_RAM_BSS_ATTR uint8_t s_bulk_storage[CONFIG_PUSH_BULK_QUEUE_DEPTH * sizeof(push_job_t)];
+static StaticQueue_t            s_lane_bufs[PUSH_LANE_COUNT];
+
+/* Set once the clock is valid; workers wait on it before their first job */
+static EventGroupHandle_t s_gate = NULL;
+#define GATE_OPEN_BIT  BIT0
+static int64_t s_opened_us = 0;
+
+/* Cleared while WiFi is down; singles then go straight to the outbox */
+static volatile bool s_online = true;
+
+extern apns_config_t g_apns_config;
+#if CONFIG_FCM_ENABLE
+extern fcm_config_t g_fcm_config;
+#endif
+
+/* ------------------------------------------------------------------ */
+/*  Blast progress ring                                                */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Blast ids are handed out sequentially; id N lives in slot (N-1) % size,
+ * so a new blast evicts the one submitted CONFIG_PUSH_BLAST_HISTORY blasts
+ * earlier — unless that one is still queued or running.
+ */
+static push_blast_status_t s_blasts[CONFIG_PUSH_BLAST_HISTORY];
+static uint32_t            s_next_blast_id = 1;
+static uint32_t            s_next_job_id   = 1;   /* under s_blast_lock too */
+static portMUX_TYPE        s_blast_lock    = portMUX_INITIALIZER_UNLOCKED;
+
+static push_blast_status_t *blast_slot(uint32_t id)
+{
+    push_blast_status_t *b = &s_blasts[(id - 1) % CONFIG_PUSH_BLAST_HISTORY];
+    return (id != 0 && b->id == id) ? b : NULL;
+}
+
+static bool blast_active(const push_blast_status_t *b)
+{
+    return b->id != 0 &&
+           (b->state == PUSH_BLAST_QUEUED || b->state == PUSH_BLAST_RUNNING);
+}
+
+/** Reserve a slot and id for a new blast; 0 if the ring is full of live jobs. */
+static uint32_t blast_alloc(bool use_sandbox, int64_t now)
+{
+    uint32_t id = 0;
+    portENTER_CRITICAL(&s_blast_lock);
+    push_blast_status_t *b = &s_blasts[(s_next_blast_id - 1) % CONFIG_PUSH_BLAST_HISTORY];
+    if (!blast_active(b)) {
+        id = s_next_blast_id++;
+        if (s_next_blast_id == 0) s_next_blast_id = 1;
+        *b = (push_blast_status_t){
+            .id          = id,
+            .state       = PUSH_BLAST_QUEUED,
+            .use_sandbox = use_sandbox,
+            .queued_us   = now,
+        };
+    }
+    portEXIT_CRITICAL(&s_blast_lock);
+    return id;
+}
+
+/** Release a slot whose job never made it into the queue. */
+static void blast_free(uint32_t id)
+{
+    portENTER_CRITICAL(&s_blast_lock);
+    push_blast_status_t *b = blast_slot(id);
+    if (b) b->id = 0;
+    portEXIT_CRITICAL(&s_blast_lock);
+}
+
+/** Move a queued blast to running.  False if it was cancelled meanwhile. */
+static bool blast_start(uint32_t id, uint32_t total)
+{
+    bool ok = false;
+    portENTER_CRITICAL(&s_blast_lock);
+    push_blast_status_t *b = blast_slot(id);
+    if (b && b->state == PUSH_BLAST_QUEUED) {
+        b->state      = PUSH_BLAST_RUNNING;
+        b->total      = total;
+        b->started_us = esp_timer_get_time();
+        ok = true;
+    }
+    portEXIT_CRITICAL(&s_blast_lock);
+    return ok;
+}
+
+static bool blast_cancel_requested(uint32_t id)
+{
+    portENTER_CRITICAL(&s_blast_lock);
+    push_blast_status_t *b = blast_slot(id);
+    bool cancel = !b || b->cancel_requested;
+    portEXIT_CRITICAL(&s_blast_lock);
+    return cancel;
+}
+
+static void blast_finish(uint32_t id, push_blast_state_t state)
+{
+    portENTER_CRITICAL(&s_blast_lock);
+    push_blast_status_t *b = blast_slot(id);
+    if (b) {
+        b->state       = state;
+        b->finished_us = esp_timer_get_time();
+    }
+    portEXIT_CRITICAL(&s_blast_lock);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Job execution                                                      */
+/* ------------------------------------------------------------------ */
+
+static void drain_kick(void);
+
+/** Point @p n at the fields of @p p. */
+static void job_notification(const push_job_t *p, apns_notification_t *n)
+{
+    *n = (apns_notification_t){
+        .device_token   = p->device_token,
+        .title          = p->title,
+        .body           = p->body,
+        .badge          = p->badge,
+        .sound          = p->has_sound  ? p->sound          : NULL,
+        .custom_payload = p->has_custom ? p->custom_payload : NULL,
+    };
+}
+
+/** Point @p n at the fields of FCM job @p p. */
+static void job_fcm_notification(const push_job_t *p, fcm_notification_t *n)
+{
+    *n = (fcm_notification_t){
+        .device_token = p->device_token,
+        .title        = p->title,
+        .body         = p->body,
+        .data         = p->has_custom ? p->custom_payload : NULL,
+    };
+}
+
+/** No answer from the push service at all, so the push may still be worth keeping. */
+static bool unanswered(esp_err_t ret)
+{
+    return ret == ESP_FAIL || ret == ESP_ERR_TIMEOUT;
+}
+
+/**
+ * Keep @p p in the outbox until the link is back.  Its TTL counts from
+ * submission.  False if it may not or cannot be kept.  The worker loop
+ * flushes once the lane is empty, so a burst shares its flash writes.
+ */
+static bool spool(const push_job_t *p)
+{
+#if CONFIG_OUTBOX_ENABLE
+    if (p->ttl_s == 0) return false;
+    int64_t ttl = p->ttl_s > 0 ? p->ttl_s : CONFIG_OUTBOX_TTL_S;
+    ttl -= (esp_timer_get_time() - p->enqueued_us) / 1000000;
+    if (ttl <= 0 || outbox_append(p, sizeof(*p), (uint32_t)(time(NULL) + ttl)) != ESP_OK) {
+        return false;
+    }
+    ESP_LOGW(TAG, "push [%.16s...] kept in outbox (%u pending)",
+             p->device_token, (unsigned)outbox_pending());
+    trace_rec(TRACE_JOB_SPOOLED, p->job_id, 0, (int32_t)ttl);
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if CONFIG_FCM_ENABLE
+static void run_single_fcm(const push_job_t *p)
+{
+    fcm_notification_t notif;
+    job_fcm_notification(p, &notif);
+
+    h2_response_t resp = { 0 };
+    esp_err_t ret = fcm_send_notification(&g_fcm_config, &notif, &resp);
+    if (unanswered(ret) && spool(p)) return;
+    if (ret == ESP_OK) drain_kick();   /* FCM is reachable: send what was kept */
+    trace_rec(TRACE_JOB_DONE, p->job_id, PUSH_PLATFORM_FCM, ret);
+    results_publish(p, 0, ret, &resp);
+
+    fcm_reason_t reason = fcm_err_reason(ret);
+    if (reason != FCM_REASON_NONE) {
+        ESP_LOGW(TAG, "push [%.16s...] → %s (fcm)", p->device_token, fcm_reason_name(reason));
+    } else {
+        TRACE_LOGI(TAG, "push [%.16s...] → %s (fcm)", p->device_token,
+                   ret == ESP_OK ? "ok" : "fail");
+    }
+}
+#endif
+
+static void run_single(const push_job_t *p)
+{
+    if (!s_online && spool(p)) return;
+#if CONFIG_FCM_ENABLE
+    if (p->platform == PUSH_PLATFORM_FCM) {
+        run_single_fcm(p);
+        return;
+    }
+#endif
+
+    apns_config_t cfg = g_apns_config;
+    cfg.use_sandbox = p->use_sandbox;
+
+    apns_notification_t notif;
+    job_notification(p, &notif);
+
+    h2_response_t resp = { 0 };
+    esp_err_t ret = apns_send_notification(&cfg, &notif, &resp);
+    if (unanswered(ret) && spool(p)) return;
+    if (ret == ESP_OK) drain_kick();   /* APNs is reachable: send what was kept */
+    trace_rec(TRACE_JOB_DONE, p->job_id, PUSH_PLATFORM_APNS, ret);
+    results_publish(p, 0, ret, &resp);
+
+    apns_reason_t reason = apns_err_reason(ret);
+    if (apns_reason_is_permanent(reason)) {
+        ESP_LOGW(TAG, "push [%.16s...]: %s (remove token manually if needed)",
+                 p->device_token, apns_reason_name(reason));
+    } else if (reason != APNS_REASON_NONE) {
+        ESP_LOGW(TAG, "push [%.16s...] → %s (%s)",
+                 p->device_token, apns_reason_name(reason),
+                 p->use_sandbox ? "sandbox" : "production");
+    } else if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "push [%.16s...] → fail (%s)",
+                 p->device_token, p->use_sandbox ? "sandbox" : "production");
+    } else {
+        TRACE_LOGI(TAG, "push [%.16s...] → ok (%s)",
+                   p->device_token, p->use_sandbox ? "sandbox" : "production");
+    }
+}
+
+typedef struct {
+    const token_entry_t *entries;
+    const push_job_t    *job;
+    uint32_t id;
+} blast_ctx_t;
+
+static void blast_result_cb(size_t index, esp_err_t r, const h2_response_t *resp, void *arg)
+{
+    blast_ctx_t *bc = (blast_ctx_t *)arg;
+    const token_entry_t *e = &bc->entries[index];
+    char ip[TOKEN_IP_LEN];
+    token_ip_format(e->ip, ip);
+
+    /* Tokens APNs will never accept again are dropped, not retried next blast */
+    bool prune = apns_reason_is_permanent(resp->reason);
+    trace_rec(TRACE_BLAST_ITEM, trace_job(), resp->status, (int32_t)e->ip);
+    results_publish(bc->job, e->ip, r, resp);
+    if (r == ESP_OK) {
+        TRACE_LOGI(TAG, "blast #%lu [%s]: ok (apns-id %s)", (unsigned long)bc->id, ip, resp->id);
+    } else if (prune) {
+        ESP_LOGW(TAG, "blast #%lu [%s]: %s — removing from store",
+                 (unsigned long)bc->id, ip, apns_reason_name(resp->reason));
+        token_store_send_del(e->ip);
+    } else if (resp->status) {
+        ESP_LOGW(TAG, "blast #%lu [%s]: %d %s (apns-id %s)", (unsigned long)bc->id, ip,
+                 resp->status, apns_reason_name(resp->reason), resp->id);
+    } else {
+        ESP_LOGW(TAG, "blast #%lu [%s]: fail (%s)", (unsigned long)bc->id, ip, esp_err_to_name(r));
+    }
+
+    portENTER_CRITICAL(&s_blast_lock);
+    push_blast_status_t *b = blast_slot(bc->id);
+    if (b) {
+        b->sent++;
+        if (r == ESP_OK)                     b->ok++;
+        else if (r == APNS_ERR_UNREGISTERED) b->unregistered++;
+        else                                 b->failed++;
+        if (prune)                           b->pruned++;
+    }
+    portEXIT_CRITICAL(&s_blast_lock);
+}
+
+/* Tokens per apns_send_batch() round; bounds the blast's stack use */
+#define BLAST_CHUNK 32
+
+_Static_assert(sizeof(((push_job_t *)0)->tags[0]) == TOKEN_TAG_LEN, "blast tags are store tag names");
+
+/** Open a cursor over the blast's recipients: the send list, or its tagged part. */
+static void blast_cursor_open(token_cursor_t *cur, const push_job_t *p, token_server_t server)
+{
+    if (p->ntags == 0) {
+        token_store_cursor_open(cur, TOKEN_LIST_SEND, server);
+    } else {
+        /* A tag dropped since submit leaves the cursor closed: nobody matches */
+        token_store_cursor_open_tagged(cur, TOKEN_LIST_SEND, server, p->tags, p->ntags);
+    }
+}
+
+/* Runs on the single bulk worker, so blasts never interleave */
+static void run_blast(const push_job_t *p)
+{
+    apns_config_t cfg = g_apns_config;
+    cfg.use_sandbox = p->use_sandbox;
+    token_server_t server = p->use_sandbox ? TOKEN_SERVER_SANDBOX : TOKEN_SERVER_PRODUCTION;
+
+    /* The body is identical for every recipient: encode it once */
+    apns_notification_t tmpl = {
+        .title          = p->title,
+        .body           = p->body,
+        .badge          = p->badge,
+        .sound          = p->has_sound  ? p->sound          : NULL,
+        .custom_payload = p->has_custom ? p->custom_payload : NULL,
+    };
+    char payload[APNS_PAYLOAD_MAX];
+    if (apns_payload_encode(&tmpl, payload, sizeof(payload), NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "blast #%lu aborted — payload exceeds %d bytes",
+                 (unsigned long)p->blast_id, APNS_PAYLOAD_MAX);
+        blast_finish(p->blast_id, PUSH_BLAST_FAILED);
+        return;
+    }
+    tmpl.payload = payload;
+
+    token_cursor_t cur;
+    blast_cursor_open(&cur, p, server);
+    size_t total = token_store_cursor_skip(&cur, SIZE_MAX);
+    token_store_cursor_close(&cur);
+
+    if (!blast_start(p->blast_id, (uint32_t)total)) {
+        ESP_LOGI(TAG, "blast #%lu cancelled before it started", (unsigned long)p->blast_id);
+        return;
+    }
+
+    /* Walk the recipients a chunk at a time; each chunk goes out as
+     * concurrent streams on the shared connection */
+    token_entry_t       entries[BLAST_CHUNK];
+    char                hex[BLAST_CHUNK][TOKEN_HEX_LEN];
+    apns_notification_t notifs[BLAST_CHUNK];
+    blast_ctx_t bc = { .entries = entries, .job = p, .id = p->blast_id };
+    bool cancelled = false;
+    size_t count;
+
+    blast_cursor_open(&cur, p, server);
+    while ((count = token_store_cursor_next(&cur, entries, BLAST_CHUNK)) > 0) {
+        if (blast_cancel_requested(p->blast_id)) {
+            cancelled = true;
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            token_hex_format(entries[i].token, hex[i]);
+            notifs[i] = tmpl;
+            notifs[i].device_token = hex[i];
+        }
+        apns_send_batch(&cfg, notifs, count, H2_PRIORITY_BULK, blast_result_cb, &bc);
+    }
+    token_store_cursor_close(&cur);
+    blast_finish(p->blast_id, cancelled ? PUSH_BLAST_CANCELLED : PUSH_BLAST_DONE);
+
+    push_blast_status_t st;
+    if (push_blast_get(p->blast_id, &st) == ESP_OK) {
+        ESP_LOGI(TAG, "blast #%lu %s — %lu ok, %lu fail, %lu unregistered, %lu pruned in %lld ms (server=%s)",
+                 (unsigned long)st.id, cancelled ? "cancelled" : "done",
+                 (unsigned long)st.ok, (unsigned long)st.failed, (unsigned long)st.unregistered,
+                 (unsigned long)st.pruned,
+                 (long long)((st.finished_us - st.started_us) / 1000),
+                 p->use_sandbox ? "sandbox" : "production");
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Outbox drain                                                       */
+/* ------------------------------------------------------------------ */
+
+/* Outbox records per send_batch() round */
+#define DRAIN_CHUNK 16
+
+_Static_assert(sizeof(push_job_t) <= OUTBOX_DATA_MAX, "a push job must fit an outbox slot");
+
+/* Only the bulk worker drains, so the chunk can be static (and in PSRAM) */
+static EXT_RAM_BSS_ATTR push_job_t s_drain_jobs[DRAIN_CHUNK];
+static outbox_meta_t               s_drain_meta[DRAIN_CHUNK];
+
+/* At most one drain job queued; the job itself carries no data */
+static EXT_RAM_BSS_ATTR push_job_t s_drain_job;
+static bool                        s_drain_queued;
+static portMUX_TYPE                s_drain_lock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct {
+    const size_t *map;      /* batch index → chunk index */
+    size_t        kept;
+} drain_ctx_t;
+
+static void drain_result_cb(size_t index, esp_err_t r, const h2_response_t *resp, void *arg)
+{
+    drain_ctx_t *dc = (drain_ctx_t *)arg;
+    size_t i = dc->map[index];
+    const push_job_t *p = &s_drain_jobs[i];
+
+    if (unanswered(r)) {
+        dc->kept++;   /* stays queued for the next drain */
+        return;
+    }
+    outbox_consume(s_drain_meta[i].seq, false);
+    trace_rec(TRACE_JOB_DONE, p->job_id, p->platform, r);
+    results_publish(p, 0, r, resp);
+    if (r == ESP_OK) {
+        TRACE_LOGI(TAG, "outbox [%.16s...] → ok (id %s)", p->device_token, resp->id);
+    } else if (resp->status) {
+        ESP_LOGW(TAG, "outbox [%.16s...] → %d %s", p->device_token, resp->status,
+                 p->platform == PUSH_PLATFORM_FCM ? fcm_reason_name(resp->reason)
+                                                  : apns_reason_name(resp->reason));
+    } else {
+        ESP_LOGW(TAG, "outbox [%.16s...] → %s", p->device_token, esp_err_to_name(r));
+    }
+}
+
+/* Outbox records are sent one batch per host: APNs production, APNs sandbox, FCM */
+#define DRAIN_GROUPS 3
+
+static int drain_group(const push_job_t *p)
+{
+    if (p->platform == PUSH_PLATFORM_FCM) return 2;
+    return p->use_sandbox ? 1 : 0;
+}
+
+/*
+ * Send the outbox oldest first, a chunk at a time, each chunk pipelined over
+ * the connection like a blast.  Stops when the link drops again or a chunk
+ * gets no answer; whatever is left waits for the next drain_kick().
+ */
+static void run_drain(void)
+{
+    portENTER_CRITICAL(&s_drain_lock);
+    s_drain_queued = false;
+    portEXIT_CRITICAL(&s_drain_lock);
+
+    size_t n, sent = 0, kept = 0;
+    while (kept == 0 && s_online &&
+           (n = outbox_peek(s_drain_jobs, sizeof(push_job_t), s_drain_meta, DRAIN_CHUNK)) > 0) {
+        uint32_t now = (uint32_t)time(NULL);
+        union {
+            apns_notification_t apns[DRAIN_CHUNK];
+            fcm_notification_t  fcm[DRAIN_CHUNK];
+        } notifs;
+        size_t map[DRAIN_CHUNK];
+        drain_ctx_t dc = { .map = map };
+
+        /* One host per send_batch() call */
+        for (int group = 0; group < DRAIN_GROUPS; group++) {
+            size_t count = 0;
+            for (size_t i = 0; i < n; i++) {
+                const push_job_t *p = &s_drain_jobs[i];
+                if (drain_group(p) != group) continue;
+                if (s_drain_meta[i].len != sizeof(push_job_t) ||
+                    (s_drain_meta[i].expires && now >= s_drain_meta[i].expires)) {
+                    /* Out of time, or written by firmware with another job layout */
+                    ESP_LOGW(TAG, "outbox [%.16s...] expired unsent", p->device_token);
+                    outbox_consume(s_drain_meta[i].seq, true);
+                    continue;
+                }
+                if (group == 2) job_fcm_notification(p, &notifs.fcm[count]);
+                else            job_notification(p, &notifs.apns[count]);
+                map[count++] = i;
+            }
+            if (count == 0) continue;
+
+            if (group == 2) {
+#if CONFIG_FCM_ENABLE
+                fcm_send_batch(&g_fcm_config, notifs.fcm, count, H2_PRIORITY_BULK,
+                               drain_result_cb, &dc);
+#else
+                /* Spooled by firmware built with FCM: no way to send them now */
+                for (size_t k = 0; k < count; k++) {
+                    outbox_consume(s_drain_meta[map[k]].seq, true);
+                }
+                continue;
+#endif
+            } else {
+                apns_config_t cfg = g_apns_config;
+                cfg.use_sandbox = group == 1;
+                apns_send_batch(&cfg, notifs.apns, count, H2_PRIORITY_BULK, drain_result_cb, &dc);
+            }
+            sent += count;
+        }
+        kept = dc.kept;
+    }
+    outbox_flush();
+
+    if (sent) {
+        trace_rec(TRACE_DRAIN, trace_job(), (int32_t)(sent - kept), (int32_t)outbox_pending());
+        ESP_LOGI(TAG, "outbox drained %u push(es), %u still pending%s", (unsigned)(sent - kept),
+                 (unsigned)outbox_pending(), kept ? " — push service unreachable" : "");
+    }
+}
+
+/** Queue a drain on the bulk lane if there is anything to send and a way to send it. */
+static void drain_kick(void)
+{
+    if (!s_online || !s_opened_us || outbox_pending() == 0) return;
+
+    portENTER_CRITICAL(&s_drain_lock);
+    bool queued = s_drain_queued;
+    s_drain_queued = true;
+    portEXIT_CRITICAL(&s_drain_lock);
+    if (queued) return;
+
+    s_drain_job.type = PUSH_JOB_DRAIN;
+    if (push_queue_submit(&s_drain_job) != ESP_OK) {
+        /* Bulk lane full: a later kick retries */
+        portENTER_CRITICAL(&s_drain_lock);
+        s_drain_queued = false;
+        portEXIT_CRITICAL(&s_drain_lock);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Worker pool                                                        */
+/* ------------------------------------------------------------------ */
+
+static void push_worker_task(void *arg)
+{
+    QueueHandle_t lane = s_lanes[(push_lane_t)(uintptr_t)arg];
+    push_job_t job;   /* lives on the worker stack, reused for every job */
+
+    xEventGroupWaitBits(s_gate, GATE_OPEN_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    for (;;) {
+        if (xQueueReceive(lane, &job, portMAX_DELAY) != pdTRUE) continue;
+        int64_t wait_us = esp_timer_get_time() - job.enqueued_us;
+        h2_engine_record_queue_wait(wait_us);
+        trace_set_job(job.job_id);
+        trace_rec(TRACE_JOB_START, job.job_id, job.type,
+                  wait_us > INT32_MAX ? INT32_MAX : (int32_t)wait_us);
+
+        switch (job.type) {
+        case PUSH_JOB_BLAST: run_blast(&job);  break;
+        case PUSH_JOB_DRAIN: run_drain();      break;
+        default:             run_single(&job); break;
+        }
+        trace_set_job(0);
+        /* Spooled jobs reach flash together once the lane runs dry */
+        if (uxQueueMessagesWaiting(lane) == 0) outbox_flush();
+    }
+}
+
+static esp_err_t start_worker(const char *name, push_lane_t lane)
+{
+    if (xTaskCreatePinnedToCore(push_worker_task, name,
+                                CONFIG_PUSH_WORKER_STACK_SIZE, (void *)(uintptr_t)lane, 5, NULL,
+                                CONFIG_PUSH_WORKER_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start worker %s", name);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t push_queue_start(void)
+{
+    s_lanes[PUSH_LANE_INTERACTIVE] = xQueueCreateStatic(CONFIG_PUSH_QUEUE_DEPTH, sizeof(push_job_t),
+                                                        s_job_storage,
+                                                        &s_lane_bufs[PUSH_LANE_INTERACTIVE]);
+    s_lanes[PUSH_LANE_BULK]        = xQueueCreateStatic(CONFIG_PUSH_BULK_QUEUE_DEPTH, sizeof(push_job_t),
+                                                        s_bulk_storage,
+                                                        &s_lane_bufs[PUSH_LANE_BULK]);
+    s_gate = xEventGroupCreate();
+    if (!s_lanes[PUSH_LANE_INTERACTIVE] || !s_lanes[PUSH_LANE_BULK] || !s_gate) {
+        ESP_LOGE(TAG, "Failed to create job queue");
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < CONFIG_PUSH_WORKER_COUNT; i++) {
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "push_w%d", i);
+        esp_err_t ret = start_worker(name, PUSH_LANE_INTERACTIVE);
+        if (ret != ESP_OK) return ret;
+    }
+    esp_err_t ret = start_worker("push_b0", PUSH_LANE_BULK);
+    if (ret != ESP_OK) return ret;
+
+    ESP_LOGI(TAG, "%d interactive + 1 bulk push workers on core %d, queue depth %d + %d",
+             CONFIG_PUSH_WORKER_COUNT, CONFIG_PUSH_WORKER_CORE,
+             CONFIG_PUSH_QUEUE_DEPTH, CONFIG_PUSH_BULK_QUEUE_DEPTH);
+    return ESP_OK;
+}
+
+void push_queue_open(void)
+{
+    if (!s_gate || s_opened_us) return;
+    s_opened_us = esp_timer_get_time();
+    xEventGroupSetBits(s_gate, GATE_OPEN_BIT);
+    ESP_LOGI(TAG, "Clock valid, sending (%u job(s) were waiting)",
+             (unsigned)push_queue_pending());
+    drain_kick();
+}
+
+void push_queue_set_online(bool online)
+{
+    if (s_online == online) return;
+    s_online = online;
+    if (online) {
+        ESP_LOGI(TAG, "Link up (%u push(es) in the outbox)", (unsigned)outbox_pending());
+        drain_kick();
+    } else {
+        ESP_LOGW(TAG, "Link down — single pushes go to the outbox");
+    }
+}
+
+int64_t push_queue_opened_us(void)
+{
+    return s_opened_us;
+}
+
+esp_err_t push_queue_submit(push_job_t *job)
+{
+    return push_queue_submit_wait(job, 0);
+}
+
+esp_err_t push_queue_submit_wait(push_job_t *job, uint32_t timeout_ms)
+{
+    QueueHandle_t lane = s_lanes[push_job_lane(job)];
+    if (!lane) return ESP_ERR_INVALID_STATE;
+    job->enqueued_us = esp_timer_get_time();
+    job->blast_id    = 0;
+    portENTER_CRITICAL(&s_blast_lock);
+    job->job_id = s_next_job_id++;
+    if (s_next_job_id == 0) s_next_job_id = 1;
+    portEXIT_CRITICAL(&s_blast_lock);
+    if (job->type == PUSH_JOB_BLAST) {
+        job->blast_id = blast_alloc(job->use_sandbox, job->enqueued_us);
+        if (job->blast_id == 0) return ESP_ERR_NO_MEM;
+    }
+    if (xQueueSend(lane, job, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+        if (job->blast_id) blast_free(job->blast_id);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+push_lane_t push_job_lane(const push_job_t *job)
+{
+    return job->type == PUSH_JOB_SINGLE ? PUSH_LANE_INTERACTIVE : PUSH_LANE_BULK;
+}
+
+size_t push_queue_pending_lane(push_lane_t lane)
+{
+    return s_lanes[lane] ? (size_t)uxQueueMessagesWaiting(s_lanes[lane]) : 0;
+}
+
+size_t push_queue_pending(void)
+{
+    return push_queue_pending_lane(PUSH_LANE_INTERACTIVE) + push_queue_pending_lane(PUSH_LANE_BULK);
+}
+
+esp_err_t push_blast_get(uint32_t id, push_blast_status_t *out)
+{
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    portENTER_CRITICAL(&s_blast_lock);
+    const push_blast_status_t *b = blast_slot(id);
+    if (b) {
+        *out = *b;
+        ret  = ESP_OK;
+    }
+    portEXIT_CRITICAL(&s_blast_lock);
+    return ret;
+}
+
+esp_err_t push_blast_cancel(uint32_t id)
+{
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    portENTER_CRITICAL(&s_blast_lock);
+    push_blast_status_t *b = blast_slot(id);
+    if (b) {
+        if (b->state == PUSH_BLAST_QUEUED) {
+            /* The worker sees this when it dequeues the job and skips it */
+            b->state       = PUSH_BLAST_CANCELLED;
+            b->finished_us = esp_timer_get_time();
+            ret = ESP_OK;
+        } else if (b->state == PUSH_BLAST_RUNNING) {
+            b->cancel_requested = true;
+            ret = ESP_OK;
+        } else {
+            ret = ESP_ERR_INVALID_STATE;
+        }
+    }
+    portEXIT_CRITICAL(&s_blast_lock);
+    return ret;
+}
+
+const char *push_blast_state_name(push_blast_state_t state)
+{
+    switch (state) {
+    case PUSH_BLAST_QUEUED:    return "queued";
+    case PUSH_BLAST_RUNNING:   return "running";
+    case PUSH_BLAST_DONE:      return "done";
+    case PUSH_BLAST_CANCELLED: return "cancelled";
+    case PUSH_BLAST_FAILED:    return "failed";
+    }
+    return "unknown";
+}
@@ -0,0 +1,197 @@
+/*
+ * push_queue.h — bounded send-job queue served by a fixed worker pool
+ *
+ * HTTP handlers parse a request into a push_job_t and hand it to
+ * push_queue_submit(), which copies it into a FreeRTOS queue and returns
+ * immediately.  A fixed set of worker tasks, pinned to the core that is
+ * not running WiFi / httpd, drain the queue and drive the APNs client (or,
+ * for single pushes to Android devices, the FCM client; both send through
+ * the one HTTP/2 engine).
+ *
+ * There are two lanes with their own queue and workers: single pushes
+ * (interactive) and blasts (bulk).  CONFIG_PUSH_WORKER_COUNT workers serve
+ * the interactive lane and one worker serves the bulk lane, so a running
+ * blast never occupies a worker a /push needs.  On the connection itself,
+ * a blast leaves stream slots free and carries interactive sends ahead of
+ * its own (see H2_PRIORITY_BULK).
+ *
+ * Jobs are passed by value, so the queue owns its storage up front and
+ * nothing is allocated per push.
+ *
+ * Single pushes that cannot go out — the link is down, or APNs never
+ * answered — are spooled to the flash outbox (outbox.h) instead of being
+ * dropped.  The bulk worker drains it, pipelined like a blast, once the
+ * link is back (push_queue_set_online()) and the clock is valid.
+ *
+ * Every job gets a job id at submit time, which tags its records in the
+ * trace ring (trace.h) for as long as a worker is running it, and the
+ * per-push outcomes it publishes to live subscribers (results.h).
+ *
+ * Blast jobs also get an id at submit time and a slot in a small RAM ring that
+ * tracks their progress (push_blast_get()) until newer blasts evict it.
+ * Blasts run one at a time on the bulk worker so they do not interleave on
+ * the APNs connection; a later one waits, still "queued", for the current
+ * one to finish.  push_blast_cancel() stops a blast between chunks.
+ * A blast that names tags goes only to the send-list entries carrying any
+ * of them, walked through the store's tag bitmaps; the payload is still
+ * encoded once and the chunks share the one connection.
+ *
+ * Tunables (menuconfig → "APNs Configuration" → "Push Worker Pool"):
+ *   CONFIG_PUSH_WORKER_COUNT       number of interactive worker tasks
+ *   CONFIG_PUSH_QUEUE_DEPTH        max queued single pushes before backpressure
+ *   CONFIG_PUSH_BULK_QUEUE_DEPTH   max queued blasts before backpressure
+ *   CONFIG_PUSH_WORKER_CORE        core the workers are pinned to
+ *   CONFIG_PUSH_WORKER_STACK_SIZE  stack per worker (bytes)
+ *   CONFIG_PUSH_BLAST_HISTORY      blast jobs tracked in the progress ring
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PUSH_JOB_SINGLE,   /*!< one notification to device_token */
+    PUSH_JOB_BLAST,    /*!< same notification to the send list, or its tagged part */
+    PUSH_JOB_DRAIN,    /*!< internal: send what the outbox holds */
+} push_job_type_t;
+
+typedef enum {
+    PUSH_PLATFORM_APNS,          /*!< apns_send_notification(); blasts are always APNs */
+    PUSH_PLATFORM_FCM,           /*!< fcm_send_notification(), PUSH_JOB_SINGLE only */
+} push_platform_t;
+
+#define PUSH_BLAST_TAGS_MAX  4
+
+typedef struct {
+    push_job_type_t type;
+    push_platform_t platform;
+    char device_token[192];      /*!< PUSH_JOB_SINGLE only; FCM tokens run to ~160 chars */
+    char title[128];
+    char body[256];
+    int  badge;
+    char sound[32];
+    char custom_payload[256];    /*!< APNs: extra root fields; FCM: members of "data" */
+    bool has_sound;
+    bool has_custom;
+    bool use_sandbox;
+    int  ttl_s;                  /*!< outbox lifetime: < 0 = CONFIG_OUTBOX_TTL_S, 0 = never spooled */
+    int64_t enqueued_us;         /*!< set by push_queue_submit(), for the queue-wait metric */
+    uint32_t job_id;             /*!< set by push_queue_submit(), names the job in the trace */
+    uint32_t blast_id;           /*!< PUSH_JOB_BLAST: assigned by push_queue_submit() */
+    char    tags[PUSH_BLAST_TAGS_MAX][16];   /*!< PUSH_JOB_BLAST: only entries with any of these */
+    uint8_t ntags;               /*!< 0 = the whole send list */
+} push_job_t;
+
+typedef enum {
+    PUSH_LANE_INTERACTIVE,   /*!< PUSH_JOB_SINGLE */
+    PUSH_LANE_BULK,          /*!< PUSH_JOB_BLAST, PUSH_JOB_DRAIN */
+    PUSH_LANE_COUNT,
+} push_lane_t;
+
+typedef enum {
+    PUSH_BLAST_QUEUED,
+    PUSH_BLAST_RUNNING,
+    PUSH_BLAST_DONE,
+    PUSH_BLAST_CANCELLED,
+    PUSH_BLAST_FAILED,           /*!< never started (payload too large) */
+} push_blast_state_t;
+
+/** Progress snapshot of one blast job.  ok + failed + unregistered == sent. */
+typedef struct {
+    uint32_t id;                 /*!< 0 = free slot */
+    push_blast_state_t state;
+    bool     use_sandbox;
+    bool     cancel_requested;
+    uint32_t total;              /*!< matching send-list entries when the blast started */
+    uint32_t sent;
+    uint32_t ok;
+    uint32_t failed;
+    uint32_t unregistered;       /*!< also removed from the send list */
+    uint32_t pruned;             /*!< removed for any permanent reason, unregistered included */
+    int64_t  queued_us;
+    int64_t  started_us;         /*!< 0 until a worker picks it up */
+    int64_t  finished_us;        /*!< 0 while queued / running */
+} push_blast_status_t;
+
+/**
+ * @brief Create the job queue and start the worker tasks.
+ *        Call once after apns_init() and before api_server_start().
+ *
+ * Jobs are accepted straight away, but workers hold them until
+ * push_queue_open() reports a valid clock, so the API can come up before
+ * SNTP has finished.
+ */
+esp_err_t push_queue_start(void);
+
+/**
+ * @brief Let the workers start sending: the system time is now good for
+ *        JWT timestamps.  Idempotent.
+ */
+void push_queue_open(void);
+
+/** Boot → push_queue_open() in microseconds, 0 while still held. */
+int64_t push_queue_opened_us(void);
+
+/**
+ * @brief Report the link state.  While offline, single pushes go straight
+ *        to the outbox; coming back online starts draining it.
+ */
+void push_queue_set_online(bool online);
+
+/**
+ * @brief Stamp @p job with the enqueue time and a job id and queue a copy
+ *        without blocking.  For blasts, also assigns @p job->blast_id and a
+ *        progress slot.
+ *
+ * @return
+ *   - ESP_OK on success
+ *   - ESP_ERR_NO_MEM if the job's lane (or, for blasts, the progress ring) is
+ *     full — caller should report backpressure
+ *   - ESP_ERR_INVALID_STATE if push_queue_start() has not run
+ */
+esp_err_t push_queue_submit(push_job_t *job);
+
+/**
+ * @brief push_queue_submit(), but wait up to @p timeout_ms for a free queue
+ *        slot.  For callers that feed many jobs in a row (POST /push/batch)
+ *        and would rather pace themselves to the workers than drop jobs.
+ */
+esp_err_t push_queue_submit_wait(push_job_t *job, uint32_t timeout_ms);
+
+/** Lane @p job is queued on. */
+push_lane_t push_job_lane(const push_job_t *job);
+
+/** Jobs currently waiting for a worker, both lanes together. */
+size_t push_queue_pending(void);
+
+/** Jobs currently waiting in @p lane. */
+size_t push_queue_pending_lane(push_lane_t lane);
+
+/**
+ * @brief Copy the progress of blast @p id into @p out.
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if the id is unknown or was evicted
+ */
+esp_err_t push_blast_get(uint32_t id, push_blast_status_t *out);
+
+/**
+ * @brief Cancel blast @p id.  A queued blast is cancelled at once; a running
+ *        one stops after the chunk in flight (up to 32 sends) completes.
+ * @return
+ *   - ESP_OK if the blast is (or will shortly be) cancelled
+ *   - ESP_ERR_NOT_FOUND if the id is unknown or was evicted
+ *   - ESP_ERR_INVALID_STATE if it already finished
+ */
+esp_err_t push_blast_cancel(uint32_t id);
+
+/** "queued", "running", "done", "cancelled" or "failed". */
+const char *push_blast_state_name(push_blast_state_t state);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,106 @@
+/*
+ * results.c — delivery result ring
+ *
+ * A seq_ring_t of result_rec_t, like the trace ring.  Readers keep their
+ * own cursor, so one slow subscriber never holds up another, nor the
+ * senders.
+ */
+#include "results.h"
+#include "seq_ring.h"
+#include "apns.h"
+#include "fcm.h"
+
+#include "esp_attr.h"
+#include "sdkconfig.h"
+
+const char *results_reason_name(const result_rec_t *r)
+{
+    if (r->reason) {
+        return r->platform == PUSH_PLATFORM_FCM ? fcm_reason_name((fcm_reason_t)r->reason)
+                                                : apns_reason_name((apns_reason_t)r->reason);
+    }
+    return r->err == ESP_OK ? "" : esp_err_to_name(r->err);
+}
+
+#if CONFIG_RESULTS_ENABLE
+
+#define RESULTS_SIZE  CONFIG_RESULTS_RING_SIZE
+#define RESULTS_MASK  (RESULTS_SIZE - 1)
+_Static_assert((RESULTS_SIZE & RESULTS_MASK) == 0, "CONFIG_RESULTS_RING_SIZE must be a power of two");
+
+static EXT_RAM_BSS_ATTR result_rec_t s_recs[RESULTS_SIZE];
+static seq_ring_t s_ring = SEQ_RING_INIT(s_recs, RESULTS_SIZE);
+static void     (*s_notify)(void);
+
+void results_set_notify(void (*fn)(void))
+{
+    s_notify = fn;
+}
+
+void results_publish(const push_job_t *job, uint32_t ip, esp_err_t err,
+                     const h2_response_t *resp)
+{
+    /* Single pushes only see an error code; the reason is folded into it */
+    int reason = resp ? resp->reason : 0;
+    if (!reason) {
+        reason = job->platform == PUSH_PLATFORM_FCM ? (int)fcm_err_reason(err)
+                                                    : (int)apns_err_reason(err);
+    }
+    result_rec_t rec = {
+        .job        = job->job_id,
+        .ip         = ip,
+        .latency_us = resp ? resp->rtt_us : 0,
+        .err        = err,
+        .status     = resp ? (int16_t)resp->status : 0,
+        .type       = (uint8_t)job->type,
+        .platform   = (uint8_t)job->platform,
+        .reason     = (uint16_t)reason,
+    };
+
+    seq_ring_push(&s_ring, &rec);
+
+    void (*notify)(void) = s_notify;
+    if (notify) notify();
+}
+
+size_t results_read(uint32_t *seq, result_rec_t *out, size_t max, uint32_t *lost)
+{
+    return seq_ring_read(&s_ring, seq, out, max, lost);
+}
+
+uint32_t results_head(void)
+{
+    return seq_ring_head(&s_ring);
+}
+
+#else
+
+void results_set_notify(void (*fn)(void))
+{
+    (void)fn;
+}
+
+void results_publish(const push_job_t *job, uint32_t ip, esp_err_t err,
+                     const h2_response_t *resp)
+{
+    (void)job;
+    (void)ip;
+    (void)err;
+    (void)resp;
+}
+
+size_t results_read(uint32_t *seq, result_rec_t *out, size_t max, uint32_t *lost)
+{
+    (void)seq;
+    (void)out;
+    (void)max;
+    *lost = 0;
+    return 0;
+}
+
+uint32_t results_head(void)
+{
+    return 0;
+}
+
+#endif /* CONFIG_RESULTS_ENABLE */
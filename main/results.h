@@ -0,0 +1,84 @@
+/*
+ * results.h — per-push delivery results for live subscribers
+ *
+ * Every push that reaches a final outcome — a single push answered or
+ * given up on, one recipient of a blast, an outbox resend — is published
+ * as one small record: job id, recipient IP, :status, provider reason and
+ * latency.  Records go into a bounded RAM ring; GET /results streams them
+ * to subscribers as Server-Sent Events, each subscriber reading at its own
+ * position.  A subscriber that falls a whole ring behind loses the oldest
+ * records rather than holding up the senders.
+ *
+ * Pushes kept in the outbox are published when they are finally sent (or
+ * dropped by the peer), under their original job id.
+ *
+ * Tunables (menuconfig → "APNs Configuration" → "Live Results"):
+ *   CONFIG_RESULTS_ENABLE        publish results and serve GET /results
+ *   CONFIG_RESULTS_RING_SIZE     records buffered (power of two, 24 bytes each)
+ *   CONFIG_RESULTS_MAX_CLIENTS   concurrent subscribers
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "h2_engine.h"
+#include "push_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t job;                /*!< push job id (push_job_t.job_id) */
+    uint32_t ip;                 /*!< recipient IPv4, 0 = addressed by device token */
+    uint32_t latency_us;         /*!< request submitted → answer, 0 if none arrived */
+    int32_t  err;                /*!< esp_err_t result, ESP_OK on 200 */
+    int16_t  status;             /*!< HTTP :status, 0 = no response */
+    uint8_t  type;               /*!< push_job_type_t of the job */
+    uint8_t  platform;           /*!< push_platform_t */
+    uint16_t reason;             /*!< apns_reason_t / fcm_reason_t, 0 = none */
+} result_rec_t;                  /* 24 bytes */
+
+/**
+ * @brief Publish the outcome of one push.  Callable from any task; a no-op
+ *        with CONFIG_RESULTS_ENABLE off.
+ *
+ * @param job   the job the push belongs to; its type, platform and id are used
+ * @param ip    recipient IPv4 (blasts), 0 for a push addressed by token
+ * @param err   the send result
+ * @param resp  the answer, or NULL if there was none
+ */
+void results_publish(const push_job_t *job, uint32_t ip, esp_err_t err,
+                     const h2_response_t *resp);
+
+/**
+ * @brief Called after each publish, e.g. to wake the code that streams to
+ *        subscribers.  Runs on the publishing task; must not block.
+ */
+void results_set_notify(void (*fn)(void));
+
+/**
+ * @brief Copy records from sequence number *@p seq on, oldest first.
+ *
+ * Same contract as trace_read(): records are numbered from 0 at boot, a
+ * cursor that has been overwritten (or comes from before a reboot) starts
+ * at the oldest record held and *@p lost counts what was skipped, and
+ * *@p seq is left at the next record to read.
+ *
+ * @return records copied, at most @p max
+ */
+size_t results_read(uint32_t *seq, result_rec_t *out, size_t max, uint32_t *lost);
+
+/** Sequence number the next record will get. */
+uint32_t results_head(void);
+
+/**
+ * The provider's reason for @p r ("Unregistered", "UNREGISTERED", ...);
+ * for a failure without one, the esp_err_t name; "" on success.
+ */
+const char *results_reason_name(const result_rec_t *r);
+
+#ifdef __cplusplus
+}
+#endif
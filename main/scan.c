@@ -1,16 +1,20 @@
 /*
  * ESP32 APNs (Apple Push Notification) Demo
  *
- * Connects to WiFi, syncs time via SNTP, then sends a push notification
- * to an iOS device through Apple's APNs HTTP/2 API.
+ * Connects to WiFi and serves the HTTP API as soon as it has an IP.  SNTP
+ * runs in the background; pushes accepted before the clock is valid wait
+ * in the job queue and go out once it is.
  *
  * Configuration:  idf.py menuconfig → "APNs Configuration"
  * APNs key:       Place your .p8 file at main/certs/apns_auth_key.p8
+ * FCM key:        With CONFIG_FCM_ENABLE, place the service account's
+ *                 private_key (PEM) at main/certs/fcm_service_account.pem
  */
 
 #include <string.h>
 #include <time.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
@@ -19,7 +23,10 @@
 #include "esp_netif.h"
 #include "esp_netif_sntp.h"
 #include "apns.h"
+#include "fcm.h"
 #include "api_server.h"
+#include "outbox.h"
+#include "push_queue.h"
 #include "token_store.h"
 
 static const char *TAG = "main";
@@ -37,12 +44,33 @@ static bool s_connected_once = false;
 extern const char apns_auth_key_start[] asm("_binary_apns_auth_key_p8_start");
 extern const char apns_auth_key_end[]   asm("_binary_apns_auth_key_p8_end");
 
+/* ---- Global APNs config (used by api_server) ---- */
+apns_config_t g_apns_config;
+
+#if CONFIG_FCM_ENABLE
+/* Embedded FCM service account key */
+extern const char fcm_sa_key_start[] asm("_binary_fcm_service_account_pem_start");
+
+/* ---- Global FCM config (used by push_queue) ---- */
+fcm_config_t g_fcm_config;
+#endif
+
+/** Warm every push host the next send is likely to need. */
+static void prewarm_hosts(void)
+{
+    apns_prewarm(g_apns_config.use_sandbox);
+#if CONFIG_FCM_ENABLE
+    fcm_prewarm();
+#endif
+}
+
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        push_queue_set_online(false);
         if (s_connected_once) {
             /* After first successful connect: always retry — no hard cap */
             esp_wifi_connect();
@@ -59,8 +87,13 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
         ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+        if (s_connected_once) {
+            /* The old socket died with the link: reconnect before the next push needs it */
+            prewarm_hosts();
+        }
         s_connected_once = true;
         s_retry_num = 0;
+        push_queue_set_online(true);
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
@@ -114,21 +147,34 @@ static void sync_time(void)
     esp_sntp_config_t sntp_cfg = ESP_NETIF_SNTP_DEFAULT_CONFIG("pool.ntp.org");
     esp_netif_sntp_init(&sntp_cfg);
 
-    if (esp_netif_sntp_sync_wait(pdMS_TO_TICKS(20000)) != ESP_OK) {
-        ESP_LOGW(TAG, "NTP sync failed – JWT timestamps may be wrong");
-    } else {
-        time_t now;
-        struct tm ti;
-        time(&now);
-        localtime_r(&now, &ti);
-        char buf[64];
-        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &ti);
-        ESP_LOGI(TAG, "Time synced: %s", buf);
+    /* Keep waiting: pushes stay queued until the clock is usable */
+    while (esp_netif_sntp_sync_wait(pdMS_TO_TICKS(20000)) != ESP_OK) {
+        ESP_LOGW(TAG, "NTP sync still pending – pushes are held until it succeeds");
     }
+
+    time_t now;
+    struct tm ti;
+    time(&now);
+    localtime_r(&now, &ti);
+    char buf[64];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &ti);
+    ESP_LOGI(TAG, "Time synced: %s", buf);
 }
 
-/* ---- Global APNs config (used by api_server) ---- */
-apns_config_t g_apns_config;
+/*
+ * Background stage of the boot: the API is already up.  Once the clock is
+ * valid, release the queued pushes and warm the APNs connection.
+ */
+static void time_sync_task(void *arg)
+{
+    bool already_open = push_queue_opened_us() != 0;   /* RTC clock was kept */
+    sync_time();
+    if (!already_open) {
+        push_queue_open();
+        prewarm_hosts();
+    }
+    vTaskDelete(NULL);
+}
 
 /* ---- Entry point ---- */
 
@@ -145,14 +191,16 @@ void app_main(void)
     /* Token store (NVS must be ready first) */
     ESP_ERROR_CHECK(token_store_init());
 
+#if CONFIG_OUTBOX_ENABLE
+    /* Pushes kept from before the reset; without the partition none are kept */
+    outbox_init();
+#endif
+
     /* WiFi */
     if (wifi_init_sta() != ESP_OK) {
         return;
     }
 
-    /* Time sync (JWT needs accurate timestamps) */
-    sync_time();
-
     /* Set up APNs config (global) */
     g_apns_config.team_id      = CONFIG_APNS_TEAM_ID;
     g_apns_config.key_id       = CONFIG_APNS_KEY_ID;
@@ -164,11 +212,33 @@ void app_main(void)
     g_apns_config.use_sandbox  = false;
 #endif
 
-    /* Init APNs module (creates internal send mutex) */
-    ESP_ERROR_CHECK(apns_init());
+    /* Init APNs module (parses the .p8 key, starts JWT refresher; no clock needed) */
+    ESP_ERROR_CHECK(apns_init(&g_apns_config));
+
+#if CONFIG_FCM_ENABLE
+    /* Init FCM on the same HTTP/2 engine (parses the key, starts the token task) */
+    g_fcm_config.project_id = CONFIG_FCM_PROJECT_ID;
+    g_fcm_config.sa_email   = CONFIG_FCM_SA_EMAIL;
+    g_fcm_config.sa_key_pem = fcm_sa_key_start;
+    ESP_ERROR_CHECK(fcm_init(&g_fcm_config));
+#endif
+
+    /* Push worker pool (must exist before the API accepts jobs) */
+    ESP_ERROR_CHECK(push_queue_start());
 
-    /* Start API server */
+    /* Start API server: registration and queries work from here on */
     api_server_start();
 
     ESP_LOGI(TAG, "API server ready — HTTP Basic Auth required on all endpoints");
+
+    /* A clock that survived a soft reset is good enough to start sending now */
+    if (apns_clock_valid()) {
+        push_queue_open();
+        prewarm_hosts();
+    }
+
+    /* Time sync (JWT needs accurate timestamps) in the background */
+    if (xTaskCreate(time_sync_task, "time_sync", 4096, NULL, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start time sync task");
+    }
 }
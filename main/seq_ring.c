@@ -0,0 +1,45 @@
+/*
+ * seq_ring.c — fixed-size record ring addressed by sequence number
+ */
+#include "seq_ring.h"
+
+#include <string.h>
+
+void seq_ring_push(seq_ring_t *r, const void *rec)
+{
+    portENTER_CRITICAL_SAFE(&r->lock);
+    uint32_t i = r->head++ & (r->size - 1);
+    memcpy((uint8_t *)r->recs + (size_t)i * r->rec_size, rec, r->rec_size);
+    portEXIT_CRITICAL_SAFE(&r->lock);
+}
+
+size_t seq_ring_read(seq_ring_t *r, uint32_t *seq, void *out, size_t max, uint32_t *lost)
+{
+    portENTER_CRITICAL(&r->lock);
+    uint32_t head   = r->head;
+    uint32_t oldest = head > r->size ? head - r->size : 0;
+    uint32_t from   = *seq;
+    /* Outside [oldest, head]: overwritten, or a reader from before a reboot */
+    if (head - from > head - oldest) from = oldest;
+    *lost = *seq < from ? from - *seq : 0;
+
+    size_t n = head - from;
+    if (n > max) n = max;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t slot = (from + (uint32_t)i) & (r->size - 1);
+        memcpy((uint8_t *)out + i * r->rec_size,
+               (const uint8_t *)r->recs + (size_t)slot * r->rec_size, r->rec_size);
+    }
+    portEXIT_CRITICAL(&r->lock);
+
+    *seq = from + (uint32_t)n;
+    return n;
+}
+
+uint32_t seq_ring_head(seq_ring_t *r)
+{
+    portENTER_CRITICAL(&r->lock);
+    uint32_t head = r->head;
+    portEXIT_CRITICAL(&r->lock);
+    return head;
+}
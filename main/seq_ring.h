@@ -0,0 +1,54 @@
+/*
+ * seq_ring.h — fixed-size record ring addressed by sequence number
+ *
+ * The storage behind the trace ring (trace.h) and the result ring
+ * (results.h).  Records are numbered from 0 at boot and kept in a
+ * power-of-two array, so record N lives at N & mask and the oldest ones
+ * are overwritten once it is full.  Readers keep their own cursor.
+ * Writers and readers share a spinlock, held only for the copy of a record
+ * (or of a reader's batch).
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    void        *recs;
+    size_t       rec_size;
+    uint32_t     size;        /*!< records held, a power of two */
+    uint32_t     head;        /*!< sequence number of the next record */
+    portMUX_TYPE lock;
+} seq_ring_t;
+
+/** Static initialiser over the array @p recs of @p n records. */
+#define SEQ_RING_INIT(recs_, n_) {                              \
+    .recs = (recs_), .rec_size = sizeof((recs_)[0]), .size = (n_), \
+    .head = 0, .lock = portMUX_INITIALIZER_UNLOCKED }
+
+/** Append a copy of @p rec.  Callable from any task or ISR. */
+void seq_ring_push(seq_ring_t *r, const void *rec);
+
+/**
+ * @brief Copy records from sequence number *@p seq on, oldest first.
+ *
+ * If *@p seq has already been overwritten, or lies ahead of the head (a
+ * cursor from before a reboot), copying starts at the oldest record still
+ * held and *@p lost says how many were skipped.  On return *@p seq is the
+ * number of the next record to read.
+ *
+ * @return records copied, at most @p max
+ */
+size_t seq_ring_read(seq_ring_t *r, uint32_t *seq, void *out, size_t max, uint32_t *lost);
+
+/** Sequence number the next record will get (= records written since boot). */
+uint32_t seq_ring_head(seq_ring_t *r);
+
+#ifdef __cplusplus
+}
+#endif
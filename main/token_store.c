@@ -1,11 +1,49 @@
 /*
  * token_store.c — NVS-backed push token registry implementation
+ *
+ * The namespaces live in their own NVS partition ("tokens", see
+ * partitions.csv) so the registry is not squeezed by WiFi / PHY data.
+ * All four are loaded into an in-RAM hash index at init; reads
+ * are served from it and never touch flash.  Without write-behind,
+ * mutations write through to NVS first and update the index once the
+ * record write (nvs_set_blob / nvs_erase_key) succeeded; the commit comes
+ * later, once per namespace, in token_store_batch_end().  ESP-IDF's NVS has
+ * already written the record to flash when nvs_set_blob() returns, so in
+ * practice the index mirrors what survives a reboot; a commit that fails
+ * anyway is reported by token_store_batch_end(), but the index is not
+ * rolled back (NVS has no rollback to match it against).
+ *
+ * With CONFIG_TOKEN_STORE_WRITE_BEHIND the index is updated at once and the
+ * (list, ip) key goes into a small dirty table instead; a key changed again
+ * before the flush is still one entry there.  The "tok_flush" task writes
+ * whatever the index holds for each dirty key (or erases it if the key is
+ * gone), one commit per namespace.  Until then, the index is ahead of
+ * flash by at most the dirty table.
+ *
+ * Record format: key = packed IPv4 as 8 hex digits, value = 32-byte
+ * binary token blob, plus the entry's tag set as 4 more bytes when it is
+ * not empty.  Records written by older firmware (dotted-quad key, hex
+ * string value) are converted the first time they are loaded.
+ *
+ * Tag ids are stored in the records, their names in "tok_tags".  A name
+ * is only recycled once no entry in the index carries its id, so records
+ * never point at the wrong name.
  */
 #include "token_store.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_system.h"
+#endif
+#include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include "sdkconfig.h"
 
 static const char *TAG = "token_store";
 
@@ -13,267 +51,1130 @@ static const char *TAG = "token_store";
 #define NS_SEND_P  "tok_snd_p"   /* production send   */
 #define NS_BLOCK_S "tok_blk_s"   /* sandbox block     */
 #define NS_BLOCK_P "tok_blk_p"   /* production block  */
+#define NS_TAGS    "tok_tags"    /* tag id → name     */
 
-static const char *send_ns(const char *server_type)
+/* List ids double as index into s_ns_names; bit 0 is the server type */
+enum { LIST_SEND_S, LIST_SEND_P, LIST_BLOCK_S, LIST_BLOCK_P, LIST_COUNT };
+
+_Static_assert(LIST_COUNT == sizeof(((token_batch_t *)0)->handles) / sizeof(nvs_handle_t),
+               "token_batch_t needs one handle per list");
+_Static_assert(LIST_SEND_S + TOKEN_SERVER_PRODUCTION == LIST_SEND_P &&
+               LIST_BLOCK_S + TOKEN_SERVER_PRODUCTION == LIST_BLOCK_P,
+               "list id = base + server type");
+
+static const char *const s_ns_names[LIST_COUNT] = {
+    NS_SEND_S, NS_SEND_P, NS_BLOCK_S, NS_BLOCK_P,
+};
+
+static int send_list_id(token_server_t server)
 {
-    return (strcmp(server_type, "production") == 0) ? NS_SEND_P : NS_SEND_S;
+    return LIST_SEND_S + (server == TOKEN_SERVER_PRODUCTION);
 }
 
-static const char *block_ns(const char *server_type)
+static int block_list_id(token_server_t server)
 {
-    return (strcmp(server_type, "production") == 0) ? NS_BLOCK_P : NS_BLOCK_S;
+    return LIST_BLOCK_S + (server == TOKEN_SERVER_PRODUCTION);
 }
 
 /* ------------------------------------------------------------------ */
-/*  Internal helpers                                                   */
+/*  API-edge codecs                                                    */
 /* ------------------------------------------------------------------ */
 
-static esp_err_t ns_set(const char *ns, const char *key, const char *value)
+bool token_ip_parse(const char *s, uint32_t *out)
+{
+    uint32_t ip = 0;
+    for (int octet = 0; octet < 4; octet++) {
+        if (octet > 0 && *s++ != '.') return false;
+        unsigned v = 0;
+        int digits = 0;
+        while (*s >= '0' && *s <= '9' && digits < 3) {
+            v = v * 10 + (unsigned)(*s++ - '0');
+            digits++;
+        }
+        if (digits == 0 || v > 255) return false;
+        ip = (ip << 8) | v;
+    }
+    if (*s != '\0') return false;
+    *out = ip;
+    return true;
+}
+
+void token_ip_format(uint32_t ip, char out[TOKEN_IP_LEN])
+{
+    snprintf(out, TOKEN_IP_LEN, "%u.%u.%u.%u",
+             (unsigned)(ip >> 24), (unsigned)(ip >> 16) & 0xFF,
+             (unsigned)(ip >> 8) & 0xFF, (unsigned)ip & 0xFF);
+}
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool token_hex_parse(const char *s, uint8_t out[TOKEN_BIN_LEN])
+{
+    for (int i = 0; i < TOKEN_BIN_LEN; i++) {
+        int hi = hex_nibble(s[2 * i]);
+        int lo = (hi < 0) ? -1 : hex_nibble(s[2 * i + 1]);
+        if (lo < 0) return false;
+        out[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return s[2 * TOKEN_BIN_LEN] == '\0';
+}
+
+void token_hex_format(const uint8_t tok[TOKEN_BIN_LEN], char out[TOKEN_HEX_LEN])
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < TOKEN_BIN_LEN; i++) {
+        out[2 * i]     = digits[tok[i] >> 4];
+        out[2 * i + 1] = digits[tok[i] & 0x0F];
+    }
+    out[2 * TOKEN_BIN_LEN] = '\0';
+}
+
+token_server_t token_server_parse(const char *s)
+{
+    return (s && strcmp(s, "production") == 0) ? TOKEN_SERVER_PRODUCTION
+                                               : TOKEN_SERVER_SANDBOX;
+}
+
+const char *token_server_name(token_server_t server)
+{
+    return (server == TOKEN_SERVER_PRODUCTION) ? "production" : "sandbox";
+}
+
+bool token_tag_valid(const char *s)
+{
+    size_t n = 0;
+    for (; s[n]; n++) {
+        char c = s[n];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              c == '.' || c == '_' || c == '-')) return false;
+    }
+    return n > 0 && n < TOKEN_TAG_LEN;
+}
+
+/** NVS key for @p ip: 8 lowercase hex digits. */
+static void record_key(uint32_t ip, char key[9])
 {
+    snprintf(key, 9, "%08lx", (unsigned long)ip);
+}
+
+/* ------------------------------------------------------------------ */
+/*  In-RAM index                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Entry pool shared by all four lists (CONFIG_TOKEN_STORE_CAPACITY entries,
+ * PSRAM when available), a free stack of pool indices, and an
+ * open-addressing hash (linear probing, load factor <= 0.5) keyed by
+ * (list, ip) holding pool indices.  Next to them, one bitmap per tag over
+ * the pool (bit i = entry i carries the tag), kept in step with each
+ * entry's own tag set.  All of it is sized once at init.
+ */
+#define INDEX_CAPACITY  CONFIG_TOKEN_STORE_CAPACITY
+#define SLOT_EMPTY      0xFFFF
+_Static_assert(INDEX_CAPACITY < SLOT_EMPTY, "pool indices must fit in uint16_t");
+
+#define MAX_TAGS        CONFIG_TOKEN_STORE_MAX_TAGS
+#define TAG_WORDS       ((INDEX_CAPACITY + 31) / 32)
+_Static_assert(MAX_TAGS <= TOKEN_TAGS_MAX, "tag ids must fit in token_tags_t");
+
+typedef struct {
+    uint32_t     ip;
+    uint8_t      token[TOKEN_BIN_LEN];
+    token_tags_t tags;
+    uint8_t      list;
+    bool         used;
+} idx_entry_t;   /* 44 bytes */
+
+static idx_entry_t      *s_entries = NULL;   /* INDEX_CAPACITY */
+static uint16_t         *s_free    = NULL;   /* INDEX_CAPACITY, stack of unused pool indices */
+static size_t            s_free_top;
+static uint16_t         *s_slots   = NULL;   /* s_slot_mask + 1 */
+static uint32_t          s_slot_mask;
+static size_t            s_list_count[LIST_COUNT];
+static uint32_t         *s_tag_bits = NULL;  /* MAX_TAGS × TAG_WORDS */
+static uint32_t          s_tag_count[MAX_TAGS];
+static char              s_tag_names[MAX_TAGS][TOKEN_TAG_LEN];   /* "" = unused id */
+static SemaphoreHandle_t s_lock = NULL;   /* recursive: batches may read */
+static const char       *s_part = TOKEN_PARTITION_LABEL;
+
+#define LOCK()   xSemaphoreTakeRecursive(s_lock, portMAX_DELAY)
+#define UNLOCK() xSemaphoreGiveRecursive(s_lock)
+
+static uint32_t idx_hash(int list, uint32_t ip)
+{
+    uint32_t h = ip ^ ((uint32_t)list * 0x9E3779B9u);   /* murmur3 finaliser */
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h & s_slot_mask;
+}
+
+/** Return the hash slot holding (list, ip), or the empty slot where it would go. */
+static uint32_t idx_probe(int list, uint32_t ip)
+{
+    uint32_t s = idx_hash(list, ip);
+    while (s_slots[s] != SLOT_EMPTY) {
+        const idx_entry_t *e = &s_entries[s_slots[s]];
+        if (e->list == list && e->ip == ip) break;
+        s = (s + 1) & s_slot_mask;
+    }
+    return s;
+}
+
+static idx_entry_t *idx_find(int list, uint32_t ip)
+{
+    uint32_t s = idx_probe(list, ip);
+    return (s_slots[s] == SLOT_EMPTY) ? NULL : &s_entries[s_slots[s]];
+}
+
+/** Give pool entry @p i the tag set @p tags, keeping the bitmaps in step. */
+static void idx_tag(uint16_t i, token_tags_t tags)
+{
+    idx_entry_t *e = &s_entries[i];
+    for (token_tags_t diff = e->tags ^ tags; diff; diff &= diff - 1) {
+        int t = __builtin_ctz(diff);
+        uint32_t *w = &s_tag_bits[(size_t)t * TAG_WORDS + i / 32];
+        if (tags & (1u << t)) {
+            *w |= 1u << (i % 32);
+            s_tag_count[t]++;
+        } else {
+            *w &= ~(1u << (i % 32));
+            s_tag_count[t]--;
+        }
+    }
+    e->tags = tags;
+}
+
+/** Bitmap word @p w of every tag in @p tags, OR-ed together. */
+static uint32_t idx_tag_word(token_tags_t tags, size_t w)
+{
+    uint32_t bits = 0;
+    for (; tags; tags &= tags - 1) {
+        bits |= s_tag_bits[(size_t)__builtin_ctz(tags) * TAG_WORDS + w];
+    }
+    return bits;
+}
+
+/** Insert or update (list, ip).  @p tags NULL keeps the entry's tags (none if new). */
+static esp_err_t idx_put(int list, uint32_t ip, const uint8_t *token, const token_tags_t *tags)
+{
+    uint32_t s = idx_probe(list, ip);
+    if (s_slots[s] == SLOT_EMPTY) {
+        if (s_free_top == 0) return ESP_ERR_NO_MEM;
+        uint16_t free_i = s_free[--s_free_top];
+
+        idx_entry_t *e = &s_entries[free_i];
+        e->ip   = ip;
+        e->list = (uint8_t)list;
+        e->used = true;
+        s_slots[s] = free_i;
+        s_list_count[list]++;
+    }
+    memcpy(s_entries[s_slots[s]].token, token, TOKEN_BIN_LEN);
+    if (tags) idx_tag(s_slots[s], *tags);
+    return ESP_OK;
+}
+
+static void idx_remove(int list, uint32_t ip)
+{
+    uint32_t s = idx_probe(list, ip);
+    if (s_slots[s] == SLOT_EMPTY) return;
+
+    idx_tag(s_slots[s], 0);
+    s_entries[s_slots[s]].used = false;
+    s_free[s_free_top++] = s_slots[s];
+    s_list_count[list]--;
+    s_slots[s] = SLOT_EMPTY;
+
+    /* Backward-shift deletion keeps probe chains intact without tombstones */
+    uint32_t hole = s;
+    for (uint32_t j = (s + 1) & s_slot_mask;
+         s_slots[j] != SLOT_EMPTY;
+         j = (j + 1) & s_slot_mask) {
+        const idx_entry_t *e = &s_entries[s_slots[j]];
+        uint32_t home = idx_hash(e->list, e->ip);
+        /* Move j into the hole unless its home lies cyclically in (hole, j] */
+        bool stays = (hole <= j) ? (hole < home && home <= j)
+                                 : (hole < home || home <= j);
+        if (!stays) {
+            s_slots[hole] = s_slots[j];
+            s_slots[j]    = SLOT_EMPTY;
+            hole = j;
+        }
+    }
+}
+
+/**
+ * Step over up to @p max entries whose list is in @p mask and, if @p tags is
+ * not 0, that carry one of @p tags, copying them into @p out unless it is
+ * NULL.  Scans the pool from *pos and leaves *pos just past the last one
+ * visited.  Pool positions never move, so deletions between calls cannot
+ * make a later call skip or repeat an entry.
+ */
+static size_t idx_list(unsigned mask, token_tags_t tags, size_t *pos,
+                       token_entry_t *out, size_t max)
+{
+    size_t n = 0;
+    size_t i = *pos;
+    for (; i < INDEX_CAPACITY && n < max; i++) {
+        if (tags) {
+            /* Jump straight to the next pool position carrying one of the tags */
+            uint32_t w = idx_tag_word(tags, i / 32) >> (i % 32);
+            if (!w) {
+                i |= 31;
+                continue;
+            }
+            i += (size_t)__builtin_ctz(w);
+        }
+        const idx_entry_t *e = &s_entries[i];
+        if (!e->used || !(mask & (1u << e->list))) continue;
+        if (out) {
+            out[n].ip     = e->ip;
+            out[n].tags   = e->tags;
+            out[n].server = (uint8_t)(e->list & 1);
+            memcpy(out[n].token, e->token, TOKEN_BIN_LEN);
+        }
+        n++;
+    }
+    *pos = i;
+    return n;
+}
+
+static esp_err_t idx_alloc(void)
+{
+    uint32_t slots = 1;
+    while (slots < INDEX_CAPACITY * 2) slots <<= 1;   /* power of two, load <= 0.5 */
+    s_slot_mask = slots - 1;
+
+    /* The pool is the only part that grows with capacity: keep it out of
+     * internal RAM when PSRAM is fitted. */
+    s_entries = heap_caps_calloc_prefer(INDEX_CAPACITY, sizeof(idx_entry_t), 2,
+                                        MALLOC_CAP_SPIRAM, MALLOC_CAP_8BIT);
+    s_tag_bits = heap_caps_calloc_prefer((size_t)MAX_TAGS * TAG_WORDS, sizeof(uint32_t), 2,
+                                         MALLOC_CAP_SPIRAM, MALLOC_CAP_8BIT);
+    s_free    = malloc(INDEX_CAPACITY * sizeof(uint16_t));
+    s_slots   = malloc(slots * sizeof(uint16_t));
+    if (!s_entries || !s_tag_bits || !s_free || !s_slots) return ESP_ERR_NO_MEM;
+
+    memset(s_slots, 0xFF, slots * sizeof(uint16_t));
+    for (size_t i = 0; i < INDEX_CAPACITY; i++) {
+        s_free[i] = (uint16_t)(INDEX_CAPACITY - 1 - i);   /* pop lowest first */
+    }
+    s_free_top = INDEX_CAPACITY;
+    return ESP_OK;
+}
+
+/* ------------------------------------------------------------------ */
+/*  NVS write-through (batched: one handle + one commit per namespace)  */
+/* ------------------------------------------------------------------ */
+
+static esp_err_t batch_handle(token_batch_t *b, int list, nvs_handle_t *out)
+{
+    if (!(b->open_mask & (1u << list))) {
+        esp_err_t ret = nvs_open_from_partition(s_part, s_ns_names[list], NVS_READWRITE,
+                                                &b->handles[list]);
+        if (ret != ESP_OK) return ret;
+        b->open_mask |= (uint8_t)(1u << list);
+    }
+    *out = b->handles[list];
+    return ESP_OK;
+}
+
+static esp_err_t batch_note(token_batch_t *b, esp_err_t ret)
+{
+    if (ret != ESP_OK && b->err == ESP_OK) b->err = ret;
+    return ret;
+}
+
+/** Write the record for (list, ip) into the batch's handle for @p list. */
+static esp_err_t record_set(token_batch_t *b, int list, uint32_t ip,
+                            const uint8_t *token, token_tags_t tags)
+{
+    /* Untagged entries keep the plain 32-byte record older firmware reads */
+    uint8_t rec[TOKEN_BIN_LEN + sizeof(token_tags_t)];
+    memcpy(rec, token, TOKEN_BIN_LEN);
+    memcpy(rec + TOKEN_BIN_LEN, &tags, sizeof(tags));
+
     nvs_handle_t h;
-    esp_err_t ret = nvs_open(ns, NVS_READWRITE, &h);
-    if (ret != ESP_OK) return ret;
-    ret = nvs_set_str(h, key, value);
-    if (ret == ESP_OK) ret = nvs_commit(h);
-    nvs_close(h);
+    char key[9];
+    record_key(ip, key);
+    esp_err_t ret = batch_handle(b, list, &h);
+    if (ret == ESP_OK) ret = nvs_set_blob(h, key, rec, tags ? sizeof(rec) : TOKEN_BIN_LEN);
+    if (ret == ESP_OK) b->dirty_mask |= (uint8_t)(1u << list);
     return ret;
 }
 
-static esp_err_t ns_get(const char *ns, const char *key, char *out, size_t len)
+/** Erase the record for (list, ip); one that is not there counts as erased. */
+static esp_err_t record_erase(token_batch_t *b, int list, uint32_t ip)
 {
     nvs_handle_t h;
-    esp_err_t ret = nvs_open(ns, NVS_READONLY, &h);
+    char key[9];
+    record_key(ip, key);
+    esp_err_t ret = batch_handle(b, list, &h);
+    if (ret == ESP_OK) ret = nvs_erase_key(h, key);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) ret = ESP_OK;
+    if (ret == ESP_OK) b->dirty_mask |= (uint8_t)(1u << list);
+    return ret;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Write-behind                                                       */
+/* ------------------------------------------------------------------ */
+
+#if CONFIG_TOKEN_STORE_WRITE_BEHIND
+/*
+ * Dirty keys in arrival order.  Twice the flush threshold, so mutations
+ * keep landing in RAM while the flusher gets round to it; only when it is
+ * completely full does a mutation flush inline.  Looked up linearly: it is
+ * a few hundred bytes and a flash write costs far more than the scan.
+ */
+#define WB_FLUSH_DIRTY  CONFIG_TOKEN_STORE_FLUSH_DIRTY
+#define WB_MAX          (WB_FLUSH_DIRTY * 2)
+
+typedef struct {
+    uint32_t ip;
+    uint8_t  list;
+} wb_key_t;
+
+static wb_key_t     s_wb[WB_MAX];
+static size_t       s_wb_count;
+static TaskHandle_t s_wb_task = NULL;
+static uint32_t     s_wb_flushes;
+static uint32_t     s_wb_failures;
+
+/**
+ * Write every dirty key as the index now has it, one commit per namespace.
+ * Keys whose write or commit failed stay dirty for the next flush.
+ * Caller holds the store lock.
+ */
+static esp_err_t wb_flush_locked(void)
+{
+    if (s_wb_count == 0) return ESP_OK;
+
+    token_batch_t b;
+    memset(&b, 0, sizeof(b));
+    uint8_t failed_lists = 0;
+    bool    failed[WB_MAX];
+
+    for (size_t i = 0; i < s_wb_count; i++) {
+        const wb_key_t *k = &s_wb[i];
+        const idx_entry_t *e = idx_find(k->list, k->ip);
+        esp_err_t ret = e ? record_set(&b, k->list, k->ip, e->token, e->tags)
+                          : record_erase(&b, k->list, k->ip);
+        failed[i] = (batch_note(&b, ret) != ESP_OK);
+    }
+    for (int l = 0; l < LIST_COUNT; l++) {
+        if (!(b.open_mask & (1u << l))) continue;
+        if ((b.dirty_mask & (1u << l)) && batch_note(&b, nvs_commit(b.handles[l])) != ESP_OK) {
+            failed_lists |= (uint8_t)(1u << l);
+        }
+        nvs_close(b.handles[l]);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < s_wb_count; i++) {
+        if (failed[i] || (failed_lists & (1u << s_wb[i].list))) s_wb[kept++] = s_wb[i];
+    }
+    ESP_LOGD(TAG, "flushed %u keys, %u still dirty", (unsigned)(s_wb_count - kept),
+             (unsigned)kept);
+    s_wb_count = kept;
+    s_wb_flushes++;
+    if (b.err != ESP_OK) {
+        s_wb_failures++;
+        ESP_LOGW(TAG, "write-behind flush failed (%s), %u keys kept",
+                 esp_err_to_name(b.err), (unsigned)kept);
+    }
+    return b.err;
+}
+
+/**
+ * Mark (list, ip) dirty.  Only fails if the table is full and an inline
+ * flush could not make room; the caller then leaves the index untouched.
+ */
+static esp_err_t wb_mark(int list, uint32_t ip)
+{
+    for (size_t i = 0; i < s_wb_count; i++) {
+        if (s_wb[i].list == list && s_wb[i].ip == ip) return ESP_OK;
+    }
+    if (s_wb_count == WB_MAX) {
+        wb_flush_locked();
+        if (s_wb_count == WB_MAX) return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    s_wb[s_wb_count].ip   = ip;
+    s_wb[s_wb_count].list = (uint8_t)list;
+    s_wb_count++;
+
+    /* The first key starts the flush interval, the threshold cuts it short */
+    if (s_wb_task && (s_wb_count == 1 || s_wb_count == WB_FLUSH_DIRTY)) {
+        xTaskNotifyGive(s_wb_task);
+    }
+    return ESP_OK;
+}
+
+static size_t wb_pending(void)
+{
+    LOCK();
+    size_t n = s_wb_count;
+    UNLOCK();
+    return n;
+}
+
+static void wb_task(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        do {
+            /* Let a burst collapse unless it already reached the threshold */
+            if (wb_pending() < WB_FLUSH_DIRTY) {
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_TOKEN_STORE_FLUSH_MS));
+            }
+            token_store_flush();
+        } while (wb_pending() > 0);   /* failed keys: retry after another interval */
+    }
+}
+
+#if !CONFIG_IDF_TARGET_LINUX
+static void wb_shutdown(void)
+{
+    token_store_flush();
+}
+#endif
+#endif /* CONFIG_TOKEN_STORE_WRITE_BEHIND */
+
+/**
+ * Persist (list, ip) → token and mirror it; no flash write if unchanged.
+ * @p tags NULL keeps the entry's tags.
+ */
+static esp_err_t list_set(token_batch_t *b, int list, uint32_t ip, const uint8_t *token,
+                          const token_tags_t *tags)
+{
+    const idx_entry_t *e = idx_find(list, ip);
+    token_tags_t t = tags ? *tags : (e ? e->tags : 0);
+    if (e && memcmp(e->token, token, TOKEN_BIN_LEN) == 0 && e->tags == t) {
+        b->unchanged++;
+        return ESP_OK;
+    }
+    if (!e && s_free_top == 0) return batch_note(b, ESP_ERR_NO_MEM);
+
+#if CONFIG_TOKEN_STORE_WRITE_BEHIND
+    esp_err_t ret = wb_mark(list, ip);
+#else
+    esp_err_t ret = record_set(b, list, ip, token, t);
+#endif
+    if (ret == ESP_OK) {
+        ret = idx_put(list, ip, token, &t);
+        b->written++;
+    }
+    return batch_note(b, ret);
+}
+
+static esp_err_t list_del(token_batch_t *b, int list, uint32_t ip)
+{
+    if (!idx_find(list, ip)) return ESP_ERR_NVS_NOT_FOUND;
+
+#if CONFIG_TOKEN_STORE_WRITE_BEHIND
+    esp_err_t ret = wb_mark(list, ip);
+#else
+    esp_err_t ret = record_erase(b, list, ip);
+#endif
+    if (ret == ESP_OK) {
+        idx_remove(list, ip);
+        b->written++;
+    }
+    return batch_note(b, ret);
+}
+
+static esp_err_t list_get(int list, uint32_t ip, uint8_t *out)
+{
+    const idx_entry_t *e = idx_find(list, ip);
+    if (!e) return ESP_ERR_NVS_NOT_FOUND;
+    if (out) memcpy(out, e->token, TOKEN_BIN_LEN);
+    return ESP_OK;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Tag table                                                          */
+/* ------------------------------------------------------------------ */
+
+static void tag_key(int id, char key[4])
+{
+    snprintf(key, 4, "t%d", id);
+}
+
+/** Load the tag names.  Ids whose stored name is unreadable stay unused. */
+static esp_err_t load_tags(void)
+{
+    nvs_handle_t h;
+    esp_err_t ret = nvs_open_from_partition(s_part, NS_TAGS, NVS_READWRITE, &h);
     if (ret != ESP_OK) return ret;
-    ret = nvs_get_str(h, key, out, &len);
+
+    for (int t = 0; t < MAX_TAGS; t++) {
+        char key[4];
+        size_t len = TOKEN_TAG_LEN;
+        tag_key(t, key);
+        if (nvs_get_str(h, key, s_tag_names[t], &len) != ESP_OK ||
+            !token_tag_valid(s_tag_names[t])) {
+            s_tag_names[t][0] = '\0';
+        }
+    }
     nvs_close(h);
-    return ret;
+    return ESP_OK;
+}
+
+/** Id of tag @p name, or -1 if it is not in the table. */
+static int tag_find(const char *name)
+{
+    for (int t = 0; t < MAX_TAGS; t++) {
+        if (s_tag_names[t][0] && strcmp(s_tag_names[t], name) == 0) return t;
+    }
+    return -1;
 }
 
-static esp_err_t ns_del(const char *ns, const char *key)
+/**
+ * Add @p name to the table: an unused id if there is one, else one that no
+ * entry carries any more.  Ids in @p busy are about to be assigned and are
+ * not recycled.  Committed right away, before any record refers to it.
+ */
+static esp_err_t tag_add(const char *name, token_tags_t busy, int *id)
 {
+    int t = 0;
+    while (t < MAX_TAGS && s_tag_names[t][0]) t++;
+    if (t == MAX_TAGS) {
+        for (t = 0; t < MAX_TAGS && (s_tag_count[t] || (busy & (1u << t))); t++) {}
+    }
+    if (t == MAX_TAGS) return ESP_ERR_NO_MEM;
+
+#if CONFIG_TOKEN_STORE_WRITE_BEHIND
+    /* Records still on flash may carry the id being recycled */
+    if (s_tag_names[t][0]) {
+        esp_err_t fret = wb_flush_locked();
+        if (fret != ESP_OK) return fret;
+    }
+#endif
+
     nvs_handle_t h;
-    esp_err_t ret = nvs_open(ns, NVS_READWRITE, &h);
+    char key[4];
+    tag_key(t, key);
+    esp_err_t ret = nvs_open_from_partition(s_part, NS_TAGS, NVS_READWRITE, &h);
     if (ret != ESP_OK) return ret;
-    ret = nvs_erase_key(h, key);
+    ret = nvs_set_str(h, key, name);
     if (ret == ESP_OK) ret = nvs_commit(h);
     nvs_close(h);
-    return ret;
+    if (ret != ESP_OK) return ret;
+
+    if (s_tag_names[t][0]) {
+        ESP_LOGI(TAG, "tag \"%s\" recycled for \"%s\"", s_tag_names[t], name);
+    }
+    memcpy(s_tag_names[t], name, strlen(name) + 1);   /* validated: < TOKEN_TAG_LEN */
+    *id = t;
+    return ESP_OK;
 }
 
-static esp_err_t ns_list(const char *ns, token_entry_t *out,
-                          size_t *count, size_t max)
+/** Turn @p n names into a tag set; unknown names are added if @p create, else skipped. */
+static esp_err_t tags_resolve(const char (*names)[TOKEN_TAG_LEN], size_t n, bool create,
+                              token_tags_t *out)
 {
-    *count = 0;
+    token_tags_t tags = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!token_tag_valid(names[i])) return ESP_ERR_INVALID_ARG;
+        int t = tag_find(names[i]);
+        if (t < 0 && create) {
+            esp_err_t ret = tag_add(names[i], tags, &t);
+            if (ret != ESP_OK) return ret;
+        }
+        if (t >= 0) tags |= 1u << t;
+    }
+    *out = tags;
+    return ESP_OK;
+}
 
+/**
+ * Rewrite records left by older firmware (key "192.168.1.10", value hex
+ * string) as binary ones.  Unparseable records could never be delivered
+ * and are dropped.  NVS iterators must not outlive a write, so each
+ * record is looked up afresh.
+ */
+static esp_err_t convert_legacy(nvs_handle_t h, int list)
+{
+    unsigned converted = 0, dropped = 0;
+    esp_err_t ret = ESP_OK;
     nvs_iterator_t it = NULL;
-    esp_err_t ret = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns,
-                                   NVS_TYPE_STR, &it);
-    if (ret == ESP_ERR_NVS_NOT_FOUND) {
-        return ESP_OK; /* namespace is empty */
+
+    while (ret == ESP_OK &&
+           nvs_entry_find(s_part, s_ns_names[list], NVS_TYPE_STR, &it) == ESP_OK) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        nvs_release_iterator(it);
+        it = NULL;
+
+        char hex[TOKEN_HEX_LEN + 1];
+        size_t hex_len = sizeof(hex);
+        uint32_t ip;
+        uint8_t tok[TOKEN_BIN_LEN];
+        if (nvs_get_str(h, info.key, hex, &hex_len) == ESP_OK &&
+            token_ip_parse(info.key, &ip) && token_hex_parse(hex, tok)) {
+            char key[9];
+            record_key(ip, key);
+            ret = nvs_set_blob(h, key, tok, TOKEN_BIN_LEN);
+            converted++;
+        } else {
+            ESP_LOGW(TAG, "%s: dropping unreadable record %s", s_ns_names[list], info.key);
+            dropped++;
+        }
+        if (ret == ESP_OK) ret = nvs_erase_key(h, info.key);
     }
-    if (ret != ESP_OK) return ret;
+    if (ret == ESP_OK && (converted || dropped)) {
+        ret = nvs_commit(h);
+        ESP_LOGI(TAG, "%s: converted %u records, dropped %u", s_ns_names[list],
+                 converted, dropped);
+    }
+    return ret;
+}
 
+/** Ids that have a name in the tag table. */
+static token_tags_t tags_known(void)
+{
+    token_tags_t known = 0;
+    for (int t = 0; t < MAX_TAGS; t++) {
+        if (s_tag_names[t][0]) known |= 1u << t;
+    }
+    return known;
+}
+
+/** Load one namespace into the index. */
+static esp_err_t load_list(int list)
+{
+    token_tags_t known = tags_known();
     nvs_handle_t h;
-    ret = nvs_open(ns, NVS_READONLY, &h);
+    esp_err_t ret = nvs_open_from_partition(s_part, s_ns_names[list], NVS_READWRITE, &h);
+    if (ret != ESP_OK) return ret;
+
+    ret = convert_legacy(h, list);
     if (ret != ESP_OK) {
-        nvs_release_iterator(it);
+        nvs_close(h);
         return ret;
     }
 
-    while (it != NULL && *count < max) {
+    nvs_iterator_t it = NULL;
+    ret = nvs_entry_find(s_part, s_ns_names[list], NVS_TYPE_BLOB, &it);
+    while (ret == ESP_OK) {
         nvs_entry_info_t info;
         nvs_entry_info(it, &info);
 
-        strncpy(out[*count].ip, info.key, TOKEN_IP_LEN - 1);
-        out[*count].ip[TOKEN_IP_LEN - 1] = '\0';
-
-        size_t tok_len = TOKEN_LEN;
-        if (nvs_get_str(h, info.key, out[*count].token, &tok_len) == ESP_OK) {
-            (*count)++;
+        uint8_t rec[TOKEN_BIN_LEN + sizeof(token_tags_t)];
+        size_t rec_len = sizeof(rec);
+        token_tags_t tags = 0;
+        char *end;
+        uint32_t ip = (uint32_t)strtoul(info.key, &end, 16);
+        if (*end != '\0' || nvs_get_blob(h, info.key, rec, &rec_len) != ESP_OK ||
+            (rec_len != TOKEN_BIN_LEN && rec_len != sizeof(rec))) {
+            ESP_LOGW(TAG, "%s: skipping malformed record %s", s_ns_names[list], info.key);
+        } else {
+            if (rec_len == sizeof(rec)) {
+                memcpy(&tags, rec + TOKEN_BIN_LEN, sizeof(tags));
+                tags &= known;   /* ids without a name (or beyond MAX_TAGS) are dropped */
+            }
+            if (idx_put(list, ip, rec, &tags) != ESP_OK) {
+                ESP_LOGW(TAG, "%s: store full, entry %s not loaded",
+                         s_ns_names[list], info.key);
+            }
         }
 
-        ret = nvs_entry_next(&it);
-        if (ret != ESP_OK) break; /* ESP_ERR_NVS_NOT_FOUND = end, sets it=NULL */
+        ret = nvs_entry_next(&it); /* ESP_ERR_NVS_NOT_FOUND = end, sets it=NULL */
     }
 
     nvs_release_iterator(it);
     nvs_close(h);
-    return ESP_OK;
+    return (ret == ESP_ERR_NVS_NOT_FOUND) ? ESP_OK : ret;
 }
 
-/* Like ns_list but also populates the server_type field of each entry. */
-static esp_err_t ns_list_tagged(const char *ns, const char *server_type,
-                                 token_entry_t *out, size_t *count, size_t max)
+/* ------------------------------------------------------------------ */
+/*  Public API                                                         */
+/* ------------------------------------------------------------------ */
+
+/**
+ * Bring up the token partition.  Falls back to the default NVS partition
+ * when the flashed partition table predates it.
+ */
+static esp_err_t part_init(void)
 {
-    *count = 0;
+    esp_err_t ret = nvs_flash_init_partition(TOKEN_PARTITION_LABEL);
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "Partition \"%s\" needs erase (%d)", TOKEN_PARTITION_LABEL, ret);
+        ret = nvs_flash_erase_partition(TOKEN_PARTITION_LABEL);
+        if (ret == ESP_OK) ret = nvs_flash_init_partition(TOKEN_PARTITION_LABEL);
+    }
+    if (ret == ESP_ERR_NOT_FOUND) {
+        ESP_LOGW(TAG, "No \"%s\" partition — storing tokens in \"%s\"",
+                 TOKEN_PARTITION_LABEL, NVS_DEFAULT_PART_NAME);
+        s_part = NVS_DEFAULT_PART_NAME;
+        return ESP_OK;
+    }
+    return ret;
+}
 
+/** Move a namespace left in the default partition by older firmware. */
+static esp_err_t migrate_list(int list)
+{
     nvs_iterator_t it = NULL;
-    esp_err_t ret = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns,
+    esp_err_t ret = nvs_entry_find(NVS_DEFAULT_PART_NAME, s_ns_names[list],
                                    NVS_TYPE_STR, &it);
-    if (ret == ESP_ERR_NVS_NOT_FOUND) {
-        return ESP_OK;
-    }
+    if (ret == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;
     if (ret != ESP_OK) return ret;
 
-    nvs_handle_t h;
-    ret = nvs_open(ns, NVS_READONLY, &h);
+    nvs_handle_t src, dst;
+    ret = nvs_open(s_ns_names[list], NVS_READWRITE, &src);
+    if (ret != ESP_OK) {
+        nvs_release_iterator(it);
+        return ret;
+    }
+    ret = nvs_open_from_partition(s_part, s_ns_names[list], NVS_READWRITE, &dst);
     if (ret != ESP_OK) {
         nvs_release_iterator(it);
+        nvs_close(src);
         return ret;
     }
 
-    while (it != NULL && *count < max) {
+    /* Copied verbatim; load_list() converts them to binary records */
+    unsigned moved = 0;
+    while (it != NULL && ret == ESP_OK) {
         nvs_entry_info_t info;
         nvs_entry_info(it, &info);
 
-        strncpy(out[*count].ip, info.key, TOKEN_IP_LEN - 1);
-        out[*count].ip[TOKEN_IP_LEN - 1] = '\0';
-
-        strncpy(out[*count].server_type, server_type, TOKEN_SERVER_TYPE_LEN - 1);
-        out[*count].server_type[TOKEN_SERVER_TYPE_LEN - 1] = '\0';
-
-        size_t tok_len = TOKEN_LEN;
-        if (nvs_get_str(h, info.key, out[*count].token, &tok_len) == ESP_OK) {
-            (*count)++;
+        char tok[TOKEN_HEX_LEN + 1];
+        size_t tok_len = sizeof(tok);
+        if (nvs_get_str(src, info.key, tok, &tok_len) == ESP_OK) {
+            ret = nvs_set_str(dst, info.key, tok);
+            moved++;
         }
-
-        ret = nvs_entry_next(&it);
-        if (ret != ESP_OK) break;
+        if (ret == ESP_OK && nvs_entry_next(&it) != ESP_OK) break;
     }
-
     nvs_release_iterator(it);
-    nvs_close(h);
-    return ESP_OK;
-}
 
-/* ------------------------------------------------------------------ */
-/*  Public API                                                         */
-/* ------------------------------------------------------------------ */
+    /* Only drop the old copy once the new one is committed */
+    if (ret == ESP_OK) ret = nvs_commit(dst);
+    if (ret == ESP_OK) ret = nvs_erase_all(src);
+    if (ret == ESP_OK) ret = nvs_commit(src);
+    nvs_close(dst);
+    nvs_close(src);
+
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG, "%s: migrated %u entries to \"%s\"", s_ns_names[list], moved, s_part);
+    }
+    return ret;
+}
 
 esp_err_t token_store_init(void)
 {
-    nvs_handle_t h;
-    esp_err_t ret;
+    s_lock = xSemaphoreCreateRecursiveMutex();
+    if (!s_lock || idx_alloc() != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot allocate token index");
+        return ESP_ERR_NO_MEM;
+    }
 
-    const char *namespaces[] = { NS_SEND_S, NS_SEND_P, NS_BLOCK_S, NS_BLOCK_P };
-    for (int i = 0; i < 4; i++) {
-        ret = nvs_open(namespaces[i], NVS_READWRITE, &h);
+    esp_err_t ret = part_init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot init partition %s: %d", TOKEN_PARTITION_LABEL, ret);
+        return ret;
+    }
+
+    /* Before the lists: records only keep tag ids that have a name */
+    ret = load_tags();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot load namespace %s: %d", NS_TAGS, ret);
+        return ret;
+    }
+
+    for (int i = 0; i < LIST_COUNT; i++) {
+        if (strcmp(s_part, NVS_DEFAULT_PART_NAME) != 0 && migrate_list(i) != ESP_OK) {
+            ESP_LOGW(TAG, "Cannot migrate namespace %s, old entries stay put", s_ns_names[i]);
+        }
+
+        ret = load_list(i);
         if (ret != ESP_OK) {
-            ESP_LOGE(TAG, "Cannot open namespace %s: %d", namespaces[i], ret);
+            ESP_LOGE(TAG, "Cannot load namespace %s: %d", s_ns_names[i], ret);
             return ret;
         }
-        nvs_close(h);
     }
 
-    ESP_LOGI(TAG, "Token store initialised");
+#if CONFIG_TOKEN_STORE_WRITE_BEHIND
+    if (xTaskCreate(wb_task, "tok_flush", 4096, NULL, 2, &s_wb_task) != pdPASS) {
+        ESP_LOGE(TAG, "Cannot start flush task");
+        return ESP_ERR_NO_MEM;
+    }
+#if !CONFIG_IDF_TARGET_LINUX
+    esp_register_shutdown_handler(wb_shutdown);
+#endif
+#endif
+
+    ESP_LOGI(TAG, "Token store initialised on \"%s\" (send %u/%u, block %u/%u, capacity %u, "
+             "tags %d/%d)",
+             s_part,
+             (unsigned)s_list_count[LIST_SEND_S], (unsigned)s_list_count[LIST_SEND_P],
+             (unsigned)s_list_count[LIST_BLOCK_S], (unsigned)s_list_count[LIST_BLOCK_P],
+             (unsigned)INDEX_CAPACITY, __builtin_popcount(tags_known()), MAX_TAGS);
     return ESP_OK;
 }
 
-/* Send list */
-esp_err_t token_store_send_set(const char *server_type, const char *ip, const char *token)
+/* Batch API */
+void token_store_batch_begin(token_batch_t *b)
 {
-    return ns_set(send_ns(server_type), ip, token);
+    LOCK();
+    memset(b, 0, sizeof(*b));
 }
 
-esp_err_t token_store_send_get(const char *server_type, const char *ip, char *tok_out, size_t len)
+esp_err_t token_store_batch_end(token_batch_t *b)
 {
-    return ns_get(send_ns(server_type), ip, tok_out, len);
+    for (int i = 0; i < LIST_COUNT; i++) {
+        if (!(b->open_mask & (1u << i))) continue;
+        if (b->dirty_mask & (1u << i)) batch_note(b, nvs_commit(b->handles[i]));
+        nvs_close(b->handles[i]);
+    }
+    b->open_mask = 0;
+    UNLOCK();
+    return b->err;
 }
 
-esp_err_t token_store_send_del(const char *ip)
+/** Result of applying a delete to both server types. */
+static esp_err_t merge_del(esp_err_t r1, esp_err_t r2)
 {
-    esp_err_t r1 = ns_del(NS_SEND_S, ip);
-    esp_err_t r2 = ns_del(NS_SEND_P, ip);
     if (r1 == ESP_OK || r2 == ESP_OK) return ESP_OK;
     if (r1 == ESP_ERR_NVS_NOT_FOUND && r2 == ESP_ERR_NVS_NOT_FOUND)
         return ESP_ERR_NVS_NOT_FOUND;
     return (r1 != ESP_OK) ? r1 : r2;
 }
 
-esp_err_t token_store_send_list(token_entry_t *out, size_t *count, size_t max)
+/* Send list */
+esp_err_t token_store_batch_send_set(token_batch_t *b, token_server_t server,
+                                     uint32_t ip, const uint8_t token[TOKEN_BIN_LEN])
 {
-    size_t c1 = 0;
-    ns_list_tagged(NS_SEND_S, "sandbox", out, &c1, max);
-    size_t c2 = 0;
-    if (c1 < max)
-        ns_list_tagged(NS_SEND_P, "production", out + c1, &c2, max - c1);
-    *count = c1 + c2;
-    return ESP_OK;
+    return list_set(b, send_list_id(server), ip, token, NULL);
+}
+
+esp_err_t token_store_batch_send_set_tagged(token_batch_t *b, token_server_t server,
+                                            uint32_t ip, const uint8_t token[TOKEN_BIN_LEN],
+                                            const char (*tags)[TOKEN_TAG_LEN], size_t ntags)
+{
+    token_tags_t set;
+    esp_err_t ret = tags_resolve(tags, ntags, true, &set);
+    if (ret != ESP_OK) return batch_note(b, ret);
+    return list_set(b, send_list_id(server), ip, token, &set);
+}
+
+esp_err_t token_store_send_set(token_server_t server, uint32_t ip,
+                               const uint8_t token[TOKEN_BIN_LEN])
+{
+    token_batch_t b;
+    token_store_batch_begin(&b);
+    token_store_batch_send_set(&b, server, ip, token);
+    return token_store_batch_end(&b);
+}
+
+esp_err_t token_store_send_set_tagged(token_server_t server, uint32_t ip,
+                                      const uint8_t token[TOKEN_BIN_LEN],
+                                      const char (*tags)[TOKEN_TAG_LEN], size_t ntags)
+{
+    token_batch_t b;
+    token_store_batch_begin(&b);
+    token_store_batch_send_set_tagged(&b, server, ip, token, tags, ntags);
+    return token_store_batch_end(&b);
+}
+
+esp_err_t token_store_send_get(token_server_t server, uint32_t ip,
+                               uint8_t tok_out[TOKEN_BIN_LEN])
+{
+    LOCK();
+    esp_err_t ret = list_get(send_list_id(server), ip, tok_out);
+    UNLOCK();
+    return ret;
+}
+
+esp_err_t token_store_batch_send_del(token_batch_t *b, uint32_t ip)
+{
+    esp_err_t r1 = list_del(b, LIST_SEND_S, ip);
+    esp_err_t r2 = list_del(b, LIST_SEND_P, ip);
+    return merge_del(r1, r2);
 }
 
-esp_err_t token_store_send_list_type(const char *server_type, token_entry_t *out,
-                                      size_t *count, size_t max)
+esp_err_t token_store_send_del(uint32_t ip)
 {
-    return ns_list_tagged(send_ns(server_type), server_type, out, count, max);
+    token_batch_t b;
+    token_store_batch_begin(&b);
+    esp_err_t ret = token_store_batch_send_del(&b, ip);
+    esp_err_t cret = token_store_batch_end(&b);
+    return (ret == ESP_OK) ? cret : ret;
 }
 
 /* Block list */
-esp_err_t token_store_block_set(const char *ip, const char *token)
+esp_err_t token_store_batch_block_set(token_batch_t *b, uint32_t ip,
+                                      const uint8_t token[TOKEN_BIN_LEN])
 {
-    esp_err_t r1 = ns_set(NS_BLOCK_S, ip, token);
-    esp_err_t r2 = ns_set(NS_BLOCK_P, ip, token);
+    esp_err_t r1 = list_set(b, LIST_BLOCK_S, ip, token, NULL);
+    esp_err_t r2 = list_set(b, LIST_BLOCK_P, ip, token, NULL);
     return (r1 == ESP_OK && r2 == ESP_OK) ? ESP_OK : (r1 != ESP_OK ? r1 : r2);
 }
 
-esp_err_t token_store_block_get(const char *server_type, const char *ip, char *tok_out, size_t len)
+esp_err_t token_store_block_set(uint32_t ip, const uint8_t token[TOKEN_BIN_LEN])
 {
-    return ns_get(block_ns(server_type), ip, tok_out, len);
+    token_batch_t b;
+    token_store_batch_begin(&b);
+    token_store_batch_block_set(&b, ip, token);
+    return token_store_batch_end(&b);
 }
 
-esp_err_t token_store_block_del(const char *ip)
+esp_err_t token_store_block_get(token_server_t server, uint32_t ip,
+                                uint8_t tok_out[TOKEN_BIN_LEN])
 {
-    esp_err_t r1 = ns_del(NS_BLOCK_S, ip);
-    esp_err_t r2 = ns_del(NS_BLOCK_P, ip);
-    if (r1 == ESP_OK || r2 == ESP_OK) return ESP_OK;
-    if (r1 == ESP_ERR_NVS_NOT_FOUND && r2 == ESP_ERR_NVS_NOT_FOUND)
-        return ESP_ERR_NVS_NOT_FOUND;
-    return (r1 != ESP_OK) ? r1 : r2;
+    LOCK();
+    esp_err_t ret = list_get(block_list_id(server), ip, tok_out);
+    UNLOCK();
+    return ret;
 }
 
-esp_err_t token_store_block_list(token_entry_t *out, size_t *count, size_t max)
+esp_err_t token_store_batch_block_del(token_batch_t *b, uint32_t ip)
 {
-    size_t c1 = 0;
-    ns_list_tagged(NS_BLOCK_S, "sandbox", out, &c1, max);
-    size_t c2 = 0;
-    if (c1 < max)
-        ns_list_tagged(NS_BLOCK_P, "production", out + c1, &c2, max - c1);
-    *count = c1 + c2;
-    return ESP_OK;
+    esp_err_t r1 = list_del(b, LIST_BLOCK_S, ip);
+    esp_err_t r2 = list_del(b, LIST_BLOCK_P, ip);
+    return merge_del(r1, r2);
 }
 
-/* Move operations — apply to both server types */
-esp_err_t token_store_move_to_block(const char *ip)
+esp_err_t token_store_block_del(uint32_t ip)
 {
-    char tok[TOKEN_LEN];
-    bool moved = false;
+    token_batch_t b;
+    token_store_batch_begin(&b);
+    esp_err_t ret = token_store_batch_block_del(&b, ip);
+    esp_err_t cret = token_store_batch_end(&b);
+    return (ret == ESP_OK) ? cret : ret;
+}
 
-    if (ns_get(NS_SEND_S, ip, tok, sizeof(tok)) == ESP_OK) {
-        ns_set(NS_BLOCK_S, ip, tok);
-        ns_del(NS_SEND_S, ip);
-        moved = true;
-    }
-    if (ns_get(NS_SEND_P, ip, tok, sizeof(tok)) == ESP_OK) {
-        ns_set(NS_BLOCK_P, ip, tok);
-        ns_del(NS_SEND_P, ip);
-        moved = true;
+/* Enumeration */
+void token_store_cursor_open(token_cursor_t *c, token_list_t list, int server)
+{
+    bool send = (list == TOKEN_LIST_SEND);
+    c->pos  = 0;
+    c->tags = 0;
+    if (server != TOKEN_SERVER_ANY) {
+        c->mask = (uint8_t)(1u << (send ? send_list_id((token_server_t)server)
+                                        : block_list_id((token_server_t)server)));
+    } else {
+        c->mask = send ? (1u << LIST_SEND_S) | (1u << LIST_SEND_P)
+                       : (1u << LIST_BLOCK_S) | (1u << LIST_BLOCK_P);
     }
-    return moved ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
 }
 
-esp_err_t token_store_move_to_send(const char *ip)
+esp_err_t token_store_cursor_open_tagged(token_cursor_t *c, token_list_t list, int server,
+                                         const char (*tags)[TOKEN_TAG_LEN], size_t ntags)
 {
-    char tok[TOKEN_LEN];
-    bool moved = false;
+    token_store_cursor_open(c, list, server);
+    LOCK();
+    esp_err_t ret = tags_resolve(tags, ntags, false, &c->tags);
+    UNLOCK();
+    if (ret == ESP_OK && c->tags == 0) ret = ESP_ERR_NOT_FOUND;
+    if (ret != ESP_OK) token_store_cursor_close(c);
+    return ret;
+}
 
-    if (ns_get(NS_BLOCK_S, ip, tok, sizeof(tok)) == ESP_OK) {
-        ns_set(NS_SEND_S, ip, tok);
-        ns_del(NS_BLOCK_S, ip);
-        moved = true;
-    }
-    if (ns_get(NS_BLOCK_P, ip, tok, sizeof(tok)) == ESP_OK) {
-        ns_set(NS_SEND_P, ip, tok);
-        ns_del(NS_BLOCK_P, ip);
-        moved = true;
+size_t token_store_cursor_next(token_cursor_t *c, token_entry_t *out, size_t max)
+{
+    LOCK();
+    size_t n = idx_list(c->mask, c->tags, &c->pos, out, max);
+    UNLOCK();
+    return n;
+}
+
+size_t token_store_cursor_skip(token_cursor_t *c, size_t n)
+{
+    return token_store_cursor_next(c, NULL, n);
+}
+
+void token_store_cursor_close(token_cursor_t *c)
+{
+    c->pos  = INDEX_CAPACITY;
+    c->mask = 0;
+    c->tags = 0;
+}
+
+/* Tags */
+size_t token_store_tag_list(token_tag_info_t *out, size_t max)
+{
+    size_t n = 0;
+    LOCK();
+    for (int t = 0; t < MAX_TAGS && n < max; t++) {
+        if (!s_tag_names[t][0]) continue;
+        memcpy(out[n].name, s_tag_names[t], TOKEN_TAG_LEN);
+        out[n].id      = (uint8_t)t;
+        out[n].entries = s_tag_count[t];
+        n++;
     }
-    return moved ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+    UNLOCK();
+    return n;
+}
+
+/* Write-behind */
+esp_err_t token_store_flush(void)
+{
+#if CONFIG_TOKEN_STORE_WRITE_BEHIND
+    LOCK();
+    esp_err_t ret = wb_flush_locked();
+    UNLOCK();
+    return ret;
+#else
+    return ESP_OK;
+#endif
+}
+
+void token_store_wb_stats(token_wb_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+#if CONFIG_TOKEN_STORE_WRITE_BEHIND
+    LOCK();
+    out->dirty    = (uint32_t)s_wb_count;
+    out->flushes  = s_wb_flushes;
+    out->failures = s_wb_failures;
+    UNLOCK();
+#endif
+}
+
+/* Move operations — apply to both server types, one commit per namespace.
+ * Tags travel with the entry. */
+static bool move_one(token_batch_t *b, int from, int to, uint32_t ip)
+{
+    const idx_entry_t *e = idx_find(from, ip);
+    if (!e) return false;
+
+    uint8_t tok[TOKEN_BIN_LEN];
+    token_tags_t tags = e->tags;
+    memcpy(tok, e->token, TOKEN_BIN_LEN);
+    if (list_set(b, to, ip, tok, &tags) != ESP_OK) return false;
+    list_del(b, from, ip);
+    return true;
+}
+
+esp_err_t token_store_move_to_block(uint32_t ip)
+{
+    token_batch_t b;
+    token_store_batch_begin(&b);
+    bool moved = move_one(&b, LIST_SEND_S, LIST_BLOCK_S, ip);
+    moved     |= move_one(&b, LIST_SEND_P, LIST_BLOCK_P, ip);
+    esp_err_t ret = token_store_batch_end(&b);
+    return moved ? ret : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t token_store_move_to_send(uint32_t ip)
+{
+    token_batch_t b;
+    token_store_batch_begin(&b);
+    bool moved = move_one(&b, LIST_BLOCK_S, LIST_SEND_S, ip);
+    moved     |= move_one(&b, LIST_BLOCK_P, LIST_SEND_P, ip);
+    esp_err_t ret = token_store_batch_end(&b);
+    return moved ? ret : ESP_ERR_NVS_NOT_FOUND;
 }
@@ -1,84 +1,272 @@
 /*
  * token_store.h — NVS-backed push token registry
  *
- * Maintains two persistent lists (send / block), keyed by IPv4 address string.
- * Each entry maps  (server_type, ip)  →  APNs device token.
+ * Maintains two persistent lists (send / block), keyed by IPv4 address.
+ * Each entry maps  (server type, ip)  →  32-byte APNs device token.
  *
- * Storage layout (NVS key limit = 15 chars, so separate namespaces per type):
+ * Everything here is binary: IPv4 as a host-order uint32_t (192.168.1.10 =
+ * 0xC0A8010A), tokens as raw bytes, server type as token_server_t.  The
+ * token_*_parse / _format helpers convert at the HTTP / APNs edge.
+ *
+ * Storage layout (dedicated NVS partition "tokens", key limit = 15 chars,
+ * so separate namespaces per type):
  *   NVS namespace "tok_snd_s"  — sandbox send list
  *   NVS namespace "tok_snd_p"  — production send list
  *   NVS namespace "tok_blk_s"  — sandbox block list
  *   NVS namespace "tok_blk_p"  — production block list
- *   key   = IPv4 string (e.g. "192.168.1.10")
- *   value = APNs device token string
+ *   NVS namespace "tok_tags"   — tag names, key "t<id>"
+ *   key   = packed IPv4 as 8 hex digits (e.g. "c0a8010a")
+ *   value = 32-byte token blob, followed by the 4-byte tag set if it has one
+ *
+ * All namespaces are mirrored in an in-RAM hash index loaded at init:
+ * get / list calls never touch flash, and set / del write to NVS only when
+ * the value actually changes.  All calls are thread-safe.
+ *
+ * With CONFIG_TOKEN_STORE_WRITE_BEHIND (the default), set / del only update
+ * the index and mark the key dirty; repeated changes to one key collapse
+ * into one write.  The "tok_flush" task commits the dirty keys every
+ * CONFIG_TOKEN_STORE_FLUSH_MS, or sooner once CONFIG_TOKEN_STORE_FLUSH_DIRTY
+ * have piled up, and esp_restart() flushes before resetting.  A power cut
+ * loses at most the changes since the last flush.  Without it, every call
+ * writes through and commits before returning.
+ *
+ * Capacity is CONFIG_TOKEN_STORE_CAPACITY entries shared by all four lists.
+ * Enumeration goes through a cursor that hands out caller-sized batches,
+ * so no caller needs a buffer that grows with the registry.
+ *
+ * Entries can carry tags (short names such as "floor3") for targeted
+ * blasts.  Up to CONFIG_TOKEN_STORE_MAX_TAGS distinct names exist at once;
+ * the index keeps one bitmap per tag over its entry pool, so a tagged
+ * cursor skips 32 non-matching entries per word instead of visiting each.
+ * Once the table is full, a name that no entry carries any more is
+ * recycled for the next new one.
  *
  * Prerequisites:
- *   nvs_flash_init() must be called before token_store_init().
+ *   nvs_flash_init() must be called before token_store_init() (the store
+ *   brings up its own partition, entries left in the default one by older
+ *   firmware are migrated on first boot).
  */
 #pragma once
 
 #include "esp_err.h"
+#include "nvs.h"
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define TOKEN_MAX_ENTRIES      64
+#define TOKEN_PARTITION_LABEL  "tokens"
 #define TOKEN_IP_LEN           16   /* "255.255.255.255\0" */
-#define TOKEN_LEN             100   /* APNs device token + null */
-#define TOKEN_SERVER_TYPE_LEN  12   /* "sandbox\0" or "production\0" */
+#define TOKEN_BIN_LEN          32   /* APNs device token */
+#define TOKEN_HEX_LEN          65   /* hex form + null */
+#define TOKEN_TAG_LEN          16   /* tag name + null */
+#define TOKEN_TAGS_MAX         32   /* tag ids that fit a token_tags_t */
+
+/** Set of tags, bit i = tag id i (see token_tag_info_t). */
+typedef uint32_t token_tags_t;
+
+typedef enum {
+    TOKEN_SERVER_SANDBOX    = 0,
+    TOKEN_SERVER_PRODUCTION = 1,
+} token_server_t;
+
+/** token_store_cursor_open(): walk both server types. */
+#define TOKEN_SERVER_ANY  (-1)
+
+typedef struct {
+    uint32_t     ip;
+    uint8_t      token[TOKEN_BIN_LEN];
+    token_tags_t tags;
+    uint8_t      server;            /*!< token_server_t */
+} token_entry_t;                    /* 44 bytes */
+
+typedef struct {
+    char     name[TOKEN_TAG_LEN];
+    uint8_t  id;                    /*!< bit in token_entry_t.tags */
+    uint32_t entries;               /*!< entries carrying it, all lists */
+} token_tag_info_t;
 
+/** List a cursor walks. */
+typedef enum {
+    TOKEN_LIST_SEND,
+    TOKEN_LIST_BLOCK,
+} token_list_t;
+
+/**
+ * @brief Enumeration cursor.  Caller-allocated; treat the fields as private.
+ *
+ * The store lock is only held inside each token_store_cursor_next() call,
+ * so a cursor may stay open across slow work (network sends, socket
+ * writes) and the list may be mutated meanwhile — including from the
+ * cursor's own task.  Entries added or removed between batches may or may
+ * not show up, but none is returned twice.
+ */
+typedef struct {
+    size_t       pos;
+    uint8_t      mask;
+    token_tags_t tags;              /* 0 = no tag filter */
+} token_cursor_t;
+
+/**
+ * @brief Batch of store mutations sharing one NVS handle and one commit per
+ *        namespace (with write-behind: applied together, flushed later).
+ *        Caller-allocated; treat the fields as private.
+ *
+ * Holds the store lock from token_store_batch_begin() until
+ * token_store_batch_end(), so other tasks see either none or all of it.
+ * Reads (get / list) from the same task are allowed inside a batch.
+ * NVS offers no rollback: mutations that succeeded before a failure stay,
+ * and they are in the RAM index from the moment their record was written,
+ * even if the final commit then fails.
+ */
 typedef struct {
-    char ip[TOKEN_IP_LEN];
-    char token[TOKEN_LEN];
-    char server_type[TOKEN_SERVER_TYPE_LEN];   /* "sandbox" or "production" */
-} token_entry_t;
+    nvs_handle_t handles[4];
+    uint8_t      open_mask;
+    uint8_t      dirty_mask;
+    esp_err_t    err;          /*!< first error seen */
+    unsigned     written;      /*!< entries actually written / erased */
+    unsigned     unchanged;    /*!< sets skipped because the value was identical */
+} token_batch_t;
+
+/** Write-behind counters (all zero with CONFIG_TOKEN_STORE_WRITE_BEHIND off). */
+typedef struct {
+    uint32_t dirty;                 /*!< keys changed in RAM, not yet on flash */
+    uint32_t flushes;
+    uint32_t failures;              /*!< flushes that left keys dirty */
+} token_wb_stats_t;
 
 /**
- * @brief Initialise token store — opens both NVS namespaces to verify access.
- *        Must be called once after nvs_flash_init().
+ * @brief Initialise token store — mounts the token partition, opens all four
+ *        NVS namespaces and loads them into the in-RAM index.  Must be called
+ *        once after nvs_flash_init().
  */
 esp_err_t token_store_init(void);
 
-/* ---- Send list ---- */
+/* ---- API-edge codecs ---- */
 
-/** Add or overwrite a send-list entry for the given server_type ("sandbox" or "production"). */
-esp_err_t token_store_send_set(const char *server_type, const char *ip, const char *token);
+/** Parse a dotted-quad IPv4 string.  Strict: exactly four 0-255 octets. */
+bool token_ip_parse(const char *s, uint32_t *out);
 
-/** Look up a token by server_type + IP in the send list. Returns ESP_ERR_NVS_NOT_FOUND if absent. */
-esp_err_t token_store_send_get(const char *server_type, const char *ip, char *tok_out, size_t len);
+void token_ip_format(uint32_t ip, char out[TOKEN_IP_LEN]);
 
-/** Remove an entry from the send list for @p ip — applies to both sandbox and production. */
-esp_err_t token_store_send_del(const char *ip);
+/** Parse a 64-digit hex device token (either case). */
+bool token_hex_parse(const char *s, uint8_t out[TOKEN_BIN_LEN]);
+
+/** Format a token as 64 lowercase hex digits, as APNs expects in the path. */
+void token_hex_format(const uint8_t tok[TOKEN_BIN_LEN], char out[TOKEN_HEX_LEN]);
+
+/** "production" → TOKEN_SERVER_PRODUCTION; anything else (incl. NULL) → sandbox. */
+token_server_t token_server_parse(const char *s);
+
+const char *token_server_name(token_server_t server);
+
+/** Tag names are 1-15 characters of [A-Za-z0-9._-]. */
+bool token_tag_valid(const char *s);
+
+/* ---- Send list ---- */
+
+/** Add or overwrite a send-list entry for the given server type.  An existing
+ *  entry keeps its tags; a new one has none.
+ *  Returns ESP_ERR_NO_MEM if the store already holds CONFIG_TOKEN_STORE_CAPACITY entries. */
+esp_err_t token_store_send_set(token_server_t server, uint32_t ip,
+                               const uint8_t token[TOKEN_BIN_LEN]);
+
+/** token_store_send_set(), replacing the entry's tags with the @p ntags names
+ *  in @p tags (0 clears them).  New names are added to the tag table.
+ *  Returns ESP_ERR_INVALID_ARG for an invalid name, ESP_ERR_NO_MEM if the
+ *  store or the tag table is full. */
+esp_err_t token_store_send_set_tagged(token_server_t server, uint32_t ip,
+                                      const uint8_t token[TOKEN_BIN_LEN],
+                                      const char (*tags)[TOKEN_TAG_LEN], size_t ntags);
 
-/** Enumerate all send-list entries (both server types) into @p out. server_type field is populated. */
-esp_err_t token_store_send_list(token_entry_t *out, size_t *count, size_t max);
+/** Look up a token by server type + IP in the send list. Returns ESP_ERR_NVS_NOT_FOUND if absent.
+ *  @p tok_out may be NULL to test for presence only. */
+esp_err_t token_store_send_get(token_server_t server, uint32_t ip,
+                               uint8_t tok_out[TOKEN_BIN_LEN]);
 
-/** Enumerate send-list entries for a specific server_type only. Used by /blast. */
-esp_err_t token_store_send_list_type(const char *server_type, token_entry_t *out, size_t *count, size_t max);
+/** Remove an entry from the send list for @p ip — applies to both sandbox and production. */
+esp_err_t token_store_send_del(uint32_t ip);
 
 /* ---- Block list ---- */
 
 /** Add or overwrite a block-list entry for @p ip — applies to both sandbox and production. */
-esp_err_t token_store_block_set(const char *ip, const char *token);
+esp_err_t token_store_block_set(uint32_t ip, const uint8_t token[TOKEN_BIN_LEN]);
 
-/** Look up a token by server_type + IP in the block list. Returns ESP_ERR_NVS_NOT_FOUND if absent. */
-esp_err_t token_store_block_get(const char *server_type, const char *ip, char *tok_out, size_t len);
+/** Look up a token by server type + IP in the block list. Returns ESP_ERR_NVS_NOT_FOUND if absent.
+ *  @p tok_out may be NULL to test for presence only. */
+esp_err_t token_store_block_get(token_server_t server, uint32_t ip,
+                                uint8_t tok_out[TOKEN_BIN_LEN]);
 
 /** Remove an entry from the block list for @p ip — applies to both sandbox and production. */
-esp_err_t token_store_block_del(const char *ip);
+esp_err_t token_store_block_del(uint32_t ip);
+
+/* ---- Enumeration ---- */
+
+/** Position @p c at the start of @p list.  @p server is a token_server_t,
+ *  or TOKEN_SERVER_ANY to walk both. */
+void token_store_cursor_open(token_cursor_t *c, token_list_t list, int server);
+
+/** Like token_store_cursor_open(), but only entries carrying at least one of
+ *  the @p ntags names in @p tags.  Names that are not in the tag table match
+ *  nothing.
+ *  Returns ESP_OK, ESP_ERR_INVALID_ARG for an invalid name, or
+ *  ESP_ERR_NOT_FOUND if no name is known; the cursor is closed on error. */
+esp_err_t token_store_cursor_open_tagged(token_cursor_t *c, token_list_t list, int server,
+                                         const char (*tags)[TOKEN_TAG_LEN], size_t ntags);
+
+/** Copy the next up to @p max entries into @p out (server populated).
+ *  Returns the number copied; 0 means the walk is over. */
+size_t token_store_cursor_next(token_cursor_t *c, token_entry_t *out, size_t max);
+
+/** Step over up to @p n entries without copying them.  Returns the number skipped. */
+size_t token_store_cursor_skip(token_cursor_t *c, size_t n);
+
+/** Finish a walk.  Further next / skip calls return 0. */
+void token_store_cursor_close(token_cursor_t *c);
+
+/* ---- Tags ---- */
+
+/** Copy up to @p max entries of the tag table into @p out, by id.
+ *  Returns the number copied (at most CONFIG_TOKEN_STORE_MAX_TAGS). */
+size_t token_store_tag_list(token_tag_info_t *out, size_t max);
+
+/* ---- Batched mutations (same semantics as the single-shot calls) ---- */
+
+/** Start a batch; takes the store lock. */
+void token_store_batch_begin(token_batch_t *b);
+
+esp_err_t token_store_batch_send_set(token_batch_t *b, token_server_t server,
+                                     uint32_t ip, const uint8_t token[TOKEN_BIN_LEN]);
+esp_err_t token_store_batch_send_set_tagged(token_batch_t *b, token_server_t server,
+                                            uint32_t ip, const uint8_t token[TOKEN_BIN_LEN],
+                                            const char (*tags)[TOKEN_TAG_LEN], size_t ntags);
+esp_err_t token_store_batch_send_del(token_batch_t *b, uint32_t ip);
+esp_err_t token_store_batch_block_set(token_batch_t *b, uint32_t ip,
+                                      const uint8_t token[TOKEN_BIN_LEN]);
+esp_err_t token_store_batch_block_del(token_batch_t *b, uint32_t ip);
+
+/** Commit every touched namespace once, close handles, release the lock.
+ *  Returns the first error seen during the batch or the commit. */
+esp_err_t token_store_batch_end(token_batch_t *b);
+
+/* ---- Write-behind ---- */
+
+/** Commit every dirty key now.  A no-op without write-behind.
+ *  Returns the first NVS error; keys that failed stay dirty. */
+esp_err_t token_store_flush(void);
 
-/** Enumerate all block-list entries (both server types) into @p out. server_type field is populated. */
-esp_err_t token_store_block_list(token_entry_t *out, size_t *count, size_t max);
+void token_store_wb_stats(token_wb_stats_t *out);
 
-/* ---- Move operations (IP only — apply to both server types) ---- */
+/* ---- Move operations (IP only — apply to both server types, tags travel along) ---- */
 
 /** Move entry for @p ip from send list → block list. Succeeds if found in either server type. */
-esp_err_t token_store_move_to_block(const char *ip);
+esp_err_t token_store_move_to_block(uint32_t ip);
 
 /** Move entry for @p ip from block list → send list. Succeeds if found in either server type. */
-esp_err_t token_store_move_to_send(const char *ip);
+esp_err_t token_store_move_to_send(uint32_t ip);
 
 #ifdef __cplusplus
 }
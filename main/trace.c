@@ -0,0 +1,150 @@
+/*
+ * trace.c — binary event ring
+ *
+ * A seq_ring_t of trace_rec_t.  Its spinlock is held only for the copy of
+ * a record (or of a reader's batch), so a trace_rec() from the send path
+ * never waits behind a slow GET /trace.
+ */
+#include "trace.h"
+#include "seq_ring.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+
+static const char *const s_names[TRACE_EVENT_COUNT] = {
+    [TRACE_NONE]           = "none",
+    [TRACE_JOB_QUEUED]     = "job_queued",
+    [TRACE_JOB_REJECTED]   = "job_rejected",
+    [TRACE_JOB_START]      = "job_start",
+    [TRACE_JOB_DONE]       = "job_done",
+    [TRACE_JOB_SPOOLED]    = "job_spooled",
+    [TRACE_BLAST_ITEM]     = "blast_item",
+    [TRACE_DRAIN]          = "drain",
+    [TRACE_CONNECT]        = "connect",
+    [TRACE_CONNECTED]      = "connected",
+    [TRACE_CONNECT_FAIL]   = "connect_fail",
+    [TRACE_DISCONNECT]     = "disconnect",
+    [TRACE_GOAWAY]         = "goaway",
+    [TRACE_STREAM_SUBMIT]  = "stream_submit",
+    [TRACE_STREAM_DONE]    = "stream_done",
+    [TRACE_STREAM_TIMEOUT] = "stream_timeout",
+    [TRACE_RETRY]          = "retry",
+    [TRACE_WINDOW]         = "window",
+    [TRACE_AUTH_REFRESH]   = "auth_refresh",
+    [TRACE_AUTH_FAIL]      = "auth_fail",
+};
+
+const char *trace_event_name(uint16_t event)
+{
+    return (event < TRACE_EVENT_COUNT && s_names[event]) ? s_names[event] : "?";
+}
+
+/*
+ * Current job per task.  Only the push workers set one, so a handful of
+ * slots looked up by task handle is enough; a task that finds no free slot
+ * simply records job 0.
+ */
+#define TRACE_TASKS_MAX  8
+
+typedef struct {
+    TaskHandle_t task;
+    uint32_t     job;
+} trace_task_t;
+
+static trace_task_t s_tasks[TRACE_TASKS_MAX];
+static portMUX_TYPE s_task_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void trace_set_job(uint32_t job)
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&s_task_lock);
+    trace_task_t *slot = NULL;
+    for (int i = 0; i < TRACE_TASKS_MAX; i++) {
+        if (s_tasks[i].task == self) {
+            slot = &s_tasks[i];
+            break;
+        }
+        if (!s_tasks[i].task && !slot) slot = &s_tasks[i];
+    }
+    if (slot && (slot->task == self || job)) {
+        slot->task = self;
+        slot->job  = job;
+    }
+    portEXIT_CRITICAL(&s_task_lock);
+}
+
+uint32_t trace_job(void)
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    uint32_t job = 0;
+    portENTER_CRITICAL(&s_task_lock);
+    for (int i = 0; i < TRACE_TASKS_MAX; i++) {
+        if (s_tasks[i].task == self) {
+            job = s_tasks[i].job;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_task_lock);
+    return job;
+}
+
+#if CONFIG_TRACE_ENABLE
+
+#define TRACE_SIZE  CONFIG_TRACE_RING_SIZE
+#define TRACE_MASK  (TRACE_SIZE - 1)
+_Static_assert((TRACE_SIZE & TRACE_MASK) == 0, "CONFIG_TRACE_RING_SIZE must be a power of two");
+
+static EXT_RAM_BSS_ATTR trace_rec_t s_recs[TRACE_SIZE];
+static seq_ring_t s_ring = SEQ_RING_INIT(s_recs, TRACE_SIZE);
+
+void trace_rec(trace_event_t event, uint32_t job, int32_t a, int32_t b)
+{
+    if (a > INT16_MAX) a = INT16_MAX;
+    if (a < INT16_MIN) a = INT16_MIN;
+    trace_rec_t r = {
+        .ts_us = (uint32_t)esp_timer_get_time(),
+        .event = (uint16_t)event,
+        .a     = (int16_t)a,
+        .job   = job,
+        .b     = b,
+    };
+    seq_ring_push(&s_ring, &r);
+}
+
+size_t trace_read(uint32_t *seq, trace_rec_t *out, size_t max, uint32_t *lost)
+{
+    return seq_ring_read(&s_ring, seq, out, max, lost);
+}
+
+uint32_t trace_head(void)
+{
+    return seq_ring_head(&s_ring);
+}
+
+#else
+
+void trace_rec(trace_event_t event, uint32_t job, int32_t a, int32_t b)
+{
+    (void)event;
+    (void)job;
+    (void)a;
+    (void)b;
+}
+
+size_t trace_read(uint32_t *seq, trace_rec_t *out, size_t max, uint32_t *lost)
+{
+    (void)seq;
+    (void)out;
+    (void)max;
+    *lost = 0;
+    return 0;
+}
+
+uint32_t trace_head(void)
+{
+    return 0;
+}
+
+#endif /* CONFIG_TRACE_ENABLE */
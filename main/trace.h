@@ -0,0 +1,111 @@
+/*
+ * trace.h — binary event ring for the push path
+ *
+ * The send path records what it does (job queued, connect, stream
+ * submitted, :status, retry, ...) as fixed 16-byte records in a RAM ring
+ * rather than as formatted UART lines.  Recording is a timestamp and four
+ * stores under a spinlock, cheap enough to leave on in production;
+ * GET /trace hands the ring out for offline reading.  The oldest records
+ * are overwritten once the ring is full.
+ *
+ * Records carry the id of the push job they belong to.  push_queue_submit()
+ * gives every job one, and a worker marks it as its current job
+ * (trace_set_job()) while running it, so layers that never see the job,
+ * like the HTTP/2 engine, tag their records with trace_job().
+ *
+ * The per-push INFO lines the send path used to print are TRACE_LOGI()
+ * now, compiled in only with CONFIG_TRACE_VERBOSE_LOG.  Warnings, errors
+ * and once-per-connection lines are unaffected.
+ *
+ * Tunables (menuconfig → "APNs Configuration" → "Tracing"):
+ *   CONFIG_TRACE_ENABLE       record to the ring and serve GET /trace
+ *   CONFIG_TRACE_RING_SIZE    records kept (power of two, 16 bytes each)
+ *   CONFIG_TRACE_VERBOSE_LOG  also print the per-push INFO lines
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if CONFIG_TRACE_VERBOSE_LOG
+#define TRACE_LOGI(tag, ...)  ESP_LOGI(tag, __VA_ARGS__)
+#else
+#define TRACE_LOGI(tag, ...)  do { } while (0)
+#endif
+
+/** Event ids.  Meaning of the two integers per event in the comments. */
+typedef enum {
+    TRACE_NONE = 0,
+    /* api_server.c */
+    TRACE_JOB_QUEUED,        /*!< a = push_job_type_t, b = jobs waiting in its lane */
+    TRACE_JOB_REJECTED,      /*!< a = push_job_type_t, b = esp_err_t (job id 0) */
+    /* push_queue.c */
+    TRACE_JOB_START,         /*!< a = push_job_type_t, b = queue wait (µs) */
+    TRACE_JOB_DONE,          /*!< a = push_platform_t, b = esp_err_t */
+    TRACE_JOB_SPOOLED,       /*!< kept in the outbox, b = ttl (s) */
+    TRACE_BLAST_ITEM,        /*!< a = :status (0 = none), b = recipient IPv4 */
+    TRACE_DRAIN,             /*!< a = pushes sent, b = still in the outbox */
+    /* h2_engine.c */
+    TRACE_CONNECT,           /*!< a = host index */
+    TRACE_CONNECTED,         /*!< a = host index, b = DNS + TCP + TLS (µs) */
+    TRACE_CONNECT_FAIL,      /*!< a = host index */
+    TRACE_DISCONNECT,        /*!< a = host index */
+    TRACE_GOAWAY,            /*!< a = host index, b = HTTP/2 error code */
+    TRACE_STREAM_SUBMIT,     /*!< a = host index, b = stream id */
+    TRACE_STREAM_DONE,       /*!< a = :status (0 = reset), b = stream id */
+    TRACE_STREAM_TIMEOUT,    /*!< a = host index, b = stream id */
+    TRACE_RETRY,             /*!< a = attempt, b = backoff (ms) */
+    TRACE_WINDOW,            /*!< a = host index, b = new AIMD window */
+    /* apns.c, fcm.c */
+    TRACE_AUTH_REFRESH,      /*!< a = 0 APNs JWT / 1 FCM token, b = time taken (µs) */
+    TRACE_AUTH_FAIL,         /*!< a = 0 APNs JWT / 1 FCM token, b = esp_err_t */
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+typedef struct {
+    uint32_t ts_us;          /*!< esp_timer_get_time(), low 32 bits (wraps every ~71 min) */
+    uint16_t event;          /*!< trace_event_t */
+    int16_t  a;
+    uint32_t job;            /*!< push job id, 0 = none */
+    int32_t  b;
+} trace_rec_t;               /* 16 bytes */
+
+/**
+ * @brief Append one record.  Callable from any task; a no-op with
+ *        CONFIG_TRACE_ENABLE off.  @p a is clamped to int16_t.
+ */
+void trace_rec(trace_event_t event, uint32_t job, int32_t a, int32_t b);
+
+/** Mark @p job as the calling task's current job; 0 clears it. */
+void trace_set_job(uint32_t job);
+
+/** The calling task's current job, 0 if none. */
+uint32_t trace_job(void);
+
+/**
+ * @brief Copy records from sequence number *@p seq on, oldest first.
+ *
+ * Records written since boot are numbered from 0.  If *@p seq has already
+ * been overwritten, copying starts at the oldest record still held and
+ * *@p lost says how many were skipped.  On return *@p seq is the number of
+ * the next record to read.
+ *
+ * @return records copied, at most @p max
+ */
+size_t trace_read(uint32_t *seq, trace_rec_t *out, size_t max, uint32_t *lost);
+
+/** Sequence number the next record will get (= records written since boot). */
+uint32_t trace_head(void);
+
+/** "connect", "stream_done", ...; "?" for an unknown id. */
+const char *trace_event_name(uint16_t event);
+
+#ifdef __cplusplus
+}
+#endif
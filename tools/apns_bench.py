@@ -0,0 +1,289 @@
+#!/usr/bin/env python3
+"""
+Throughput / latency benchmark for the ESP32 APNs sender.
+
+Drives the device's REST API (/push, /push/batch and /blast, which go through
+apns_send_notification() and apns_send_batch()), then reads GET /metrics
+before and after the run.  It reports:
+
+  - pushes/sec over the run
+  - p50 / p99 request RTT, from the device's own histogram
+  - queue wait and connect times
+  - peak heap use
+
+Only the Python standard library is needed.  Point the firmware at
+tools/mock_apns.py (CONFIG_APNS_MOCK_SERVER) so Apple never sees the traffic:
+
+    python3 tools/apns_bench.py --device 192.168.1.50 push --count 200 --concurrency 4
+    python3 tools/apns_bench.py --device 192.168.1.50 batch --count 200 --size 50
+    python3 tools/apns_bench.py --device 192.168.1.50 blast --tokens 1000 --rounds 3
+
+blast mode first seeds --tokens send-list entries in 10.0.0.0/8 through
+POST /tokens/bulk.  Pass --no-seed to reuse the entries already stored.
+Completion is tracked through GET /blast/{id}.
+"""
+
+import argparse
+import base64
+import json
+import secrets
+import sys
+import threading
+import time
+import urllib.error
+import urllib.request
+
+BULK_CHUNK = 200          # keeps each /tokens/bulk body well under 32 KB
+
+
+class Device:
+    def __init__(self, host, user, password, timeout=30):
+        self.base = f"http://{host}"
+        self.auth = "Basic " + base64.b64encode(f"{user}:{password}".encode()).decode()
+        self.timeout = timeout
+
+    def call(self, method, path, body=None):
+        """Return (status, parsed JSON or None, headers)."""
+        data = json.dumps(body).encode() if body is not None else None
+        req = urllib.request.Request(self.base + path, data=data, method=method)
+        req.add_header("Authorization", self.auth)
+        if data is not None:
+            req.add_header("Content-Type", "application/json")
+        try:
+            with urllib.request.urlopen(req, timeout=self.timeout) as r:
+                raw = r.read()
+                return r.status, json.loads(raw) if raw else None, r.headers
+        except urllib.error.HTTPError as e:
+            raw = e.read()
+            try:
+                doc = json.loads(raw) if raw else None
+            except ValueError:
+                doc = None
+            return e.code, doc, e.headers
+
+    def metrics(self):
+        status, doc, _ = self.call("GET", "/metrics")
+        if status != 200:
+            sys.exit(f"GET /metrics failed: HTTP {status}")
+        return doc
+
+    def submit(self, path, body):
+        """POST a push job, honouring 503 + Retry-After backpressure."""
+        rejected = 0
+        while True:
+            status, doc, headers = self.call("POST", path, body)
+            if status != 503:
+                return status, rejected, doc
+            rejected += 1
+            time.sleep(float(headers.get("Retry-After") or 1))
+
+
+# -- histogram maths ---------------------------------------------------------
+
+def hist_delta(before, after):
+    return {
+        "count":   after["count"] - before["count"],
+        "sum_us":  after["sum_us"] - before["sum_us"],
+        "max_us":  after["max_us"],
+        "buckets": [a - b for a, b in zip(after["buckets"], before["buckets"])],
+    }
+
+
+def percentile(h, bounds, q):
+    """Upper bucket bound holding the q-th sample, in ms (None if empty)."""
+    if h["count"] <= 0:
+        return None
+    rank = q * h["count"]
+    seen = 0
+    for i, n in enumerate(h["buckets"]):
+        seen += n
+        if seen >= rank:
+            return (bounds[i] if i < len(bounds) else h["max_us"]) / 1000.0
+    return h["max_us"] / 1000.0
+
+
+def fmt_ms(v):
+    return "   n/a" if v is None else f"{v:6.1f}"
+
+
+# -- workloads ---------------------------------------------------------------
+
+def seed_tokens(dev, n, server):
+    print(f"Seeding {n} send-list entries ...")
+    for start in range(0, n, BULK_CHUNK):
+        entries = []
+        for i in range(start, min(n, start + BULK_CHUNK)):
+            ip = f"10.{(i >> 16) & 255}.{(i >> 8) & 255}.{i & 255}"
+            entries.append({"ip": ip, "token": secrets.token_hex(32), "server_type": server})
+        status, doc, _ = dev.call("POST", "/tokens/bulk", {"list": "send", "entries": entries})
+        if status != 200:
+            sys.exit(f"/tokens/bulk failed: HTTP {status} {doc}")
+
+
+def run_push(dev, args):
+    body = {"title": "bench", "body": "hello", "server_type": args.server}
+    remaining = [args.count]
+    lock = threading.Lock()
+    totals = {"accepted": 0, "rejected": 0, "errors": 0}
+
+    def worker():
+        while True:
+            with lock:
+                if remaining[0] <= 0:
+                    return
+                remaining[0] -= 1
+            b = dict(body, device_token=secrets.token_hex(32))
+            status, rejected, _ = dev.submit("/push", b)
+            with lock:
+                totals["rejected"] += rejected
+                if status == 200:
+                    totals["accepted"] += 1
+                else:
+                    totals["errors"] += 1
+
+    threads = [threading.Thread(target=worker) for _ in range(args.concurrency)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return totals["accepted"], totals
+
+
+def run_batch(dev, args):
+    base = {"title": "bench", "body": "hello", "server_type": args.server}
+    totals = {"accepted": 0, "rejected": 0, "errors": 0}
+    for start in range(0, args.count, args.size):
+        items = [dict(base, device_token=secrets.token_hex(32))
+                 for _ in range(min(args.size, args.count - start))]
+        status, doc, _ = dev.call("POST", "/push/batch", items)
+        if status == 200:
+            totals["accepted"] += doc["accepted"]
+            totals["rejected"] += doc["rejected"]
+        else:
+            totals["errors"] += 1
+    return totals["accepted"], totals
+
+
+def run_blast(dev, args):
+    body = {"title": "bench", "body": "hello", "server_type": args.server}
+    totals = {"accepted": 0, "rejected": 0, "errors": 0}
+    ids = []
+    for _ in range(args.rounds):
+        status, rejected, doc = dev.submit("/blast", body)
+        totals["rejected"] += rejected
+        if status == 200:
+            totals["accepted"] += 1
+            ids.append(doc["id"])
+        else:
+            totals["errors"] += 1
+
+    # Each blast reports its own progress: wait for all of them to finish
+    expected = 0
+    deadline = time.monotonic() + args.timeout
+    for job in ids:
+        while True:
+            status, doc, _ = dev.call("GET", f"/blast/{job}")
+            if status != 200 or doc["state"] not in ("queued", "running"):
+                break
+            if time.monotonic() > deadline:
+                break
+            time.sleep(0.25)
+        if status == 200:
+            expected += doc["sent"]
+    return expected, totals
+
+
+def wait_drained(dev, before, expected, timeout):
+    """Poll /metrics until the expected pushes completed and the queue is empty."""
+    deadline = time.monotonic() + timeout
+    last_sent, idle_since = -1, time.monotonic()
+    while True:
+        m = dev.metrics()
+        sent = m["push"]["sent"] - before["push"]["sent"]
+        if m["queue"]["pending"] == 0:
+            if expected is not None and sent >= expected:
+                return m
+            if expected is None and sent == last_sent and time.monotonic() - idle_since > 2:
+                return m
+        if sent != last_sent:
+            last_sent, idle_since = sent, time.monotonic()
+        if time.monotonic() > deadline:
+            print("warning: timed out waiting for the device to finish", file=sys.stderr)
+            return m
+        time.sleep(0.25)
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Benchmark the ESP32 APNs sender")
+    ap.add_argument("--device", required=True, help="device IP or host[:port]")
+    ap.add_argument("--user", default="admin")
+    ap.add_argument("--password", default="changeme")
+    ap.add_argument("--server", default="sandbox", choices=["sandbox", "production"])
+    ap.add_argument("--timeout", type=float, default=300, help="max seconds to wait for the device")
+    sub = ap.add_subparsers(dest="mode", required=True)
+
+    p = sub.add_parser("push", help="many single-token POST /push jobs")
+    p.add_argument("--count", type=int, default=100)
+    p.add_argument("--concurrency", type=int, default=4, help="client threads")
+
+    pb = sub.add_parser("batch", help="POST /push/batch, --size items per request")
+    pb.add_argument("--count", type=int, default=200)
+    pb.add_argument("--size", type=int, default=50)
+
+    b = sub.add_parser("blast", help="POST /blast over the send list")
+    b.add_argument("--tokens", type=int, default=1000, help="send-list entries to seed")
+    b.add_argument("--rounds", type=int, default=1)
+    b.add_argument("--no-seed", action="store_true", help="use the entries already stored")
+    args = ap.parse_args()
+
+    dev = Device(args.device, args.user, args.password)
+    if args.mode == "blast" and not args.no_seed:
+        seed_tokens(dev, args.tokens, args.server)
+
+    before = dev.metrics()
+    t0 = time.monotonic()
+    if args.mode == "push":
+        expected, totals = run_push(dev, args)
+    elif args.mode == "batch":
+        expected, totals = run_batch(dev, args)
+    else:
+        expected, totals = run_blast(dev, args)
+    after = wait_drained(dev, before, expected, args.timeout)
+    elapsed = time.monotonic() - t0
+
+    bounds = after["histograms"]["bounds_us"]
+    hist = {k: hist_delta(before["histograms"][k], after["histograms"][k])
+            for k in ("rtt", "queue_wait", "connect", "jwt_sign")}
+    push = {k: after["push"][k] - before["push"][k] for k in after["push"]}
+    heap = after["heap"]
+
+    print()
+    print(f"mode            {args.mode}  ({totals['accepted']} jobs accepted, "
+          f"{totals['rejected']} {'items rejected' if args.mode == 'batch' else 'x 503 retried'}, "
+          f"{totals['errors']} errors)")
+    print(f"elapsed         {elapsed:.2f} s")
+    print(f"pushes          sent={push['sent']} ok={push['ok']} "
+          f"unregistered={push['unregistered']} timeouts={push['timeouts']} "
+          f"failed={push['failed']}")
+    print(f"throughput      {push['sent'] / elapsed:.1f} pushes/s")
+    pacing = after.get("pacing")
+    if pacing:
+        shrinks = pacing["window_shrinks"] - before["pacing"]["window_shrinks"]
+        waits = pacing["rate_waits"] - before["pacing"]["rate_waits"]
+        print(f"pacing          window={pacing['window'][args.server]} "
+              f"shrinks={shrinks} rate_waits={waits}")
+    print(f"{'':16}{'p50 ms':>8}{'p99 ms':>8}{'max ms':>8}{'count':>8}")
+    for name in ("rtt", "queue_wait", "connect", "jwt_sign"):
+        h = hist[name]
+        print(f"{name:16}{fmt_ms(percentile(h, bounds, 0.50)):>8}"
+              f"{fmt_ms(percentile(h, bounds, 0.99)):>8}"
+              f"{fmt_ms(h['max_us'] / 1000.0 if h['count'] else None):>8}{h['count']:>8}")
+    print(f"heap            free={heap['free']} min_free={heap['min_free']} "
+          f"internal_min_free={heap['internal_min_free']}")
+    print(f"peak heap use   {before['heap']['free'] - heap['min_free']} B below the pre-run free "
+          f"(min_free is since boot)")
+    print("percentiles are histogram bucket upper bounds; max_us is since boot")
+
+
+if __name__ == "__main__":
+    main()
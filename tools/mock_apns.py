@@ -0,0 +1,256 @@
+#!/usr/bin/env python3
+"""
+Mock APNs HTTP/2 server for benchmarking the ESP32 sender.
+
+Answers POST /3/device/<token> the way api.push.apple.com does: 200 with an
+apns-id header, or an error status with a {"reason": ...} body.  Latency and
+the 429 / 410 error mix are configurable, so throughput and retry behaviour
+can be measured without sending traffic to Apple.
+
+Build the firmware with CONFIG_APNS_MOCK_SERVER=y and CONFIG_APNS_MOCK_HOST
+set to this machine's address, then:
+
+    pip install h2
+    python3 tools/mock_apns.py --port 8443 --latency-ms 20 --jitter-ms 10 \
+        --rate-429 0.01 --rate-410 0.02
+
+A self-signed certificate is generated on first run (needs the openssl CLI)
+unless --cert/--key are given.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import random
+import ssl
+import subprocess
+import sys
+import time
+import uuid
+
+try:
+    import h2.config
+    import h2.connection
+    import h2.events
+    import h2.exceptions
+    import h2.settings
+except ImportError:
+    sys.exit("mock_apns.py needs the h2 package: pip install h2")
+
+
+class Stats:
+    def __init__(self):
+        self.connections = 0
+        self.requests = 0
+        self.status = {}
+        self.started = time.monotonic()
+
+    def count(self, status):
+        self.requests += 1
+        self.status[status] = self.status.get(status, 0) + 1
+
+    def line(self):
+        elapsed = time.monotonic() - self.started
+        codes = " ".join(f"{k}={v}" for k, v in sorted(self.status.items()))
+        return (f"[{elapsed:7.1f}s] conns={self.connections} "
+                f"requests={self.requests} {codes}")
+
+
+class APNsProtocol(asyncio.Protocol):
+    def __init__(self, args, stats):
+        self.args = args
+        self.stats = stats
+        self.conn = h2.connection.H2Connection(
+            config=h2.config.H2Configuration(client_side=False,
+                                             header_encoding="utf-8"))
+        self.transport = None
+        self.streams = {}        # stream id -> (headers, body bytearray)
+        self.served = 0
+        self.active = 0          # requests received but not yet answered
+
+    # -- asyncio.Protocol ---------------------------------------------------
+
+    def connection_made(self, transport):
+        self.transport = transport
+        self.stats.connections += 1
+        self.conn.initiate_connection()
+        self.conn.update_settings({
+            h2.settings.SettingCodes.MAX_CONCURRENT_STREAMS: self.args.max_streams,
+        })
+        self.flush()
+
+    def connection_lost(self, exc):
+        self.transport = None
+
+    def data_received(self, data):
+        try:
+            events = self.conn.receive_data(data)
+        except Exception as e:           # protocol error: drop the client
+            print(f"h2 error: {e}", file=sys.stderr)
+            self.transport.close()
+            return
+        for ev in events:
+            if isinstance(ev, h2.events.RequestReceived):
+                self.streams[ev.stream_id] = (dict(ev.headers), bytearray())
+            elif isinstance(ev, h2.events.DataReceived):
+                if ev.stream_id in self.streams:
+                    self.streams[ev.stream_id][1].extend(ev.data)
+                self.conn.acknowledge_received_data(ev.flow_controlled_length,
+                                                    ev.stream_id)
+            elif isinstance(ev, h2.events.StreamEnded):
+                headers, body = self.streams.pop(ev.stream_id, ({}, b""))
+                asyncio.get_event_loop().create_task(
+                    self.respond(ev.stream_id, headers, bytes(body)))
+            elif isinstance(ev, h2.events.StreamReset):
+                self.streams.pop(ev.stream_id, None)
+            elif isinstance(ev, h2.events.ConnectionTerminated):
+                self.transport.close()
+                return
+        self.flush()
+
+    # -- request handling ---------------------------------------------------
+
+    def flush(self):
+        if self.transport:
+            self.transport.write(self.conn.data_to_send())
+
+    def pick(self, headers, body):
+        """Return (status, reason) for one request."""
+        path = headers.get(":path", "")
+        if headers.get(":method") != "POST":
+            return 405, "MethodNotAllowed"
+        if not path.startswith("/3/device/"):
+            return 404, "BadPath"
+        token = path[len("/3/device/"):]
+        if len(token) != 64 or any(c not in "0123456789abcdefABCDEF" for c in token):
+            return 400, "BadDeviceToken"
+        if not headers.get("authorization", "").startswith("bearer "):
+            return 403, "MissingProviderToken"
+        if not headers.get("apns-topic"):
+            return 400, "MissingTopic"
+        if not body:
+            return 400, "PayloadEmpty"
+        if len(body) > 4096:
+            return 413, "PayloadTooLarge"
+        if self.args.throttle_streams and self.active > self.args.throttle_streams:
+            return 429, "TooManyRequests"
+        r = random.random()
+        if r < self.args.rate_429:
+            return 429, "TooManyRequests"
+        if r < self.args.rate_429 + self.args.rate_410:
+            return 410, "Unregistered"
+        if r < self.args.rate_429 + self.args.rate_410 + self.args.rate_503:
+            return 503, "ServiceUnavailable"
+        return 200, None
+
+    async def respond(self, stream_id, headers, body):
+        self.active += 1
+        delay = self.args.latency_ms + random.uniform(0, self.args.jitter_ms)
+        if delay > 0:
+            await asyncio.sleep(delay / 1000.0)
+        status, reason = self.pick(headers, body)
+        self.active -= 1
+        if self.transport is None:
+            return
+
+        self.stats.count(status)
+        apns_id = headers.get("apns-id") or str(uuid.uuid4()).upper()
+        out = [(":status", str(status)), ("apns-id", apns_id)]
+        try:
+            if status == 200:
+                out.append(("apns-unique-id", str(uuid.uuid4())))
+                self.conn.send_headers(stream_id, out, end_stream=True)
+            else:
+                doc = {"reason": reason}
+                if status == 410:
+                    doc["timestamp"] = int(time.time() * 1000)
+                data = json.dumps(doc).encode()
+                out += [("content-type", "application/json"),
+                        ("content-length", str(len(data)))]
+                if status == 429 and self.args.retry_after:
+                    out.append(("retry-after", str(self.args.retry_after)))
+                self.conn.send_headers(stream_id, out)
+                self.conn.send_data(stream_id, data, end_stream=True)
+        except h2.exceptions.ProtocolError:   # stream reset or GOAWAY already sent
+            return
+
+        self.served += 1
+        if self.args.goaway_after and self.served == self.args.goaway_after:
+            # Like APNs: GOAWAY, then leave it to the client to reconnect
+            self.conn.close_connection(last_stream_id=stream_id)
+        self.flush()
+
+
+def ensure_cert(args):
+    if args.cert and args.key:
+        return args.cert, args.key
+    here = os.path.dirname(os.path.abspath(__file__))
+    cert = os.path.join(here, "mock_apns_cert.pem")
+    key = os.path.join(here, "mock_apns_key.pem")
+    if not (os.path.exists(cert) and os.path.exists(key)):
+        print("Generating self-signed certificate ...")
+        subprocess.run(["openssl", "req", "-x509", "-newkey", "ec",
+                        "-pkeyopt", "ec_paramgen_curve:prime256v1",
+                        "-nodes", "-days", "3650", "-subj", "/CN=mock-apns",
+                        "-keyout", key, "-out", cert], check=True,
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+async def report(stats, interval):
+    while True:
+        await asyncio.sleep(interval)
+        print(stats.line(), flush=True)
+
+
+async def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("--host", default="0.0.0.0")
+    ap.add_argument("--port", type=int, default=8443)
+    ap.add_argument("--cert", help="PEM certificate (default: generated)")
+    ap.add_argument("--key", help="PEM private key (default: generated)")
+    ap.add_argument("--latency-ms", type=float, default=20.0,
+                    help="fixed delay before each response")
+    ap.add_argument("--jitter-ms", type=float, default=0.0,
+                    help="extra uniform random delay, 0..N ms")
+    ap.add_argument("--rate-429", type=float, default=0.0,
+                    help="fraction of pushes answered 429 TooManyRequests")
+    ap.add_argument("--rate-410", type=float, default=0.0,
+                    help="fraction of pushes answered 410 Unregistered")
+    ap.add_argument("--rate-503", type=float, default=0.0,
+                    help="fraction of pushes answered 503 ServiceUnavailable")
+    ap.add_argument("--retry-after", type=int, default=0,
+                    help="Retry-After seconds to send with 429 (0 = none)")
+    ap.add_argument("--throttle-streams", type=int, default=0,
+                    help="answer 429 while more than N requests are in flight (0 = off)")
+    ap.add_argument("--max-streams", type=int, default=1000,
+                    help="SETTINGS_MAX_CONCURRENT_STREAMS to advertise")
+    ap.add_argument("--goaway-after", type=int, default=0,
+                    help="send GOAWAY after N responses per connection")
+    ap.add_argument("--stats-interval", type=float, default=5.0)
+    args = ap.parse_args()
+
+    cert, key = ensure_cert(args)
+    ctx = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+    ctx.load_cert_chain(cert, key)
+    ctx.set_alpn_protocols(["h2"])
+
+    stats = Stats()
+    loop = asyncio.get_running_loop()
+    server = await loop.create_server(lambda: APNsProtocol(args, stats),
+                                      args.host, args.port, ssl=ctx)
+    print(f"Mock APNs listening on {args.host}:{args.port} "
+          f"(latency {args.latency_ms}+{args.jitter_ms} ms, "
+          f"429 {args.rate_429:.1%}, 410 {args.rate_410:.1%}, "
+          f"503 {args.rate_503:.1%})", flush=True)
+    asyncio.create_task(report(stats, args.stats_interval))
+    async with server:
+        await server.serve_forever()
+
+
+if __name__ == "__main__":
+    try:
+        asyncio.run(main())
+    except KeyboardInterrupt:
+        pass